@@ -0,0 +1,153 @@
+#include <stdlib.h>
+#include <math.h>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "AlignmentAssist.h"
+
+// Edge and line detection parameters, for full resolution. The Hough vote
+// threshold and line lengths shrink with the downscale factor.
+#define CANNY_LOW_THRESHOLD   50
+#define CANNY_HIGH_THRESHOLD  200
+#define HOUGH_VOTES           50
+#define HOUGH_MIN_LENGTH      75
+#define HOUGH_MAX_GAP         7
+
+// Lines within CLOSE_THRESHOLD radians of horizontal or vertical get a guide,
+// unless they are already within GREAT_THRESHOLD.
+#define CLOSE_THRESHOLD       0.1f
+#define GREAT_THRESHOLD       0.02f
+#define CLOSE_VALUE           0
+#define GREAT_VALUE           255
+
+AlignmentAssist::AlignmentAssist(int width, int height, int downscale) :
+	m_width(width), m_height(height), m_downscale(downscale < 1 ? 1 : downscale) {
+	m_hasInput = false;
+	m_quit = false;
+	m_generation = 0;
+	m_workGeneration = 0;
+	pthread_mutex_init(&m_lock, 0);
+	pthread_cond_init(&m_inputReady, 0);
+
+	// launch the work thread
+	pthread_create(&m_thread, 0, AlignmentAssist::ThreadProc, this);
+}
+
+AlignmentAssist::~AlignmentAssist(void) {
+	pthread_mutex_lock(&m_lock);
+	m_quit = true;
+	pthread_cond_signal(&m_inputReady);
+	pthread_mutex_unlock(&m_lock);
+	pthread_join(m_thread, 0);
+
+	pthread_cond_destroy(&m_inputReady);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void AlignmentAssist::post(const uchar *luma, int stride) {
+	// Downscale outside the lock, into our own buffer.
+	cv::Mat src(m_height, m_width, CV_8UC1, (void *)luma, stride);
+	if (m_downscale == 1) {
+		src.copyTo(m_staging);
+	} else {
+		cv::resize(src, m_staging, cv::Size(m_width / m_downscale, m_height / m_downscale), 0, 0, cv::INTER_AREA);
+	}
+
+	// Latest wins: an input the worker hasn't picked up yet is replaced.
+	pthread_mutex_lock(&m_lock);
+	std::swap(m_staging, m_input);
+	m_hasInput = true;
+	pthread_cond_signal(&m_inputReady);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void AlignmentAssist::draw(uchar *luma, int stride) {
+	cv::Mat dst(m_height, m_width, CV_8UC1, luma, stride);
+
+	pthread_mutex_lock(&m_lock);
+	for (size_t i = 0; i < m_lines.size(); i++) {
+		const Line &l = m_lines[i];
+		cv::line(dst, l.from, l.to, cv::Scalar(l.value), 1, CV_AA);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void AlignmentAssist::clear(void) {
+	pthread_mutex_lock(&m_lock);
+	m_lines.clear();
+	m_hasInput = false;
+	m_generation++;
+	pthread_mutex_unlock(&m_lock);
+}
+
+void *AlignmentAssist::ThreadProc(void *opaque) {
+	AlignmentAssist *instance = (AlignmentAssist *)opaque;
+	std::vector<Line> lines;
+
+	pthread_mutex_lock(&instance->m_lock);
+	for (;;) {
+		while (!instance->m_hasInput && !instance->m_quit) {
+			pthread_cond_wait(&instance->m_inputReady, &instance->m_lock);
+		}
+		if (instance->m_quit) break;
+
+		std::swap(instance->m_input, instance->m_work);
+		instance->m_hasInput = false;
+		instance->m_workGeneration = instance->m_generation;
+		pthread_mutex_unlock(&instance->m_lock);
+
+		instance->findLines(instance->m_work, lines);
+
+		pthread_mutex_lock(&instance->m_lock);
+		if (instance->m_workGeneration == instance->m_generation) {
+			instance->m_lines.swap(lines);
+		}
+	}
+	pthread_mutex_unlock(&instance->m_lock);
+
+	return 0;
+}
+
+void AlignmentAssist::findLines(const cv::Mat &luma, std::vector<Line> &lines) {
+	cv::Mat edges;
+	std::vector<cv::Vec4i> segments;
+	int s = m_downscale;
+
+	cv::Canny(luma, edges, CANNY_LOW_THRESHOLD, CANNY_HIGH_THRESHOLD, 3);
+	cv::HoughLinesP(edges, segments, 1, CV_PI / 180, HOUGH_VOTES / s, HOUGH_MIN_LENGTH / s, HOUGH_MAX_GAP / s);
+
+	// For each line that is nearly, but not quite, level or plumb, draw it
+	// (dark, with a bright copy offset by a pixel so it shows on any
+	// background) along with the level or plumb line through its end nearest
+	// the center.
+	lines.clear();
+	for (size_t i = 0; i < segments.size(); i++) {
+		int x0 = segments[i][0] * s, y0 = segments[i][1] * s;
+		int x1 = segments[i][2] * s, y1 = segments[i][3] * s;
+		float dx = (float)abs(x1 - x0), dy = (float)abs(y1 - y0);
+
+		Line l[4];
+		if (atan2f(dy, dx) < CLOSE_THRESHOLD) {
+			if (atan2f(dy, dx) < GREAT_THRESHOLD) continue;
+			int y = abs(x0 - m_width / 2) < abs(x1 - m_width / 2) ? y0 : y1;
+			Line h[4] = {
+				{cv::Point(x0, y0), cv::Point(x1, y1), CLOSE_VALUE},
+				{cv::Point(x0, y0 + 1), cv::Point(x1, y1 + 1), GREAT_VALUE},
+				{cv::Point(x0, y + 1), cv::Point(x1, y + 1), GREAT_VALUE},
+				{cv::Point(x0, y), cv::Point(x1, y), CLOSE_VALUE}
+			};
+			for (int j = 0; j < 4; j++) l[j] = h[j];
+		} else if (atan2f(dx, dy) < CLOSE_THRESHOLD) {
+			if (atan2f(dx, dy) < GREAT_THRESHOLD) continue;
+			int x = abs(y0 - m_height / 2) < abs(y1 - m_height / 2) ? x0 : x1;
+			Line v[4] = {
+				{cv::Point(x0, y0), cv::Point(x1, y1), CLOSE_VALUE},
+				{cv::Point(x0 + 1, y0), cv::Point(x1 + 1, y1), GREAT_VALUE},
+				{cv::Point(x + 1, y0), cv::Point(x + 1, y1), GREAT_VALUE},
+				{cv::Point(x, y0), cv::Point(x, y1), CLOSE_VALUE}
+			};
+			for (int j = 0; j < 4; j++) l[j] = v[j];
+		} else {
+			continue;
+		}
+		lines.insert(lines.end(), l, l + 4);
+	}
+}
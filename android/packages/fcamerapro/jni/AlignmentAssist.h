@@ -0,0 +1,59 @@
+#ifndef _ALIGNMENTASSIST_H
+#define _ALIGNMENTASSIST_H
+
+#include <pthread.h>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "Common.h"
+
+// Finds nearly horizontal and nearly vertical lines in the preview, for the
+// alignment assist, on a thread of its own so the capture loop never waits for
+// Canny and Hough.
+//
+// The capture thread posts the luma plane of each presented frame. It is
+// downscaled into a single-slot mailbox where a newer frame replaces one the
+// worker hasn't started on yet. The worker then publishes the guide lines for
+// the latest frame it analyzed, and the capture thread draws them into the
+// frames it presents after that.
+class AlignmentAssist {
+public:
+	AlignmentAssist(int width, int height, int downscale = 2);
+	~AlignmentAssist(void);
+
+	// Hand the worker a luma plane. Doesn't wait for the worker.
+	void post(const uchar *luma, int stride);
+
+	// Draw the latest published guide lines into a luma plane.
+	void draw(uchar *luma, int stride);
+
+	// Forget the published lines, e.g. when the assist is switched off.
+	void clear(void);
+
+private:
+	struct Line {
+		cv::Point from, to;
+		uchar value;
+	};
+
+	static void *ThreadProc(void *);
+	void findLines(const cv::Mat &luma, std::vector<Line> &lines);
+
+	const int m_width, m_height, m_downscale;
+
+	// m_staging belongs to the posting thread and m_work to the worker. Posting
+	// swaps m_staging with the mailbox, m_input, and the worker swaps m_input
+	// with m_work.
+	cv::Mat m_staging, m_input, m_work;
+	bool m_hasInput, m_quit;
+
+	// m_generation is bumped by clear() so that lines found in a frame the
+	// worker picked up before it are thrown away instead of published.
+	int m_generation, m_workGeneration;
+
+	std::vector<Line> m_lines; // published
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_inputReady;
+	pthread_t m_thread;
+};
+
+#endif
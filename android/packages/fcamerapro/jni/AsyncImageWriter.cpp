@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "AsyncImageWriter.h"
 #include "FCam/processing/JPEG.h"
 #include "FCam/processing/DNG.h"
@@ -15,20 +16,32 @@
 #define THUMBNAIL_BLUR_RADIUS 5
 #define THUMBNAIL_BLUR_NORM   (0x10000/(THUMBNAIL_BLUR_RADIUS*THUMBNAIL_BLUR_RADIUS))
 
+// Image sets waiting to be written, and encode jobs per encoder thread. Each
+// queued image set holds a full burst in memory.
+#define MAX_PENDING_IMAGE_SETS 4
+#define JOBS_PER_ENCODER       2
+#define MAX_ENCODER_THREADS    4
+
 static const char sXmlName[] = "img_%04i.xml";
 static const char sImageName[] = "img_%04i_%02i.%s";
 static const char sThumbnailName[] = "thumb_%04i_%02i.jpg";
 static const char sJpegExt[] = "jpg";
+static const char sTempSuffix[] = ".tmp";
 
 // ===================================================================
 // ImageSet
 // ===================================================================
 
 ImageSet::ImageSet(int id, const char *outputDirPrefix) : m_outputDirPrefix(outputDirPrefix), m_fileId(id) {
-
+	m_pushTime = 0;
+	m_pending = 0;
+	pthread_mutex_init(&m_lock, 0);
+	pthread_cond_init(&m_encoded, 0);
 }
 
 ImageSet::~ImageSet(void) {
+	pthread_cond_destroy(&m_encoded);
+	pthread_mutex_destroy(&m_lock);
 }
 
 void ImageSet::add(const FileFormatDescriptor &ff, const FCam::Frame &frame) {
@@ -132,9 +145,18 @@ static void CreateThumbnail(FCam::Image &dest, const FCam::Image &source) {
 	}
 }
 
-void ImageSet::dumpToFileSystem(ASYNC_IMAGE_WRITER_CALLBACK onFileSystemChange) {
+// Move a file written under its temporary name into place.
+static void CommitFile(const char *tmpName, const char *name) {
+	if (rename(tmpName, name) != 0) {
+		ERROR("AsyncImageWriter: failed to write %s", name);
+		unlink(tmpName);
+	}
+}
+
+void ImageSet::dumpToFileSystem(WorkQueue<EncodeJob> &jobs, ASYNC_IMAGE_WRITER_CALLBACK onFileSystemChange) {
 	char fname[128];
-	char buf[128];
+	char buf[256];
+	char tmp[256];
 
 	// i/o error support does not exist. This is a to-do for NVidia folks.
 	int icount = m_frames.size();
@@ -142,77 +164,115 @@ void ImageSet::dumpToFileSystem(ASYNC_IMAGE_WRITER_CALLBACK onFileSystemChange)
 		return;
 	}
 
-	// output xml file
-	sprintf(fname, sXmlName, m_fileId);
-	sprintf(buf, "%s%s", m_outputDirPrefix, fname);
-
-	FILE *xml = fopen(buf, "wb");
-
-	fprintf(xml, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n");
-	fprintf(xml, "<imagestack imagecount=\"%i\">\n", icount);
+	// Build the xml index first: the encoder threads release each frame once
+	// it's written.
+	std::string xml;
+	xml += "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n";
+	sprintf(buf, "<imagestack imagecount=\"%i\">\n", icount);
+	xml += buf;
 
 	for (int i = 0; i < icount; i++) {
 		const FCam::Frame &frame = m_frames[i];
 
-		fprintf(xml, "<image ");
+		xml += "<image ";
 		// image name
 		sprintf(fname, sImageName, m_fileId, i, sJpegExt);
-		fprintf(xml, "name=\"%s\" ", fname);
+		sprintf(buf, "name=\"%s\" ", fname);
+		xml += buf;
 		// thumbnail name
 		sprintf(fname, sThumbnailName, m_fileId, i);
-		fprintf(xml, "thumbnail=\"%s\" ", fname);
+		sprintf(buf, "thumbnail=\"%s\" ", fname);
+		xml += buf;
 		// flash on/off
-		fprintf(xml, "flash=\"%i\" ", frame["flash.brightness"].valid() &&
+		sprintf(buf, "flash=\"%i\" ", frame["flash.brightness"].valid() &&
 				(float)frame["flash.brightness"] > 0.f ? 1 : 0);
+		xml += buf;
 		// gain
-		fprintf(xml, "gain=\"%i\" ", (int)(frame.gain() * 100));
+		sprintf(buf, "gain=\"%i\" ", (int)(frame.gain() * 100));
+		xml += buf;
 		// exposure
-		fprintf(xml, "exposure=\"%i\" ", frame.exposure());
+		sprintf(buf, "exposure=\"%i\" ", frame.exposure());
+		xml += buf;
 		// whitebalance
-		fprintf(xml, "wb=\"%i\" ", frame.whiteBalance());
-		fprintf(xml, "/>\n");
+		sprintf(buf, "wb=\"%i\" ", frame.whiteBalance());
+		xml += buf;
+		xml += "/>\n";
 	}
 
-	fprintf(xml, "</imagestack>\n");
-	fclose(xml);
+	xml += "</imagestack>\n";
+
+	// output data files
+	pthread_mutex_lock(&m_lock);
+	m_pending = icount;
+	pthread_mutex_unlock(&m_lock);
+
+	for (int i = 0; i < icount; i++) {
+		jobs.produce(EncodeJob(this, i));
+	}
+
+	pthread_mutex_lock(&m_lock);
+	while (m_pending > 0) {
+		pthread_cond_wait(&m_encoded, &m_lock);
+	}
+	pthread_mutex_unlock(&m_lock);
+
+	// output xml file, now that everything it lists is in place
+	sprintf(fname, sXmlName, m_fileId);
+	sprintf(buf, "%s%s", m_outputDirPrefix, fname);
+	sprintf(tmp, "%s%s", buf, sTempSuffix);
+
+	FILE *f = fopen(tmp, "wb");
+	if (f == 0) {
+		ERROR("AsyncImageWriter: failed to write %s", buf);
+		return;
+	}
+	fwrite(xml.data(), 1, xml.size(), f);
+	fclose(f);
+	CommitFile(tmp, buf);
 
 	// notify fs change
 	if (onFileSystemChange != 0) {
 		onFileSystemChange();
 	}
+}
 
-	FCam::Image thumbnail(THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT, m_frames[0].image().type());
-
+void ImageSet::encodeFrame(int i, FCam::Image &thumbnail) {
+	char fname[128];
+	char buf[256];
+	char tmp[256];
 	Timer timer;
 
-	// output data files
-	for (int i = 0; i < icount; i++) {
-		const FCam::Frame &frame = m_frames[i];
-		if (thumbnail.type() != frame.image().type())
-			thumbnail = FCam::Image(THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT, frame.image().type());
-
-		// write image
-		switch (m_frameFormat[i].getFormat()) {
-		case FileFormatDescriptor::EFormatJPEG:
-			sprintf(fname, sImageName, m_fileId, i, sJpegExt);
-			sprintf(buf, "%s%s", m_outputDirPrefix, fname);
-            FCam::saveJPEG(frame, buf, m_frameFormat[i].getQuality());
-			break;
-		}
+	const FCam::Frame &frame = m_frames[i];
+	if (!thumbnail.valid() || thumbnail.type() != frame.image().type())
+		thumbnail = FCam::Image(THUMBNAIL_WIDTH, THUMBNAIL_HEIGHT, frame.image().type());
 
-		// write thumbnail
-		sprintf(fname, sThumbnailName, m_fileId, i);
+	// write image
+	switch (m_frameFormat[i].getFormat()) {
+	case FileFormatDescriptor::EFormatJPEG:
+		sprintf(fname, sImageName, m_fileId, i, sJpegExt);
 		sprintf(buf, "%s%s", m_outputDirPrefix, fname);
-		timer.tic();
-		CreateThumbnail(thumbnail, frame.image());
-		LOG("create thumbnail time: %.3f\n", timer.toc());
-        FCam::saveJPEG(thumbnail, buf, THUMBNAIL_QUALITY);
-
-		// notify fs change
-		if (onFileSystemChange != 0) {
-			onFileSystemChange();
-		}
+		sprintf(tmp, "%s%s", buf, sTempSuffix);
+		FCam::saveJPEG(frame, tmp, m_frameFormat[i].getQuality());
+		CommitFile(tmp, buf);
+		break;
 	}
+
+	// write thumbnail
+	sprintf(fname, sThumbnailName, m_fileId, i);
+	sprintf(buf, "%s%s", m_outputDirPrefix, fname);
+	sprintf(tmp, "%s%s", buf, sTempSuffix);
+	timer.tic();
+	CreateThumbnail(thumbnail, frame.image());
+	LOG("create thumbnail time: %.3f\n", timer.toc());
+	FCam::saveJPEG(thumbnail, tmp, THUMBNAIL_QUALITY);
+	CommitFile(tmp, buf);
+
+	// Nothing else touches this frame, so free it now rather than with the set.
+	m_frames[i] = FCam::Frame();
+
+	pthread_mutex_lock(&m_lock);
+	if (--m_pending == 0) pthread_cond_signal(&m_encoded);
+	pthread_mutex_unlock(&m_lock);
 }
 
 
@@ -226,7 +286,16 @@ void AsyncImageWriter::SetFreeFileId(int id) {
 	sFreeId = id;
 }
 
-AsyncImageWriter::AsyncImageWriter(const char *outputDirPrefix) {
+static int EncoderThreadCount(int requested) {
+	if (requested > 0) return requested;
+
+	int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > MAX_ENCODER_THREADS) return MAX_ENCODER_THREADS;
+	return cpus < 1 ? 1 : cpus;
+}
+
+AsyncImageWriter::AsyncImageWriter(const char *outputDirPrefix, int encoderThreads) :
+	m_queue(MAX_PENDING_IMAGE_SETS), m_jobs(EncoderThreadCount(encoderThreads) * JOBS_PER_ENCODER) {
 	// copy dir prefix
 
 	// add '/' to the path if its not there already
@@ -242,6 +311,13 @@ AsyncImageWriter::AsyncImageWriter(const char *outputDirPrefix) {
 	}
 
 	m_onChangedCallback = 0;
+
+	// launch the encoder threads
+	m_encoders.resize(EncoderThreadCount(encoderThreads));
+	for (size_t i = 0; i < m_encoders.size(); i++) {
+		pthread_create(&m_encoders[i], 0, AsyncImageWriter::EncoderProc, this);
+	}
+
 	// launch the work thread
 	pthread_create(&m_thread, 0, AsyncImageWriter::ThreadProc, this);
 }
@@ -251,6 +327,14 @@ AsyncImageWriter::~AsyncImageWriter(void) {
 	m_queue.produce(0);
 	pthread_join(m_thread, 0);
 
+	// and a null job each encoder thread
+	for (size_t i = 0; i < m_encoders.size(); i++) {
+		m_jobs.produce(EncodeJob());
+	}
+	for (size_t i = 0; i < m_encoders.size(); i++) {
+		pthread_join(m_encoders[i], 0);
+	}
+
 	delete [] m_outputDirPrefix;
 }
 
@@ -277,7 +361,17 @@ ImageSet *AsyncImageWriter::newImageSet(void) {
 
 void AsyncImageWriter::push(ImageSet *is) {
 	if (is != 0) {
-		m_queue.produce(is);
+		is->m_pushTime = m_timer.get();
+		if (!m_queue.tryProduce(is)) {
+			// The writer is behind. Wait for it, so that captured frames are
+			// never dropped, but say that the capture thread stalled. The set
+			// may be written and deleted as soon as it's queued.
+			int id = is->m_fileId;
+			double start = is->m_pushTime;
+			LOG("image set %i: %i sets already pending, waiting for the writer\n", id, m_queue.size());
+			m_queue.produce(is);
+			LOG("image set %i: capture waited %.1f ms for the writer\n", id, m_timer.get() - start);
+		}
 	}
 }
 
@@ -295,11 +389,31 @@ void *AsyncImageWriter::ThreadProc(void *opaque) {
 			break;
 		}
 
-		imageset->dumpToFileSystem(instance->m_onChangedCallback);
+		int frames = imageset->m_frames.size();
+		imageset->dumpToFileSystem(instance->m_jobs, instance->m_onChangedCallback);
+		LOG("image set %i: %i frames flushed in %.1f ms\n", imageset->m_fileId, frames,
+				instance->m_timer.get() - imageset->m_pushTime);
 		delete imageset;
 	}
 
 	return 0;
 }
 
+void *AsyncImageWriter::EncoderProc(void *opaque) {
+	AsyncImageWriter *instance = (AsyncImageWriter *)opaque;
+	FCam::Image thumbnail;
+	EncodeJob job;
+
+	while (instance->m_jobs.consume(job, true)) {
+		if (job.set == 0) {
+			// end of work, leave
+			break;
+		}
+
+		job.set->encodeFrame(job.index, thumbnail);
+	}
+
+	return 0;
+}
+
 
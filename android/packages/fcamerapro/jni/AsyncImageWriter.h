@@ -2,8 +2,11 @@
 #define _ASYNCIMAGEWRITER_H
 
 #include <FCam/Tegra.h>
+#include <pthread.h>
+#include <string>
 #include <vector>
 #include "WorkQueue.h"
+#include "HPT.h"
 
 
 class FileFormatDescriptor {
@@ -32,6 +35,16 @@ private:
 
 typedef void (*ASYNC_IMAGE_WRITER_CALLBACK)(void);
 
+class ImageSet;
+
+// One frame of an image set, for an encoder thread. A null set tells the
+// encoder thread to exit.
+struct EncodeJob {
+	EncodeJob(ImageSet *set = 0, int index = 0) : set(set), index(index) { }
+	ImageSet *set;
+	int index;
+};
+
 class ImageSet {
 	friend class AsyncImageWriter;
 public:
@@ -42,21 +55,47 @@ private:
 	ImageSet(int id, const char *outputDirPrefix);
 	~ImageSet(void);
 
-	void dumpToFileSystem(ASYNC_IMAGE_WRITER_CALLBACK proc);
+	// Hands each frame to the encoder threads, waits for them, and then writes
+	// the xml index.
+	void dumpToFileSystem(WorkQueue<EncodeJob> &jobs, ASYNC_IMAGE_WRITER_CALLBACK proc);
+	// Called on an encoder thread. The thumbnail image is the thread's own
+	// scratch space.
+	void encodeFrame(int i, FCam::Image &thumbnail);
 
 	std::vector<FCam::Frame> m_frames;
 	std::vector<FileFormatDescriptor> m_frameFormat;
 	const char *m_outputDirPrefix;
 	const int m_fileId;
+
+	double m_pushTime;
+	int m_pending; // frames not yet encoded
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_encoded;
 };
 
+// Writes image sets to the file system in the background. A dispatch thread
+// takes one image set at a time and fans its frames out to a pool of encoder
+// threads, which write each image and its thumbnail. Once all frames of a set
+// are written, the dispatch thread writes its xml index, so the gallery never
+// sees a set with missing files. Every file is written under a temporary name
+// and then renamed into place.
+//
+// Memory is bounded by the number of image sets that may be queued and by each
+// encoder thread owning one thumbnail. Frames are released as soon as they are
+// written.
 class AsyncImageWriter {
 public:
-	AsyncImageWriter(const char *outputDirPrefix);
+	// With encoderThreads zero, uses one encoder thread per CPU, up to four.
+	AsyncImageWriter(const char *outputDirPrefix, int encoderThreads = 0);
 	~AsyncImageWriter(void);
 
 	ImageSet *newImageSet(void);
 
+	// Queue an image set to be written, and take ownership of it. This is the
+	// backpressure on capture: if MAX_PENDING_IMAGE_SETS sets are already
+	// waiting, push() blocks the calling (capture) thread until the oldest one
+	// has been written, rather than dropping a burst or holding more of them
+	// in memory. Waits are logged with their length.
 	void push(ImageSet *is);
 	void setOnFileSystemChangedCallback(ASYNC_IMAGE_WRITER_CALLBACK cb);
 	static void SetFreeFileId(int id);
@@ -64,10 +103,14 @@ public:
 private:
 	char *m_outputDirPrefix;
 	WorkQueue<ImageSet *> m_queue;
+	WorkQueue<EncodeJob> m_jobs;
 	ASYNC_IMAGE_WRITER_CALLBACK m_onChangedCallback;
+	Timer m_timer;
 
 	pthread_t m_thread;
+	std::vector<pthread_t> m_encoders;
 	static void *ThreadProc(void *);
+	static void *EncoderProc(void *);
 
 	static int sFreeId;
 };
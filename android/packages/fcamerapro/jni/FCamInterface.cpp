@@ -9,6 +9,9 @@
 #include <ImageStack/ImageStack.h>
 #include "FCamInterface.h"
 #include "AsyncImageWriter.h"
+#include "PreviewTarget.h"
+#include "AlignmentAssist.h"
+#include "FaceTracker.h"
 #include "MyAutoFocus.h"
 #include "MyFaceDetector.h"
 #include "ParamStat.h"
@@ -28,12 +31,17 @@
 #define CAPTURE_IMAGE_WIDTH  2592
 #define CAPTURE_IMAGE_HEIGHT 1936
 
-#define PI_PLANE_SIZE (PREVIEW_IMAGE_WIDTH*PREVIEW_IMAGE_HEIGHT)
-#define PI_U_OFFSET   (PREVIEW_IMAGE_WIDTH*PREVIEW_IMAGE_HEIGHT)
-#define PI_V_OFFSET   (PREVIEW_IMAGE_WIDTH*PREVIEW_IMAGE_HEIGHT+(PREVIEW_IMAGE_WIDTH*PREVIEW_IMAGE_HEIGHT>>2))
-
 #define FPS_UPDATE_PERIOD 500 // in ms
 
+// Face detection runs on the preview halved this many times, at most once per
+// interval. In between, faces are tracked on every frame.
+#define FACE_PYRAMID_LEVELS  1
+#define FACE_DETECT_INTERVAL 500 // in ms
+// Face autofocus falls back to a global sweep if no face turns up in time, and
+// only moves the focus spot when the face moves by more than the tolerance.
+#define FACE_AF_TIMEOUT      2000 // in ms
+#define FACE_SPOT_TOLERANCE  0.02f
+
 /* GL_OES_egl_image_external */
 #ifndef GL_OES_egl_image_external
 #define GL_OES_egl_image_external 1
@@ -53,6 +61,15 @@ static AsyncImageWriter *writer;
 
 static void *FCamAppThread(void *tdata);
 
+// Queue a request for the app thread. The callers are UI, JNI and writer
+// threads, which must not stall, so this never waits: the queue only fills up
+// if the app thread is stuck, and then the request is dropped.
+static void PostRequest(int param, const void *data, int dataSize) {
+	if (!sAppData->requestQueue.tryProduce(ParamSetRequest(param, data, dataSize))) {
+		ERROR("request queue full, dropping request %d!", param);
+	}
+}
+
 // ==========================================================================================
 // PUBLIC JNI FUNCTIONS
 // ==========================================================================================
@@ -85,7 +102,7 @@ JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_unlockViewerText
 }
 
 JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_setParamInt(JNIEnv *env, jobject thiz, jint param, jint value) {
-	sAppData->requestQueue.produce(ParamSetRequest(param, &value, sizeof(int)));
+	PostRequest(param, &value, sizeof(int));
 }
 
 JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_setParamIntArray(JNIEnv *env, jobject thiz, jint param, jintArray value) {
@@ -104,7 +121,7 @@ JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_setParamIntArray
 		}
 
 		arrayData = env->GetIntArrayElements(value, 0);
-		sAppData->requestQueue.produce(ParamSetRequest(param, arrayData, arraySize * sizeof(int)));
+		PostRequest(param, arrayData, arraySize * sizeof(int));
 		env->ReleaseIntArrayElements(value, arrayData, 0);
 		break;
 
@@ -192,7 +209,7 @@ JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_getParamIntArray
 }
 
 JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_setParamFloat(JNIEnv *env, jobject thiz, jint param, jfloat value) {
-	sAppData->requestQueue.produce(ParamSetRequest(param, &value, sizeof(float)));
+	PostRequest(param, &value, sizeof(float));
 }
 
 JNIEXPORT float JNICALL Java_com_nvidia_fcamerapro_FCamInterface_getParamFloat(JNIEnv *env, jobject thiz, jint param) {
@@ -247,7 +264,7 @@ JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_getParamFloatArr
 
 JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_setParamString(JNIEnv *env, jobject thiz, jint param, jstring value) {
     const char *str = (const char *) env->GetStringUTFChars(value, 0);
-	sAppData->requestQueue.produce(ParamSetRequest(param, str, strlen(str) + 1));
+	PostRequest(param, str, strlen(str) + 1);
     env->ReleaseStringUTFChars(value, str);
 }
 
@@ -323,12 +340,12 @@ JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_enqueueMessageFo
 	 */
 	LOG("! enqueueMessageForAutofocus");
 	const int value = 0;
-	sAppData->requestQueue.produce(ParamSetRequest(PARAM_GLOBAL_AF, &value, sizeof(int)));}
+	PostRequest(PARAM_GLOBAL_AF, &value, sizeof(int));}
 
 JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_enqueueMessageForFastAutofocus(JNIEnv *env, jobject thiz) {
 	LOG("! enqueueMessageForFastAutofocus");
 	const int value = 1;
-	sAppData->requestQueue.produce(ParamSetRequest(PARAM_GLOBAL_AF, &value, sizeof(int)));
+	PostRequest(PARAM_GLOBAL_AF, &value, sizeof(int));
 }
 
 
@@ -338,7 +355,7 @@ JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_enqueueMessageFo
 	 */
 	const float spot[2] = {float(x), float(y)};
 	LOG("! enqueueMessageForAutofocusSpot (%f, %f)", x, y);
-	sAppData->requestQueue.produce(ParamSetRequest(PARAM_LOCAL_AF, &spot, sizeof(float)*2));
+	PostRequest(PARAM_LOCAL_AF, &spot, sizeof(float)*2);
 	// TODO TODO TODO
 	// TODO TODO TODO
 	// TODO TODO TODO
@@ -351,11 +368,11 @@ JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_enqueueMessageFo
  * Add a new function that enqueues a message representing a request for face-detection-based autofocus.
  * You will also need to add a corresponding Java method in FCamInterface.java
  */
-// TODO TODO TODO
-// TODO TODO TODO
-// TODO TODO TODO
-// TODO TODO TODO
-// TODO TODO TODO
+JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_enqueueMessageForFaceAutofocus(JNIEnv *env, jobject thiz) {
+	LOG("! enqueueMessageForFaceAutofocus");
+	const int value = 1;
+	PostRequest(PARAM_FACE_AF, &value, sizeof(int));
+}
 
 /* [CS478] Assignment #2
  * Add a new function performs flash/no-flash fusion using ImageStack. The form of
@@ -377,7 +394,7 @@ JNIEXPORT void JNICALL Java_com_nvidia_fcamerapro_FCamInterface_enqueueMessageFo
 static void OnFileSystemChanged(void) {
 	// Called from the asynchronous image writer thread -> queue request to resolve in the main app thread
 	const int value = 1;
-	sAppData->requestQueue.produce(ParamSetRequest(PARAM_PRIV_FS_CHANGED, &value, sizeof(int)));
+	PostRequest(PARAM_PRIV_FS_CHANGED, &value, sizeof(int));
 }
 
 static void OnCapture(FCAM_INTERFACE_DATA *tdata, AsyncImageWriter *writer, FCam::Tegra::Sensor &sensor,
@@ -432,6 +449,10 @@ static void *FCamAppThread(void *ptr) {
     tdata->javaVM->AttachCurrentThread(&env, 0);
     writer = 0; // Initialized on the first PARAM_OUTPUT_DIRECTORY set request.
 
+    // Preview frames are written by the sensor directly into the viewer's
+    // buffers. This must outlive the sensor.
+    PreviewTarget previewTarget(tdata->tripleBuffer, PREVIEW_IMAGE_WIDTH, PREVIEW_IMAGE_HEIGHT);
+
     // Initialize FCam devices.
     FCam::Tegra::Sensor sensor;
     FCam::Tegra::Lens lens;
@@ -440,8 +461,9 @@ static void *FCamAppThread(void *ptr) {
     sensor.attach(&flash);
     MyAutoFocus autofocus(&lens);
     MyFaceDetector faceDetector("/data/fcam/data.xml");
+    AlignmentAssist assist(PREVIEW_IMAGE_WIDTH, PREVIEW_IMAGE_HEIGHT);
+    FaceTracker faces(&faceDetector, PREVIEW_IMAGE_WIDTH, PREVIEW_IMAGE_HEIGHT, FACE_PYRAMID_LEVELS, FACE_DETECT_INTERVAL);
 
-    FCam::Image previewImage(PREVIEW_IMAGE_WIDTH, PREVIEW_IMAGE_HEIGHT, FCam::YUV420p);
     FCam::Tegra::Shot shot;
 
     // Initialize FPS stat calculation.
@@ -455,11 +477,19 @@ static void *FCamAppThread(void *ptr) {
 
 	bool alignmentAssist = false;
 
+	// Face autofocus keeps the focus spot on the largest tracked face. The
+	// sweep starts once there is a face to focus on.
+	bool faceFocus = false, faceSweepPending = false;
+	double faceFocusTime = 0;
+	float faceX = -1, faceY = -1;
+
 	for (;;) {
 		FCAM_SHOT_PARAMS *currentShot = &tdata->currentShot;
 		FCAM_SHOT_PARAMS *previousShot = &tdata->previousShot;
-	    // Copy tasks to local queue
-	    sAppData->requestQueue.consumeAll(taskQueue);
+	    // Copy tasks to local queue. With the viewer off there's nothing else to
+	    // do, so wait for a task instead of spinning.
+	    if (tdata->isViewerActive) sAppData->requestQueue.consumeAll(taskQueue);
+	    else sAppData->requestQueue.consumeAllTimed(taskQueue, 100);
 
 	    // Parse all tasks from the Android applications.
 	    while (!taskQueue.empty()) {
@@ -571,11 +601,13 @@ static void *FCamAppThread(void *ptr) {
 				 * message types in ParamSetRequest.h.
 				 */
 				case PARAM_GLOBAL_AF:
+					faceFocus = false;
 					autofocus.runFaster(taskData[0]!=0);
 					autofocus.setSpot(); //reset to global
 				    autofocus.startSweep(); // will return immediately if already sweeping
 					break;
 				case PARAM_LOCAL_AF:
+					faceFocus = false;
 					autofocus.runFaster(false);
 					autofocus.setSpot(((float *)taskData)[0], ((float *)taskData)[1]);
 				    autofocus.startSweep();
@@ -586,13 +618,18 @@ static void *FCamAppThread(void *ptr) {
 				 * based autofocus. Recall that it might be useful to add a new
 				 * message type in ParamSetRequest.h
 				 */
-				// TODO TODO TODO
-				// TODO TODO TODO
-				// TODO TODO TODO
-				// TODO TODO TODO
-				// TODO TODO TODO
+				case PARAM_FACE_AF:
+					autofocus.runFaster(false);
+					faces.reset();
+					faceFocus = true;
+					faceSweepPending = true;
+					faceFocusTime = timer.get();
+					faceX = faceY = -1;
+					break;
 				case PARAM_PREVIEW_ALIGNMENT_ASSIST_ON:
 					alignmentAssist = taskData[0]!=0;
+					if (!alignmentAssist) assist.clear();
+					break;
 			default:
 				ERROR("TaskDispatch(): received unsupported task id (%i)!", taskId);
 			}
@@ -604,7 +641,8 @@ static void *FCamAppThread(void *ptr) {
 	    shot.exposure = currentShot->preview.autoExposure ? previousShot->preview.evaluated.exposure : currentShot->preview.user.exposure;
 	    shot.gain = currentShot->preview.autoGain ? previousShot->preview.evaluated.gain : currentShot->preview.user.gain;
 	    shot.whiteBalance = currentShot->preview.autoWB ? previousShot->preview.evaluated.wb : currentShot->preview.user.wb;
-	    shot.image = previewImage;
+	    shot.image = FCam::Image(PREVIEW_IMAGE_WIDTH, PREVIEW_IMAGE_HEIGHT, FCam::YUV420p, FCam::Image::Discard);
+	    shot.target = &previewTarget;
 	    shot.histogram.enabled = true;
 	    shot.histogram.region = FCam::Rect(0, 0, PREVIEW_IMAGE_WIDTH, PREVIEW_IMAGE_HEIGHT);
 	    shot.sharpness.enabled = currentShot->preview.autoFocus;
@@ -640,40 +678,6 @@ static void *FCamAppThread(void *ptr) {
             currentShot->preview.evaluated.wb = shot.whiteBalance;
 	    }
 
-	    if (false) {
-
-	    	std::vector<cv::Rect> facesFound = faceDetector.detectFace(frame.image());
-	    	for (unsigned int i = 0; i < facesFound.size(); i++) {
-	    		cv::Rect r = facesFound[i];
-	    		for (int x = 0; x < r.width; x++) {
-	    			frame.image()(r.x + x, r.y)[0] = 254u;
-	    			frame.image()(r.x + x, r.y + r.height)[0] = 254u;
-	    		}
-	    		for (int y = 0; y < r.height; y++) {
-					frame.image()(r.x, r.y + y)[0] = 254u;
-					frame.image()(r.x + r.width, r.y + y)[0] = 254u;
-	    		}
-	    	}
-
-	    }
-	    /* [CS478] Assignment #2
-	     * Above, facesFound contains the list of detected faces, for the given frame.
-	     * If applicable, you may pass these values to the MyAutoFocus instance.
-	     *
-	     * e.g. autofocus.setTarget(facesFound);
-	     * Note that MyAutoFocus currently has no setTarget method. You'd have
-	     * to write the appropriate interface.
-	     *
-	     * You should also only run faceDetector.detectFace(...) if it
-	     * is necessary (to save compute), so change "true" above to something else
-	     * appropriate.
-	     */
-	    // TODO TODO TODO
-	    // TODO TODO TODO
-	    // TODO TODO TODO
-	    // TODO TODO TODO
-	    // TODO TODO TODO
-
 	    /* [CS478] Assignment #1
 	     * You should process the incoming frame for autofocus, if necessary.
 	     * Your autofocus (MyAutoFocus.h) has a function called update(...).
@@ -712,90 +716,46 @@ static void *FCamAppThread(void *ptr) {
 		// TODO: Edge Detection
 
 
-	    const FCam::Image image = frame.image();
-	    cv::Mat imgsrc;
-
-	    if(alignmentAssist){
-	    imgsrc = cvCreateImage(cvSize(PREVIEW_IMAGE_WIDTH, PREVIEW_IMAGE_HEIGHT), 8, 1);
-	    memcpy(imgsrc.data, (uchar *)frame.image()(0, 0), PI_PLANE_SIZE);
-
-	    cv::Mat dst, cdst;
-	    cv::Canny(imgsrc, dst, 50, 200, 3);
-	    LOG("CV: 1");
-	    //cv::cvtColor(dst, cdst, CV_GRAY2BGR);
-
-		std::vector<cv::Vec4i> lines;
-		cv::HoughLinesP(dst, lines, 1, CV_PI/180, 50, 75, 7 );
-		for( size_t i = 0; i < lines.size(); i++ )
-		{
-			cv::Vec4i l = lines[i];
-
-			int lineThickness = 1;
-
-			float closeThreshold = 0.1;
-			cv::Scalar closeColor = cv::Scalar(0);
-			float greatThreshold = 0.02;
-			cv::Scalar greatColor = cv::Scalar(255);
-
-
-			if(atan2(abs(l[3]-l[1]), abs(l[2]-l[0])) < closeThreshold) {
-				// If the line is close to horizontal...
-				if(atan2(abs(l[3]-l[1]), abs(l[2]-l[0])) < greatThreshold) {
-					// If the line is truly horizontal, we don't need to draw anything...
-					//cv::line( imgsrc, cv::Point(l[0], l[1]), cv::Point(l[2], l[3]), greatColor, lineThickness, CV_AA);
-				} else {
-					// Otherwise if the line is not quite horizontal, we draw the line and a
-					cv::line( imgsrc, cv::Point(l[0], l[1]), cv::Point(l[2], l[3]), closeColor, lineThickness, CV_AA);
-					cv::line( imgsrc, cv::Point(l[0], l[1]+1), cv::Point(l[2], l[3]+1), greatColor, lineThickness, CV_AA);
-					if(abs(l[0]-PREVIEW_IMAGE_WIDTH/2) < abs(l[2]-PREVIEW_IMAGE_WIDTH/2)){
-						cv::line( imgsrc, cv::Point(l[0], l[1]+1), cv::Point(l[2], l[1]+1), greatColor, lineThickness, CV_AA);
-						cv::line( imgsrc, cv::Point(l[0], l[1]), cv::Point(l[2], l[1]), closeColor, lineThickness, CV_AA);
-					} else {
-						cv::line( imgsrc, cv::Point(l[0], l[3]+1), cv::Point(l[2], l[3]+1), greatColor, lineThickness, CV_AA);
-						cv::line( imgsrc, cv::Point(l[0], l[3]), cv::Point(l[2], l[3]), closeColor, lineThickness, CV_AA);
-					}
-				}
-			} else if(atan2(abs(l[2]-l[0]), abs(l[3]-l[1])) < closeThreshold) {
-				// If the line is close to vertical...
-				if(atan2(abs(l[2]-l[0]), abs(l[3]-l[1])) < greatThreshold) {
-					//cv::line( imgsrc, cv::Point(l[0], l[1]), cv::Point(l[2], l[3]), greatColor, lineThickness, CV_AA);
-
-				} else {
-					cv::line( imgsrc, cv::Point(l[0], l[1]), cv::Point(l[2], l[3]), closeColor, lineThickness, CV_AA);
-					cv::line( imgsrc, cv::Point(l[0]+1, l[1]), cv::Point(l[2]+1, l[3]), greatColor, lineThickness, CV_AA);
-					if(abs(l[1]-PREVIEW_IMAGE_HEIGHT/2) < abs(l[3]-PREVIEW_IMAGE_HEIGHT/2)) {
-						cv::line( imgsrc, cv::Point(l[0]+1, l[1]), cv::Point(l[0]+1, l[3]), greatColor, lineThickness, CV_AA);
-						cv::line( imgsrc, cv::Point(l[0], l[1]), cv::Point(l[0], l[3]), closeColor, lineThickness, CV_AA);
-					} else {
-						cv::line( imgsrc, cv::Point(l[2]+1, l[1]), cv::Point(l[2]+1, l[3]), greatColor, lineThickness, CV_AA);
-						cv::line( imgsrc, cv::Point(l[2], l[1]), cv::Point(l[2], l[3]), closeColor, lineThickness, CV_AA);
-					}
-				}
-
-			}
-
-
-
-		}
-
-	    //cv::cvtColor(cdst, dst, CV_BGR2GRAY);
-	    //memcpy((uchar *)image(0, 0), imgsrc.data, PI_PLANE_SIZE);
-
+	    // The sensor has been writing into the viewer's back buffer, possibly
+	    // newer frames than this one. Claim what's there for presenting. There's
+	    // nothing to claim if this frame's image was dropped, or if a later frame
+	    // was already presented.
+	    bool hasPreview = frame.image().valid() && previewTarget.claim();
+
+	    if((alignmentAssist || faceFocus) && hasPreview){
+	    	// Hand this frame to the vision workers before drawing any overlays
+	    	// into it, then draw the guide lines and faces they found so far.
+	    	FCam::Tegra::Hal::SharedBuffer *previewBuffer = previewTarget.claimedBuffer();
+	    	uchar *luma = (uchar *)previewBuffer->lock();
+	    	if (alignmentAssist) assist.post(luma, PREVIEW_IMAGE_WIDTH);
+	    	if (faceFocus) faces.update(luma, PREVIEW_IMAGE_WIDTH);
+	    	if (alignmentAssist) assist.draw(luma, PREVIEW_IMAGE_WIDTH);
+	    	if (faceFocus) faces.draw(luma, PREVIEW_IMAGE_WIDTH);
+	    	previewBuffer->unlock();
 	    }
 
+	    // Point the autofocus at the largest face.
+	    float x, y;
+	    if (faceFocus && hasPreview && faces.getLargestFace(x, y)) {
+	    	if (fabsf(x - faceX) > FACE_SPOT_TOLERANCE || fabsf(y - faceY) > FACE_SPOT_TOLERANCE) {
+	    		faceX = x;
+	    		faceY = y;
+	    		autofocus.setSpot(x, y);
+	    	}
+	    	if (faceSweepPending) {
+	    		autofocus.startSweep();
+	    		faceSweepPending = false;
+	    	}
+	    } else if (faceSweepPending && timer.get() - faceFocusTime > FACE_AF_TIMEOUT) {
+	    	LOG("Face AF: no face found, focusing globally");
+	    	autofocus.setSpot();
+	    	autofocus.startSweep();
+	    	faceSweepPending = false;
+	    }
 
-	    // Update the frame buffer.
-	    uchar *src = (uchar *)image(0, 0);
-	    FCam::Tegra::Hal::SharedBuffer *captureBuffer = tdata->tripleBuffer->getBackBuffer();
-	    uchar *dest = (uchar *)captureBuffer->lock();
 
-	    // Note: why do we need to shuffle U and V channels? It seems to be a bug.
-	    if(alignmentAssist) memcpy(dest, imgsrc.data, PI_PLANE_SIZE);
-	    else memcpy(dest, src, PI_PLANE_SIZE);
-	    memcpy(dest + PI_U_OFFSET, (uchar *)image(0, 0) + PI_V_OFFSET, PI_PLANE_SIZE >> 2);
-	    memcpy(dest + PI_V_OFFSET, (uchar *)image(0, 0) + PI_U_OFFSET, PI_PLANE_SIZE >> 2);
-	    captureBuffer->unlock();
-	    tdata->tripleBuffer->swapBackBuffer();
+	    // Hand the frame to the viewer.
+	    if (hasPreview) previewTarget.present();
 
 	    // Frame capture complete, copy current shot data to previous one
 	    pthread_mutex_lock(&tdata->currentShotLock);
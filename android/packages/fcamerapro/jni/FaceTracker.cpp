@@ -0,0 +1,201 @@
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+#include "FaceTracker.h"
+
+// A track is searched for within this fraction of its size around its last
+// position, and dropped when the best normalized correlation falls below
+// TRACK_MIN_SCORE.
+#define TRACK_SEARCH_FRACTION 0.5f
+#define TRACK_MIN_SCORE       0.5
+
+FaceTracker::FaceTracker(MyFaceDetector *detector, int width, int height, int levels, int intervalMs) :
+	m_detector(detector), m_width(width), m_height(height), m_levels(levels < 0 ? 0 : levels) {
+	m_interval = intervalMs;
+	m_lastPost = -1e9;
+	m_postTime = 0;
+	m_lastLatency = 0;
+	m_hasInput = false;
+	m_busy = false;
+	m_hasResult = false;
+	m_quit = false;
+	m_generation = 0;
+	m_workGeneration = 0;
+	pthread_mutex_init(&m_lock, 0);
+	pthread_cond_init(&m_inputReady, 0);
+
+	// launch the work thread
+	pthread_create(&m_thread, 0, FaceTracker::ThreadProc, this);
+}
+
+FaceTracker::~FaceTracker(void) {
+	pthread_mutex_lock(&m_lock);
+	m_quit = true;
+	pthread_cond_signal(&m_inputReady);
+	pthread_mutex_unlock(&m_lock);
+	pthread_join(m_thread, 0);
+
+	pthread_cond_destroy(&m_inputReady);
+	pthread_mutex_destroy(&m_lock);
+}
+
+void FaceTracker::setInterval(int intervalMs) {
+	m_interval = intervalMs;
+}
+
+void FaceTracker::update(const uchar *luma, int stride) {
+	// Build the downscaled plane outside the lock.
+	cv::Mat src(m_height, m_width, CV_8UC1, (void *)luma, stride);
+	if (m_levels == 0) {
+		src.copyTo(m_plane);
+	} else {
+		cv::pyrDown(src, m_plane);
+		for (int i = 1; i < m_levels; i++) {
+			cv::pyrDown(m_plane, m_scratch);
+			std::swap(m_plane, m_scratch);
+		}
+	}
+
+	double now = m_timer.get();
+	bool detected = false, post = false;
+
+	pthread_mutex_lock(&m_lock);
+	if (m_hasResult) {
+		std::swap(m_result, m_detected);
+		m_faces.swap(m_resultFaces);
+		m_hasResult = false;
+		detected = true;
+	}
+	post = !m_hasInput && !m_busy && now - m_lastPost >= m_interval;
+	pthread_mutex_unlock(&m_lock);
+
+	// The worker is idle and only looks at m_input once m_hasInput is set, so
+	// it's ours to fill until then.
+	if (post) {
+		m_plane.copyTo(m_input);
+		m_lastPost = m_postTime = now;
+
+		pthread_mutex_lock(&m_lock);
+		m_hasInput = true;
+		pthread_cond_signal(&m_inputReady);
+		pthread_mutex_unlock(&m_lock);
+	}
+
+	// Fresh detections replace the tracks, then everything is matched into
+	// this frame.
+	if (detected) {
+		startTracks(m_detected, m_faces);
+		m_lastLatency = now - m_postTime;
+	}
+	for (size_t i = 0; i < m_tracks.size();) {
+		if (track(m_tracks[i], m_plane)) i++;
+		else m_tracks.erase(m_tracks.begin() + i);
+	}
+}
+
+void FaceTracker::reset(void) {
+	pthread_mutex_lock(&m_lock);
+	m_generation++;
+	m_hasInput = false;
+	m_hasResult = false;
+	pthread_mutex_unlock(&m_lock);
+
+	m_tracks.clear();
+	m_lastPost = -1e9;
+}
+
+void FaceTracker::getFaces(std::vector<cv::Rect> &faces) const {
+	faces.clear();
+	for (size_t i = 0; i < m_tracks.size(); i++) {
+		faces.push_back(toFullRes(m_tracks[i].rect));
+	}
+}
+
+bool FaceTracker::getLargestFace(float &x, float &y) const {
+	const Track *largest = 0;
+	for (size_t i = 0; i < m_tracks.size(); i++) {
+		if (!largest || m_tracks[i].rect.area() > largest->rect.area()) largest = &m_tracks[i];
+	}
+	if (!largest) return false;
+
+	cv::Rect r = toFullRes(largest->rect);
+	x = (r.x + r.width * 0.5f) / m_width;
+	y = (r.y + r.height * 0.5f) / m_height;
+	return true;
+}
+
+void FaceTracker::draw(uchar *luma, int stride, uchar value) const {
+	cv::Mat dst(m_height, m_width, CV_8UC1, luma, stride);
+	for (size_t i = 0; i < m_tracks.size(); i++) {
+		cv::rectangle(dst, toFullRes(m_tracks[i].rect), cv::Scalar(value));
+	}
+}
+
+void *FaceTracker::ThreadProc(void *opaque) {
+	FaceTracker *instance = (FaceTracker *)opaque;
+	std::vector<cv::Rect> faces;
+
+	pthread_mutex_lock(&instance->m_lock);
+	for (;;) {
+		while (!instance->m_hasInput && !instance->m_quit) {
+			pthread_cond_wait(&instance->m_inputReady, &instance->m_lock);
+		}
+		if (instance->m_quit) break;
+
+		std::swap(instance->m_input, instance->m_work);
+		instance->m_hasInput = false;
+		instance->m_busy = true;
+		instance->m_workGeneration = instance->m_generation;
+		pthread_mutex_unlock(&instance->m_lock);
+
+		faces = instance->m_detector->detectFace(instance->m_work);
+
+		pthread_mutex_lock(&instance->m_lock);
+		if (instance->m_workGeneration == instance->m_generation) {
+			std::swap(instance->m_work, instance->m_result);
+			instance->m_resultFaces.swap(faces);
+			instance->m_hasResult = true;
+		}
+		instance->m_busy = false;
+	}
+	pthread_mutex_unlock(&instance->m_lock);
+
+	return 0;
+}
+
+void FaceTracker::startTracks(const cv::Mat &plane, const std::vector<cv::Rect> &faces) {
+	cv::Rect bounds(0, 0, plane.cols, plane.rows);
+
+	m_tracks.clear();
+	for (size_t i = 0; i < faces.size(); i++) {
+		Track t;
+		t.rect = faces[i] & bounds;
+		if (t.rect.width <= 0 || t.rect.height <= 0) continue;
+		// The detection frame's buffer is reused, so the patch needs its own copy.
+		t.patch = plane(t.rect).clone();
+		m_tracks.push_back(t);
+	}
+}
+
+bool FaceTracker::track(Track &t, const cv::Mat &plane) {
+	int mx = (int)(t.rect.width * TRACK_SEARCH_FRACTION);
+	int my = (int)(t.rect.height * TRACK_SEARCH_FRACTION);
+	cv::Rect window(t.rect.x - mx, t.rect.y - my, t.rect.width + 2 * mx, t.rect.height + 2 * my);
+	window &= cv::Rect(0, 0, plane.cols, plane.rows);
+	if (window.width < t.patch.cols || window.height < t.patch.rows) return false;
+
+	double score;
+	cv::Point loc;
+	cv::matchTemplate(plane(window), t.patch, m_score, CV_TM_CCOEFF_NORMED);
+	cv::minMaxLoc(m_score, 0, &score, 0, &loc);
+	// A flat patch correlates to NaN, which must count as lost.
+	if (!(score >= TRACK_MIN_SCORE)) return false;
+
+	t.rect.x = window.x + loc.x;
+	t.rect.y = window.y + loc.y;
+	return true;
+}
+
+cv::Rect FaceTracker::toFullRes(const cv::Rect &r) const {
+	int s = 1 << m_levels;
+	return cv::Rect(r.x * s, r.y * s, r.width * s, r.height * s);
+}
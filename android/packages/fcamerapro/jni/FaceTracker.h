@@ -0,0 +1,89 @@
+#ifndef _FACETRACKER_H
+#define _FACETRACKER_H
+
+#include <pthread.h>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include "Common.h"
+#include "HPT.h"
+#include "MyFaceDetector.h"
+
+// Keeps track of the faces in the preview without running the face detector on
+// every frame.
+//
+// The capture thread hands every frame to update(), which halves the luma plane
+// once per pyramid level. Every interval milliseconds, if the worker isn't busy
+// with an earlier frame, the downscaled plane is posted to the worker thread,
+// which runs the cascade on it. The faces the worker finds become the new set of
+// tracks, each remembering what its face looked like in the detection frame.
+// On every frame, detected or not, each track is moved to the best template
+// match near its last position, and dropped if the match is poor. Since tracks
+// are matched into the newest frame, detections don't lag behind by the time
+// the cascade took.
+class FaceTracker {
+public:
+	FaceTracker(MyFaceDetector *detector, int width, int height, int levels = 1, int intervalMs = 500);
+	~FaceTracker(void);
+
+	// Time between detections. Zero detects as often as the worker keeps up.
+	void setInterval(int intervalMs);
+
+	// Track faces into a new frame, and post it for detection if it's time.
+	// Doesn't wait for the worker.
+	void update(const uchar *luma, int stride);
+
+	// Drop all tracks, along with any detection in flight.
+	void reset(void);
+
+	// The tracked faces, in full resolution coordinates.
+	void getFaces(std::vector<cv::Rect> &faces) const;
+
+	// The center of the largest tracked face, normalized to [0, 1]. Returns
+	// false if there are no faces.
+	bool getLargestFace(float &x, float &y) const;
+
+	// Draw a box around each tracked face into a luma plane.
+	void draw(uchar *luma, int stride, uchar value = 254) const;
+
+	// Time from posting a frame to the worker to its faces being picked up, in
+	// ms, for the most recent detection.
+	double lastLatency(void) const { return m_lastLatency; }
+
+private:
+	struct Track {
+		cv::Rect rect; // in the downscaled plane
+		cv::Mat patch;
+	};
+
+	static void *ThreadProc(void *);
+	void startTracks(const cv::Mat &plane, const std::vector<cv::Rect> &faces);
+	bool track(Track &t, const cv::Mat &plane);
+	cv::Rect toFullRes(const cv::Rect &r) const;
+
+	MyFaceDetector *m_detector;
+	const int m_width, m_height, m_levels;
+	int m_interval;
+	Timer m_timer;
+
+	// Capture thread state.
+	cv::Mat m_plane, m_scratch, m_score;
+	std::vector<Track> m_tracks;
+	double m_lastPost, m_postTime, m_lastLatency;
+
+	// The mailboxes. The capture thread swaps a downscaled frame into m_input,
+	// and the worker swaps it back out into m_work. The worker publishes the
+	// frame along with the faces found in it by swapping them into m_result and
+	// m_resultFaces, and the capture thread swaps those into m_detected and
+	// m_faces. m_generation is bumped by reset() so that detections started
+	// before it are thrown away.
+	cv::Mat m_input, m_work, m_result, m_detected;
+	std::vector<cv::Rect> m_resultFaces, m_faces;
+	bool m_hasInput, m_busy, m_hasResult, m_quit;
+	int m_generation, m_workGeneration;
+
+	pthread_mutex_t m_lock;
+	pthread_cond_t m_inputReady;
+	pthread_t m_thread;
+};
+
+#endif
@@ -3,33 +3,42 @@
 
 #include <vector>
 
-#include <FCam/Base.h>
+#include <FCam/Image.h>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/features2d/features2d.hpp>
 #include <opencv2/objdetect/objdetect.hpp>
 
+// Haar cascade parameters. The detector runs on a downscaled preview, so the
+// minimum face size is in downscaled pixels.
+#define FACE_SCALE_FACTOR  1.2
+#define FACE_MIN_NEIGHBORS 3
+#define FACE_MIN_SIZE      20
+
 class MyFaceDetector {
 public:
 	MyFaceDetector(const char* filename) : classifier(filename) {
 		// Empty constructor. Nothing to do.
 	}
 
-	std::vector<cv::Rect> detectFace(const FCam::Image& im) {
-		/* [CS478]
-		 * You will need to call the proper method belonging to
-		 * classifier. See the OpenCV documentation.
-		 * http://opencv.willowgarage.com/documentation/cpp/objdetect_cascade_classification.html
-		 */
+	// Find faces in a single-channel 8-bit image. Not thread-safe: only one
+	// thread should use a given detector.
+	std::vector<cv::Rect> detectFace(const cv::Mat& luma) {
 		std::vector<cv::Rect> ret;
-		// TODO TODO TODO
-		// TODO TODO TODO
-		// TODO TODO TODO
-		// TODO TODO TODO
-		// TODO TODO TODO
+		if (classifier.empty()) return ret;
+		classifier.detectMultiScale(luma, ret, FACE_SCALE_FACTOR, FACE_MIN_NEIGHBORS,
+				CV_HAAR_SCALE_IMAGE, cv::Size(FACE_MIN_SIZE, FACE_MIN_SIZE));
 		return ret;
 	}
+
+	// Find faces in the luma plane of a YUV420p image, at full resolution.
+	std::vector<cv::Rect> detectFace(const FCam::Image& im) {
+		std::vector<cv::Rect> ret;
+		if (!im.valid()) return ret;
+		cv::Mat luma(im.height(), im.width(), CV_8UC1, (void *)im(0, 0), im.bytesPerRow());
+		return detectFace(luma);
+	}
 private:
 	cv::CascadeClassifier classifier;
 };
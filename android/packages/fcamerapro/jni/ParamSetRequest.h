@@ -54,11 +54,7 @@
  * It might be necessary to add another message type to handle
  * face-based autofocus. Do so here.
  */
-// TODO TODO TODO
-// TODO TODO TODO
-// TODO TODO TODO
-// TODO TODO TODO
-// TODO TODO TODO
+#define PARAM_FACE_AF                  21
 #define PARAM_PRIV_FS_CHANGED     100
 
 #define SHOT_PARAM_EXPOSURE 0
@@ -78,27 +74,32 @@ public:
 	ParamSetRequest(int param, const void *data, int dataSize) {
 		m_id = param;
 		m_dataSize = dataSize;
-		m_data = new uchar[m_dataSize];
-		if (data != 0) memcpy(m_data, data, m_dataSize);
+		m_data = m_dataSize ? new uchar[m_dataSize] : 0;
+		if (data != 0 && m_dataSize) memcpy(m_data, data, m_dataSize);
 	}
 
 	ParamSetRequest(const ParamSetRequest &instance) {
 		// copy constructor
 		m_id = instance.m_id;
 		m_dataSize = instance.m_dataSize;
-		m_data = new uchar[m_dataSize];
-		memcpy(m_data, instance.m_data, m_dataSize);
+		m_data = m_dataSize ? new uchar[m_dataSize] : 0;
+		if (m_dataSize) memcpy(m_data, instance.m_data, m_dataSize);
 	}
 
 	ParamSetRequest &operator=(const ParamSetRequest &instance) {
+		if (this == &instance) return *this;
+
 		m_id = instance.m_id;
-		m_dataSize = instance.m_dataSize;
-		if (m_data != 0) {
-			delete [] m_data;
+		// requests are recycled through the work queue, so reuse the buffer
+		// when it's the right size
+		if (m_dataSize != instance.m_dataSize) {
+			if (m_data != 0) {
+				delete [] m_data;
+			}
+			m_dataSize = instance.m_dataSize;
+			m_data = m_dataSize ? new uchar[m_dataSize] : 0;
 		}
-
-		m_data = new uchar[m_dataSize];
-		memcpy(m_data, instance.m_data, m_dataSize);
+		if (m_dataSize) memcpy(m_data, instance.m_data, m_dataSize);
 
 		return *this;
 	}
@@ -0,0 +1,90 @@
+#ifndef _PREVIEWTARGET_H
+#define _PREVIEWTARGET_H
+
+#include <pthread.h>
+#include <FCam/Tegra/Shot.h>
+#include "TripleBuffer.h"
+#include "FCam/Tegra/hal/SharedBuffer.h"
+
+// Lets the sensor write preview frames straight into the back buffer of the
+// viewer's triple buffer. The shared buffers are YV12, so the daemon writes the
+// V plane first.
+//
+// Until the app thread claims the back buffer, each new frame simply replaces
+// the one in it, so the viewer always gets the newest frame however far behind
+// the app thread is. Once claimed (to draw overlays, say), frames that arrive
+// before it is presented are dropped rather than written over it.
+class PreviewTarget : public FCam::Tegra::ImageTarget {
+public:
+	PreviewTarget(TripleBuffer<FCam::Tegra::Hal::SharedBuffer> *buffers, int width, int height) :
+		FCam::Tegra::ImageTarget(true), m_buffers(buffers), m_width(width), m_height(height) {
+		pthread_mutex_init(&m_lock, 0);
+		m_writing = m_written = m_claimed = false;
+	}
+
+	~PreviewTarget(void) {
+		pthread_mutex_destroy(&m_lock);
+	}
+
+	// Called by the FCam daemon.
+	FCam::Image acquire(void) {
+		FCam::Image rval;
+
+		pthread_mutex_lock(&m_lock);
+		if (!m_claimed) {
+			unsigned char *data = (unsigned char *)m_buffers->getBackBuffer()->lock();
+			rval = FCam::Image(m_width, m_height, FCam::YUV420p, data);
+			m_writing = true;
+		}
+		pthread_mutex_unlock(&m_lock);
+
+		return rval;
+	}
+
+	// Called by the FCam daemon.
+	void release(FCam::Image image, bool written) {
+		pthread_mutex_lock(&m_lock);
+		m_buffers->getBackBuffer()->unlock();
+		m_writing = false;
+		m_written = m_written || written;
+		pthread_mutex_unlock(&m_lock);
+	}
+
+	// Take the newest written frame for presenting, and stop the sensor from
+	// replacing it. Returns false if there is no complete frame to take.
+	bool claim(void) {
+		bool rval;
+
+		pthread_mutex_lock(&m_lock);
+		rval = m_written && !m_writing;
+		m_claimed = rval;
+		pthread_mutex_unlock(&m_lock);
+
+		return rval;
+	}
+
+	// The buffer holding the claimed frame, for drawing overlays before it's
+	// presented.
+	FCam::Tegra::Hal::SharedBuffer *claimedBuffer(void) {
+		return m_buffers->getBackBuffer();
+	}
+
+	// Hand the claimed frame to the viewer and free the back buffer for the
+	// next one.
+	void present(void) {
+		pthread_mutex_lock(&m_lock);
+		if (m_claimed) {
+			m_buffers->swapBackBuffer();
+			m_written = m_claimed = false;
+		}
+		pthread_mutex_unlock(&m_lock);
+	}
+
+private:
+	TripleBuffer<FCam::Tegra::Hal::SharedBuffer> *m_buffers;
+	int m_width, m_height;
+	bool m_writing, m_written, m_claimed;
+	pthread_mutex_t m_lock;
+};
+
+#endif
@@ -1,77 +1,86 @@
 #ifndef _TRIPLEBUFFER_H
 #define _TRIPLEBUFFER_H
 
-#include <pthread.h>
-
+// A triple buffer for handing frames from one producer thread to one consumer
+// thread without locks. The producer writes into the back buffer and publishes
+// it with swapBackBuffer(), which trades it for the spare. The consumer picks up
+// the newest published frame with swapFrontBuffer(), which trades the front
+// buffer for the spare if something new was published.
+//
+// The three buffer indices and a "fresh" bit live in one word that is only
+// changed with compare-and-swap. The consumer can only change it once per
+// publish, so swapBackBuffer() retries at most once. The swaps are full
+// barriers, so everything written to a buffer before it's published is visible
+// to the consumer once it swaps it to the front.
 template<class T> class TripleBuffer {
 public:
 	TripleBuffer(T *buffers[3]) {
-		pthread_mutex_init(&m_lock, 0);
-		m_frontBuffer = buffers[0];
-		m_backBuffer = buffers[1];
-		m_spareBuffer = buffers[2];
-		m_updateFrontBuffer = false;
+		for (int i = 0; i < 3; i++) m_buffers[i] = buffers[i];
+		m_state = pack(0, 1, 2, false);
 	}
 
 	~TripleBuffer(void) {
-		pthread_mutex_destroy(&m_lock);
 	}
 
 	T *getFrontBuffer(void) {
-		T *rval;
-
-		pthread_mutex_lock(&m_lock);
-		rval = m_frontBuffer;
-		pthread_mutex_unlock(&m_lock);
-
-		return rval;
+		return m_buffers[front(load())];
 	}
 
 	T *swapFrontBuffer(void) {
-		T *rval;
-
-		pthread_mutex_lock(&m_lock);
-		if (m_updateFrontBuffer) {
-			rval = m_spareBuffer;
-			m_spareBuffer = m_frontBuffer;
-			m_frontBuffer = rval;
-			m_updateFrontBuffer = false;
-		} else {
-			rval = m_frontBuffer;
+		int state = load();
+		while (fresh(state)) {
+			int next = pack(spare(state), back(state), front(state), false);
+			int seen = __sync_val_compare_and_swap(&m_state, state, next);
+			if (seen == state) return m_buffers[front(next)];
+			state = seen;
 		}
-		pthread_mutex_unlock(&m_lock);
-
-		return rval;
+		return m_buffers[front(state)];
 	}
 
 	T *getBackBuffer(void) {
-		T *rval;
-
-		pthread_mutex_lock(&m_lock);
-		rval = m_backBuffer;
-		pthread_mutex_unlock(&m_lock);
-
-		return rval;
+		return m_buffers[back(load())];
 	}
 
 	T *swapBackBuffer(void) {
-		T *rval;
-
-		pthread_mutex_lock(&m_lock);
-		rval = m_spareBuffer;
-		m_spareBuffer = m_backBuffer;
-		m_backBuffer = rval;
-		m_updateFrontBuffer = true;
-		pthread_mutex_unlock(&m_lock);
+		int state = load();
+		for (;;) {
+			int next = pack(front(state), spare(state), back(state), true);
+			int seen = __sync_val_compare_and_swap(&m_state, state, next);
+			if (seen == state) return m_buffers[back(next)];
+			state = seen;
+		}
+	}
 
-		return rval;
+	// Whether a frame has been published since the consumer last swapped it to
+	// the front, i.e. whether swapFrontBuffer() would return a new buffer.
+	bool hasNewFrame(void) {
+		return fresh(load());
 	}
 
 private:
-	T *m_frontBuffer, *m_backBuffer, *m_spareBuffer;
-	bool m_updateFrontBuffer;
-	pthread_mutex_t m_lock;
+	// bits 0-1: front, 2-3: back, 4-5: spare, 6: fresh
+	static int pack(int front, int back, int spare, bool fresh) {
+		return front | (back << 2) | (spare << 4) | (fresh ? 0x40 : 0);
+	}
+	static int front(int state) { return state & 3; }
+	static int back(int state) { return (state >> 2) & 3; }
+	static int spare(int state) { return (state >> 4) & 3; }
+	static bool fresh(int state) { return (state & 0x40) != 0; }
+
+	// A relaxed read is enough: each side only reads back the index it owns and
+	// the other side can't move, and every swap revalidates with its CAS. Older
+	// compilers without the __atomic builtins get a plain volatile read, which
+	// is the same instruction.
+	int load(void) {
+#ifdef __ATOMIC_RELAXED
+		return __atomic_load_n(&m_state, __ATOMIC_RELAXED);
+#else
+		return m_state;
+#endif
+	}
+
+	T *m_buffers[3];
+	volatile int m_state;
 };
 
 #endif
-
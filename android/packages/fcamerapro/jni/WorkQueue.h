@@ -2,66 +2,157 @@
 #define _WORKQUEUE_H
 
 #include <pthread.h>
-#include <semaphore.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <queue>
+#include <vector>
 
+// A bounded queue for any number of producer and consumer threads. Elements are
+// kept in a ring of fixed capacity guarded by one mutex, with condition
+// variables for waiting on "not empty" and "not full". consumeAll() takes
+// everything queued under a single lock.
+//
+// produce() blocks while the queue is full, until a consumer makes room. Threads
+// that must not stall, like the UI and JNI threads, should use tryProduce() and
+// handle a full queue themselves.
+//
+// Timeouts are in milliseconds. A negative timeout waits forever and zero
+// doesn't wait at all.
 template<class T> class WorkQueue {
 public:
-	WorkQueue(void) {
+	WorkQueue(int capacity = 1024) : m_items(capacity > 0 ? capacity : 1) {
 		pthread_mutex_init(&m_lock, 0);
-		sem_init(&m_counterSem, 0, 0);
+		pthread_cond_init(&m_notEmpty, 0);
+		pthread_cond_init(&m_notFull, 0);
+		m_head = 0;
+		m_count = 0;
+		m_waiting[0] = m_waiting[1] = 0;
 	}
 
 	~WorkQueue(void) {
-		sem_destroy(&m_counterSem);
+		pthread_cond_destroy(&m_notFull);
+		pthread_cond_destroy(&m_notEmpty);
 		pthread_mutex_destroy(&m_lock);
 	}
 
+	// Waits for as long as the queue is full.
 	void produce(const T &elem) {
+		produceTimed(elem, -1);
+	}
+
+	// Never waits. Returns false, without queueing anything, if the queue is
+	// full.
+	bool tryProduce(const T &elem) {
+		return produceTimed(elem, 0);
+	}
+
+	// Returns false if the queue stayed full for the whole timeout.
+	bool produceTimed(const T &elem, int timeoutMs) {
 		pthread_mutex_lock(&m_lock);
-		m_queue.push(elem);
-		sem_post(&m_counterSem);
+		bool rval = waitWhile(&m_notFull, true, timeoutMs);
+		if (rval) {
+			m_items[(m_head + m_count) % m_items.size()] = elem;
+			m_count++;
+			if (m_waiting[0]) pthread_cond_signal(&m_notEmpty);
+		}
 		pthread_mutex_unlock(&m_lock);
+
+		return rval;
 	}
 
 	bool consume(T &elem, bool blocking = true) {
-		if (blocking) {
-			sem_wait(&m_counterSem);
-		} else {
-			if (sem_trywait(&m_counterSem) != 0) {
-				return false;
-			}
-		}
+		return consumeTimed(elem, blocking ? -1 : 0);
+	}
 
+	// Returns false if the queue stayed empty for the whole timeout.
+	bool consumeTimed(T &elem, int timeoutMs) {
 		pthread_mutex_lock(&m_lock);
-		elem = m_queue.front();
-		m_queue.pop();
+		bool rval = waitWhile(&m_notEmpty, false, timeoutMs);
+		if (rval) {
+			elem = m_items[m_head];
+			m_items[m_head] = T();
+			m_head = (m_head + 1) % m_items.size();
+			m_count--;
+			if (m_waiting[1]) pthread_cond_signal(&m_notFull);
+		}
 		pthread_mutex_unlock(&m_lock);
 
-		return true;
+		return rval;
 	}
 
-	void consumeAll(std::queue<T> &queue) {
+	// Append everything queued to the given queue, in order, and return how many
+	// elements were taken. Doesn't wait.
+	int consumeAll(std::queue<T> &queue) {
+		return consumeAllTimed(queue, 0);
+	}
+
+	// Like consumeAll(), but first waits up to the timeout for something to be
+	// queued.
+	int consumeAllTimed(std::queue<T> &queue, int timeoutMs) {
 		pthread_mutex_lock(&m_lock);
-		queue = m_queue;
-		if (!m_queue.empty()) {
-			m_queue = std::queue<T>();
-			// NVIDIA note: This assumes no concurrent call to consume. Fix?
-			sem_destroy(&m_counterSem);
-			sem_init(&m_counterSem, 0, 0);
+		int rval = 0;
+		if (waitWhile(&m_notEmpty, false, timeoutMs)) {
+			rval = m_count;
+			for (int i = 0; i < m_count; i++) {
+				T &item = m_items[(m_head + i) % m_items.size()];
+				queue.push(item);
+				item = T();
+			}
+			m_head = 0;
+			m_count = 0;
+			if (m_waiting[1]) pthread_cond_broadcast(&m_notFull);
 		}
 		pthread_mutex_unlock(&m_lock);
+
+		return rval;
 	}
 
 	int size(void) {
-		return m_queue.size();
+		pthread_mutex_lock(&m_lock);
+		int rval = m_count;
+		pthread_mutex_unlock(&m_lock);
+
+		return rval;
+	}
+
+	int capacity(void) {
+		return m_items.size();
 	}
 
 private:
-	std::queue<T> m_queue;
+	// With m_lock held, wait on cond while the queue is full (or empty, if
+	// full is false). Returns whether the queue is now usable.
+	bool waitWhile(pthread_cond_t *cond, bool full, int timeoutMs) {
+		struct timespec deadline;
+		if (timeoutMs > 0) {
+			struct timeval now;
+			gettimeofday(&now, 0);
+			long long ns = (now.tv_usec + (timeoutMs % 1000) * 1000LL) * 1000LL;
+			deadline.tv_sec = now.tv_sec + timeoutMs / 1000 + ns / 1000000000LL;
+			deadline.tv_nsec = ns % 1000000000LL;
+		}
+
+		bool ready = true;
+		while (full ? m_count == (int)m_items.size() : m_count == 0) {
+			if (timeoutMs == 0) return false;
+			m_waiting[full]++;
+			int err = timeoutMs < 0 ? pthread_cond_wait(cond, &m_lock) :
+				pthread_cond_timedwait(cond, &m_lock, &deadline);
+			m_waiting[full]--;
+			if (err == ETIMEDOUT) {
+				ready = full ? m_count < (int)m_items.size() : m_count > 0;
+				break;
+			}
+		}
+
+		return ready;
+	}
+
+	std::vector<T> m_items;
+	int m_head, m_count;
+	int m_waiting[2]; // threads waiting for not empty, not full
 	pthread_mutex_t m_lock;
-	sem_t m_counterSem;
+	pthread_cond_t m_notEmpty, m_notFull;
 };
 
 #endif
-
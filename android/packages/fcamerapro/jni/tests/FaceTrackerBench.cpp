@@ -0,0 +1,151 @@
+// Benchmark of FaceTracker on the capture thread. Host only, and needs a host
+// OpenCV; see the Makefile.
+//
+// Feeds the tracker a preview sequence at 30 fps, the way the capture thread
+// does, and reports what update() costs that thread: percentiles over all
+// frames, and separately over the frames that pick up the worker's detections
+// and start new tracks from them. It also reports lastLatency(), the time from
+// posting a frame to picking up its faces, and how many faces were tracked.
+//
+// The sequence is either raw 8 bit luma frames of the preview size read from a
+// file, or a synthetic one: a face-like pattern drifting across a textured
+// background, with some sensor noise.
+//
+// Usage: FaceTrackerBench cascade.xml [frames [sequence.y]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+
+#include "../FaceTracker.h"
+
+namespace {
+
+// As in FCamInterface.cpp
+const int width = 640, height = 480, levels = 1, intervalMs = 500;
+const int frameUs = 33333;
+
+double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000.0 + tv.tv_usec * 0.001;
+}
+
+// ==========================================================================================
+// SEQUENCE
+// ==========================================================================================
+
+bool readSequence(const char *filename, int frames, std::vector<uchar> &seq) {
+	FILE *f = fopen(filename, "rb");
+	if (!f) return false;
+	seq.resize((size_t)frames * width * height);
+	size_t n = fread(&seq[0], (size_t)width * height, frames, f);
+	fclose(f);
+	seq.resize(n * width * height);
+	return n > 0;
+}
+
+void synthesize(int frames, std::vector<uchar> &seq) {
+	seq.resize((size_t)frames * width * height);
+	unsigned s = 1;
+	for (int i = 0; i < frames; i++) {
+		cv::Mat im(height, width, CV_8UC1, &seq[(size_t)i * width * height]);
+		for (int y = 0; y < height; y++) {
+			uchar *row = im.ptr<uchar>(y);
+			for (int x = 0; x < width; x++) {
+				s = s * 1103515245 + 12345;
+				row[x] = (uchar)(96 + 40 * sin(x * 0.05) * cos(y * 0.07) + ((s >> 16) & 7));
+			}
+		}
+
+		// A face about a third of the frame high, drifting right and back
+		int r = height / 6;
+		cv::Point c((int)(width / 2 + width / 4 * sin(i * 0.02)), height / 2 + (int)(10 * sin(i * 0.05)));
+		cv::ellipse(im, c, cv::Size(r * 4 / 5, r), 0, 0, 360, cv::Scalar(190), -1);
+		cv::ellipse(im, c - cv::Point(r / 3, r / 4), cv::Size(r / 6, r / 10), 0, 0, 360, cv::Scalar(40), -1);
+		cv::ellipse(im, c + cv::Point(r / 3, -r / 4), cv::Size(r / 6, r / 10), 0, 0, 360, cv::Scalar(40), -1);
+		cv::ellipse(im, c + cv::Point(0, r / 2), cv::Size(r / 3, r / 10), 0, 0, 360, cv::Scalar(70), -1);
+		cv::line(im, c - cv::Point(0, r / 8), c + cv::Point(0, r / 4), cv::Scalar(140), 3);
+	}
+}
+
+// ==========================================================================================
+// BENCHMARK
+// ==========================================================================================
+
+void report(const char *name, std::vector<double> &ms) {
+	if (ms.empty()) {
+		printf("%-22s no frames\n", name);
+		return;
+	}
+	std::sort(ms.begin(), ms.end());
+	size_t n = ms.size();
+	printf("%-22s %5d frames: p50 %6.2f ms, p90 %6.2f ms, p99 %6.2f ms, max %6.2f ms\n",
+		name, (int)n, ms[n / 2], ms[n * 9 / 10], ms[n * 99 / 100], ms[n - 1]);
+}
+
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		printf("Usage: %s cascade.xml [frames [sequence.y]]\n", argv[0]);
+		return 1;
+	}
+	int frames = argc > 2 ? atoi(argv[2]) : 300;
+
+	std::vector<uchar> seq;
+	if (argc > 3) {
+		if (!readSequence(argv[3], frames, seq)) {
+			printf("Couldn't read %dx%d frames from %s\n", width, height, argv[3]);
+			return 1;
+		}
+	} else {
+		// Loop a shorter synthetic sequence, to keep it small
+		synthesize(std::min(frames, 150), seq);
+	}
+	int unique = (int)(seq.size() / ((size_t)width * height));
+
+	MyFaceDetector detector(argv[1]);
+	FaceTracker tracker(&detector, width, height, levels, intervalMs);
+
+	std::vector<double> all, busy, latency;
+	std::vector<cv::Rect> faces;
+	int tracked = 0, lastDetection = -1;
+	double lastLatency = tracker.lastLatency();
+	double next = now();
+	for (int i = 0; i < frames; i++) {
+		const uchar *luma = &seq[(size_t)(i % unique) * width * height];
+
+		double start = now();
+		tracker.update(luma, width);
+		double ms = now() - start;
+		all.push_back(ms);
+
+		// A new latency means this frame picked up a detection
+		if (tracker.lastLatency() != lastLatency) {
+			lastLatency = tracker.lastLatency();
+			latency.push_back(lastLatency);
+			busy.push_back(ms);
+			lastDetection = i;
+		}
+		tracker.getFaces(faces);
+		tracked += (int)faces.size();
+
+		next += frameUs / 1000.0;
+		double wait = next - now();
+		if (wait > 0) usleep((useconds_t)(wait * 1000));
+	}
+
+	printf("%d frames at %dx%d, %d pyramid level%s, detecting every %d ms\n",
+		frames, width, height, levels, levels == 1 ? "" : "s", intervalMs);
+	report("update()", all);
+	report("update() on pickup", busy);
+	report("lastLatency()", latency);
+	printf("%.2f faces tracked per frame, last detection picked up at frame %d\n",
+		(double)tracked / frames, lastDetection);
+	return 0;
+}
@@ -0,0 +1,294 @@
+// Stress test and benchmark for TripleBuffer. Host only, see the Makefile.
+//
+// The stress test has a producer fill buffers with a sequence number and a
+// consumer check them, and fails if the consumer ever sees a torn or older
+// frame, or if both threads are ever handed the same buffer. The benchmark
+// times the swaps with both threads hammering the buffer, against the mutex
+// based triple buffer the lock-free one replaced.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../TripleBuffer.h"
+
+namespace {
+
+// The mutex based implementation, for comparison
+template<class T> class MutexTripleBuffer {
+public:
+	MutexTripleBuffer(T *buffers[3]) {
+		pthread_mutex_init(&m_lock, 0);
+		m_frontBuffer = buffers[0];
+		m_backBuffer = buffers[1];
+		m_spareBuffer = buffers[2];
+		m_updateFrontBuffer = false;
+	}
+
+	~MutexTripleBuffer(void) {
+		pthread_mutex_destroy(&m_lock);
+	}
+
+	T *getFrontBuffer(void) {
+		pthread_mutex_lock(&m_lock);
+		T *rval = m_frontBuffer;
+		pthread_mutex_unlock(&m_lock);
+		return rval;
+	}
+
+	T *swapFrontBuffer(void) {
+		T *rval;
+		pthread_mutex_lock(&m_lock);
+		if (m_updateFrontBuffer) {
+			rval = m_spareBuffer;
+			m_spareBuffer = m_frontBuffer;
+			m_frontBuffer = rval;
+			m_updateFrontBuffer = false;
+		} else {
+			rval = m_frontBuffer;
+		}
+		pthread_mutex_unlock(&m_lock);
+		return rval;
+	}
+
+	T *getBackBuffer(void) {
+		pthread_mutex_lock(&m_lock);
+		T *rval = m_backBuffer;
+		pthread_mutex_unlock(&m_lock);
+		return rval;
+	}
+
+	T *swapBackBuffer(void) {
+		pthread_mutex_lock(&m_lock);
+		T *rval = m_spareBuffer;
+		m_spareBuffer = m_backBuffer;
+		m_backBuffer = rval;
+		m_updateFrontBuffer = true;
+		pthread_mutex_unlock(&m_lock);
+		return rval;
+	}
+
+private:
+	T *m_frontBuffer, *m_backBuffer, *m_spareBuffer;
+	bool m_updateFrontBuffer;
+	pthread_mutex_t m_lock;
+};
+
+double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// ==========================================================================================
+// STRESS TEST
+// ==========================================================================================
+
+struct Frame {
+	volatile int owners; // threads currently holding this buffer
+	int seq;
+	int payload[1023];   // every element equals seq
+};
+
+struct StressState {
+	TripleBuffer<Frame> *buffer;
+	int frames;
+	volatile int done;
+	volatile int failures;
+	int framesSeen;
+};
+
+void fail(StressState *state, const char *what, int a, int b) {
+	if (__sync_fetch_and_add(&state->failures, 1) < 10) {
+		fprintf(stderr, "TripleBufferTest: %s (%d, %d)\n", what, a, b);
+	}
+}
+
+void acquire(StressState *state, Frame *f) {
+	int owners = __sync_add_and_fetch(&f->owners, 1);
+	if (owners != 1) fail(state, "buffer held by both threads", owners, f->seq);
+}
+
+void release(Frame *f) {
+	__sync_sub_and_fetch(&f->owners, 1);
+}
+
+void *stressProducer(void *arg) {
+	StressState *state = (StressState *)arg;
+	Frame *f = state->buffer->getBackBuffer();
+	for (int seq = 1; seq <= state->frames; seq++) {
+		acquire(state, f);
+		f->seq = seq;
+		for (int i = 0; i < 1023; i++) f->payload[i] = seq;
+		release(f);
+		f = state->buffer->swapBackBuffer();
+		// Give the consumer a look in on a single core
+		if (!(seq & 63)) sched_yield();
+	}
+	__atomic_store_n(&state->done, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void *stressConsumer(void *arg) {
+	StressState *state = (StressState *)arg;
+	int last = 0;
+	for (;;) {
+		// Read done first, so the last frame is always picked up
+		bool finished = __atomic_load_n(&state->done, __ATOMIC_ACQUIRE);
+		bool fresh = state->buffer->hasNewFrame();
+		Frame *f = state->buffer->swapFrontBuffer();
+		acquire(state, f);
+		if (fresh) {
+			if (f->seq <= last) fail(state, "frame older than the last one", f->seq, last);
+			state->framesSeen++;
+		} else if (f->seq != last) {
+			fail(state, "front buffer changed without a swap", f->seq, last);
+		}
+		for (int i = 0; i < 1023; i++) {
+			if (f->payload[i] != f->seq) {
+				fail(state, "torn frame", f->seq, f->payload[i]);
+				break;
+			}
+		}
+		last = f->seq;
+		release(f);
+		if (finished && !state->buffer->hasNewFrame()) break;
+		if (!fresh) sched_yield();
+	}
+	if (last != state->frames) fail(state, "last frame never arrived", last, state->frames);
+	return 0;
+}
+
+bool stressTest(int frames) {
+	static Frame frame[3];
+	memset(frame, 0, sizeof(frame));
+	Frame *buffers[3] = {&frame[0], &frame[1], &frame[2]};
+	TripleBuffer<Frame> buffer(buffers);
+
+	StressState state;
+	state.buffer = &buffer;
+	state.frames = frames;
+	state.done = 0;
+	state.failures = 0;
+	state.framesSeen = 0;
+
+	pthread_t producer, consumer;
+	pthread_create(&consumer, 0, stressConsumer, &state);
+	pthread_create(&producer, 0, stressProducer, &state);
+	pthread_join(producer, 0);
+	pthread_join(consumer, 0);
+
+	printf("stress: %d frames published, %d seen by the consumer, %d failures\n",
+	       frames, state.framesSeen, state.failures);
+	return state.failures == 0;
+}
+
+// ==========================================================================================
+// BENCHMARK
+// ==========================================================================================
+
+template<class B> struct BenchState {
+	B *buffer;
+	int payload; // bytes touched per frame
+	volatile int stop;
+	long long produced, consumed;
+};
+
+template<class B> void *benchProducer(void *arg) {
+	BenchState<B> *state = (BenchState<B> *)arg;
+	char *f = state->buffer->getBackBuffer();
+	long long n = 0;
+	while (!__atomic_load_n(&state->stop, __ATOMIC_RELAXED)) {
+		if (state->payload) memset(f, (int)n, state->payload);
+		f = state->buffer->swapBackBuffer();
+		n++;
+	}
+	state->produced = n;
+	return 0;
+}
+
+template<class B> void *benchConsumer(void *arg) {
+	BenchState<B> *state = (BenchState<B> *)arg;
+	long long n = 0;
+	volatile char sink = 0;
+	while (!__atomic_load_n(&state->stop, __ATOMIC_RELAXED)) {
+		char *f = state->buffer->swapFrontBuffer();
+		if (state->payload) {
+			char x = 0;
+			for (int i = 0; i < state->payload; i += 64) x ^= f[i];
+			sink = x;
+		}
+		n++;
+	}
+	(void)sink;
+	state->consumed = n;
+	return 0;
+}
+
+template<class B> void benchmark(const char *name, int payload, double seconds) {
+	static char data[3][1 << 16];
+	char *buffers[3] = {data[0], data[1], data[2]};
+	B buffer(buffers);
+
+	BenchState<B> state;
+	state.buffer = &buffer;
+	state.payload = payload;
+	state.stop = 0;
+
+	pthread_t producer, consumer;
+	double t0 = now();
+	pthread_create(&producer, 0, benchProducer<B>, &state);
+	pthread_create(&consumer, 0, benchConsumer<B>, &state);
+	while (now() - t0 < seconds) {
+		struct timespec ts = {0, 10 * 1000 * 1000};
+		nanosleep(&ts, 0);
+	}
+	__atomic_store_n(&state.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(producer, 0);
+	pthread_join(consumer, 0);
+	double t = now() - t0;
+
+	printf("%-10s payload %5d bytes: producer %7.2f M swaps/s, consumer %7.2f M swaps/s\n",
+	       name, payload, state.produced / t * 1e-6, state.consumed / t * 1e-6);
+}
+
+// Single threaded cost of one publish and one pickup
+template<class B> void uncontended(const char *name) {
+	static char data[3][64];
+	char *buffers[3] = {data[0], data[1], data[2]};
+	B buffer(buffers);
+
+	const int n = 10 * 1000 * 1000;
+	double t0 = now();
+	for (int i = 0; i < n; i++) {
+		buffer.swapBackBuffer();
+		buffer.swapFrontBuffer();
+	}
+	double t = now() - t0;
+	printf("%-10s uncontended: %.1f ns per swap\n", name, t / (2.0 * n) * 1e9);
+}
+
+}
+
+int main(int argc, char **argv) {
+	int frames = argc > 1 ? atoi(argv[1]) : 200000;
+	double seconds = argc > 2 ? atof(argv[2]) : 1.0;
+
+	if (!stressTest(frames)) {
+		printf("FAILED\n");
+		return 1;
+	}
+	if (seconds <= 0) return 0;
+
+	int payloads[] = {0, 4096, 65536};
+	for (int i = 0; i < 3; i++) {
+		benchmark<MutexTripleBuffer<char> >("mutex", payloads[i], seconds);
+		benchmark<TripleBuffer<char> >("lock-free", payloads[i], seconds);
+	}
+	uncontended<MutexTripleBuffer<char> >("mutex");
+	uncontended<TripleBuffer<char> >("lock-free");
+	return 0;
+}
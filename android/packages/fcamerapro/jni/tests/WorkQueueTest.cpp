@@ -0,0 +1,295 @@
+// Concurrency test and benchmark for WorkQueue. Host only, see the Makefile.
+//
+// The concurrency test pushes items from several producers through a small
+// queue to consumers using each of the consume calls, and fails unless every
+// item arrives exactly once and each consumer sees each producer's items in
+// order. It also checks the timeouts and that tryProduce() never waits. The
+// benchmark times producing and consuming in a few common patterns.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <queue>
+#include <vector>
+
+#include "../WorkQueue.h"
+
+namespace {
+
+double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+int failures = 0;
+
+void fail(const char *what, int a, int b) {
+	if (__sync_fetch_and_add(&failures, 1) < 10) {
+		fprintf(stderr, "WorkQueueTest: %s (%d, %d)\n", what, a, b);
+	}
+}
+
+// ==========================================================================================
+// CONCURRENCY TEST
+// ==========================================================================================
+
+const int PRODUCERS = 4;
+const int CONSUMERS = 3;
+
+enum ConsumeMode {CONSUME, CONSUME_TIMED, CONSUME_ALL_TIMED};
+
+struct TestState {
+	WorkQueue<int> *queue;
+	int items; // per producer
+	int consumed;
+	std::vector<int> seen; // times each item arrived
+};
+
+struct ProducerArg {
+	TestState *state;
+	int id;
+};
+
+struct ConsumerArg {
+	TestState *state;
+	ConsumeMode mode;
+	int taken;
+};
+
+// Items are producer * items + sequence number
+void *testProducer(void *ptr) {
+	ProducerArg *arg = (ProducerArg *)ptr;
+	TestState *state = arg->state;
+	for (int i = 0; i < state->items; i++) {
+		int item = arg->id * state->items + i;
+		switch (i % 3) {
+		case 0:
+			state->queue->produce(item);
+			break;
+		case 1:
+			while (!state->queue->produceTimed(item, 1));
+			break;
+		default:
+			while (!state->queue->tryProduce(item)) sched_yield();
+			break;
+		}
+	}
+	return 0;
+}
+
+void take(ConsumerArg *arg, int item, int *last) {
+	TestState *state = arg->state;
+	if (item < 0 || item >= PRODUCERS * state->items) {
+		fail("item out of range", item, 0);
+		return;
+	}
+	int producer = item / state->items;
+	if (item <= last[producer]) fail("items from one producer out of order", item, last[producer]);
+	last[producer] = item;
+	__sync_fetch_and_add(&state->seen[item], 1);
+	__sync_fetch_and_add(&state->consumed, 1);
+	arg->taken++;
+}
+
+void *testConsumer(void *ptr) {
+	ConsumerArg *arg = (ConsumerArg *)ptr;
+	TestState *state = arg->state;
+	const int total = PRODUCERS * state->items;
+	int last[PRODUCERS];
+	for (int i = 0; i < PRODUCERS; i++) last[i] = -1;
+
+	std::queue<int> batch;
+	while (__sync_fetch_and_add(&state->consumed, 0) < total) {
+		int item;
+		switch (arg->mode) {
+		case CONSUME:
+			// Non-blocking, since another consumer may take the last item
+			if (state->queue->consume(item, false)) take(arg, item, last);
+			else sched_yield();
+			break;
+		case CONSUME_TIMED:
+			if (state->queue->consumeTimed(item, 5)) take(arg, item, last);
+			break;
+		case CONSUME_ALL_TIMED:
+			state->queue->consumeAllTimed(batch, 5);
+			while (!batch.empty()) {
+				take(arg, batch.front(), last);
+				batch.pop();
+			}
+			break;
+		}
+	}
+	return 0;
+}
+
+bool concurrencyTest(int capacity, int items) {
+	WorkQueue<int> queue(capacity);
+	TestState state;
+	state.queue = &queue;
+	state.items = items;
+	state.consumed = 0;
+	state.seen.assign(PRODUCERS * items, 0);
+
+	pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+	ProducerArg pargs[PRODUCERS];
+	ConsumerArg cargs[CONSUMERS];
+	for (int i = 0; i < CONSUMERS; i++) {
+		cargs[i].state = &state;
+		cargs[i].mode = (ConsumeMode)i;
+		cargs[i].taken = 0;
+		pthread_create(&consumers[i], 0, testConsumer, &cargs[i]);
+	}
+	for (int i = 0; i < PRODUCERS; i++) {
+		pargs[i].state = &state;
+		pargs[i].id = i;
+		pthread_create(&producers[i], 0, testProducer, &pargs[i]);
+	}
+	for (int i = 0; i < PRODUCERS; i++) pthread_join(producers[i], 0);
+	for (int i = 0; i < CONSUMERS; i++) pthread_join(consumers[i], 0);
+
+	for (int i = 0; i < PRODUCERS * items; i++) {
+		if (state.seen[i] != 1) fail("item not seen exactly once", i, state.seen[i]);
+	}
+	if (queue.size() != 0) fail("queue not empty at the end", queue.size(), 0);
+
+	printf("concurrency: capacity %d, %d producers x %d items, taken by consume %d, "
+	       "consumeTimed %d, consumeAllTimed %d\n", capacity, PRODUCERS, items,
+	       cargs[0].taken, cargs[1].taken, cargs[2].taken);
+	return failures == 0;
+}
+
+bool timeoutTest(void) {
+	WorkQueue<int> queue(2);
+	int item;
+
+	double t0 = now();
+	if (queue.consumeTimed(item, 50)) fail("consumeTimed on an empty queue succeeded", 0, 0);
+	double consumeWait = now() - t0;
+	if (consumeWait < 0.045) fail("consumeTimed returned early (ms)", (int)(consumeWait * 1000), 50);
+
+	queue.produce(1);
+	queue.produce(2);
+	t0 = now();
+	if (queue.tryProduce(3)) fail("tryProduce on a full queue succeeded", 0, 0);
+	double tryWait = now() - t0;
+	if (tryWait > 0.005) fail("tryProduce waited (ms)", (int)(tryWait * 1000), 0);
+
+	t0 = now();
+	if (queue.produceTimed(3, 30)) fail("produceTimed on a full queue succeeded", 0, 0);
+	double produceWait = now() - t0;
+	if (produceWait < 0.025) fail("produceTimed returned early (ms)", (int)(produceWait * 1000), 30);
+
+	std::queue<int> batch;
+	if (queue.consumeAll(batch) != 2 || batch.front() != 1 || batch.back() != 2) {
+		fail("consumeAll didn't take both items in order", (int)batch.size(), 0);
+	}
+
+	printf("timeouts: consumeTimed(50) %.1f ms, produceTimed(30) %.1f ms, tryProduce %.3f ms\n",
+	       consumeWait * 1000, produceWait * 1000, tryWait * 1000);
+	return failures == 0;
+}
+
+// ==========================================================================================
+// BENCHMARK
+// ==========================================================================================
+
+// A request with a small heap payload, like ParamSetRequest
+struct Request {
+	Request(void) : id(-1), data(0) {}
+	explicit Request(int i) : id(i), data(new int[4]) {}
+	Request(const Request &other) : id(other.id), data(other.data ? new int[4] : 0) {
+		if (data) memcpy(data, other.data, 4 * sizeof(int));
+	}
+	Request &operator=(const Request &other) {
+		if (this != &other) {
+			if (other.data && !data) data = new int[4];
+			if (!other.data) {
+				delete[] data;
+				data = 0;
+			} else {
+				memcpy(data, other.data, 4 * sizeof(int));
+			}
+			id = other.id;
+		}
+		return *this;
+	}
+	~Request(void) {
+		delete[] data;
+	}
+	int id;
+	int *data;
+};
+
+// One thread producing and consuming in batches of the given size
+void sameThread(int batchSize, int n) {
+	WorkQueue<Request> queue;
+	std::queue<Request> batch;
+	double t0 = now();
+	for (int i = 0; i < n; i += batchSize) {
+		for (int j = 0; j < batchSize; j++) queue.produce(Request(i + j));
+		if (batchSize == 1) {
+			Request r;
+			queue.consume(r);
+		} else {
+			queue.consumeAll(batch);
+			while (!batch.empty()) batch.pop();
+		}
+	}
+	double t = now() - t0;
+	printf("same thread, %s, batch of %2d: %6.1f ns per request\n",
+	       batchSize == 1 ? "consume   " : "consumeAll", batchSize, t / n * 1e9);
+}
+
+struct PipeArg {
+	WorkQueue<int> *queue;
+	int n;
+};
+
+void *pipeProducer(void *ptr) {
+	PipeArg *arg = (PipeArg *)ptr;
+	for (int i = 0; i < arg->n; i++) arg->queue->produce(i);
+	return 0;
+}
+
+// Producer threads feeding one consumer that takes whatever is queued
+void pipeline(int producers, int n) {
+	WorkQueue<int> queue;
+	PipeArg arg = {&queue, n};
+	std::vector<pthread_t> threads(producers);
+	double t0 = now();
+	for (int i = 0; i < producers; i++) pthread_create(&threads[i], 0, pipeProducer, &arg);
+	std::queue<int> batch;
+	int taken = 0, batches = 0;
+	while (taken < producers * n) {
+		taken += queue.consumeAllTimed(batch, 10);
+		while (!batch.empty()) batch.pop();
+		batches++;
+	}
+	for (int i = 0; i < producers; i++) pthread_join(threads[i], 0);
+	double t = now() - t0;
+	printf("%d producer%s -> consumeAllTimed: %6.1f ns per item, %.1f items per batch\n",
+	       producers, producers > 1 ? "s" : " ", t / taken * 1e9, (double)taken / batches);
+}
+
+}
+
+int main(int argc, char **argv) {
+	int items = argc > 1 ? atoi(argv[1]) : 25000;
+	int n = argc > 2 ? atoi(argv[2]) : 1000000;
+
+	if (!concurrencyTest(8, items) || !concurrencyTest(1, items / 10) || !timeoutTest()) {
+		printf("FAILED\n");
+		return 1;
+	}
+	if (n <= 0) return 0;
+
+	int batches[] = {1, 8, 64};
+	for (int i = 0; i < 3; i++) sameThread(batches[i], n);
+	pipeline(1, n);
+	pipeline(2, n / 2);
+	return 0;
+}
@@ -0,0 +1,27 @@
+// Stand-in for the NDK's android/log.h, so the jni sources that log through
+// Common.h build on the host. Logs go to stderr.
+
+#ifndef _HOST_ANDROID_LOG_H
+#define _HOST_ANDROID_LOG_H
+
+#include <stdarg.h>
+#include <stdio.h>
+
+enum {
+	ANDROID_LOG_DEBUG = 3,
+	ANDROID_LOG_INFO,
+	ANDROID_LOG_WARN,
+	ANDROID_LOG_ERROR
+};
+
+static inline int __android_log_print(int prio, const char *tag, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	fprintf(stderr, "%s: ", tag);
+	int n = vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+	va_end(args);
+	return n;
+}
+
+#endif
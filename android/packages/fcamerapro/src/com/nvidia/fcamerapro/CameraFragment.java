@@ -394,17 +394,10 @@ public final class CameraFragment extends Fragment implements OnClickListener, O
 			case 2: // local
 				FCamInterface.GetInstance().enqueueMessageForAutofocusSpot(event.getX()/v.getWidth(), event.getY()/v.getHeight());
 				break;
+			case 3: // face
+				FCamInterface.GetInstance().enqueueMessageForFaceAutofocus();
+				break;
 			}
-			
-			/* [CS478] Assignment #2
-			 * You'll need to further modify the code you used here in Assignment 1
-			 * to handle face focus touch events.
-			 */
-			// TODO TODO TODO
-			// TODO TODO TODO
-			// TODO TODO TODO
-			// TODO TODO TODO
-			// TODO TODO TODO
 			return true;
 		}
 		return false;
@@ -238,9 +238,5 @@ public final class FCamInterface {
 	 * request for face-detection-based autofocus. There should be a corresponding
 	 * method in FCamInterface.cpp
 	 */
-	// TODO TODO TODO
-	// TODO TODO TODO
-	// TODO TODO TODO
-	// TODO TODO TODO
-	// TODO TODO TODO
+	public native void enqueueMessageForFaceAutofocus();
 }
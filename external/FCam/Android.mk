@@ -25,14 +25,15 @@ LOCAL_SRC_FILES :=
 LOCAL_SRC_FILES += Action.cpp AutoExposure.cpp AutoFocus.cpp
 LOCAL_SRC_FILES += AutoWhiteBalance.cpp AsyncFile.cpp 
 LOCAL_SRC_FILES += Base.cpp Device.cpp Event.cpp Flash.cpp
-LOCAL_SRC_FILES += Frame.cpp Image.cpp Lens.cpp Shot.cpp
-LOCAL_SRC_FILES += Sensor.cpp Time.cpp TagValue.cpp processing/DNG.cpp
-LOCAL_SRC_FILES += processing/TIFF.cpp processing/TIFFTags.cpp processing/Dump.cpp
+LOCAL_SRC_FILES += Frame.cpp Image.cpp ImagePool.cpp Lens.cpp Parallel.cpp Shot.cpp
+LOCAL_SRC_FILES += Sensor.cpp Time.cpp Trace.cpp TagName.cpp TagValue.cpp processing/DNG.cpp
+LOCAL_SRC_FILES += processing/TIFF.cpp processing/TIFFTags.cpp processing/TIFFTiles.cpp
+LOCAL_SRC_FILES += processing/Dump.cpp
 LOCAL_SRC_FILES += processing/JPEG.cpp processing/Demosaic.cpp processing/Color.cpp
 LOCAL_SRC_FILES += Tegra/AutoFocus.cpp Tegra/Shot.cpp
 LOCAL_SRC_FILES += Tegra/Platform.cpp Tegra/Sensor.cpp Tegra/Frame.cpp
 LOCAL_SRC_FILES += Tegra/Statistics.cpp Tegra/Lens.cpp Tegra/Flash.cpp
-LOCAL_SRC_FILES += Tegra/Daemon.cpp Tegra/YUV420.cpp
+LOCAL_SRC_FILES += Tegra/Daemon.cpp Tegra/ActionScheduler.cpp Tegra/YUV420.cpp
 
 LOCAL_MODULE    := fcamlib
 LOCAL_MODULE_FILENAME := libFCam
@@ -40,11 +41,25 @@ LOCAL_MODULE_FILENAME := libFCam
 LOCAL_STATIC_LIBRARIES += libjpeg
 LOCAL_EXPORT_STATIC_LIBRARIES += libjpeg
 
-LOCAL_SHARED_LIBRARIES += fcamhal
-LOCAL_EXPORT_SHARED_LIBRARIES := fcamhal
+LOCAL_SRC_FILES += Tegra/hal/SimulatedCamera.cpp
 
-LOCAL_LDLIBS := -llog
-LOCAL_EXPORT_LDLIBS := -llog
+# The x86 demosaic picks SSE2 or AVX2 kernels at runtime
+ifneq ($(filter x86 x86_64,$(TARGET_ARCH_ABI)),)
+  LOCAL_CFLAGS += -DFCAM_ARCH_X86
+  LOCAL_SRC_FILES += processing/Demosaic_x86.cpp
+endif
+
+# Build with FCAM_SIMULATED_HAL=1 to replace the prebuilt camera hal
+# with the software one in Tegra/hal/SimulatedCamera.cpp.
+ifeq ($(FCAM_SIMULATED_HAL),1)
+  LOCAL_CFLAGS += -DFCAM_TEGRA_SIMULATED_HAL
+else
+  LOCAL_SHARED_LIBRARIES += fcamhal
+  LOCAL_EXPORT_SHARED_LIBRARIES := fcamhal
+endif
+
+LOCAL_LDLIBS := -llog -lz
+LOCAL_EXPORT_LDLIBS := -llog -lz
 
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/../../include
 LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)/../../include
@@ -14,163 +14,220 @@ using namespace std;
 namespace FCam {
     void *launch_async_file_writer_thread_(void *arg) {
         AsyncFileWriter *d = (AsyncFileWriter *)arg;
-        d->run();    
-        d->running = false;    
+        d->run();
         pthread_exit(NULL);
         return NULL;
     }
 
 
-    AsyncFileWriter::AsyncFileWriter() {
+    AsyncFileWriter::AsyncFileWriter(int workers) {
         pthread_attr_t attr;
         struct sched_param param;
 
         pending = 0;
-        
-        // make the thread
-        
+        pendingBytes = 0;
+        dropped = 0;
+        sequence = 0;
+        budget = 0;
+        policy = Block;
+        priorities[Dump] = 2;
+        priorities[DNG] = 1;
+        priorities[JPEG] = 0;
+
+        // make the threads
+
         param.sched_priority = sched_get_priority_min(SCHED_OTHER);
-        
+
         pthread_attr_init(&attr);
 
-        running = false;
         stop = false;
 
-#ifdef FCAM_PLATFORM_OSX
-        // unnamed semaphores not supported on OSX
-        char semName[256];
-        // Create a unique semaphore name for this TSQueue using its pointer value
-        snprintf(semName, 256, "FCam::AsyncFile::sem::%llx", (long long unsigned)this);
-        saveQueueSemaphore = sem_open(semName, O_CREAT, 666, 0);
-#else
-        saveQueueSemaphore = new sem_t;
-        sem_init(saveQueueSemaphore, 0, 0);
-#endif
         pthread_mutex_init(&saveQueueMutex, NULL);
+        pthread_cond_init(&requestQueued, NULL);
+        pthread_cond_init(&requestDone, NULL);
 
-        if ((errno =
-             -(pthread_attr_setschedparam(&attr, &param) ||
-               pthread_attr_setschedpolicy(&attr, SCHED_OTHER) ||
+        if (workers < 1) workers = 1;
+        for (int i = 0; i < workers; i++) {
+            pthread_t thread;
+            if ((errno =
+                 -(pthread_attr_setschedpolicy(&attr, SCHED_OTHER) ||
+                   pthread_attr_setschedparam(&attr, &param) ||
 #ifndef FCAM_PLATFORM_ANDROID
-               pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) ||
+                   pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) ||
 #endif
-               pthread_create(&thread, &attr, launch_async_file_writer_thread_, this)))) {
-            error(Event::InternalError, "Error creating async file writer thread");
-            return;
-        } else {
-            running = true;
-        }        
+                   pthread_create(&thread, &attr, launch_async_file_writer_thread_, this)))) {
+                error(Event::InternalError, "Error creating async file writer thread");
+                break;
+            } else {
+                threads.push_back(thread);
+            }
+        }
+
+        pthread_attr_destroy(&attr);
     }
 
     AsyncFileWriter::~AsyncFileWriter() {
+        pthread_mutex_lock(&saveQueueMutex);
         stop = true;
-        sem_post(saveQueueSemaphore);
-        if (running) {
-            pthread_join(thread, NULL);
+        pthread_cond_broadcast(&requestQueued);
+        pthread_cond_broadcast(&requestDone);
+        pthread_mutex_unlock(&saveQueueMutex);
+
+        for (size_t i = 0; i < threads.size(); i++) {
+            pthread_join(threads[i], NULL);
         }
-#ifdef FCAM_PLATFORM_OSX
-        sem_close(saveQueueSemaphore);
-        char semName[256];
-        // Recreate the unique semaphore name for this AsyncFileWriter using its pointer value
-        snprintf(semName, 256, "FCam::AsyncFile::sem::%llx", (long long unsigned)this);
-        sem_unlink(semName);
-#else
-        sem_destroy(saveQueueSemaphore);
-        delete saveQueueSemaphore;
-#endif
 
+        pthread_cond_destroy(&requestQueued);
+        pthread_cond_destroy(&requestDone);
+        pthread_mutex_destroy(&saveQueueMutex);
     }
 
-    void AsyncFileWriter::saveDNG(Frame f, std::string filename) {
+    bool AsyncFileWriter::enqueue(SaveRequest &r, FileType type, const Image &im) {
+        r.bytes = im.valid() ? (size_t)im.bytesPerRow() * im.allocateHeight() : 0;
+
+        pthread_mutex_lock(&saveQueueMutex);
+        r.priority = priorities[type];
+
+        // Apply the memory budget. A request that is bigger than the
+        // whole budget is let through when nothing else is pending,
+        // or it could never be saved.
+        while (budget && pendingBytes && pendingBytes + r.bytes > budget && !stop) {
+            if (policy == Drop) {
+                dropped++;
+                pthread_mutex_unlock(&saveQueueMutex);
+                warning(Event::InternalError,
+                        "AsyncFileWriter: Dropping save of %s, %d bytes already pending",
+                        r.filename.c_str(), (int)pendingBytes);
+                return false;
+            }
+            pthread_cond_wait(&requestDone, &saveQueueMutex);
+        }
+
+        r.sequence = sequence++;
         pending++;
+        pendingBytes += r.bytes;
+        saveQueue.push(r);
+        pthread_cond_signal(&requestQueued);
+        pthread_mutex_unlock(&saveQueueMutex);
+        return true;
+    }
+
+    bool AsyncFileWriter::saveDNG(Frame f, std::string filename, DNGCompression compression) {
         SaveRequest r;
         r.frame = f;
         r.filename = filename;
         r.fileType = SaveRequest::DNGFrame;
         r.quality = 0; // meaningless for DNG
+        r.compression = compression;
 
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, DNG, f.image());
     }
 
-    void AsyncFileWriter::saveJPEG(Frame f, std::string filename, int quality) {
-        pending++;
+    bool AsyncFileWriter::saveJPEG(Frame f, std::string filename, int quality) {
         SaveRequest r;
         r.frame = f;
         r.filename = filename;
         r.quality = quality;
         r.fileType = SaveRequest::JPEGFrame;
 
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, JPEG, f.image());
     }
 
-    void AsyncFileWriter::saveJPEG(Image im, std::string filename, int quality) {
-        pending++;
+    bool AsyncFileWriter::saveJPEG(Image im, std::string filename, int quality) {
         SaveRequest r;
         r.image = im;
         r.filename = filename;
         r.quality = quality;
         r.fileType = SaveRequest::JPEGImage;
 
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, JPEG, im);
     }
 
-    void AsyncFileWriter::saveDump(Frame f, std::string filename) {
-        pending++;
+    bool AsyncFileWriter::saveDump(Frame f, std::string filename) {
         SaveRequest r;
         r.frame = f;
         r.filename = filename;
         r.quality = 0;
         r.fileType = SaveRequest::DumpFrame;
 
-        pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
-        pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return enqueue(r, Dump, f.image());
     }
 
-    void AsyncFileWriter::saveDump(Image im, std::string filename) {
-        pending++;
+    bool AsyncFileWriter::saveDump(Image im, std::string filename) {
         SaveRequest r;
         r.image = im;
         r.filename = filename;
         r.quality = 0;
         r.fileType = SaveRequest::DumpImage;
 
+        return enqueue(r, Dump, im);
+    }
+
+    int AsyncFileWriter::savesPending(size_t *bytes) {
         pthread_mutex_lock(&saveQueueMutex);
-        saveQueue.push(r);
+        int p = pending;
+        if (bytes) *bytes = pendingBytes;
+        pthread_mutex_unlock(&saveQueueMutex);
+        return p;
+    }
+
+    int AsyncFileWriter::savesDropped() {
+        pthread_mutex_lock(&saveQueueMutex);
+        int d = dropped;
         pthread_mutex_unlock(&saveQueueMutex);
-        sem_post(saveQueueSemaphore);
+        return d;
+    }
+
+    void AsyncFileWriter::setMemoryBudget(size_t bytes, BudgetPolicy p) {
+        pthread_mutex_lock(&saveQueueMutex);
+        budget = bytes;
+        policy = p;
+        // Blocked callers may fit now, or need to drop instead
+        pthread_cond_broadcast(&requestDone);
+        pthread_mutex_unlock(&saveQueueMutex);
+    }
+
+    void AsyncFileWriter::setPriority(FileType type, int p) {
+        pthread_mutex_lock(&saveQueueMutex);
+        priorities[type] = p;
+        pthread_mutex_unlock(&saveQueueMutex);
+    }
+
+    int AsyncFileWriter::priority(FileType type) {
+        pthread_mutex_lock(&saveQueueMutex);
+        int p = priorities[type];
+        pthread_mutex_unlock(&saveQueueMutex);
+        return p;
     }
 
     void AsyncFileWriter::cancel() {
         pthread_mutex_lock(&saveQueueMutex);
         while (saveQueue.size()) {
+            pending--;
+            pendingBytes -= saveQueue.top().bytes;
             saveQueue.pop();
         };
+        pthread_cond_broadcast(&requestDone);
         pthread_mutex_unlock(&saveQueueMutex);
     }
 
     void AsyncFileWriter::run() {
-        while (!stop) {
-            sem_wait(saveQueueSemaphore);
-            if (stop) return;
+        while (1) {
             SaveRequest r;
             pthread_mutex_lock(&saveQueueMutex);
-            r = saveQueue.front();
+            while (!stop && saveQueue.empty()) {
+                pthread_cond_wait(&requestQueued, &saveQueueMutex);
+            }
+            if (stop) {
+                pthread_mutex_unlock(&saveQueueMutex);
+                return;
+            }
+            r = saveQueue.top();
             saveQueue.pop();
-            pthread_mutex_unlock(&saveQueueMutex);            
+            pthread_mutex_unlock(&saveQueueMutex);
             switch (r.fileType) {
-            case SaveRequest::DNGFrame:                    
-                FCam::saveDNG(r.frame, r.filename);
+            case SaveRequest::DNGFrame:
+                FCam::saveDNG(r.frame, r.filename, r.compression);
                 break;
             case SaveRequest::JPEGFrame:
                 FCam::saveJPEG(r.frame, r.filename, r.quality);
@@ -188,8 +245,15 @@ namespace FCam {
                 cerr << "Corrupted entry in async file writer save queue." << endl;
             }
 
+            // Let go of the image before releasing its budget
+            r.frame = Frame();
+            r.image = Image();
+
+            pthread_mutex_lock(&saveQueueMutex);
             pending--;
+            pendingBytes -= r.bytes;
+            pthread_cond_broadcast(&requestDone);
+            pthread_mutex_unlock(&saveQueueMutex);
         }
     }
 }
-    
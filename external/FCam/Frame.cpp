@@ -63,8 +63,9 @@ namespace FCam {
                shot().histogram.region.x+shot().histogram.region.width, 
                shot().histogram.region.y+shot().histogram.region.height);
         printf("\t\tRequested sharpness map configuration:\n");
-        printf("\t\t\tEnabled: %s, size: %d x %d\n", shot().sharpness.enabled ? "yes" : "no", 
-               shot().sharpness.size.width, shot().sharpness.size.height);
+        printf("\t\t\tEnabled: %s, size: %d x %d, metric: %s\n", shot().sharpness.enabled ? "yes" : "no", 
+               shot().sharpness.size.width, shot().sharpness.size.height,
+               shot().sharpness.metric == SharpnessMapConfig::GradientEnergy ? "gradient energy" : "variance");
         printf("\t\tRequested actions:\n");
         for (std::set<Action *>::const_iterator it=shot().actions().begin(); it != shot().actions().end(); it++) {
             printf("\t\t\tAction object at %llx to fire at %d us into exposure, latency of %d us.\n", (long long unsigned)*it, (*it)->time, (*it)->latency);
@@ -75,4 +76,38 @@ namespace FCam {
         printf("\t**  Dump of frame image data follows\n");
         image.debug("Frame::image");        
     }
+
+    void appendTagMapBlob(const TagMap &tags, std::string *out) {
+        for (TagMap::const_iterator it = tags.begin(); it != tags.end(); it++) {
+            TagValue(it->first).appendBlob(out);
+            it->second.appendBlob(out);
+        }
+    }
+
+    bool readTagMapBlob(const char *buf, size_t size, TagMap *tags) {
+        const char *end = buf + size;
+        TagValue key;
+        while (buf < end) {
+            // Older versions of toBlob padded DoubleVectors with four
+            // zero bytes, which can't be the start of a key
+            if (end - buf >= 4 && !buf[0] && !buf[1] && !buf[2] && !buf[3]) {
+                buf += 4;
+                continue;
+            }
+            size_t used = TagValue::fromBlob(buf, end - buf, &key);
+            if (!used) return false;
+            if (key.type != TagValue::String) {
+                error(Event::ParseError, "readTagMapBlob: Tag name is not a string");
+                return false;
+            }
+            buf += used;
+            used = TagValue::fromBlob(buf, end - buf, &(*tags)[key.asString()]);
+            if (!used) {
+                tags->erase(key.asString());
+                return false;
+            }
+            buf += used;
+        }
+        return true;
+    }
 }
@@ -5,6 +5,7 @@
 #include <algorithm>
 
 #include "FCam/Image.h"
+#include "FCam/ImagePool.h"
 #include "FCam/Time.h"
 #include "FCam/Event.h"
 #include "Debug.h"
@@ -19,7 +20,8 @@ namespace FCam {
           data(Image::Discard), buffer(NULL), bytesAllocated(0),
           refCount(NULL), mutex(NULL), 
           memMapped(false), holdingLock(false), 
-          privateData(NULL) {
+          privateData(NULL),
+          pool(NULL) {
     }
     
     Image::Image(int w, int h, ImageFormat f) 
@@ -31,7 +33,8 @@ namespace FCam {
           refCount(NULL), mutex(NULL), 
           memMapped(false),
           holdingLock(false),
-          privateData(NULL) {
+          privateData(NULL),
+          pool(NULL) {
         
         bytesAllocated = bytesPerRow()*allocateHeight();
         setBuffer(new unsigned char[bytesAllocated]);
@@ -50,7 +53,8 @@ namespace FCam {
           refCount(NULL), mutex(NULL), 
           memMapped(false),
           holdingLock(false),
-          privateData(NULL) {
+          privateData(NULL),
+          pool(NULL) {
 
         bytesAllocated = bytesPerRow()*allocateHeight();
         setBuffer(new unsigned char[bytesAllocated]);        
@@ -69,7 +73,8 @@ namespace FCam {
           refCount(NULL), mutex(NULL),
           memMapped(true),
           holdingLock(false),
-          privateData(NULL) {
+          privateData(NULL),
+          pool(NULL) {
         
         unsigned char *mappedBuffer;
         int flags;
@@ -133,6 +138,26 @@ namespace FCam {
         pthread_mutex_init(mutex, NULL);
     }
 
+    Image::Image(Size s, ImageFormat f, unsigned char *b, unsigned int bytes, ImagePool *p)
+        : _size(s), 
+          _type(f), 
+          _bytesPerPixel(FCam::bytesPerPixel(f)), 
+          _bytesPerRow(bytesPerPixel()*width()),
+          data(NULL), buffer(NULL), bytesAllocated(bytes),
+          refCount(NULL), mutex(NULL), 
+          memMapped(false),
+          holdingLock(false),
+          privateData(NULL),
+          pool(NULL) {
+
+        setBuffer(b);
+        pool = p;
+        refCount = new unsigned;
+        *refCount = 1; // only I know about this data
+        mutex = new pthread_mutex_t;
+        pthread_mutex_init(mutex, NULL);
+    }
+
     Image::Image(Size s, ImageFormat f, unsigned char *d, int srcBytesPerRow) 
         : _size(s), 
           _type(f), 
@@ -141,7 +166,8 @@ namespace FCam {
           refCount(NULL), mutex(NULL), 
           memMapped(false),
           holdingLock(false), 
-          privateData(NULL) {
+          privateData(NULL),
+          pool(NULL) {
 
         _bytesPerRow = (srcBytesPerRow == -1) ? (bytesPerPixel() * width()) : srcBytesPerRow;
         setBuffer(NULL, d);
@@ -162,7 +188,8 @@ namespace FCam {
           refCount(NULL), mutex(NULL), 
           memMapped(false),
           holdingLock(false),
-          privateData(NULL) {
+          privateData(NULL),
+          pool(NULL) {
 
         _bytesPerRow = (srcBytesPerRow == -1) ? (bytesPerPixel() * width()) : srcBytesPerRow;
         setBuffer(NULL, d);
@@ -190,7 +217,8 @@ namespace FCam {
           mutex(other.mutex), 
           memMapped(other.memMapped), 
           holdingLock(false),
-          privateData(other.privateData) {
+          privateData(other.privateData),
+          pool(other.pool) {
         if (refCount) {
             (*refCount)++;
         }
@@ -217,6 +245,7 @@ namespace FCam {
         memMapped = other.memMapped;
         holdingLock = false;
         privateData = other.privateData;
+        pool = other.pool;
 
         return (*this);
     }
@@ -245,6 +274,7 @@ namespace FCam {
         sub.refCount = refCount;
         sub.mutex = mutex;
         sub.memMapped = memMapped;
+        sub.pool = pool;
 
         if (refCount) (*refCount)++;
         
@@ -307,12 +337,15 @@ namespace FCam {
                               "Image::setBuffer: Unable to unmap memory mapped region starting at %x of size %d: %s", 
                               buffer, bytesAllocated, strerror(errno));
                     }
+                } else if (pool) {
+                    pool->release(buffer);
                 } else {
                     delete[] buffer;
                 }
             }
             refCount = NULL;
             mutex = NULL;
+            pool = NULL;
         }
 
         if (b == Image::Discard ||
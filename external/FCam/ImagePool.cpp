@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <malloc.h>
+
+#include "FCam/ImagePool.h"
+#include "FCam/Event.h"
+#include "Debug.h"
+
+namespace FCam {
+
+    namespace {
+        unsigned char *alignedAlloc(size_t bytes) {
+#if defined(FCAM_PLATFORM_ANDROID)
+            // No posix_memalign on older bionic
+            return (unsigned char *)memalign(ImagePool::Alignment, bytes);
+#else
+            void *p;
+            if (posix_memalign(&p, ImagePool::Alignment, bytes)) return NULL;
+            return (unsigned char *)p;
+#endif
+        }
+    }
+
+    ImagePool &ImagePool::instance() {
+        // Never destroyed, so images that outlive static destructors
+        // can still return their buffers.
+        static ImagePool *pool = new ImagePool;
+        return *pool;
+    }
+
+    ImagePool::ImagePool() : maxFree(4) {
+        pthread_mutex_init(&mutex, NULL);
+    }
+
+    ImagePool::~ImagePool() {
+        trim();
+        pthread_mutex_destroy(&mutex);
+    }
+
+    Image ImagePool::acquire(Size s, ImageFormat f) {
+        // Let Image work out the footprint, planar formats included
+        Image shape(s, f, Image::Discard);
+        size_t bytes = shape.bytesPerRow() * shape.allocateHeight();
+        if (bytes == 0) return shape;
+
+        Key key;
+        key.size = s;
+        key.type = f;
+
+        unsigned char *buf = NULL;
+        pthread_mutex_lock(&mutex);
+        std::map<Key, std::vector<unsigned char *> >::iterator it = freeLists.find(key);
+        if (it != freeLists.end() && !it->second.empty()) {
+            buf = it->second.back();
+            it->second.pop_back();
+            counters.hits++;
+            counters.buffersFree--;
+        } else {
+            counters.misses++;
+        }
+        pthread_mutex_unlock(&mutex);
+
+        if (!buf) {
+            buf = alignedAlloc(bytes);
+            if (!buf) {
+                warning(Event::InternalError,
+                        "ImagePool: Unable to allocate %lu bytes, falling back to the heap", (unsigned long)bytes);
+                return Image(s, f);
+            }
+            Buffer b;
+            b.key = key;
+            b.bytes = bytes;
+            pthread_mutex_lock(&mutex);
+            buffers[buf] = b;
+            counters.buffersAllocated++;
+            counters.bytesAllocated += bytes;
+            if (counters.buffersAllocated > counters.highWaterBuffers) {
+                counters.highWaterBuffers = counters.buffersAllocated;
+            }
+            if (counters.bytesAllocated > counters.highWaterBytes) {
+                counters.highWaterBytes = counters.bytesAllocated;
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+
+        return Image(s, f, buf, bytes, this);
+    }
+
+    void ImagePool::release(unsigned char *buf) {
+        pthread_mutex_lock(&mutex);
+        std::map<unsigned char *, Buffer>::iterator it = buffers.find(buf);
+        if (it == buffers.end()) {
+            pthread_mutex_unlock(&mutex);
+            error(Event::InternalError, "ImagePool: Releasing a buffer the pool doesn't own");
+            return;
+        }
+
+        std::vector<unsigned char *> &freeList = freeLists[it->second.key];
+        if (freeList.size() < maxFree) {
+            freeList.push_back(buf);
+            counters.buffersFree++;
+        } else {
+            counters.buffersAllocated--;
+            counters.bytesAllocated -= it->second.bytes;
+            buffers.erase(it);
+            free(buf);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void ImagePool::setMaxFreeBuffers(unsigned int n) {
+        pthread_mutex_lock(&mutex);
+        maxFree = n;
+        // Drop whatever no longer fits
+        trimLocked(n);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    unsigned int ImagePool::maxFreeBuffers() const {
+        pthread_mutex_lock(&mutex);
+        unsigned int n = maxFree;
+        pthread_mutex_unlock(&mutex);
+        return n;
+    }
+
+    void ImagePool::trim() {
+        pthread_mutex_lock(&mutex);
+        trimLocked(0);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void ImagePool::trimLocked(size_t n) {
+        std::map<Key, std::vector<unsigned char *> >::iterator it = freeLists.begin();
+        while (it != freeLists.end()) {
+            std::vector<unsigned char *> &freeList = it->second;
+            while (freeList.size() > n) {
+                unsigned char *buf = freeList.back();
+                freeList.pop_back();
+                std::map<unsigned char *, Buffer>::iterator b = buffers.find(buf);
+                if (b != buffers.end()) {
+                    counters.buffersAllocated--;
+                    counters.bytesAllocated -= b->second.bytes;
+                    buffers.erase(b);
+                }
+                counters.buffersFree--;
+                free(buf);
+            }
+            if (freeList.empty()) {
+                freeLists.erase(it++);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    ImagePool::Stats ImagePool::stats() const {
+        pthread_mutex_lock(&mutex);
+        Stats s = counters;
+        pthread_mutex_unlock(&mutex);
+        return s;
+    }
+
+    void ImagePool::resetStats() {
+        pthread_mutex_lock(&mutex);
+        counters.hits = 0;
+        counters.misses = 0;
+        counters.highWaterBuffers = counters.buffersAllocated;
+        counters.highWaterBytes = counters.bytesAllocated;
+        pthread_mutex_unlock(&mutex);
+    }
+
+}
@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "FCam/Event.h"
+
+#include "Parallel.h"
+#include "Debug.h"
+
+namespace FCam {
+
+    namespace {
+        // The loop the pool is currently running
+        struct Loop {
+            ParallelTask *task;
+            int begin, end, grain;
+            int chunks;
+            volatile int nextChunk;
+        };
+
+        struct Pool {
+            // Held for the duration of a parallelFor
+            pthread_mutex_t busy;
+
+            // Guards everything below
+            pthread_mutex_t lock;
+            pthread_cond_t wake, done;
+
+            int threads;  // 0 until first use
+            int workers;  // threads that actually started
+            Loop *loop;
+            int generation; // bumped to start a loop
+            int running;    // workers yet to finish the current loop
+        };
+
+        // Statically initialized, so it's usable from other static
+        // constructors.
+        Pool pool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+                     PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                     0, 0, NULL, 0, 0};
+
+        int defaultThreadCount() {
+            const char *env = getenv("FCAM_THREADS");
+            long n = env ? atoi(env) : 0;
+            if (n < 1) n = sysconf(_SC_NPROCESSORS_ONLN);
+            if (n < 1) n = 1;
+            if (n > 64) n = 64;
+            return (int)n;
+        }
+
+        void runChunks(Loop &loop) {
+            while (1) {
+                int c = __sync_fetch_and_add(&loop.nextChunk, 1);
+                if (c >= loop.chunks) break;
+                int b = loop.begin + c*loop.grain;
+                loop.task->run(b, std::min(b + loop.grain, loop.end));
+            }
+        }
+
+        void *workerMain(void *arg) {
+            pthread_mutex_lock(&pool.lock);
+            // The generation when this worker was started, not
+            // pool.generation, which may already be a loop this
+            // worker is expected to take part in.
+            int seen = (int)(long)arg;
+            while (1) {
+                while (pool.generation == seen) {
+                    pthread_cond_wait(&pool.wake, &pool.lock);
+                }
+                seen = pool.generation;
+                Loop *loop = pool.loop;
+                pthread_mutex_unlock(&pool.lock);
+
+                runChunks(*loop);
+
+                pthread_mutex_lock(&pool.lock);
+                if (--pool.running == 0) pthread_cond_signal(&pool.done);
+            }
+            return NULL;
+        }
+
+        // Start the workers. Called once, with pool.busy held.
+        void startPool() {
+            pool.threads = defaultThreadCount();
+            for (int i = 1; i < pool.threads; i++) {
+                pthread_t thread;
+                if (pthread_create(&thread, NULL, workerMain, (void *)(long)pool.generation) != 0) {
+                    warning(Event::InternalError, "parallelFor: Could only start %d of %d worker threads",
+                            pool.workers, pool.threads - 1);
+                    break;
+                }
+                pthread_detach(thread);
+                pool.workers++;
+            }
+            dprintf(3, "parallelFor: Started %d worker threads\n", pool.workers);
+        }
+    }
+
+    void parallelFor(int begin, int end, ParallelTask &task, int grain) {
+        if (begin >= end) return;
+        if (grain < 1) grain = 1;
+
+        // Nested or concurrent loops run serially
+        if (pthread_mutex_trylock(&pool.busy)) {
+            task.run(begin, end);
+            return;
+        }
+
+        if (!pool.threads) startPool();
+
+        Loop loop;
+        loop.task = &task;
+        loop.begin = begin;
+        loop.end = end;
+        loop.grain = grain;
+        loop.chunks = (int)(((long long)end - begin + grain - 1)/grain);
+        loop.nextChunk = 0;
+
+        if (!pool.workers || loop.chunks == 1) {
+            pthread_mutex_unlock(&pool.busy);
+            task.run(begin, end);
+            return;
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        pool.loop = &loop;
+        pool.running = pool.workers;
+        pool.generation++;
+        pthread_cond_broadcast(&pool.wake);
+        pthread_mutex_unlock(&pool.lock);
+
+        // This thread works too
+        runChunks(loop);
+
+        pthread_mutex_lock(&pool.lock);
+        while (pool.running > 0) {
+            pthread_cond_wait(&pool.done, &pool.lock);
+        }
+        pool.loop = NULL;
+        pthread_mutex_unlock(&pool.lock);
+
+        pthread_mutex_unlock(&pool.busy);
+    }
+
+    int threadCount() {
+        return pool.threads ? pool.threads : defaultThreadCount();
+    }
+
+}
@@ -0,0 +1,37 @@
+#ifndef FCAM_PARALLEL_H
+#define FCAM_PARALLEL_H
+
+// A process-wide pool of worker threads for the image processing
+// loops (demosaicking, YUV conversion, tile compression). The threads
+// are started on first use and then kept around, so loops that run
+// once per preview frame don't pay for thread creation every time.
+//
+// A parallelFor hands out chunks of its range in order to the calling
+// thread and the workers as they become free. One called from inside
+// another, or while another thread is running one, just runs serially
+// on the calling thread.
+
+namespace FCam {
+
+    // The body of a parallel loop. run is called on disjoint chunks of
+    // the full range, from several threads at once, so it should only
+    // write to memory that belongs to its chunk. It may be called many
+    // times on the same thread, so per-thread scratch space is
+    // allocated once per call rather than once per item.
+    class ParallelTask {
+    public:
+        virtual ~ParallelTask() {}
+        virtual void run(int begin, int end) = 0;
+    };
+
+    // Run task over [begin, end) in chunks of grain, and wait for it
+    // to finish. Chunks are claimed in increasing order.
+    void parallelFor(int begin, int end, ParallelTask &task, int grain = 1);
+
+    // The number of threads a parallelFor uses, including the caller:
+    // one per core, or the FCAM_THREADS environment variable.
+    int threadCount();
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include <pthread.h>
+#include <string.h>
+#include <vector>
+
+#include "FCam/TagName.h"
+
+namespace FCam {
+
+    namespace {
+        struct Entry {
+            std::string name;
+            size_t hash;
+            Entry *next;
+        };
+
+        // The intern table. It's built on first use, so that names
+        // can be interned during static initialization, and never
+        // freed.
+        pthread_mutex_t tableLock = PTHREAD_MUTEX_INITIALIZER;
+        std::vector<Entry *> *table = NULL;
+        size_t entries = 0;
+
+        // FNV-1a
+        size_t hashName(const char *s, size_t len) {
+            size_t h = 2166136261u;
+            for (size_t i = 0; i < len; i++) {
+                h = (h ^ (unsigned char)s[i]) * 16777619u;
+            }
+            return h;
+        }
+
+        void grow() {
+            std::vector<Entry *> *bigger = new std::vector<Entry *>(table->size()*2, (Entry *)NULL);
+            for (size_t i = 0; i < table->size(); i++) {
+                Entry *e = (*table)[i];
+                while (e) {
+                    Entry *next = e->next;
+                    Entry *&bucket = (*bigger)[e->hash & (bigger->size()-1)];
+                    e->next = bucket;
+                    bucket = e;
+                    e = next;
+                }
+            }
+            delete table;
+            table = bigger;
+        }
+
+        // Look up a name without allocating, adding it if it's new
+        const std::string *intern(const char *s, size_t len) {
+            size_t h = hashName(s, len);
+
+            pthread_mutex_lock(&tableLock);
+            if (!table) table = new std::vector<Entry *>(256, (Entry *)NULL);
+
+            Entry *e = (*table)[h & (table->size()-1)];
+            while (e && !(e->hash == h && e->name.size() == len &&
+                          memcmp(e->name.data(), s, len) == 0)) {
+                e = e->next;
+            }
+            if (!e) {
+                if (entries >= table->size()) grow();
+                e = new Entry;
+                e->name.assign(s, len);
+                e->hash = h;
+                Entry *&bucket = (*table)[h & (table->size()-1)];
+                e->next = bucket;
+                bucket = e;
+                entries++;
+            }
+            pthread_mutex_unlock(&tableLock);
+
+            return &e->name;
+        }
+    }
+
+    TagName::TagName() : name(intern("", 0)) {}
+
+    TagName::TagName(const char *s) : name(intern(s, strlen(s))) {}
+
+    TagName::TagName(const std::string &s) : name(intern(s.data(), s.size())) {}
+
+}
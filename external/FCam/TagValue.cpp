@@ -1,12 +1,23 @@
 #include "FCam/TagValue.h"
 
 #include <ctype.h>
+#include <new>
+#include <string.h>
 #include <sstream>
 #include <iomanip>
 #include <iostream>
 
 namespace FCam {
 
+    namespace {
+        // Values live in TagValue::storage, which is raw memory of the
+        // right size and alignment for any of them
+        template<typename T>
+        void destroy(void *p) {
+            ((T *)p)->~T();
+        }
+    }
+
     TagValue::TagValue() : type(Null), data(NULL) {
 
     }
@@ -18,287 +29,104 @@ namespace FCam {
     void TagValue::nullify() {
         switch (type) {
         case Null:
-            break;
         case Int:
-            delete (int *)data;
-            break;
         case Float:
-            delete (float *)data;
-            break;
         case Double:
-            delete (double *)data;
+        case Time:
             break;
         case String:
-            delete (std::string *)data;
-            break;
-        case Time:
-            delete (FCam::Time *)data;
+            destroy<std::string>(data);
             break;
         case IntVector:
-            delete (std::vector<int> *)data;
+            destroy<std::vector<int> >(data);
             break;
         case FloatVector:
-            delete (std::vector<float> *)data;
+            destroy<std::vector<float> >(data);
             break;
         case DoubleVector:
-            delete (std::vector<double> *)data;
+            destroy<std::vector<double> >(data);
             break;
         case StringVector:
-            delete (std::vector<std::string> *)data;
+            destroy<std::vector<std::string> >(data);
             break;
         case TimeVector:
-            delete (std::vector<FCam::Time> *)data;
+            destroy<std::vector<FCam::Time> >(data);
             break;
         }
         type = Null;
         data = NULL;
     }
 
-    TagValue::TagValue(int x) {
-        type = Int;
-        int *ptr = new int;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(float x) {
-        type = Float;
-        float *ptr = new float;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(double x) {
-        type = Double;
-        double *ptr = new double;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(std::string x) {
-        type = String;
-        std::string *ptr = new std::string;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(FCam::Time x) {
-        type = Time;
-        FCam::Time *ptr = new FCam::Time;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(std::vector<int> x) {
-        type = IntVector;
-        std::vector<int> *ptr = new std::vector<int>;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(std::vector<float> x) {
-        type = FloatVector;
-        std::vector<float> *ptr = new std::vector<float>;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(std::vector<double> x) {
-        type = DoubleVector;
-        std::vector<double> *ptr = new std::vector<double>;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(std::vector<std::string> x) {
-        type = StringVector;
-        std::vector<std::string> *ptr = new std::vector<std::string>;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    TagValue::TagValue(std::vector<FCam::Time> x) {
-        type = TimeVector;
-        std::vector<FCam::Time> *ptr = new std::vector<FCam::Time>;
-        *ptr = x;
-        data = (void *)ptr;
-    }
-
-    const TagValue &TagValue::operator=(const int &x) {
-        if (type == Int) {
-            ((int *)data)[0] = x;
-        } else {
-            nullify();
-            type = Int;
-            int *ptr = new int;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
-
-    const TagValue &TagValue::operator=(const float &x) {
-        if (type == Float) {
-            ((float *)data)[0] = x;
-        } else {
-            nullify();
-            type = Float;
-            float *ptr = new float;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
-
-    const TagValue &TagValue::operator=(const double &x) {
-        if (type == Double) {
-            ((double *)data)[0] = x;
-        } else {
-            nullify();
-            type = Double;
-            double *ptr = new double;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
-
-    const TagValue &TagValue::operator=(const std::string &x) {
-        if (type == String) {
-            ((std::string *)data)[0] = x;
-        } else {
-            nullify();
-            type = String;
-            std::string *ptr = new std::string;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
-
-    const TagValue &TagValue::operator=(const FCam::Time &x) {
-        if (type == Time) {
-            ((FCam::Time *)data)[0] = x;
-        } else {
-            nullify();
-            type = Time;
-            FCam::Time *ptr = new FCam::Time;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
-
-    const TagValue &TagValue::operator=(const std::vector<int> &x) {
-        if (type == IntVector) {
-            ((std::vector<int> *)data)[0] = x;
-        } else {
-            nullify();
-            type = IntVector;
-            std::vector<int> *ptr = new std::vector<int>;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
+    TagValue::TagValue(int x) : type(Int), data(new (&storage) int(x)) {}
+    TagValue::TagValue(float x) : type(Float), data(new (&storage) float(x)) {}
+    TagValue::TagValue(double x) : type(Double), data(new (&storage) double(x)) {}
+    TagValue::TagValue(const std::string &x) : 
+        type(String), data(new (&storage) std::string(x)) {}
+    TagValue::TagValue(FCam::Time x) : type(Time), data(new (&storage) FCam::Time(x)) {}
+    TagValue::TagValue(const std::vector<int> &x) : 
+        type(IntVector), data(new (&storage) std::vector<int>(x)) {}
+    TagValue::TagValue(const std::vector<float> &x) : 
+        type(FloatVector), data(new (&storage) std::vector<float>(x)) {}
+    TagValue::TagValue(const std::vector<double> &x) : 
+        type(DoubleVector), data(new (&storage) std::vector<double>(x)) {}
+    TagValue::TagValue(const std::vector<std::string> &x) : 
+        type(StringVector), data(new (&storage) std::vector<std::string>(x)) {}
+    TagValue::TagValue(const std::vector<FCam::Time> &x) : 
+        type(TimeVector), data(new (&storage) std::vector<FCam::Time>(x)) {}
+
+    // Assigning a value of the current type reuses the existing
+    // storage (and for strings and vectors, their capacity)
+#define ASSIGN(T, TYPE)                                 \
+    const TagValue &TagValue::operator=(const T &x) {   \
+        if (type == TYPE) {                             \
+            *(T *)data = x;                             \
+        } else {                                        \
+            nullify();                                  \
+            data = new (&storage) T(x);                 \
+            type = TYPE;                                \
+        }                                               \
+        return *this;                                   \
     }
 
-    const TagValue &TagValue::operator=(const std::vector<float> &x) {
-        if (type == FloatVector) {
-            ((std::vector<float> *)data)[0] = x;
-        } else {
-            nullify();
-            type = FloatVector;
-            std::vector<float> *ptr = new std::vector<float>;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
+    ASSIGN(int, Int)
+    ASSIGN(float, Float)
+    ASSIGN(double, Double)
+    ASSIGN(std::string, String)
+    ASSIGN(FCam::Time, Time)
+    ASSIGN(std::vector<int>, IntVector)
+    ASSIGN(std::vector<float>, FloatVector)
+    ASSIGN(std::vector<double>, DoubleVector)
+    ASSIGN(std::vector<std::string>, StringVector)
+    ASSIGN(std::vector<FCam::Time>, TimeVector)
 
-    const TagValue &TagValue::operator=(const std::vector<double> &x) {
-        if (type == DoubleVector) {
-            ((std::vector<double> *)data)[0] = x;
-        } else {
-            nullify();
-            type = DoubleVector;
-            std::vector<double> *ptr = new std::vector<double>;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
-
-    const TagValue &TagValue::operator=(const std::vector<std::string> &x) {
-        if (type == StringVector) {
-            ((std::vector<std::string> *)data)[0] = x;
-        } else {
-            nullify();
-            type = StringVector;
-            std::vector<std::string> *ptr = new std::vector<std::string>;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
-
-    const TagValue &TagValue::operator=(const std::vector<FCam::Time> &x) {
-        if (type == TimeVector) {
-            ((std::vector<FCam::Time> *)data)[0] = x;
-        } else {
-            nullify();
-            type = TimeVector;
-            std::vector<FCam::Time> *ptr = new std::vector<FCam::Time>;
-            ptr[0] = x;
-            data = (void *)ptr;
-        }
-        return *this;
-    }
+#undef ASSIGN
 
     const TagValue &TagValue::operator=(const TagValue &other) {
+        if (&other == this) return *this;
         switch(other.type) {
         case Null:
             nullify();
             return *this;
         case Int:
-            *this = (int)other;
-            return *this;
+            return *this = *(int *)other.data;
         case Float:
-            *this = (float)other;
-            return *this;
+            return *this = *(float *)other.data;
         case Double:
-            *this = (double)other;
-            return *this;
+            return *this = *(double *)other.data;
         case String:
-            *this = (std::string)other;
-            return *this;
+            return *this = *(std::string *)other.data;
         case Time:
-            *this = (FCam::Time)other;
-            return *this;
-        case IntVector: {
-            std::vector<int> temp = other;
-            *this = temp;
-            return *this;
-        }
-        case FloatVector: {
-            std::vector<float> temp = other;
-            *this = temp;
-            return *this;
-        }
-        case DoubleVector: {
-            std::vector<double> temp = other;
-            *this = temp;
-            return *this;
-        }
-        case StringVector: {
-            std::vector<std::string> temp = other;
-            *this = temp;
-            return *this;
-        }
-        case TimeVector: {
-            std::vector<FCam::Time> temp = other;
-            *this = temp;
-            return *this;
-        }
+            return *this = *(FCam::Time *)other.data;
+        case IntVector:
+            return *this = *(std::vector<int> *)other.data;
+        case FloatVector:
+            return *this = *(std::vector<float> *)other.data;
+        case DoubleVector:
+            return *this = *(std::vector<double> *)other.data;
+        case StringVector:
+            return *this = *(std::vector<std::string> *)other.data;
+        case TimeVector:
+            return *this = *(std::vector<FCam::Time> *)other.data;
         }
         return *this;
     }
@@ -703,141 +531,217 @@ namespace FCam {
         return t;
     }
 
+    namespace {
+        // Every value in the binary format starts with 'b', its type,
+        // and two zero bytes for word-alignment and future proofing.
+        void appendHeader(std::string *out, TagValue::Type type) {
+            const char header[4] = {'b', (char)type, 0, 0};
+            out->append(header, 4);
+        }
+
+        void appendRaw(std::string *out, const void *src, size_t bytes) {
+            out->append((const char *)src, bytes);
+        }
+
+        void appendInt(std::string *out, int x) {
+            appendRaw(out, &x, sizeof(int));
+        }
+
+        // A count followed by the elements, copied in one go
+        template<typename T>
+        void appendArray(std::string *out, const std::vector<T> &x) {
+            appendInt(out, (int)x.size());
+            if (!x.empty()) appendRaw(out, &x[0], x.size()*sizeof(T));
+        }
+    }
+
     std::string TagValue::toBlob() const {
         std::string str;
+        appendBlob(&str);
+        return str;
+    }
+
+    void TagValue::appendBlob(std::string *out) const {
+        appendHeader(out, type);
         switch(type) {
         case Null:
-        {
-            str.resize(2);
-            str[0] = 'b';
-            str[1] = (char)type;
-            return str;
-        }
+            return;
         case Int:
-        {
-            str.resize(4 + sizeof(int));
-            str[0] = 'b';
-            str[1] = (char)type;
-            int *ptr = (int *)((void *)(&(str[4])));
-            ptr[0] = (int)(*this);
-            return str;
-        }
+            appendInt(out, *(int *)data);
+            return;
         case Float:
-        {
-            str.resize(4 + sizeof(float));
-            str[0] = 'b';
-            str[1] = (char)type;
-            float *ptr = (float *)((void *)(&(str[4])));
-            ptr[0] = (float)(*this);
-            return str;
-        }
+            appendRaw(out, data, sizeof(float));
+            return;
         case Double:
-        {
-            str.resize(4 + sizeof(double));
-            str[0] = 'b';
-            str[1] = (char)type;
-            double *ptr = (double *)((void *)(&(str[4])));
-            ptr[0] = (double)(*this);
-            return str;
-        }
+            appendRaw(out, data, sizeof(double));
+            return;
         case String: {
-            std::string &x = *this;
-            str.resize(8 + x.size());
-            str[0] = 'b';
-            str[1] = (char)type;
-            int *ptr = (int *)((void *)(&(str[4])));
-            ptr[0] = x.size();
-            for (size_t i = 0; i < x.size(); i++) {
-                str[i+8] = x[i];
-            }
-            return str;
+            const std::string &x = *(std::string *)data;
+            appendInt(out, (int)x.size());
+            out->append(x);
+            return;
         }
         case Time: {
-            str.resize(4 + sizeof(int)*2);
-            str[0] = 'b';
-            str[1] = (char)type;
-            int *ptr = (int *)((void *)(&(str[4])));
-            FCam::Time time = *this;
-            ptr[0] = time.s();
-            ptr[1] = time.us();
-            return str;
+            const FCam::Time &time = *(FCam::Time *)data;
+            appendInt(out, time.s());
+            appendInt(out, time.us());
+            return;
         }
-        case IntVector: {
-            std::vector<int> &x = *this;
-            str.resize(4 + (1+x.size())*sizeof(int));
-            str[0] = 'b';
-            str[1] = (char)type;
-            int *ptr = (int *)((void *)(&(str[4])));
-            ptr[0] = x.size();
+        case IntVector:
+            appendArray(out, *(std::vector<int> *)data);
+            return;
+        case FloatVector:
+            appendArray(out, *(std::vector<float> *)data);
+            return;
+        case DoubleVector:
+            appendArray(out, *(std::vector<double> *)data);
+            return;
+        case StringVector: {
+            const std::vector<std::string> &x = *(std::vector<std::string> *)data;
+            appendInt(out, (int)x.size());
             for (size_t i = 0; i < x.size(); i++) {
-                ptr[i+1] = x[i];
+                appendInt(out, (int)x[i].size());
             }
-            return str;
-        }
-        case FloatVector: {
-            std::vector<float> &x = *this;
-            str.resize(4 + sizeof(int) + x.size()*sizeof(float));
-            str[0] = 'b';
-            str[1] = (char)type;
-            int *iptr = (int *)((void *)(&(str[4])));
-            float *fptr = (float *)((void *)(&(str[4 + sizeof(int)])));
-            iptr[0] = x.size();
             for (size_t i = 0; i < x.size(); i++) {
-                fptr[i] = x[i];
+                out->append(x[i]);
             }
-            return str;
+            return;
         }
-        case DoubleVector: {
-            std::vector<double> &x = *this;
-            str.resize(4 + (1+x.size())*sizeof(double));
-            str[0] = 'b';
-            str[1] = (char)type;
-            int *iptr = (int *)((void *)(&(str[4])));
-            double *fptr = (double *)((void *)(&(str[4 + sizeof(int)])));
-            iptr[0] = x.size();
+        case TimeVector: {
+            const std::vector<FCam::Time> &x = *(std::vector<FCam::Time> *)data;
+            appendInt(out, (int)x.size());
             for (size_t i = 0; i < x.size(); i++) {
-                fptr[i] = x[i];
+                appendInt(out, x[i].s());
+                appendInt(out, x[i].us());
             }
-            return str;
+            return;
         }
-        case StringVector: {
-            std::vector<std::string> &x = *this;
-            size_t total = 0;
-            for (size_t i = 0; i < x.size(); i++) {
-                total += x[i].size();
+        }
+    }
+
+    namespace {
+        // Bounds-checked reads from a blob buffer
+        struct BlobReader {
+            const char *ptr, *end;
+
+            bool read(void *dst, size_t bytes) {
+                if ((size_t)(end - ptr) < bytes) return false;
+                memcpy(dst, ptr, bytes);
+                ptr += bytes;
+                return true;
             }
-            str.resize(4 + sizeof(int)*(1+x.size()) + total);
-            str[0] = 'b';
-            str[1] = (char)type;
-            int *ptr = (int *)((void *)(&(str[4])));
-            ptr[0] = x.size();
-            for (size_t i = 0; i < x.size(); i++) {
-                ptr[i+1] = x[i].size();
+
+            // A count of elements of the given size, which must all
+            // fit in what's left of the buffer
+            bool readCount(size_t elementSize, int *count) {
+                if (!read(count, sizeof(int))) return false;
+                return *count >= 0 && (size_t)*count <= (size_t)(end - ptr)/elementSize;
             }
-            int idx = 4 + sizeof(int)*(1+x.size());
-            for (size_t i = 0; i < x.size(); i++) {
-                for (size_t j = 0; j < x[i].size(); j++) {
-                    str[idx+j] = x[i][j];
-                }
-                idx += x[i].size();
+
+            template<typename T>
+            bool readArray(std::vector<T> &x) {
+                int count;
+                if (!readCount(sizeof(T), &count)) return false;
+                x.resize(count);
+                return count == 0 || read(&x[0], count*sizeof(T));
             }
-            return str;
-        }
+        };
+    }
 
-        case TimeVector:
-            std::vector<FCam::Time> &x = *this;
-            str.resize(4 + sizeof(int)*(1+2*x.size()));
-            str[0] = 'b';
-            str[1] = (char)type;
-            int *ptr = (int *)((void *)(&(str[4])));
-            ptr[0] = x.size();
-            for (size_t i = 0; i < x.size(); i++) {
-                ptr[i*2+1] = x[i].s();
-                ptr[i*2+2] = x[i].us();
+    size_t TagValue::fromBlob(const char *buf, size_t size, TagValue *t) {
+        BlobReader in;
+        in.ptr = buf;
+        in.end = buf + size;
+
+        if (size < 4 || buf[0] != 'b' || buf[2] != 0 || buf[3] != 0) goto error;
+        in.ptr += 4;
+
+        switch (buf[1]) {
+        case Null:
+            t->nullify();
+            break;
+        case Int: {
+            int x;
+            if (!in.read(&x, sizeof(int))) goto error;
+            *t = x;
+            break;
+        }
+        case Float: {
+            float x;
+            if (!in.read(&x, sizeof(float))) goto error;
+            *t = x;
+            break;
+        }
+        case Double: {
+            double x;
+            if (!in.read(&x, sizeof(double))) goto error;
+            *t = x;
+            break;
+        }
+        case Time: {
+            int x[2];
+            if (!in.read(x, sizeof(int)*2)) goto error;
+            *t = FCam::Time(x[0], x[1]);
+            break;
+        }
+        case String: {
+            int count;
+            if (!in.readCount(1, &count)) goto error;
+            *t = std::string();
+            t->asString().assign(in.ptr, count);
+            in.ptr += count;
+            break;
+        }
+        // Vectors are decoded in place, so the payload is only copied once
+        case IntVector:
+            *t = std::vector<int>();
+            if (!in.readArray(t->asIntVector())) goto error;
+            break;
+        case FloatVector:
+            *t = std::vector<float>();
+            if (!in.readArray(t->asFloatVector())) goto error;
+            break;
+        case DoubleVector:
+            *t = std::vector<double>();
+            if (!in.readArray(t->asDoubleVector())) goto error;
+            break;
+        case StringVector: {
+            int count;
+            if (!in.readCount(sizeof(int), &count)) goto error;
+            std::vector<int> sizes(count);
+            if (count && !in.read(&sizes[0], count*sizeof(int))) goto error;
+            *t = std::vector<std::string>();
+            std::vector<std::string> &x = t->asStringVector();
+            x.resize(count);
+            for (int i = 0; i < count; i++) {
+                if (sizes[i] < 0 || sizes[i] > in.end - in.ptr) goto error;
+                x[i].assign(in.ptr, sizes[i]);
+                in.ptr += sizes[i];
             }
-            return str;
+            break;
+        }
+        case TimeVector: {
+            int count;
+            if (!in.readCount(sizeof(int)*2, &count)) goto error;
+            *t = std::vector<FCam::Time>();
+            std::vector<FCam::Time> &x = t->asTimeVector();
+            x.resize(count);
+            for (int i = 0; i < count; i++) {
+                int time[2];
+                in.read(time, sizeof(int)*2);
+                x[i] = FCam::Time(time[0], time[1]);
+            }
+            break;
         }
-        return "";
+        default:
+            goto error;
+        }
+        return in.ptr - buf;
+
+      error:
+        t->nullify();
+        error(Event::ParseError, "Could not parse binary TagValue");
+        return 0;
     }
 
     std::ostream & operator<<(std::ostream& out, const TagValue &t) {
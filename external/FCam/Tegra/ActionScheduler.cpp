@@ -0,0 +1,358 @@
+#include <algorithm>
+
+#include "FCam/Tegra/ActionScheduler.h"
+#include "FCam/Event.h"
+#include "../Debug.h"
+
+namespace FCam { namespace Tegra {
+
+    namespace {
+        // Never sleep longer than this without rechecking the
+        // wheel. Also keeps sem_timedwait's nanosecond arithmetic
+        // from overflowing.
+        const int MaxSleep = 500000;
+    }
+
+    ActionScheduler::Stats::Stats() : scheduled(0), fired(0), cancelled(0) {}
+
+    int ActionScheduler::Stats::errorPercentile(float p) const {
+        if (error.empty()) return 0;
+        std::vector<int> sorted(error);
+        std::sort(sorted.begin(), sorted.end());
+        size_t i = (size_t)(p / 100.0f * (sorted.size() - 1) + 0.5f);
+        if (i >= sorted.size()) i = sorted.size() - 1;
+        return sorted[i];
+    }
+
+    std::vector<unsigned> ActionScheduler::Stats::errorHistogram(int bucketWidth, int buckets) const {
+        if (bucketWidth < 1) bucketWidth = 1;
+        if (buckets < 1) buckets = 1;
+        std::vector<unsigned> h(buckets, 0);
+        for (size_t i = 0; i < error.size(); i++) {
+            int b = error[i] / bucketWidth;
+            if (b < 0) b = 0;
+            if (b >= buckets) b = buckets - 1;
+            h[b]++;
+        }
+        return h;
+    }
+
+    ActionScheduler::ActionScheduler() :
+        commands(CommandQueueCapacity),
+        stopping(false),
+        spinThreshold(500),
+        overflow(NULL), due(NULL),
+        currentTick(toMicroseconds(Time::now()) >> TickShift),
+        pending(0),
+        nextSample(0) {
+        for (int l = 0; l < Levels; l++) {
+            for (int s = 0; s < Slots; s++) {
+                wheel[l][s] = NULL;
+            }
+        }
+        pthread_mutex_init(&statsMutex, NULL);
+    }
+
+    ActionScheduler::~ActionScheduler() {
+        Command c;
+        while (commands.tryPull(&c)) {
+            if (c.op == Command::Schedule) {
+                delete c.entry->action;
+                delete c.entry;
+            }
+        }
+        dropAll(NULL, true);
+        pthread_mutex_destroy(&statsMutex);
+    }
+
+    void ActionScheduler::post(const Command &c) {
+        if (!commands.push(c)) {
+            // Only happens if the firing thread has stalled or was
+            // never started.
+            error(Event::InternalError,
+                  "ActionScheduler: Command queue full, dropping command %d", c.op);
+            if (c.op == Command::Schedule) {
+                delete c.entry->action;
+                delete c.entry;
+            }
+        }
+    }
+
+    void ActionScheduler::schedule(FCam::Action *action, Time time, const void *tag) {
+        Entry *e = new Entry;
+        e->action = action;
+        e->deadline = toMicroseconds(time);
+        e->tag = tag;
+        e->prev = e->next = NULL;
+        e->list = NULL;
+
+        Command c;
+        c.op = Command::Schedule;
+        c.entry = e;
+        c.tag = tag;
+        post(c);
+    }
+
+    void ActionScheduler::cancel(const void *tag) {
+        Command c;
+        c.op = Command::Cancel;
+        c.entry = NULL;
+        c.tag = tag;
+        post(c);
+    }
+
+    void ActionScheduler::cancelAll() {
+        Command c;
+        c.op = Command::CancelAll;
+        c.entry = NULL;
+        c.tag = NULL;
+        post(c);
+    }
+
+    void ActionScheduler::shutdown() {
+        stopping = true;
+        // Wake the firing thread up
+        Command c;
+        c.op = Command::Shutdown;
+        c.entry = NULL;
+        c.tag = NULL;
+        commands.push(c);
+    }
+
+    void ActionScheduler::run() {
+        dprintf(2, "ActionScheduler: Running...\n");
+        while (!stopping && processCommands()) {
+            long long now = toMicroseconds(Time::now());
+            advance(now >> TickShift);
+
+            if (!due) {
+                // Nothing due in this tick. Sleep until the next
+                // occupied slot or a new command.
+                long long wake = nextWakeup();
+                if (wake < 0) {
+                    commands.wait();
+                } else {
+                    long long delay = wake - now;
+                    if (delay < 1) delay = 1;
+                    if (delay > MaxSleep) delay = MaxSleep;
+                    commands.wait((unsigned int)delay);
+                }
+                continue;
+            }
+
+            // Sleep most of the way to the deadline
+            long long delay = due->deadline - now;
+            if (delay > spinThreshold) {
+                delay -= spinThreshold;
+                if (delay > MaxSleep) delay = MaxSleep;
+                commands.wait((unsigned int)delay);
+                continue;
+            }
+
+            // Spin the rest, but let a cancel get in first
+            bool interrupted = false;
+            while (now < due->deadline) {
+                if (!commands.empty()) {
+                    interrupted = true;
+                    break;
+                }
+                now = toMicroseconds(Time::now());
+            }
+            if (interrupted) continue;
+
+            Entry *e = due;
+            unlink(e);
+            pending--;
+            fire(e, now);
+        }
+        dprintf(2, "ActionScheduler: Stopped\n");
+    }
+
+    bool ActionScheduler::processCommands() {
+        Command c;
+        unsigned int scheduled = 0;
+        while (commands.tryPull(&c)) {
+            switch (c.op) {
+            case Command::Schedule:
+                insert(c.entry);
+                pending++;
+                scheduled++;
+                break;
+            case Command::Cancel:
+                dropAll(c.tag, false);
+                break;
+            case Command::CancelAll:
+                dropAll(NULL, true);
+                break;
+            case Command::Shutdown:
+                return false;
+            }
+        }
+        if (scheduled) {
+            pthread_mutex_lock(&statsMutex);
+            stats.scheduled += scheduled;
+            pthread_mutex_unlock(&statsMutex);
+        }
+        return true;
+    }
+
+    void ActionScheduler::fire(Entry *e, long long now) {
+        e->action->doAction();
+        int err = (int)(now - e->deadline);
+        dprintf(3, "ActionScheduler: Initiated action %d us after scheduled time\n", err);
+        delete e->action;
+        delete e;
+
+        pthread_mutex_lock(&statsMutex);
+        stats.fired++;
+        if (stats.error.size() < (size_t)Stats::MaxSamples) {
+            stats.error.push_back(err);
+        } else {
+            stats.error[nextSample] = err;
+            nextSample = (nextSample + 1) % Stats::MaxSamples;
+        }
+        pthread_mutex_unlock(&statsMutex);
+    }
+
+    void ActionScheduler::insert(Entry *e) {
+        long long tick = e->deadline >> TickShift;
+        long long delta = tick - currentTick;
+        const long long mask = Slots - 1;
+
+        if (delta <= 0) {
+            // Due in this tick (or overdue); keep the due list sorted
+            if (!due || e->deadline < due->deadline) {
+                link(&due, e);
+            } else {
+                Entry *p = due;
+                while (p->next && p->next->deadline <= e->deadline) p = p->next;
+                e->prev = p;
+                e->next = p->next;
+                if (p->next) p->next->prev = e;
+                p->next = e;
+                e->list = &due;
+            }
+        } else if (delta < Slots) {
+            link(&wheel[0][tick & mask], e);
+        } else if (delta < ((long long)Slots << SlotBits)) {
+            link(&wheel[1][(tick >> SlotBits) & mask], e);
+        } else if (delta < ((long long)Slots << (2*SlotBits))) {
+            link(&wheel[2][(tick >> (2*SlotBits)) & mask], e);
+        } else {
+            link(&overflow, e);
+        }
+    }
+
+    void ActionScheduler::cascade(Entry **list) {
+        Entry *e = *list;
+        *list = NULL;
+        while (e) {
+            Entry *next = e->next;
+            e->prev = e->next = NULL;
+            e->list = NULL;
+            insert(e);
+            e = next;
+        }
+    }
+
+    void ActionScheduler::advance(long long tick) {
+        const long long mask = Slots - 1;
+        while (currentTick < tick) {
+            if (pending == 0) {
+                // Nothing to move, skip straight there
+                currentTick = tick;
+                break;
+            }
+            long long t = ++currentTick;
+            // Entering a new period of a coarser wheel brings its
+            // slot down a level
+            if ((t & mask) == 0) {
+                if (((t >> SlotBits) & mask) == 0) {
+                    if (((t >> (2*SlotBits)) & mask) == 0) {
+                        cascade(&overflow);
+                    }
+                    cascade(&wheel[2][(t >> (2*SlotBits)) & mask]);
+                }
+                cascade(&wheel[1][(t >> SlotBits) & mask]);
+            }
+            cascade(&wheel[0][t & mask]);
+        }
+    }
+
+    long long ActionScheduler::nextWakeup() const {
+        if (pending == 0) return -1;
+        const long long mask = Slots - 1;
+        // The next occupied slot of the finest wheel, or the next
+        // cascade, whichever comes first
+        for (long long t = currentTick + 1; ; t++) {
+            if (wheel[0][t & mask] || (t & mask) == 0) {
+                return t << TickShift;
+            }
+        }
+    }
+
+    void ActionScheduler::dropAll(const void *tag, bool any) {
+        std::vector<Entry **> lists;
+        lists.push_back(&due);
+        lists.push_back(&overflow);
+        for (int l = 0; l < Levels; l++) {
+            for (int s = 0; s < Slots; s++) {
+                lists.push_back(&wheel[l][s]);
+            }
+        }
+
+        unsigned int dropped = 0;
+        for (size_t i = 0; i < lists.size(); i++) {
+            Entry *e = *lists[i];
+            while (e) {
+                Entry *next = e->next;
+                if (any || e->tag == tag) {
+                    unlink(e);
+                    delete e->action;
+                    delete e;
+                    dropped++;
+                }
+                e = next;
+            }
+        }
+
+        if (dropped) {
+            dprintf(3, "ActionScheduler: Cancelled %d actions\n", dropped);
+            pending -= dropped;
+            pthread_mutex_lock(&statsMutex);
+            stats.cancelled += dropped;
+            pthread_mutex_unlock(&statsMutex);
+        }
+    }
+
+    void ActionScheduler::link(Entry **list, Entry *e) {
+        e->prev = NULL;
+        e->next = *list;
+        if (*list) (*list)->prev = e;
+        *list = e;
+        e->list = list;
+    }
+
+    void ActionScheduler::unlink(Entry *e) {
+        if (e->prev) e->prev->next = e->next;
+        else *e->list = e->next;
+        if (e->next) e->next->prev = e->prev;
+        e->prev = e->next = NULL;
+        e->list = NULL;
+    }
+
+    ActionScheduler::Stats ActionScheduler::statistics() const {
+        pthread_mutex_lock(&statsMutex);
+        Stats s = stats;
+        pthread_mutex_unlock(&statsMutex);
+        return s;
+    }
+
+    void ActionScheduler::resetStatistics() {
+        pthread_mutex_lock(&statsMutex);
+        stats = Stats();
+        nextSample = 0;
+        pthread_mutex_unlock(&statsMutex);
+    }
+
+}}
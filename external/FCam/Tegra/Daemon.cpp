@@ -50,11 +50,14 @@
 * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include <math.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "FCam/Time.h"
 #include "FCam/Frame.h"
 #include "FCam/Action.h"
+#include "FCam/ImagePool.h"
 #include "FCam/Tegra/YUV420.h"
 
 #include "../Debug.h"
@@ -81,24 +84,20 @@ namespace FCam { namespace Tegra {
     }
 
     Daemon::Daemon(Sensor *sensor) :
+        frameQueue(FrameQueueCapacity),
         sensor(sensor),
         m_pCameraInterface(sensor->getHardwareInterface()),
         stop(false), 
         frameLimit(128),
         dropPolicy(Sensor::DropNewest),
+        inFlightQueue(InFlightQueueCapacity),
         setterRunning(false),
         exposureLatency(0),
         gainLatency(0),
         actionRunning(false),
         threadsLaunched(false) {
 
-        // make the mutexes for the producer-consumer queues
-        if (errno = -(pthread_mutex_init(&actionQueueMutex, NULL))) {
-            error(Event::InternalError, sensor, "Error creating mutexes: %d", errno);
-        }
-    
         // make the semaphore
-        sem_init(&actionQueueSemaphore, 0, 0);
         sem_init(&readySemaphore, 0, 0);
 
     }
@@ -120,8 +119,8 @@ namespace FCam { namespace Tegra {
         pthread_attr_init(&attr);
 
         if ((errno =
-             -(pthread_attr_setschedparam(&attr, &param) ||
-               pthread_attr_setschedpolicy(&attr, SCHED_FIFO) ||
+             -(pthread_attr_setschedpolicy(&attr, SCHED_FIFO) ||
+               pthread_attr_setschedparam(&attr, &param) ||
 #ifndef FCAM_PLATFORM_ANDROID
                pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) ||
 #endif
@@ -136,8 +135,8 @@ namespace FCam { namespace Tegra {
         param.sched_priority = sched_get_priority_max(SCHED_FIFO);
 
         if ((errno =
-             -(pthread_attr_setschedparam(&attr, &param) ||
-               pthread_attr_setschedpolicy(&attr, SCHED_FIFO) ||
+             -(pthread_attr_setschedpolicy(&attr, SCHED_FIFO) ||
+               pthread_attr_setschedparam(&attr, &param) ||
 #ifndef FCAM_PLATFORM_ANDROID
                pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) ||
 #endif
@@ -154,8 +153,8 @@ namespace FCam { namespace Tegra {
     Daemon::~Daemon() {
         stop = true;
 
-        // post a wakeup call to the action thread
-        sem_post(&actionQueueSemaphore);
+        // tell the action thread to finish up
+        actions.shutdown();
 
         // post a wakeup call to the setter thread if needed
         sem_post(&readySemaphore);
@@ -166,51 +165,69 @@ namespace FCam { namespace Tegra {
         if (actionRunning)
             pthread_join(actionThread, NULL);
 
-        pthread_mutex_destroy(&actionQueueMutex);
-
-        sem_destroy(&actionQueueSemaphore);
         sem_destroy(&readySemaphore);
 
         // Clean up all the internal queues
         while (inFlightQueue.size()) delete inFlightQueue.pull();        
         while (requestQueue.size()) delete requestQueue.pull();
         while (frameQueue.size()) delete frameQueue.pull();
-        while (actionQueue.size()) {
-            delete actionQueue.top().action;
-            actionQueue.pop();
-        }
 
     }
 
 
     void Daemon::setDropPolicy(Sensor::DropPolicy p, int f) {
         dropPolicy = p;
+        if (f > (int)frameQueue.capacity()) {
+            warning(Event::FrameLimitHit, sensor,
+                    "Frame limit %d exceeds the frame queue capacity, using %d\n",
+                    f, (int)frameQueue.capacity());
+            f = frameQueue.capacity();
+        }
         frameLimit = f;
         enforceDropPolicy();
     }
 
     void Daemon::enforceDropPolicy() {
-        if (frameQueue.size() > frameLimit) {
+        // Only the oldest frames can be dropped from the ring after
+        // the fact. With DropNewest, incoming frames are refused in
+        // pushFrame until the user drains the queue below the limit.
+        if (dropPolicy != Sensor::DropOldest) return;
+        _Frame *f;
+        while (frameQueue.size() > frameLimit && frameQueue.tryPull(&f)) {
+            sensor->decShotsPending();
+            delete f;
+        }
+    }
+
+    void Daemon::pushFrame(_Frame *f) {
+        if (frameQueue.size() >= frameLimit) {
             warning(Event::FrameLimitHit, sensor,
-                    "WARNING: frame limit hit (%d), silently dropping %d frames.\n"
+                    "WARNING: frame limit hit (%d), silently dropping frames.\n"
                    "You're not draining the frame queue quickly enough. Use longer \n"
                    "frame times or drain the frame queue until empty every time you \n"
-                   "call getFrame()\n", frameLimit, frameQueue.size() - frameLimit);
+                   "call getFrame()\n", frameLimit);
             if (dropPolicy == Sensor::DropOldest) {
-                while (frameQueue.size() >= frameLimit) {
+                _Frame *old;
+                while (frameQueue.size() >= frameLimit && frameQueue.tryPull(&old)) {
                     sensor->decShotsPending();
-                    delete frameQueue.pull();
+                    delete old;
                 }
             } else if (dropPolicy == Sensor::DropNewest) {
-                while (frameQueue.size() >= frameLimit) {
-                    sensor->decShotsPending();
-                    delete frameQueue.pullBack();
-                }
+                sensor->decShotsPending();
+                delete f;
+                return;
             } else {
                 error(Event::InternalError, sensor, 
                       "Unknown drop policy! Not dropping frames.\n");
             }
         }
+
+        if (!frameQueue.push(f)) {
+            error(Event::InternalError, sensor,
+                  "Frame queue full, dropping frame.\n");
+            sensor->decShotsPending();
+            delete f;
+        }
     }
 
     void Daemon::runSetter() {
@@ -313,7 +330,7 @@ namespace FCam { namespace Tegra {
             	// and push the frame to avoid getFrame() blocking.
             	if (req->_shot.wanted) {
             	    requestQueue.pop();
-            	    frameQueue.push(req);
+            	    pushFrame(req);
             	}
 
             	return;
@@ -471,8 +488,6 @@ namespace FCam { namespace Tegra {
         }
 
         // now queue up this request's actions
-        pthread_mutex_lock(&actionQueueMutex);
-        int queuedActions = 0;
         for (std::set<FCam::Action*>::const_iterator i = req->shot().actions().begin();
              i != req->shot().actions().end();
              i++) {
@@ -483,11 +498,7 @@ namespace FCam { namespace Tegra {
              // time > 0.
              if ((*i)->time > 0) 
              {
-            	 Action a;
-            	 a.action = (*i)->copy();
-                 a.time = hs_vs + (*i)->time - (*i)->latency;
-                 actionQueue.push(a);
-                 queuedActions++;
+                 actions.schedule((*i)->copy(), hs_vs + (*i)->time - (*i)->latency, req);
              }
              else
              {
@@ -497,19 +508,19 @@ namespace FCam { namespace Tegra {
              // Copy the action to the current shot
              current._shot.addAction(*(*i));
         }
-        pthread_mutex_unlock(&actionQueueMutex);
-        for (int i = 0; i < queuedActions; i++) {
-             sem_post(&actionQueueSemaphore);
-        }
 
         // Trigger capture
+        req->trace.mark(Trace::Issued);
         if (!m_pCameraInterface->capture())
         {
             error(Event::DriverError, sensor,
                 "Failed to trigger the capture\n");
 
+            // This shot won't be exposed, so don't fire its actions
+            actions.cancel(req);
+
             if (req->_shot.wanted) {
-                frameQueue.push(req);
+                pushFrame(req);
             }
 
             return;
@@ -518,7 +529,15 @@ namespace FCam { namespace Tegra {
         // The setter is done with this frame. Push it into the
         // in-flight queue for the handler to deal with.
         dprintf(4, "Setter: pushing request 0x%x\n", req);
-        inFlightQueue.push(req);
+        if (!inFlightQueue.push(req)) {
+            error(Event::InternalError, sensor,
+                  "In-flight queue full, dropping request 0x%x\n", req);
+            if (req->_shot.wanted) {
+                pushFrame(req);
+            } else {
+                delete req;
+            }
+        }
 
         dprintf(4, "Setter: Done with this HS_VS, waiting for the next one\n");
     }
@@ -558,9 +577,9 @@ namespace FCam { namespace Tegra {
     void Daemon::onFrame(Hal::CameraFrame* f)
     {
         _Frame *req = NULL;
-        if (inFlightQueue.size()) {
-            req = inFlightQueue.pull();
+        if (inFlightQueue.tryPull(&req)) {
             dprintf(4, "Handler: popping a frame request 0x%x\n", req);
+            req->trace.mark(Trace::Dequeued);
         } else {
             // there's no request for this frame - probably coming up
             // from a mode switch or starting up
@@ -601,8 +620,7 @@ namespace FCam { namespace Tegra {
                 // the histogram and sharpness map may still have appeared
                 // req->histogram = m_pCameraInterface->getHistogram(req->exposureEndTime, req->shot().histogram);
                 // req->sharpness = m_pCameraInterface->getSharpnessMap(req->exposureEndTime, req->shot().sharpness);
-                frameQueue.push(req);
-                enforceDropPolicy();
+                pushFrame(req);
             }
             req = NULL;
         } else if (true) {
@@ -624,13 +642,16 @@ namespace FCam { namespace Tegra {
                     req->histogram = Statistics::evaluateHistogram(req->_shot.histogram, im);
                 }
 
-                if (req->shot().image.autoAllocate()) {
+                if (req->shot().target) {
+                    writeToTarget(req, im);
+                } else if (req->shot().image.autoAllocate()) {
                     if (req->image.type() == req->shot().image.type() && im.weak()) {
-                        req->image = im.copy();
+                        req->image = ImagePool::instance().acquire(im.size(), im.type());
+                        req->image.copyFrom(im);
                     } else if(req->image.type() == req->shot().image.type() && !im.weak()) {
                         req->image = im;
                     } else if (req->image.type() == YUV420p && req->shot().image.type() == RGB24) {
-                        req->image = Image(req->image.size(), req->shot().image.type());
+                        req->image = ImagePool::instance().acquire(req->image.size(), req->shot().image.type());
                         convertYUV420ToRGB24(req->image, im);
                     } else {
                         error(Event::FormatMismatch, sensor,
@@ -683,8 +704,7 @@ namespace FCam { namespace Tegra {
                     }
                 }
 
-                frameQueue.push(req);
-                enforceDropPolicy();
+                pushFrame(req);
 
             }
 
@@ -698,6 +718,45 @@ namespace FCam { namespace Tegra {
 
     }
     
+    void Daemon::writeToTarget(_Frame *req, Image im) {
+        ImageTarget *target = req->shot().target;
+        Image dst = target->acquire();
+        if (!dst.valid()) {
+            // The target has nowhere to put this frame
+            req->image = Image(req->image.size(), req->image.type(), Image::Discard);
+            return;
+        }
+
+        if (dst.size() != im.size() || dst.type() != YUV420p || im.type() != YUV420p ||
+            dst.bytesPerRow() != dst.width() || im.bytesPerRow() != im.width()) {
+            error(Event::FormatMismatch, sensor,
+                  "Image target must be densely packed YUV420p of the frame size "
+                  "(%d x %d). Dropping image data.", im.width(), im.height());
+            target->release(dst, false);
+            req->image = Image(req->image.size(), req->image.type(), Image::Discard);
+            return;
+        }
+
+        // One pass from the driver's buffer to the target, putting
+        // the chroma planes in the order the target wants.
+        unsigned char *d = dst(0, 0);
+        unsigned char *s = im(0, 0);
+        size_t luma = (size_t)im.width() * im.height();
+        size_t chroma = luma / 4;
+        memcpy(d, s, luma);
+        if (target->swapUV) {
+            memcpy(d + luma, s + luma + chroma, chroma);
+            memcpy(d + luma + chroma, s + luma, chroma);
+        } else {
+            memcpy(d + luma, s + luma, 2*chroma);
+        }
+
+        // The frame shares the target's buffer, so its image is only
+        // good until the target reuses it. See ImageTarget.
+        req->image = dst;
+        target->release(dst, true);
+    }
+
     void Daemon::readyToCapture()
     {
         // Wake up the setter thread
@@ -706,26 +765,7 @@ namespace FCam { namespace Tegra {
 
     void Daemon::runAction() {
         dprintf(2, "Action thread running...\n");
-        while (1) {       
-            sem_wait(&actionQueueSemaphore);
-            if (stop) break;
-            // priority inversion :(
-            pthread_mutex_lock(&actionQueueMutex);
-            Action a = actionQueue.top();
-            actionQueue.pop();
-            pthread_mutex_unlock(&actionQueueMutex);
-
-            Time t = Time::now();
-            int delay = (a.time - t) - 500;
-            if (delay > 0) usleep(delay);
-            Time before = Time::now();
-            // busy wait until go time
-            while (a.time > before) before = Time::now();
-            a.action->doAction();
-            //Time after = Time::now();
-            dprintf(3, "Action thread: Initiated action %d us after scheduled time\n", before - a.time);
-            delete a.action;
-        }
+        actions.run();
     }
 
 }}
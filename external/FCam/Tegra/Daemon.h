@@ -1,14 +1,15 @@
 #ifndef FCAM_TEGRA_DAEMON_H
 #define FCAM_TEGRA_DAEMON_H
 
-#include <queue>
 #include <pthread.h>
 #include <semaphore.h>
 
 #include "FCam/Frame.h"
 #include "FCam/Tegra/Sensor.h"
 #include "FCam/TSQueue.h"
+#include "FCam/RingQueue.h"
 #include "FCam/Tegra/Frame.h"
+#include "FCam/Tegra/ActionScheduler.h"
 
 namespace FCam { namespace Tegra {
 
@@ -17,27 +18,13 @@ namespace FCam { namespace Tegra {
 
     class Daemon {
     public:
-        // A class for actions slaved to a frame
-        class Action {
-        public:
-            // When should this action run?
-            // The run-time will set this value when it knows when the
-            // start of the associated exposure is
-            Time time;
-            FCam::Action *action;
-                
-            bool operator<(const Action &other) const {
-                // I'm lower priority than another action if I occur later
-                return time > other.time;
-            }
-                
-            bool operator>(const Action &other) const {
-                // I'm higher priority than another action if I occur earlier
-                return time < other.time;
-            }
+        enum {
+            // Capacity of the lock-free frame queues. The hal never
+            // has more than a handful of captures in flight.
+            FrameQueueCapacity    = 256,
+            InFlightQueueCapacity = 64
         };
-            
-            
+
         Daemon(Sensor *sensor);
         ~Daemon();
 
@@ -49,8 +36,14 @@ namespace FCam { namespace Tegra {
         TSQueue<_Frame *> requestQueue;
 
         // The handler thread puts mostly constructed frames on this
-        // queue. It is consumed by user-space.
-        TSQueue<_Frame *> frameQueue;
+        // queue. It is consumed by user-space. This is a lock-free
+        // ring, so the frame limit can't exceed its capacity.
+        RingQueue<_Frame *> frameQueue;
+
+        // The setter thread schedules RT actions here once it knows
+        // when their exposure starts. They are fired by the actions
+        // thread.
+        ActionScheduler actions;
 
         void launchThreads();
 
@@ -74,15 +67,16 @@ namespace FCam { namespace Tegra {
         Sensor::DropPolicy dropPolicy;
         void enforceDropPolicy();   
 
+        // Hand a frame to user-space, applying the drop policy
+        void pushFrame(_Frame *f);
+
+        // Store a frame's image data in its shot's ImageTarget
+        void writeToTarget(_Frame *req, Image im);
+
         // The setter thread puts in flight requests on this queue, which
         // is consumed by the handler thread
-        TSQueue<_Frame *> inFlightQueue;
-            
-        // The setter thread also queues up RT actions on this priority
-        // queue, which is consumed by the actions thread
-        std::priority_queue<Action> actionQueue;
-        pthread_mutex_t actionQueueMutex;
-        sem_t actionQueueSemaphore;
+        RingQueue<_Frame *> inFlightQueue;
+
 
         // The setter thread waits on this semaphore before issuing a request
         sem_t readySemaphore;
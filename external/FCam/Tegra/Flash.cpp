@@ -57,6 +57,14 @@
 #include "../Debug.h"
 
 namespace FCam { namespace Tegra {
+
+    namespace {
+        // Made once, so that tagging a frame doesn't build any strings
+        const TagName flashBrightness("flash.brightness");
+        const TagName flashDuration("flash.duration");
+        const TagName flashStart("flash.start");
+        const TagName flashPeak("flash.peak");
+    }
     
     Flash::Flash() :  
         flashHistory(512),
@@ -162,41 +170,41 @@ namespace FCam { namespace Tegra {
 
         // If these guys are not set, and the initial brightness is zero, the flash didn't fire
         if ((offTime < 0 || onTime < 0) && (b1 == 0)) {
-        	f["flash.brightness"] = 0;
-			f["flash.duration"] = 0;
-            f["flash.start"] = 0;
-            f["flash.peak"] = 0;
+        	f[flashBrightness] = 0;
+			f[flashDuration] = 0;
+            f[flashStart] = 0;
+            f[flashPeak] = 0;
         } else if (b1 > 0) {
 
             if (b2 == 0) {
                 // it was on initially, turned off and stayed off
-                f["flash.brightness"] = b1;
-                f["flash.duration"] = offTime;
-                f["flash.start"] = 0;
-                f["flash.peak"] = offTime/2;
+                f[flashBrightness] = b1;
+                f[flashDuration] = offTime;
+                f[flashStart] = 0;
+                f[flashPeak] = offTime/2;
             } else {
                 // was on at the start and the end of the frame
-                f["flash.brightness"] = (b1+b2)/2;
-                f["flash.duration"] = t2-t1;
-                f["flash.start"] = 0;
-                f["flash.peak"] = (t2-t1)/2;
+                f[flashBrightness] = (b1+b2)/2;
+                f[flashDuration] = t2-t1;
+                f[flashStart] = 0;
+                f[flashPeak] = (t2-t1)/2;
             }
         } else {
             if (b2 > 0) {
                 // off initially, turned on, stayed on
                 int duration = (t2-t1) - onTime;
-                f["flash.brightness"] = b2;
-                f["flash.duration"] = duration;
-                f["flash.start"] = onTime;
-                f["flash.peak"] = onTime + duration/2;
+                f[flashBrightness] = b2;
+                f[flashDuration] = duration;
+                f[flashStart] = onTime;
+                f[flashPeak] = onTime + duration/2;
             } else {
                 // either didn't fire or pulsed somewhere in the middle
                 if (onTime >= 0) {
                     // pulsed in the middle
-                    f["flash.brightness"] = brightness;
-                    f["flash.duration"] = offTime - onTime;
-                    f["flash.start"] = onTime;
-                    f["flash.peak"] = onTime + (offTime - onTime)/2;
+                    f[flashBrightness] = brightness;
+                    f[flashDuration] = offTime - onTime;
+                    f[flashStart] = onTime;
+                    f[flashPeak] = onTime + (offTime - onTime)/2;
                 } else {
                     // didn't fire. No tags.
                 }
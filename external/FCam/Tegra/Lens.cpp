@@ -65,6 +65,26 @@
 #include "../Debug.h"
 
 namespace FCam { namespace Tegra {
+
+    namespace {
+        // Made once, so that tagging a frame doesn't build any strings
+        const TagName lensInitialFocus("lens.initialFocus");
+        const TagName lensFinalFocus("lens.finalFocus");
+        const TagName lensFocus("lens.focus");
+        const TagName lensFocusSpeed("lens.focusSpeed");
+        const TagName lensZoom("lens.zoom");
+        const TagName lensInitialZoom("lens.initialZoom");
+        const TagName lensFinalZoom("lens.finalZoom");
+        const TagName lensZoomSpeed("lens.zoomSpeed");
+        const TagName lensAperture("lens.aperture");
+        const TagName lensInitialAperture("lens.initialAperture");
+        const TagName lensFinalAperture("lens.finalAperture");
+        const TagName lensApertureSpeed("lens.apertureSpeed");
+        const TagName lensMinZoom("lens.minZoom");
+        const TagName lensMaxZoom("lens.maxZoom");
+        const TagName lensWideApertureMin("lens.wideApertureMin");
+        const TagName lensWideApertureMax("lens.wideApertureMax");
+    }
     
     Lens::Lens() : 
         lensHistory(512),
@@ -306,23 +326,23 @@ namespace FCam { namespace Tegra {
         float finalFocus = getFocus(f.exposureEndTime());
         
         // dprintf(4, "initial focus: %d %d %f final focus %d %d %f\n", f.exposureStartTime().s(), f.exposureStartTime().us(), initialFocus, f.exposureEndTime().s(), f.exposureEndTime().us(), finalFocus);
-        f["lens.initialFocus"] = initialFocus;
-        f["lens.finalFocus"] = finalFocus;
-        f["lens.focus"] = finalFocus; //(initialFocus + finalFocus)/2;
-        f["lens.focusSpeed"] = (1000000.0f * (finalFocus - initialFocus)/
-                                (f.exposureEndTime() - f.exposureStartTime()));
+        f[lensInitialFocus] = initialFocus;
+        f[lensFinalFocus] = finalFocus;
+        f[lensFocus] = finalFocus; //(initialFocus + finalFocus)/2;
+        f[lensFocusSpeed] = (1000000.0f * (finalFocus - initialFocus)/
+                             (f.exposureEndTime() - f.exposureStartTime()));
 
         float zoom = getZoom();
-        f["lens.zoom"] = zoom;
-        f["lens.initialZoom"] = zoom;
-        f["lens.finalZoom"] = zoom;
-        f["lens.zoomSpeed"] = 0.0f;
+        f[lensZoom] = zoom;
+        f[lensInitialZoom] = zoom;
+        f[lensFinalZoom] = zoom;
+        f[lensZoomSpeed] = 0.0f;
 
         float aperture = getAperture();
-        f["lens.aperture"] = aperture;
-        f["lens.initialAperture"] = aperture;
-        f["lens.finalAperture"] = aperture;
-        f["lens.apertureSpeed"] = 0.0f;
+        f[lensAperture] = aperture;
+        f[lensInitialAperture] = aperture;
+        f[lensFinalAperture] = aperture;
+        f[lensApertureSpeed] = 0.0f;
 
         // static properties of the Tegra's lens. In the future, we may
         // just add "lens.*" with a pointer to this lens to the tags,
@@ -330,10 +350,10 @@ namespace FCam { namespace Tegra {
         // devicename.* by asking the appropriate device for more
         // details. For now there are only four more fields, so we
         // don't mind.
-        f["lens.minZoom"] = minZoom();
-        f["lens.maxZoom"] = maxZoom();
-        f["lens.wideApertureMin"] = wideAperture(minZoom());
-        f["lens.wideApertureMax"] = wideAperture(maxZoom());
+        f[lensMinZoom] = minZoom();
+        f[lensMaxZoom] = maxZoom();
+        f[lensWideApertureMin] = wideAperture(minZoom());
+        f[lensWideApertureMax] = wideAperture(maxZoom());
     }
 
 }}
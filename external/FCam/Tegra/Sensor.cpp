@@ -219,6 +219,11 @@ namespace FCam { namespace Tegra {
             decShotsPending();
         }
 
+        // Every shot is done, so any actions still pending belong to
+        // no frame. Drop them rather than have them fire on a closed
+        // camera.
+        daemon->actions.cancelAll();
+
         // Close camera interface before deleting daemon
         if (pHardwareInterface) {
             pHardwareInterface->close();
@@ -248,6 +253,7 @@ namespace FCam { namespace Tegra {
         f->_shot = shot;        
         // clone the shot ID
         f->_shot.id = shot.id;
+        f->trace.mark(Trace::Enqueued);
 
         // push the frame to the daemon
         pthread_mutex_lock(&requestMutex);
@@ -279,6 +285,7 @@ namespace FCam { namespace Tegra {
             
             // clone the shot ID
             f->_shot.id = burst[i].id;
+            f->trace.mark(Trace::Enqueued);
 
             frames.push_back(f); 
         }
@@ -362,7 +369,15 @@ namespace FCam { namespace Tegra {
             error(Event::SensorStoppedError, "Can't request a frame before calling capture or stream\n");
             return invalid;
         }        
-        Frame frame(daemon->frameQueue.pull());
+        _Frame *f = daemon->frameQueue.pull();
+        if (Trace::enabled()) {
+            f->trace.at[Trace::ExposureStart] = f->exposureStartTime;
+            f->trace.at[Trace::ExposureEnd] = f->exposureEndTime;
+            f->trace.at[Trace::ProcessingDone] = f->processingDoneTime;
+            f->trace.mark(Trace::Delivered);
+            Trace::record(f->_shot.id, f->trace);
+        }
+        Frame frame(f);
         FCam::Sensor::tagFrame(frame); // Use the base class tagFrame
         for (size_t i = 0; i < devices.size(); i++) {
             devices[i]->tagFrame(frame);
@@ -389,6 +404,7 @@ namespace FCam { namespace Tegra {
                 _Frame *f = new _Frame;
                 f->_shot = streamingShot[i];                
                 f->_shot.id = streamingShot[i].id;
+                f->trace.mark(Trace::Enqueued);
                 shotsPending_++;
                 daemon->requestQueue.push(f);
             }
@@ -411,6 +427,15 @@ namespace FCam { namespace Tegra {
         return shotsPending_;
     }
 
+    ActionScheduler::Stats Sensor::actionStatistics() const {
+        if (!daemon) return ActionScheduler::Stats();
+        return daemon->actions.statistics();
+    }
+
+    void Sensor::resetActionStatistics() {
+        if (daemon) daemon->actions.resetStatistics();
+    }
+
     void Sensor::decShotsPending() {
         pthread_mutex_lock(&requestMutex);
         shotsPending_--;
@@ -54,7 +54,8 @@
 namespace FCam { namespace Tegra {
 
     FCam::Tegra::Shot::Shot():
-            fastMode(false)
+            fastMode(false),
+            target(NULL)
     {}
 
     FCam::Tegra::Shot::~Shot()
@@ -62,12 +63,14 @@ namespace FCam { namespace Tegra {
 
     Shot::Shot(const Shot &other):
             FCam::Shot(other),
-            fastMode(other.fastMode)
+            fastMode(other.fastMode),
+            target(other.target)
     {}
 
     Shot::Shot(const FCam::Shot &other):
             FCam::Shot(other),
-            fastMode(false)
+            fastMode(false),
+            target(NULL)
     {
         // preserve shot id when doing type conversions.
         id = other.id;
@@ -77,6 +80,7 @@ namespace FCam { namespace Tegra {
     {
         FCam::Shot::operator=(other);
         fastMode = other.fastMode;
+        target = other.target;
         return *this;
     }
 
@@ -49,36 +49,233 @@
 * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
+#include <limits.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define FCAM_STATISTICS_NEON
+#include <arm_neon.h>
+#endif
+
 #include "Statistics.h"
 
 namespace FCam { namespace Tegra { 
 
+namespace {
+
+    // Per tile sums. For the variance these are the sum and sum of
+    // squares of the samples, for the gradient energy just the sum
+    // of squared differences is used. The image can be large and the
+    // tiles few, so everything is 64 bit.
+    struct TileSums {
+        unsigned long long sum, sumSq, samples;
+        TileSums() : sum(0), sumSq(0), samples(0) {}
+    };
+
+    // The vector loops sum into 32 bit lanes for at most this many
+    // iterations before widening, which keeps the lanes from
+    // overflowing for any row length.
+    const int FLUSH_INTERVAL = 2048;
+
+    // Add the sum and sum of squares of n bytes to *sum and *sumSq
+    void sumBytes(const unsigned char *p, int n,
+                  unsigned long long *sum, unsigned long long *sumSq) {
+        int x = 0;
+        unsigned long long s = 0, q = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        __m128i s64 = zero, q64 = zero;
+        while (x + 16 <= n) {
+            __m128i q32 = zero;
+            for (int i = 0; i < FLUSH_INTERVAL && x + 16 <= n; i++, x += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(p + x));
+                s64 = _mm_add_epi64(s64, _mm_sad_epu8(v, zero));
+                __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+                q32 = _mm_add_epi32(q32, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+            }
+            q64 = _mm_add_epi64(q64, _mm_add_epi64(_mm_unpacklo_epi32(q32, zero),
+                                                   _mm_unpackhi_epi32(q32, zero)));
+        }
+        unsigned long long lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, s64);
+        s += lanes[0] + lanes[1];
+        _mm_storeu_si128((__m128i *)lanes, q64);
+        q += lanes[0] + lanes[1];
+#elif defined(FCAM_STATISTICS_NEON)
+        uint64x2_t s64 = vdupq_n_u64(0), q64 = vdupq_n_u64(0);
+        while (x + 16 <= n) {
+            uint32x4_t s32 = vdupq_n_u32(0), q32 = vdupq_n_u32(0);
+            for (int i = 0; i < FLUSH_INTERVAL && x + 16 <= n; i++, x += 16) {
+                uint8x16_t v = vld1q_u8(p + x);
+                s32 = vpadalq_u16(s32, vpaddlq_u8(v));
+                q32 = vpadalq_u16(q32, vmull_u8(vget_low_u8(v), vget_low_u8(v)));
+                q32 = vpadalq_u16(q32, vmull_u8(vget_high_u8(v), vget_high_u8(v)));
+            }
+            s64 = vpadalq_u32(s64, s32);
+            q64 = vpadalq_u32(q64, q32);
+        }
+        s += vgetq_lane_u64(s64, 0) + vgetq_lane_u64(s64, 1);
+        q += vgetq_lane_u64(q64, 0) + vgetq_lane_u64(q64, 1);
+#endif
+        for (; x < n; x++) {
+            unsigned v = p[x];
+            s += v;
+            q += v*v;
+        }
+        *sum += s;
+        *sumSq += q;
+    }
+
+    // The sum of (a[x]-b[x])^2 over n bytes
+    unsigned long long sumSquaredDifferences(const unsigned char *a, const unsigned char *b, int n) {
+        int x = 0;
+        unsigned long long total = 0;
+#if defined(__SSE2__)
+        const __m128i zero = _mm_setzero_si128();
+        __m128i t64 = zero;
+        while (x + 16 <= n) {
+            __m128i t32 = zero;
+            for (int i = 0; i < FLUSH_INTERVAL && x + 16 <= n; i++, x += 16) {
+                __m128i va = _mm_loadu_si128((const __m128i *)(a + x));
+                __m128i vb = _mm_loadu_si128((const __m128i *)(b + x));
+                __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vb, zero));
+                __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vb, zero));
+                t32 = _mm_add_epi32(t32, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+            }
+            t64 = _mm_add_epi64(t64, _mm_add_epi64(_mm_unpacklo_epi32(t32, zero),
+                                                   _mm_unpackhi_epi32(t32, zero)));
+        }
+        unsigned long long lanes[2];
+        _mm_storeu_si128((__m128i *)lanes, t64);
+        total += lanes[0] + lanes[1];
+#elif defined(FCAM_STATISTICS_NEON)
+        uint64x2_t t64 = vdupq_n_u64(0);
+        while (x + 16 <= n) {
+            uint32x4_t t32 = vdupq_n_u32(0);
+            for (int i = 0; i < FLUSH_INTERVAL && x + 16 <= n; i++, x += 16) {
+                uint8x16_t d = vabdq_u8(vld1q_u8(a + x), vld1q_u8(b + x));
+                t32 = vpadalq_u16(t32, vmull_u8(vget_low_u8(d), vget_low_u8(d)));
+                t32 = vpadalq_u16(t32, vmull_u8(vget_high_u8(d), vget_high_u8(d)));
+            }
+            t64 = vpadalq_u32(t64, t32);
+        }
+        total += vgetq_lane_u64(t64, 0) + vgetq_lane_u64(t64, 1);
+#endif
+        for (; x < n; x++) {
+            int d = (int)a[x] - (int)b[x];
+            total += d*d;
+        }
+        return total;
+    }
+
+    // The same for 16 bit raw samples, which are rare enough that
+    // they aren't vectorized
+    void sumBytes(const unsigned short *p, int n,
+                  unsigned long long *sum, unsigned long long *sumSq) {
+        for (int x = 0; x < n; x++) {
+            unsigned long long v = p[x];
+            *sum += v;
+            *sumSq += v*v;
+        }
+    }
+
+    unsigned long long sumSquaredDifferences(const unsigned short *a, const unsigned short *b, int n) {
+        unsigned long long total = 0;
+        for (int x = 0; x < n; x++) {
+            long long d = (long long)a[x] - (long long)b[x];
+            total += (unsigned long long)(d*d);
+        }
+        return total;
+    }
+
+    // Accumulate every tile of the map in one pass over the rows.
+    // Gradients are taken between samples step apart, which is 2 for
+    // raw data so that they compare samples of the same color.
+    template<typename T>
+    void accumulateTiles(const Image &im, int step, bool gradient,
+                         const std::vector<int> &xEdge, const std::vector<int> &yEdge,
+                         std::vector<TileSums> &tiles) {
+        const int width = im.width();
+        const int height = im.height();
+        const int mapWidth = (int)xEdge.size() - 1;
+
+        int ty = 0;
+        for (int y = 0; y < height; y++) {
+            while (y >= yEdge[ty+1]) ty++;
+            const T *row = (const T *)im(0, y);
+            const T *below = y + step < height ? (const T *)im(0, y + step) : NULL;
+
+            for (int tx = 0; tx < mapWidth; tx++) {
+                TileSums &t = tiles[ty*mapWidth + tx];
+                const int x0 = xEdge[tx];
+                const int n = xEdge[tx+1] - x0;
+                t.samples += n;
+                if (!gradient) {
+                    sumBytes(row + x0, n, &t.sum, &t.sumSq);
+                    continue;
+                }
+                // Differences to the right, and down. The last
+                // columns and rows of the image have fewer neighbours.
+                int nx = std::min(n, width - step - x0);
+                if (nx > 0) t.sumSq += sumSquaredDifferences(row + x0, row + x0 + step, nx);
+                if (below) t.sumSq += sumSquaredDifferences(row + x0, below + x0, n);
+            }
+        }
+    }
+}
+
 FCam::SharpnessMap Statistics::evaluateVariance(FCam::SharpnessMapConfig mapCfg, FCam::Image im)
 {
-    if (!mapCfg.enabled) return SharpnessMap();
-
-    Rect region;
-    region.x = 0;
-    region.y = 0;
-    region.width = im.size().width;
-    region.height = im.size().height;
-
-    // Make sure we don't take more than MAX_VARIANCE_SAMPLES samples
-    // to avoid integer overflow.
-    int subsample = 1;
-    int samplesX, samplesY;
-
-    samplesX = im.size().width;
-    samplesY = im.size().height;
-    while (samplesX * samplesY > MAX_VARIANCE_SAMPLES)
-    {
-        samplesX  = samplesX >> 1;
-        samplesY  = samplesY >> 1;
-        subsample = subsample << 1;
+    if (!mapCfg.enabled || !im.valid()) return SharpnessMap();
+
+    const int width = im.width();
+    const int height = im.height();
+    const int mapWidth = std::max(1, std::min(mapCfg.size.width, width));
+    const int mapHeight = std::max(1, std::min(mapCfg.size.height, height));
+    const bool gradient = mapCfg.metric == SharpnessMapConfig::GradientEnergy;
+
+    // Tile (tx, ty) covers [xEdge[tx], xEdge[tx+1]) x [yEdge[ty], yEdge[ty+1])
+    std::vector<int> xEdge(mapWidth + 1), yEdge(mapHeight + 1);
+    for (int i = 0; i <= mapWidth; i++) xEdge[i] = (int)((long long)i*width/mapWidth);
+    for (int i = 0; i <= mapHeight; i++) yEdge[i] = (int)((long long)i*height/mapHeight);
+
+    std::vector<TileSums> tiles(mapWidth*mapHeight);
+    if (im.type() == RAW) {
+        accumulateTiles<unsigned short>(im, 2, gradient, xEdge, yEdge, tiles);
+    } else if (im.type() == YUV420p) {
+        // The luma plane, which is the first height rows
+        accumulateTiles<unsigned char>(im, 1, gradient, xEdge, yEdge, tiles);
+    } else {
+        // The tiles sum contiguous bytes, which only means something
+        // for a single 8 or 16 bit channel
+        warning(Event::InternalError, "Statistics: Can't compute a sharpness map of image format %d",
+                im.type());
+        return SharpnessMap();
     }
 
-    SharpnessMap s(Size(1,1), 1);
-    s(0,0,0) = evaluateVariance(im, region, subsample);
+    SharpnessMap s(Size(mapWidth, mapHeight), 1);
+    for (int ty = 0; ty < mapHeight; ty++) {
+        for (int tx = 0; tx < mapWidth; tx++) {
+            const TileSums &t = tiles[ty*mapWidth + tx];
+            double value = 0;
+            if (t.samples) {
+                double n = (double)t.samples;
+                if (gradient) {
+                    value = t.sumSq / n;
+                } else {
+                    // E[x^2] - E[x]^2. The square of the sum can
+                    // overflow 64 bits for raw data, so use doubles.
+                    double mean = t.sum / n;
+                    value = t.sumSq / n - mean*mean;
+                }
+            }
+            if (value < 0) value = 0;
+            s(tx, ty, 0) = value >= (double)UINT_MAX ? UINT_MAX : (unsigned)value;
+        }
+    }
 
     return s;
 }
@@ -103,13 +300,19 @@ int Statistics::evaluateVariance(Image im, Rect region, int subsample)
         boundaries.height = im.size().height - region.y - 1;
     }
    
-    int sumX2, sumX, samples;
+    unsigned long long sumX2, sumX, samples;
     sumX2 = sumX = samples = 0;
 
     for (int j = boundaries.y; j < boundaries.y + boundaries.height; j += subsample)
     {
         unsigned char *dataPtr = im(boundaries.x, j);
 
+        if (subsample == 1) {
+            sumBytes(dataPtr, boundaries.width, &sumX, &sumX2);
+            samples += boundaries.width;
+            continue;
+        }
+
         for (int i = boundaries.x; i < boundaries.x + boundaries.width; i += subsample) 
         {
             sumX    += dataPtr[0];
@@ -119,9 +322,10 @@ int Statistics::evaluateVariance(Image im, Rect region, int subsample)
         }
     }
 
-    int expX2 = sumX2/samples;
-    int expX  = sumX/samples;
-    return    expX2 - expX * expX;
+    if (!samples) return 0;
+    unsigned long long expX2 = sumX2/samples;
+    unsigned long long expX  = sumX/samples;
+    return (int)(expX2 - expX * expX);
 }
 
 
@@ -13,19 +13,17 @@ namespace FCam { namespace Tegra {
            interval */
         int evaluateVariance(Image im, Rect region, int subsample);
 
-        /* Returns the SharpnessMap over a given region using a subsample
-           interval */
+        /* Returns the SharpnessMap of an image at the configured size,
+           measured with the configured metric over every pixel of each
+           tile, in a single pass. Uses the luma plane of YUV420p images
+           and the raw samples (same-color neighbours for gradients) of
+           RAW images, and returns an empty map for other formats. */
         SharpnessMap evaluateVariance(SharpnessMapConfig mapCfg, Image im);
 
         /* Returns the YUV histogram for an image*/
         Histogram evaluateHistogram(const HistogramConfig& histoCfg, const Image& im);
 
         enum { 
-            // The max number of samples to avoid overflow is 65535
-            // (8bit ^ 2 -> 16bit) -> sum up to 64k of 16bit values without
-            // overflow.
-            MAX_VARIANCE_SAMPLES  = 32768,
-
             // Just an deliberate selection.
             MAX_HISTOGRAM_SAMPLES = 32768,
          };
@@ -49,89 +49,491 @@
 * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#ifdef FCAM_ARCH_X86
+#include <immintrin.h>
+#endif
+// NEON is used whenever the compiler targets it
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#define FCAM_YUV420_NEON
+#include <arm_neon.h>
+#endif
+
 #include "FCam/Tegra/YUV420.h"
+#include "../Debug.h"
+#include "../Parallel.h"
+
+// The conversion works on one row at a time. Both rows of each 2x2
+// block read the same chroma samples, and all the per-row work is
+// independent, so the rows are split into bands which the calling
+// thread and a few helpers claim from a shared counter.
+//
+// The vector kernels use 16 bit lanes. The products 149*y and 129*u
+// don't fit in them, so (-1+149*y)/2 is computed as 74*y + (y-1)/2,
+// 17672-129*u is left to wrap (the result is in range), and the
+// final sums saturate, which only affects values that are clamped to
+// 255 anyway. Values below 64 round to zero either way and clamp to
+// 1. So every kernel gives the same bytes as the scalar formula.
 
 namespace FCam { namespace Tegra {
 
-static inline char clamp(int n, int min=1, int max=255)
-{
-    if (n < min)   return (char) min;
-    if (n > max)   return (char) max;
-    return (char) n;
-}
+namespace {
 
-bool convertYUV420ToRGB24(Image dst, Image im) {
-    
-    // Check src/dst compatibility
-    if (im.size().width  != dst.size().width ||
-        im.size().height != dst.size().height ||
-        im.type() != YUV420p || dst.type() != RGB24) {
-            return false;
+    // n/64 clamped to [1, 255]. Everything below 64 clamps to 1, so a
+    // shift gives the same result as the division, and the selects
+    // compile to conditional moves rather than branches.
+    inline unsigned char clampDiv64(int n)
+    {
+        n >>= 6;
+        n = n < 1 ? 1 : n;
+        return (unsigned char)(n > 255 ? 255 : n);
     }
 
-    Rect boundaries;
-    boundaries.x = 0;
-    boundaries.y = 0;
-    boundaries.width = im.size().width;
-    boundaries.height = im.size().height;
+    // The chroma terms shared by each 2x2 block
+    struct Chroma {
+        int r, g, b;
+        Chroma(int u, int v) : r(14216-102*v), g((8696-25*u)-52*v), b(17672-129*u) {}
+    };
 
-    for (int j = boundaries.y; j < boundaries.y + boundaries.height; j += 2)
-    {
-        unsigned int  uvrow     = j/4;
-        unsigned int  uvcol     = boundaries.x/2 + boundaries.y%4 < 2 ? 0 : im.width()/2;
-        unsigned char *rgb      = dst(boundaries.x, j);
-        unsigned char *dataYPtr = im(boundaries.x, j);
-        unsigned char *dataUPtr = im(uvcol, im.height() + uvrow);
-        unsigned char *dataVPtr = im(uvcol, im.height() + im.height()/4 + uvrow);
-
-        for (int i = boundaries.x; i < boundaries.x + boundaries.width; i += 2)
-        {
-            // formula
-            // R = [((-1+149*y)/2 - (14216-102*v)     )/2]/32
-            // G = [((-1+149*y)/2 + ((8696-25*u)-52*v))/2]/32
-            // B = [((-1+149*y)/2 - (17672-129*u)     )/2]/32
-            int y1 = dataYPtr[0];
-            int y2 = dataYPtr[1];
-            int y3 = dataYPtr[im.width()];
-            int y4 = dataYPtr[im.width() + 1];
-            int u  = dataUPtr[0];
-            int v  = dataVPtr[0];
-
-            y1 = (-1+149*y1)/2;
-            y2 = (-1+149*y2)/2;
-            y3 = (-1+149*y3)/2;
-            y4 = (-1+149*y4)/2;
-            int ruv = (14216-102*v);
-            int guv = ((8696-25*u)-52*v);
-            int buv = (17672-129*u);
-
-            
-
-            rgb[0] = clamp((y1 - ruv)/64);
-            rgb[1] = clamp((y1 + guv)/64);
-            rgb[2] = clamp((y1 - buv)/64);
-            
-            rgb[3] = clamp((y2 - ruv)/64);
-            rgb[4] = clamp((y2 + guv)/64);
-            rgb[5] = clamp((y2 - buv)/64);
-
-            rgb[0+im.width()*3] = clamp((y3 - ruv)/64);
-            rgb[1+im.width()*3] = clamp((y3 + guv)/64);        
-            rgb[2+im.width()*3] = clamp((y3 - buv)/64);
-            
-            rgb[3+im.width()*3] = clamp((y4 - ruv)/64);
-            rgb[4+im.width()*3] = clamp((y4 + guv)/64);
-            rgb[5+im.width()*3] = clamp((y4 - buv)/64);
-            
-            rgb      += 6;
-            dataYPtr += 2;
-            dataUPtr += 1;
-            dataVPtr += 1;
+    inline void yuvToRGB(int y, const Chroma &c, unsigned char *r, unsigned char *g, unsigned char *b) {
+        // formula
+        // R = [((-1+149*y)/2 - (14216-102*v)     )/2]/32
+        // G = [((-1+149*y)/2 + ((8696-25*u)-52*v))/2]/32
+        // B = [((-1+149*y)/2 - (17672-129*u)     )/2]/32
+        y = (-1+149*y)/2;
+        *r = clampDiv64(y - c.r);
+        *g = clampDiv64(y + c.g);
+        *b = clampDiv64(y - c.b);
+    }
+
+    inline void yuvToRGB(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b) {
+        yuvToRGB(y, Chroma(u, v), r, g, b);
+    }
+
+    // Widths are always even, so the scalar rows go a chroma sample
+    // at a time
+    namespace scalar {
+        void rowRGB24(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                      int width, unsigned char *out) {
+            for (int x = 0; x < width; x += 2) {
+                Chroma c(u[x/2], v[x/2]);
+                yuvToRGB(y[x], c, out, out+1, out+2);
+                yuvToRGB(y[x+1], c, out+3, out+4, out+5);
+                out += 6;
+            }
+        }
+
+        void rowRGBA32(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                       int width, unsigned char *out, unsigned char alpha) {
+            for (int x = 0; x < width; x += 2) {
+                Chroma c(u[x/2], v[x/2]);
+                yuvToRGB(y[x], c, out, out+1, out+2);
+                yuvToRGB(y[x+1], c, out+4, out+5, out+6);
+                out[3] = out[7] = alpha;
+                out += 8;
+            }
+        }
+
+        void rowFloat(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                      int width, float *outR, float *outG, float *outB) {
+            for (int x = 0; x < width; x += 2) {
+                Chroma c(u[x/2], v[x/2]);
+                unsigned char p[6];
+                yuvToRGB(y[x], c, p, p+1, p+2);
+                yuvToRGB(y[x+1], c, p+3, p+4, p+5);
+                outR[x] = p[0] / 255.0f;
+                outG[x] = p[1] / 255.0f;
+                outB[x] = p[2] / 255.0f;
+                outR[x+1] = p[3] / 255.0f;
+                outG[x+1] = p[4] / 255.0f;
+                outB[x+1] = p[5] / 255.0f;
+            }
+        }
+
+        void rowUV(const unsigned char *u, const unsigned char *v, int chromaWidth,
+                   unsigned char *out) {
+            for (int x = 0; x < chromaWidth; x++) {
+                out[2*x] = u[x];
+                out[2*x+1] = v[x];
+            }
         }
     }
 
+#ifdef FCAM_ARCH_X86
+#pragma GCC push_options
+#pragma GCC target("ssse3")
+    namespace ssse3 {
+        // Eight pixels worth of 16 bit lanes
+        inline __m128i convert8(__m128i y, __m128i u, __m128i v, __m128i *g, __m128i *b) {
+            __m128i ys = _mm_add_epi16(_mm_mullo_epi16(y, _mm_set1_epi16(74)),
+                                       _mm_srli_epi16(_mm_subs_epu16(y, _mm_set1_epi16(1)), 1));
+            __m128i ruv = _mm_sub_epi16(_mm_set1_epi16(14216), _mm_mullo_epi16(v, _mm_set1_epi16(102)));
+            __m128i guv = _mm_sub_epi16(_mm_sub_epi16(_mm_set1_epi16(8696),
+                                                      _mm_mullo_epi16(u, _mm_set1_epi16(25))),
+                                        _mm_mullo_epi16(v, _mm_set1_epi16(52)));
+            __m128i buv = _mm_sub_epi16(_mm_set1_epi16(17672), _mm_mullo_epi16(u, _mm_set1_epi16(129)));
+            *g = _mm_srai_epi16(_mm_adds_epi16(ys, guv), 6);
+            *b = _mm_srai_epi16(_mm_subs_epi16(ys, buv), 6);
+            return _mm_srai_epi16(_mm_subs_epi16(ys, ruv), 6);
+        }
+
+        inline void rgb16(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                          __m128i *r, __m128i *g, __m128i *b) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i one = _mm_set1_epi8(1);
+            __m128i yv = _mm_loadu_si128((const __m128i *)y);
+            __m128i uv = _mm_loadl_epi64((const __m128i *)u);
+            __m128i vv = _mm_loadl_epi64((const __m128i *)v);
+            uv = _mm_unpacklo_epi8(uv, uv);
+            vv = _mm_unpacklo_epi8(vv, vv);
+
+            __m128i gLo, bLo, gHi, bHi;
+            __m128i rLo = convert8(_mm_unpacklo_epi8(yv, zero), _mm_unpacklo_epi8(uv, zero),
+                                   _mm_unpacklo_epi8(vv, zero), &gLo, &bLo);
+            __m128i rHi = convert8(_mm_unpackhi_epi8(yv, zero), _mm_unpackhi_epi8(uv, zero),
+                                   _mm_unpackhi_epi8(vv, zero), &gHi, &bHi);
+            *r = _mm_max_epu8(_mm_packus_epi16(rLo, rHi), one);
+            *g = _mm_max_epu8(_mm_packus_epi16(gLo, gHi), one);
+            *b = _mm_max_epu8(_mm_packus_epi16(bLo, bHi), one);
+        }
+
+#include "YUV420_x86_kernel.h"
+    }
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+    namespace avx2 {
+        inline __m128i pack16(__m256i x) {
+            const __m128i one = _mm_set1_epi8(1);
+            __m256i p = _mm256_permute4x64_epi64(_mm256_packus_epi16(x, x), 0xD8);
+            return _mm_max_epu8(_mm256_castsi256_si128(p), one);
+        }
+
+        inline void rgb16(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                          __m128i *r, __m128i *g, __m128i *b) {
+            __m128i uv = _mm_loadl_epi64((const __m128i *)u);
+            __m128i vv = _mm_loadl_epi64((const __m128i *)v);
+            __m256i Y = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)y));
+            __m256i U = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(uv, uv));
+            __m256i V = _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(vv, vv));
+
+            __m256i ys = _mm256_add_epi16(_mm256_mullo_epi16(Y, _mm256_set1_epi16(74)),
+                                          _mm256_srli_epi16(_mm256_subs_epu16(Y, _mm256_set1_epi16(1)), 1));
+            __m256i ruv = _mm256_sub_epi16(_mm256_set1_epi16(14216),
+                                           _mm256_mullo_epi16(V, _mm256_set1_epi16(102)));
+            __m256i guv = _mm256_sub_epi16(_mm256_sub_epi16(_mm256_set1_epi16(8696),
+                                                            _mm256_mullo_epi16(U, _mm256_set1_epi16(25))),
+                                           _mm256_mullo_epi16(V, _mm256_set1_epi16(52)));
+            __m256i buv = _mm256_sub_epi16(_mm256_set1_epi16(17672),
+                                           _mm256_mullo_epi16(U, _mm256_set1_epi16(129)));
+
+            *r = pack16(_mm256_srai_epi16(_mm256_subs_epi16(ys, ruv), 6));
+            *g = pack16(_mm256_srai_epi16(_mm256_adds_epi16(ys, guv), 6));
+            *b = pack16(_mm256_srai_epi16(_mm256_subs_epi16(ys, buv), 6));
+        }
+
+#include "YUV420_x86_kernel.h"
+    }
+#pragma GCC pop_options
+#endif
+
+#ifdef FCAM_YUV420_NEON
+    namespace neon {
+        inline uint8x8_t convert8(uint16x8_t y, uint16x8_t u, uint16x8_t v, int channel) {
+            int16x8_t ys = vreinterpretq_s16_u16(
+                vaddq_u16(vmulq_n_u16(y, 74), vshrq_n_u16(vqsubq_u16(y, vdupq_n_u16(1)), 1)));
+            int16x8_t s;
+            if (channel == 0) {
+                uint16x8_t ruv = vsubq_u16(vdupq_n_u16(14216), vmulq_n_u16(v, 102));
+                s = vqsubq_s16(ys, vreinterpretq_s16_u16(ruv));
+            } else if (channel == 1) {
+                uint16x8_t guv = vsubq_u16(vsubq_u16(vdupq_n_u16(8696), vmulq_n_u16(u, 25)),
+                                           vmulq_n_u16(v, 52));
+                s = vqaddq_s16(ys, vreinterpretq_s16_u16(guv));
+            } else {
+                uint16x8_t buv = vsubq_u16(vdupq_n_u16(17672), vmulq_n_u16(u, 129));
+                s = vqsubq_s16(ys, vreinterpretq_s16_u16(buv));
+            }
+            return vmax_u8(vqshrun_n_s16(s, 6), vdup_n_u8(1));
+        }
+
+        inline uint8x16x3_t rgb16(const unsigned char *y, const unsigned char *u, const unsigned char *v) {
+            uint8x16_t yv = vld1q_u8(y);
+            uint8x8x2_t uz = vzip_u8(vld1_u8(u), vld1_u8(u));
+            uint8x8x2_t vz = vzip_u8(vld1_u8(v), vld1_u8(v));
+            uint16x8_t yLo = vmovl_u8(vget_low_u8(yv)), yHi = vmovl_u8(vget_high_u8(yv));
+            uint16x8_t uLo = vmovl_u8(uz.val[0]), uHi = vmovl_u8(uz.val[1]);
+            uint16x8_t vLo = vmovl_u8(vz.val[0]), vHi = vmovl_u8(vz.val[1]);
+            uint8x16x3_t rgb;
+            for (int c = 0; c < 3; c++) {
+                rgb.val[c] = vcombine_u8(convert8(yLo, uLo, vLo, c), convert8(yHi, uHi, vHi, c));
+            }
+            return rgb;
+        }
+
+        void rowRGB24(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                      int width, unsigned char *out) {
+            int x = 0;
+            for (; x + 16 <= width; x += 16) {
+                vst3q_u8(out + 3*x, rgb16(y + x, u + x/2, v + x/2));
+            }
+            scalar::rowRGB24(y + x, u + x/2, v + x/2, width - x, out + 3*x);
+        }
+
+        void rowRGBA32(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                       int width, unsigned char *out, unsigned char alpha) {
+            int x = 0;
+            for (; x + 16 <= width; x += 16) {
+                uint8x16x3_t rgb = rgb16(y + x, u + x/2, v + x/2);
+                uint8x16x4_t rgba;
+                rgba.val[0] = rgb.val[0];
+                rgba.val[1] = rgb.val[1];
+                rgba.val[2] = rgb.val[2];
+                rgba.val[3] = vdupq_n_u8(alpha);
+                vst4q_u8(out + 4*x, rgba);
+            }
+            scalar::rowRGBA32(y + x, u + x/2, v + x/2, width - x, out + 4*x, alpha);
+        }
+
+        void rowFloat(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                      int width, float *outR, float *outG, float *outB) {
+            // ARMv7 NEON has no exact divide, so just the conversion
+            // to bytes is vectorized
+            int x = 0;
+            for (; x + 16 <= width; x += 16) {
+                unsigned char c[3][16];
+                uint8x16x3_t rgb = rgb16(y + x, u + x/2, v + x/2);
+                vst1q_u8(c[0], rgb.val[0]);
+                vst1q_u8(c[1], rgb.val[1]);
+                vst1q_u8(c[2], rgb.val[2]);
+                for (int i = 0; i < 16; i++) {
+                    outR[x+i] = c[0][i] / 255.0f;
+                    outG[x+i] = c[1][i] / 255.0f;
+                    outB[x+i] = c[2][i] / 255.0f;
+                }
+            }
+            scalar::rowFloat(y + x, u + x/2, v + x/2, width - x, outR + x, outG + x, outB + x);
+        }
+
+        void rowUV(const unsigned char *u, const unsigned char *v, int chromaWidth,
+                   unsigned char *out) {
+            int x = 0;
+            for (; x + 16 <= chromaWidth; x += 16) {
+                uint8x16x2_t uv;
+                uv.val[0] = vld1q_u8(u + x);
+                uv.val[1] = vld1q_u8(v + x);
+                vst2q_u8(out + 2*x, uv);
+            }
+            scalar::rowUV(u + x, v + x, chromaWidth - x, out + 2*x);
+        }
+    }
+#endif
+
+    struct Kernels {
+        void (*rgb24)(const unsigned char *, const unsigned char *, const unsigned char *,
+                      int, unsigned char *);
+        void (*rgba32)(const unsigned char *, const unsigned char *, const unsigned char *,
+                       int, unsigned char *, unsigned char);
+        void (*rgbFloat)(const unsigned char *, const unsigned char *, const unsigned char *,
+                         int, float *, float *, float *);
+        void (*uv)(const unsigned char *, const unsigned char *, int, unsigned char *);
+    };
+
+    #define KERNELS(ns) {ns::rowRGB24, ns::rowRGBA32, ns::rowFloat, ns::rowUV}
+
+    Kernels bestKernels() {
+        #ifdef FCAM_ARCH_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            Kernels k = KERNELS(avx2);
+            return k;
+        }
+        if (__builtin_cpu_supports("ssse3")) {
+            Kernels k = KERNELS(ssse3);
+            return k;
+        }
+        #endif
+        #ifdef FCAM_YUV420_NEON
+        Kernels k = KERNELS(neon);
+        #else
+        Kernels k = KERNELS(scalar);
+        #endif
+        return k;
+    }
+
+    #undef KERNELS
+
+    enum Target {ToRGB24, ToRGBA32, ToFloat, ToNV12};
+
+    // Rows per unit of work
+    const int BAND_HEIGHT = 16;
+    // Don't bother waking the thread pool for less than two threads'
+    // worth of this many pixels
+    const int MIN_PIXELS_PER_THREAD = 128*1024;
+
+    struct Job {
+        Target target;
+        Kernels k;
+
+        // The source at the top left of the region
+        const unsigned char *y, *u, *v;
+        int yStride, chromaStride;
+        int width, height;
+
+        unsigned char *dst;
+        int dstStride;
+        unsigned char alpha;
+        float *planes[3];
+        int floatStride;
+        unsigned char *dstUV;
+        int uvStride;
+    };
+
+    void convertRows(const Job &job, int j0, int j1) {
+        for (int j = j0; j < j1; j++) {
+            const unsigned char *y = job.y + j*job.yStride;
+            const unsigned char *u = job.u + (j/2)*job.chromaStride;
+            const unsigned char *v = job.v + (j/2)*job.chromaStride;
+            switch (job.target) {
+            case ToRGB24:
+                job.k.rgb24(y, u, v, job.width, job.dst + j*job.dstStride);
+                break;
+            case ToRGBA32:
+                job.k.rgba32(y, u, v, job.width, job.dst + j*job.dstStride, job.alpha);
+                break;
+            case ToFloat:
+                job.k.rgbFloat(y, u, v, job.width,
+                               job.planes[0] + j*job.floatStride,
+                               job.planes[1] + j*job.floatStride,
+                               job.planes[2] + j*job.floatStride);
+                break;
+            case ToNV12:
+                memcpy(job.dst + j*job.dstStride, y, job.width);
+                if (!(j & 1)) {
+                    job.k.uv(u, v, job.width/2, job.dstUV + (j/2)*job.uvStride);
+                }
+                break;
+            }
+        }
+    }
+
+    class ConvertRows : public ParallelTask {
+    public:
+        ConvertRows(const Job &job_) : job(job_) {}
+        void run(int begin, int end) {
+            convertRows(job, begin, end);
+        }
+    private:
+        const Job &job;
+    };
+
+    // Point the job at the region of the source. Returns false if the
+    // source or the region aren't usable.
+    bool setSource(Job *job, Image src, Rect roi) {
+        if (!src.valid() || src.type() != YUV420p) return false;
+        if (roi.width == 0 && roi.height == 0) {
+            roi = Rect(0, 0, src.width(), src.height());
+        }
+        if (roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0 ||
+            ((roi.x | roi.y | roi.width | roi.height) & 1) ||
+            roi.x + roi.width > (int)src.width() ||
+            roi.y + roi.height > (int)src.height()) {
+            return false;
+        }
+
+        // The chroma planes are packed, at half the width of the
+        // image, after the luma plane
+        const int chromaStride = src.width()/2;
+        const unsigned char *uPlane = src(0, src.height());
+        const unsigned char *vPlane = uPlane + chromaStride*(src.height()/2);
+        const int offset = (roi.y/2)*chromaStride + roi.x/2;
+
+        job->y = src(roi.x, roi.y);
+        job->u = uPlane + offset;
+        job->v = vPlane + offset;
+        job->yStride = src.bytesPerRow();
+        job->chromaStride = chromaStride;
+        job->width = roi.width;
+        job->height = roi.height;
+        job->k = bestKernels();
+        job->dst = NULL;
+        job->dstUV = NULL;
+        job->planes[0] = job->planes[1] = job->planes[2] = NULL;
+        job->alpha = 255;
+        job->dstStride = job->floatStride = job->uvStride = 0;
+        return true;
+    }
+
+    void run(Job *job) {
+        if (job->width*job->height < 2*MIN_PIXELS_PER_THREAD) {
+            convertRows(*job, 0, job->height);
+            return;
+        }
+        ConvertRows task(*job);
+        parallelFor(0, job->height, task, BAND_HEIGHT);
+    }
+}
+
+bool convertYUV420ToRGB24(Image dst, Image im) {
+    return convertYUV420ToRGB24(dst, im, Rect(0, 0, im.width(), im.height()));
+}
+
+bool convertYUV420ToRGB24(Image dst, Image im, Rect roi) {
+    Job job;
+    if (!setSource(&job, im, roi)) return false;
+    // Check src/dst compatibility
+    if (!dst.valid() || dst.type() != RGB24 ||
+        (int)dst.width() != job.width || (int)dst.height() != job.height) {
+        return false;
+    }
+    job.target = ToRGB24;
+    job.dst = dst(0, 0);
+    job.dstStride = dst.bytesPerRow();
+    run(&job);
+    return true;
+}
+
+bool convertYUV420ToRGBA32(unsigned char *dst, int dstBytesPerRow,
+                           Image im, Rect roi, unsigned char alpha) {
+    Job job;
+    if (!dst || !setSource(&job, im, roi)) return false;
+    job.target = ToRGBA32;
+    job.dst = dst;
+    job.dstStride = dstBytesPerRow;
+    job.alpha = alpha;
+    run(&job);
     return true;
-}        
+}
 
+bool convertYUV420ToFloat(float *r, float *g, float *b, int dstStride,
+                          Image im, Rect roi) {
+    Job job;
+    if (!r || !g || !b || !setSource(&job, im, roi)) return false;
+    job.target = ToFloat;
+    job.planes[0] = r;
+    job.planes[1] = g;
+    job.planes[2] = b;
+    job.floatStride = dstStride;
+    run(&job);
+    return true;
+}
+
+bool convertYUV420ToNV12(unsigned char *dstY, int yBytesPerRow,
+                         unsigned char *dstUV, int uvBytesPerRow,
+                         Image im, Rect roi) {
+    Job job;
+    if (!dstY || !dstUV || !setSource(&job, im, roi)) return false;
+    job.target = ToNV12;
+    job.dst = dstY;
+    job.dstStride = yBytesPerRow;
+    job.dstUV = dstUV;
+    job.uvStride = uvBytesPerRow;
+    run(&job);
+    return true;
+}
 
 }}
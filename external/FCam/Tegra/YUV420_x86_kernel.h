@@ -0,0 +1,109 @@
+// The row converters used by YUV420.cpp on x86. This file is
+// included once per instruction set, inside a namespace that provides
+//
+//   rgb16(y, u, v, &r, &g, &b)
+//
+// which converts 16 pixels, given 16 luma and 8 chroma samples, to
+// three vectors of 16 bytes, with exactly the arithmetic of yuvToRGB.
+// Partial vectors at the end of a row are done by yuvToRGB itself.
+
+static void rowRGB24(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                     int width, unsigned char *out) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r, g, b;
+        rgb16(y + x, u + x/2, v + x/2, &r, &g, &b);
+
+        // Interleave into 48 bytes of rgbrgb...
+        __m128i o0 = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+            _mm_shuffle_epi8(g, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+            _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+        __m128i o1 = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+            _mm_shuffle_epi8(g, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+            _mm_shuffle_epi8(b, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+        __m128i o2 = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(r, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+            _mm_shuffle_epi8(g, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+            _mm_shuffle_epi8(b, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+
+        __m128i *dst = (__m128i *)(out + 3*x);
+        _mm_storeu_si128(dst, o0);
+        _mm_storeu_si128(dst + 1, o1);
+        _mm_storeu_si128(dst + 2, o2);
+    }
+    for (; x < width; x++) {
+        unsigned char *p = out + 3*x;
+        yuvToRGB(y[x], u[x/2], v[x/2], p, p+1, p+2);
+    }
+}
+
+static void rowRGBA32(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                      int width, unsigned char *out, unsigned char alpha) {
+    const __m128i a = _mm_set1_epi8((char)alpha);
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r, g, b;
+        rgb16(y + x, u + x/2, v + x/2, &r, &g, &b);
+
+        __m128i rgLo = _mm_unpacklo_epi8(r, g), rgHi = _mm_unpackhi_epi8(r, g);
+        __m128i baLo = _mm_unpacklo_epi8(b, a), baHi = _mm_unpackhi_epi8(b, a);
+
+        __m128i *dst = (__m128i *)(out + 4*x);
+        _mm_storeu_si128(dst,     _mm_unpacklo_epi16(rgLo, baLo));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(rgLo, baLo));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(rgHi, baHi));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(rgHi, baHi));
+    }
+    for (; x < width; x++) {
+        unsigned char *p = out + 4*x;
+        yuvToRGB(y[x], u[x/2], v[x/2], p, p+1, p+2);
+        p[3] = alpha;
+    }
+}
+
+// Widen 16 bytes to floats divided by 255
+static inline void storeFloat16(float *dst, __m128i c) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale = _mm_set1_ps(255.0f);
+    __m128i lo = _mm_unpacklo_epi8(c, zero), hi = _mm_unpackhi_epi8(c, zero);
+    _mm_storeu_ps(dst,      _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), scale));
+    _mm_storeu_ps(dst + 4,  _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), scale));
+    _mm_storeu_ps(dst + 8,  _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), scale));
+    _mm_storeu_ps(dst + 12, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), scale));
+}
+
+static void rowFloat(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+                     int width, float *outR, float *outG, float *outB) {
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m128i r, g, b;
+        rgb16(y + x, u + x/2, v + x/2, &r, &g, &b);
+        storeFloat16(outR + x, r);
+        storeFloat16(outG + x, g);
+        storeFloat16(outB + x, b);
+    }
+    for (; x < width; x++) {
+        unsigned char c[3];
+        yuvToRGB(y[x], u[x/2], v[x/2], c, c+1, c+2);
+        outR[x] = c[0] / 255.0f;
+        outG[x] = c[1] / 255.0f;
+        outB[x] = c[2] / 255.0f;
+    }
+}
+
+static void rowUV(const unsigned char *u, const unsigned char *v, int chromaWidth,
+                  unsigned char *out) {
+    int x = 0;
+    for (; x + 16 <= chromaWidth; x += 16) {
+        __m128i uv = _mm_loadu_si128((const __m128i *)(u + x));
+        __m128i vv = _mm_loadu_si128((const __m128i *)(v + x));
+        _mm_storeu_si128((__m128i *)(out + 2*x), _mm_unpacklo_epi8(uv, vv));
+        _mm_storeu_si128((__m128i *)(out + 2*x + 16), _mm_unpackhi_epi8(uv, vv));
+    }
+    for (; x < chromaWidth; x++) {
+        out[2*x] = u[x];
+        out[2*x+1] = v[x];
+    }
+}
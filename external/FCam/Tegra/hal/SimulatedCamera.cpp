@@ -0,0 +1,637 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "FCam/Event.h"
+#include "FCam/processing/DNG.h"
+#include "FCam/processing/Dump.h"
+#include "FCam/Tegra/hal/SimulatedCamera.h"
+
+#include "../../Debug.h"
+
+namespace FCam { namespace Tegra { namespace Hal {
+
+    namespace {
+        void sleepUntil(Time t) {
+            int delay = t - Time::now();
+            if (delay > 0) usleep(delay);
+        }
+
+        bool endsWith(const std::string &s, const std::string &suffix) {
+            if (s.size() < suffix.size()) return false;
+            std::string tail = s.substr(s.size() - suffix.size());
+            std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+            return tail == suffix;
+        }
+
+        // Fetch a 10-bit sensor value from a replayed image of any
+        // of the formats we can load.
+        inline unsigned short sampleSource(const Image &src, unsigned int x, unsigned int y) {
+            if (src.type() == FCam::RAW) {
+                return *(unsigned short *)src(x, y);
+            } else {
+                // The first byte is luma for YUV420p and an 8-bit
+                // channel for the interleaved formats.
+                return (unsigned short)(*src(x, y)) << 2;
+            }
+        }
+    }
+
+    void *simulated_camera_thread_(void *arg) {
+        SimulatedCamera *c = (SimulatedCamera *)arg;
+        c->run();
+        pthread_exit(NULL);
+        return NULL;
+    }
+
+    SimulatedCamera::Config::Config() :
+        frameTime(33333),
+        pipelineDepth(2),
+        processingLatency(10000),
+        realTime(true) {
+    }
+
+    SimulatedCamera::Stats::Stats() :
+        capturesRequested(0),
+        framesDelivered(0),
+        capturesRejected(0),
+        framesMissed(0),
+        latencyNext(0),
+        latencyTotal(0),
+        latencyMax(0) {
+    }
+
+    void SimulatedCamera::Stats::addLatency(int us) {
+        if (latency.size() < LatencySamples) {
+            latency.push_back(us);
+        } else {
+            latency[latencyNext] = us;
+        }
+        latencyNext = (latencyNext + 1) % LatencySamples;
+        latencyTotal += us;
+        if (us > latencyMax) latencyMax = us;
+    }
+
+    float SimulatedCamera::Stats::fps() const {
+        int elapsed = lastFrame - firstFrame;
+        if (framesDelivered < 2 || elapsed <= 0) return 0;
+        return (framesDelivered - 1) * 1000000.0f / elapsed;
+    }
+
+    float SimulatedCamera::Stats::meanLatency() const {
+        if (!framesDelivered) return 0;
+        return (float)latencyTotal / framesDelivered;
+    }
+
+    int SimulatedCamera::Stats::latencyPercentile(float p) const {
+        if (latency.empty()) return 0;
+        std::vector<int> sorted(latency);
+        std::sort(sorted.begin(), sorted.end());
+        if (p < 0) p = 0;
+        if (p > 100) p = 100;
+        size_t idx = (size_t)(p / 100.0f * (sorted.size() - 1) + 0.5f);
+        return sorted[idx];
+    }
+
+    SimulatedCamera::SimulatedCamera(ICameraObserver *pObserver, unsigned int id, const Config &cfg) :
+        ICamera(pObserver, id),
+        observer(pObserver),
+        config(cfg),
+        running(false),
+        stop(false),
+        busy(false),
+        freeSlots(0),
+        captureIndex(0),
+        exposure(33000),
+        frameTime(0),
+        iso(100),
+        wb(5000),
+        focusFrom(0),
+        focusTo(0) {
+
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+
+        if (config.pipelineDepth < 1) config.pipelineDepth = 1;
+
+        // Sensor modes, sorted by resolution
+        static const int modeSizes[][2] = {
+            {640, 480}, {1280, 720}, {1920, 1080}, {2592, 1944}
+        };
+        sensorConfig.numberOfModes = sizeof(modeSizes)/sizeof(modeSizes[0]);
+        for (int i = 0; i < sensorConfig.numberOfModes; i++) {
+            sensorConfig.modes[i].width         = modeSizes[i][0];
+            sensorConfig.modes[i].height        = modeSizes[i][1];
+            sensorConfig.modes[i].fMinExposure  = 0.0001f;
+            sensorConfig.modes[i].fMaxExposure  = 1.0f;
+            sensorConfig.modes[i].fMinFrameRate = 1.0f;
+            sensorConfig.modes[i].fMaxFrameRate = 1000000.0f / config.frameTime;
+        }
+        sensorConfig.fMinGain = 1.0f;
+        sensorConfig.fMaxGain = 16.0f;
+        sensorConfig.lensConfigIndex = 0;
+        sensorConfig.exposureLatency = 1;
+        sensorConfig.gainLatency = 1;
+        sensorConfig.psCameraName = (char *)"Simulated sensor";
+        sensorConfig.cameraDirection = 180;
+
+        lensConfig.psFocuserName         = (char *)"Simulated focuser";
+        lensConfig.psLensName            = (char *)"Simulated lens";
+        lensConfig.iFocusMinPosition     = 0;
+        lensConfig.iFocusMaxPosition     = 1000;
+        lensConfig.fFarFocusDiopter      = 0.0f;
+        lensConfig.fNearFocusDiopter     = 10.0f;
+        lensConfig.fFocusDioptersPerTick = 0.01f;
+        lensConfig.fMinFocusSpeed        = 0.0f;
+        lensConfig.fMaxFocusSpeed        = 4000.0f;
+        lensConfig.iFocusLatency         = 5000;
+        lensConfig.iFocusSettleTime      = 2000;
+        lensConfig.fMinZoomFocalLength   = 3.6f;
+        lensConfig.fMaxZoomFocalLength   = 3.6f;
+        lensConfig.fMinZoomSpeed         = 0.0f;
+        lensConfig.fMaxZoomSpeed         = 0.0f;
+        lensConfig.iZoomLatency          = 0;
+        lensConfig.fNarrowAperture       = 2.8f;
+        lensConfig.fWideAperture         = 2.8f;
+        lensConfig.fMinApertureSpeed     = 0.0f;
+        lensConfig.fMaxApertureSpeed     = 0.0f;
+        lensConfig.iApertureLatency      = 0;
+
+        // Load all the frames to replay up front, so file I/O does
+        // not show up in the measured frame rate.
+        for (size_t i = 0; i < config.sources.size(); i++) {
+            const std::string &name = config.sources[i];
+            Image im;
+            if (endsWith(name, ".dng")) {
+                DNGFrame f = loadDNG(name, DNGRead);
+                if (f.valid()) im = f.image();
+            } else {
+                im = loadDump(name);
+            }
+            if (!im.valid()) {
+                warning(Event::FileLoadError, "SimulatedCamera: Unable to load %s, skipping it", name.c_str());
+                continue;
+            }
+            sources.push_back(im);
+        }
+
+        frame.pBuffer    = NULL;
+        frame.bufferSize = 0;
+        frame.width      = 0;
+        frame.height     = 0;
+        frame.format     = UNKNOWN;
+    }
+
+    SimulatedCamera::~SimulatedCamera() {
+        close();
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    bool SimulatedCamera::open() {
+        pthread_mutex_lock(&mutex);
+        if (running) {
+            pthread_mutex_unlock(&mutex);
+            return true;
+        }
+        stop = false;
+        freeSlots = config.pipelineDepth;
+        if ((errno = pthread_create(&thread, NULL, simulated_camera_thread_, this))) {
+            pthread_mutex_unlock(&mutex);
+            error(Event::InternalError, "SimulatedCamera: Unable to create sensor thread: %s", strerror(errno));
+            return false;
+        }
+        running = true;
+        pthread_mutex_unlock(&mutex);
+
+        // The sensor queue is empty, ask for enough captures to fill it.
+        for (int i = 0; i < config.pipelineDepth; i++) {
+            observer->readyToCapture();
+        }
+        return true;
+    }
+
+    bool SimulatedCamera::close() {
+        pthread_mutex_lock(&mutex);
+        if (!running) {
+            pthread_mutex_unlock(&mutex);
+            return true;
+        }
+        stop = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+
+        pthread_join(thread, NULL);
+
+        pthread_mutex_lock(&mutex);
+        running = false;
+        requests.clear();
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    const SensorConfig& SimulatedCamera::getSensorConfig() {
+        return sensorConfig;
+    }
+
+    const LensConfig& SimulatedCamera::getLensConfig() {
+        return lensConfig;
+    }
+
+    int SimulatedCamera::focuserPosition(Time t) {
+        if (t < focusStart) return focusFrom;
+        if (lensConfig.fMaxFocusSpeed <= 0) return focusTo;
+        int moved = (int)((t - focusStart) * (lensConfig.fMaxFocusSpeed / 1000000.0f));
+        int distance = abs(focusTo - focusFrom);
+        if (moved >= distance) return focusTo;
+        return focusTo > focusFrom ? focusFrom + moved : focusFrom - moved;
+    }
+
+    bool SimulatedCamera::setFocuserPosition(int pos) {
+        if (pos < lensConfig.iFocusMinPosition) pos = lensConfig.iFocusMinPosition;
+        if (pos > lensConfig.iFocusMaxPosition) pos = lensConfig.iFocusMaxPosition;
+
+        pthread_mutex_lock(&mutex);
+        Time now = Time::now();
+        focusFrom = focuserPosition(now);
+        focusTo = pos;
+        focusStart = now + lensConfig.iFocusLatency;
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::getFocuserPosition(int *pos) {
+        pthread_mutex_lock(&mutex);
+        *pos = focuserPosition(Time::now());
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::setSensorFrameTime(int ft) {
+        pthread_mutex_lock(&mutex);
+        frameTime = ft;
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::getSensorFrameTime(int *ft) {
+        pthread_mutex_lock(&mutex);
+        *ft = frameTime;
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::setSensorExposure(int e) {
+        pthread_mutex_lock(&mutex);
+        // Like the real sensor, the new exposure only shows up
+        // exposureLatency captures from now.
+        PendingSetting s;
+        s.index = captureIndex + sensorConfig.exposureLatency;
+        s.value = e;
+        pendingExposure.push_back(s);
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::getSensorExposure(int *e) {
+        pthread_mutex_lock(&mutex);
+        *e = pendingExposure.empty() ? exposure : pendingExposure.back().value;
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::setSensorEffectiveISO(int i) {
+        pthread_mutex_lock(&mutex);
+        PendingSetting s;
+        s.index = captureIndex + sensorConfig.gainLatency;
+        s.value = i;
+        pendingISO.push_back(s);
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::getSensorEffectiveISO(int *i) {
+        pthread_mutex_lock(&mutex);
+        *i = pendingISO.empty() ? iso : pendingISO.back().value;
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::setISPWhiteBalance(int whiteBalance) {
+        pthread_mutex_lock(&mutex);
+        wb = whiteBalance;
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::getISPStatistics(Statistics *s) {
+        // The simulated ISP does not compute statistics
+        memset(s, 0, sizeof(Statistics));
+        return false;
+    }
+
+    bool SimulatedCamera::setCaptureMode(CameraMode m) {
+        if (m.width <= 0 || m.height <= 0 || m.type == UNKNOWN) return false;
+
+        pthread_mutex_lock(&mutex);
+        // Flush the pipeline: let the captures already queued
+        // complete in the old mode, as the hardware does.
+        while (running && (busy || !requests.empty())) {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        mode = m;
+        output = Image(m.width, m.height, m.type == RAW ? FCam::RAW : FCam::YUV420p);
+        frame.pBuffer    = output(0, 0);
+        frame.bufferSize = output.bytesPerRow() * output.allocateHeight();
+        frame.width      = m.width;
+        frame.height     = m.height;
+        frame.format     = m.type;
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    float SimulatedCamera::setFlashForStillCapture(float brightness, int duration) {
+        return brightness;
+    }
+
+    float SimulatedCamera::setFlashTorchMode(float brightness) {
+        return brightness;
+    }
+
+    void SimulatedCamera::applyPending(std::deque<PendingSetting> &q, int *value) {
+        while (!q.empty() && q.front().index <= captureIndex) {
+            *value = q.front().value;
+            q.pop_front();
+        }
+    }
+
+    bool SimulatedCamera::capture() {
+        pthread_mutex_lock(&mutex);
+        if (!running || freeSlots <= 0) {
+            stats.capturesRejected++;
+            pthread_mutex_unlock(&mutex);
+            return false;
+        }
+
+        applyPending(pendingExposure, &exposure);
+        applyPending(pendingISO, &iso);
+
+        Request r;
+        r.issued    = Time::now();
+        r.exposure  = exposure;
+        r.frameTime = frameTime;
+        r.iso       = iso;
+        r.wb        = wb;
+        requests.push_back(r);
+
+        captureIndex++;
+        freeSlots--;
+        stats.capturesRequested++;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+        return true;
+    }
+
+    bool SimulatedCamera::burstCapture(int numFrames) {
+        for (int i = 0; i < numFrames; i++) {
+            if (!capture()) return false;
+        }
+        return true;
+    }
+
+    bool SimulatedCamera::startStreaming() {
+        return true;
+    }
+
+    bool SimulatedCamera::stopStreaming() {
+        return true;
+    }
+
+    float SimulatedCamera::fps() {
+        pthread_mutex_lock(&mutex);
+        float f = stats.fps();
+        pthread_mutex_unlock(&mutex);
+        return f;
+    }
+
+    SimulatedCamera::Stats SimulatedCamera::statistics() {
+        pthread_mutex_lock(&mutex);
+        Stats s = stats;
+        pthread_mutex_unlock(&mutex);
+        return s;
+    }
+
+    void SimulatedCamera::resetStatistics() {
+        pthread_mutex_lock(&mutex);
+        stats = Stats();
+        pthread_mutex_unlock(&mutex);
+    }
+
+    void SimulatedCamera::render(const Request &r, unsigned int frameIndex) {
+        if (!output.valid()) return;
+
+        const unsigned int w = output.width();
+        const unsigned int h = output.height();
+        const bool raw = output.type() == FCam::RAW;
+
+        if (sources.empty()) {
+            // Synthetic pattern: a diagonal ramp that scrolls by a few
+            // pixels every frame, with brightness following the
+            // exposure and gain so metering loops converge.
+            float brightness = (r.exposure * (r.iso / 100.0f)) / 33000.0f;
+            if (brightness > 4.0f) brightness = 4.0f;
+            int scale = (int)(brightness * 256);
+            for (unsigned int y = 0; y < h; y++) {
+                if (raw) {
+                    unsigned short *row = (unsigned short *)output(0, y);
+                    for (unsigned int x = 0; x < w; x++) {
+                        int v = ((((x + y + frameIndex * 4) & 255) << 2) * scale) >> 8;
+                        row[x] = v > 1023 ? 1023 : v;
+                    }
+                } else {
+                    unsigned char *row = output(0, y);
+                    for (unsigned int x = 0; x < w; x++) {
+                        int v = (((x + y + frameIndex * 4) & 255) * scale) >> 8;
+                        row[x] = v > 255 ? 255 : v;
+                    }
+                }
+            }
+        } else {
+            // Replay, resampling the source to the current mode with
+            // nearest neighbour if the sizes differ.
+            const Image &src = sources[frameIndex % sources.size()];
+            std::vector<unsigned int> xmap(w);
+            for (unsigned int x = 0; x < w; x++) {
+                unsigned int sx = (unsigned int)(((unsigned long long)x * src.width()) / w);
+                // Keep the bayer phase of raw sources
+                if (src.type() == FCam::RAW) sx = (sx & ~1u) | (x & 1u);
+                xmap[x] = sx < src.width() ? sx : src.width() - 1;
+            }
+            for (unsigned int y = 0; y < h; y++) {
+                unsigned int sy = (unsigned int)(((unsigned long long)y * src.height()) / h);
+                if (src.type() == FCam::RAW) sy = (sy & ~1u) | (y & 1u);
+                if (sy >= src.height()) sy = src.height() - 1;
+                if (raw) {
+                    unsigned short *row = (unsigned short *)output(0, y);
+                    for (unsigned int x = 0; x < w; x++) {
+                        row[x] = sampleSource(src, xmap[x], sy);
+                    }
+                } else {
+                    unsigned char *row = output(0, y);
+                    for (unsigned int x = 0; x < w; x++) {
+                        row[x] = sampleSource(src, xmap[x], sy) >> 2;
+                    }
+                }
+            }
+        }
+
+        if (!raw) {
+            // Neutral chroma planes
+            memset(output(0, h), 128, (w / 2) * (h / 2) * 2);
+        }
+    }
+
+    void SimulatedCamera::run() {
+        dprintf(2, "Simulated sensor running...\n");
+
+        unsigned int frameIndex = 0;
+        Time nextFrame;
+        CameraMode lastMode;
+
+        pthread_mutex_lock(&mutex);
+        while (!stop) {
+            if (requests.empty()) {
+                pthread_cond_wait(&cond, &mutex);
+                continue;
+            }
+
+            Request r = requests.front();
+            requests.pop_front();
+            busy = true;
+
+            // A mode switch restarts the sensor timing
+            bool resync = mode.width != lastMode.width ||
+                mode.height != lastMode.height ||
+                mode.type != lastMode.type;
+            lastMode = mode;
+            pthread_mutex_unlock(&mutex);
+
+            int ft = std::max(std::max(r.frameTime, r.exposure), config.frameTime);
+
+            // The sensor runs freely: a frame starts on every frame
+            // time boundary whether or not a capture was queued for
+            // it. Count the boundaries we slept through.
+            unsigned int missed = 0;
+            Time start;
+            if (!config.realTime) {
+                start = Time::now();
+            } else if (resync || frameIndex == 0) {
+                start = r.issued;
+            } else {
+                start = nextFrame;
+                while (start < r.issued) {
+                    start += ft;
+                    missed++;
+                }
+                sleepUntil(start);
+            }
+            nextFrame = start + ft;
+
+            render(r, frameIndex++);
+
+            Time captureDone = start + ft;
+            Time processingDone = captureDone + config.processingLatency;
+            if (config.realTime) {
+                sleepUntil(processingDone);
+            } else {
+                captureDone = processingDone = Time::now();
+            }
+
+            frame.params.captureDoneTime    = captureDone;
+            frame.params.fillBufferDoneTime = processingDone;
+            frame.params.processingDoneTime = processingDone;
+            frame.params.iso       = r.iso;
+            frame.params.exposure  = r.exposure;
+            frame.params.wb        = r.wb;
+            frame.params.frameTime = ft;
+            pthread_mutex_lock(&mutex);
+            frame.params.focusPos  = focuserPosition(start + r.exposure / 2);
+            pthread_mutex_unlock(&mutex);
+
+            observer->onFrame(&frame);
+            Time delivered = Time::now();
+
+            pthread_mutex_lock(&mutex);
+            if (!stats.framesDelivered) stats.firstFrame = delivered;
+            stats.lastFrame = delivered;
+            stats.framesDelivered++;
+            stats.framesMissed += missed;
+            stats.addLatency(delivered - r.issued);
+            busy = false;
+            freeSlots++;
+            pthread_cond_broadcast(&cond);
+            pthread_mutex_unlock(&mutex);
+
+            // A slot on the sensor queue just freed up
+            observer->readyToCapture();
+
+            pthread_mutex_lock(&mutex);
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    SimulatedCamera::Config SimulatedProduct::cameraConfig;
+
+    void SimulatedProduct::setCameraConfig(const SimulatedCamera::Config &cfg) {
+        cameraConfig = cfg;
+    }
+
+    ICamera* SimulatedProduct::getCameraHal(ICameraObserver *pObserver, unsigned int cameraNum) {
+        return new SimulatedCamera(pObserver, cameraNum, cameraConfig);
+    }
+
+    void SimulatedProduct::releaseCameraHal(ICamera* cameraHal) {
+        delete cameraHal;
+    }
+
+#ifdef FCAM_TEGRA_SIMULATED_HAL
+    // Stand in for the prebuilt hal library.
+
+    SensorConfig::SensorConfig() :
+        numberOfModes(0),
+        fMinGain(1.0f),
+        fMaxGain(1.0f),
+        lensConfigIndex(0),
+        exposureLatency(0),
+        gainLatency(0),
+        psCameraName(NULL),
+        cameraDirection(0) {
+        memset(modes, 0, sizeof(modes));
+    }
+
+    LensConfig::LensConfig() {
+        memset(this, 0, sizeof(LensConfig));
+    }
+
+    ICamera::~ICamera() {}
+
+    IProduct *System::pProduct = NULL;
+    int System::numProductRefs = 0;
+
+    IProduct* System::openProduct() {
+        if (!pProduct) pProduct = new SimulatedProduct;
+        numProductRefs++;
+        return pProduct;
+    }
+
+    void System::closeProduct(IProduct *product) {
+        if (product != pProduct || numProductRefs <= 0) return;
+        if (--numProductRefs == 0) {
+            delete pProduct;
+            pProduct = NULL;
+        }
+    }
+#endif
+
+}}}
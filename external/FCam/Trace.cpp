@@ -0,0 +1,281 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#include "FCam/Trace.h"
+#include "FCam/Event.h"
+#include "Debug.h"
+
+namespace FCam {
+
+    volatile bool Trace::on = false;
+
+    namespace {
+
+        // A single-writer ring of records. Only the owning thread
+        // writes slots and advances head; readers copy the slots and
+        // then recheck head to discard any that were overwritten
+        // while they copied.
+        struct Ring {
+            Ring() : head(0), floor(0) {}
+            Trace::Record slots[Trace::RingSize];
+            volatile unsigned head;
+            // Records before this index have been cleared
+            volatile unsigned floor;
+        };
+
+        pthread_once_t ringsOnce = PTHREAD_ONCE_INIT;
+        pthread_key_t ringKey;
+        pthread_mutex_t ringsMutex = PTHREAD_MUTEX_INITIALIZER;
+        // Every ring ever handed out, and the ones whose threads
+        // have exited and can be given to new threads
+        std::vector<Ring *> *rings;
+        std::vector<Ring *> *spareRings;
+
+        void releaseRing(void *r) {
+            // Keep the records around for the next dump, but let the
+            // next new thread take over the ring.
+            pthread_mutex_lock(&ringsMutex);
+            spareRings->push_back((Ring *)r);
+            pthread_mutex_unlock(&ringsMutex);
+        }
+
+        void initRings() {
+            rings = new std::vector<Ring *>;
+            spareRings = new std::vector<Ring *>;
+            pthread_key_create(&ringKey, releaseRing);
+        }
+
+        Ring *threadRing() {
+            pthread_once(&ringsOnce, initRings);
+            Ring *r = (Ring *)pthread_getspecific(ringKey);
+            if (r) return r;
+
+            // First record from this thread
+            pthread_mutex_lock(&ringsMutex);
+            if (spareRings->size()) {
+                r = spareRings->back();
+                spareRings->pop_back();
+            } else {
+                r = new Ring;
+                rings->push_back(r);
+            }
+            pthread_mutex_unlock(&ringsMutex);
+            pthread_setspecific(ringKey, r);
+            return r;
+        }
+
+        std::vector<Ring *> allRings() {
+            pthread_once(&ringsOnce, initRings);
+            pthread_mutex_lock(&ringsMutex);
+            std::vector<Ring *> r = *rings;
+            pthread_mutex_unlock(&ringsMutex);
+            return r;
+        }
+
+        Time firstMark(const Trace::Marks &m) {
+            Time t;
+            for (int i = 0; i < Trace::NumStages; i++) {
+                if (m.at[i] == Time()) continue;
+                if (t == Time() || m.at[i] < t) t = m.at[i];
+            }
+            return t;
+        }
+
+        bool earlier(const Trace::Record &a, const Trace::Record &b) {
+            return firstMark(a.marks) < firstMark(b.marks);
+        }
+    }
+
+    const char *Trace::stageName(int stage) {
+        switch (stage) {
+        case Enqueued:       return "enqueued";
+        case Issued:         return "issued";
+        case ExposureStart:  return "exposure start";
+        case ExposureEnd:    return "exposure end";
+        case ProcessingDone: return "processing done";
+        case Dequeued:       return "dequeued";
+        case Delivered:      return "delivered";
+        default:             return "unknown";
+        }
+    }
+
+    int Trace::Marks::latency(Stage from, Stage to) const {
+        if (at[from] == Time() || at[to] == Time()) return -1;
+        return at[to] - at[from];
+    }
+
+    void Trace::setEnabled(bool e) {
+        on = e;
+    }
+
+    void Trace::record(int shotId, const Marks &m) {
+        Ring *r = threadRing();
+        unsigned h = r->head;
+        Record &slot = r->slots[h % RingSize];
+        slot.shotId = shotId;
+        slot.marks = m;
+        // Publish the slot before the new head
+        __sync_synchronize();
+        r->head = h+1;
+    }
+
+    std::vector<Trace::Record> Trace::records() {
+        std::vector<Record> result;
+        std::vector<Ring *> rs = allRings();
+        for (size_t i = 0; i < rs.size(); i++) {
+            Ring *r = rs[i];
+            unsigned h = r->head;
+            __sync_synchronize();
+            unsigned first = h > RingSize ? h - RingSize : 0;
+            if (first < r->floor) first = r->floor;
+            size_t start = result.size();
+            for (unsigned j = first; j < h; j++) {
+                result.push_back(r->slots[j % RingSize]);
+            }
+            // Drop anything the writer lapped while we were copying. The
+            // writer fills slot h2 before it publishes h2+1, so the
+            // record that slot held may already be half overwritten.
+            __sync_synchronize();
+            unsigned h2 = r->head;
+            if (h2 + 1 > RingSize && h2 + 1 - RingSize > first) {
+                unsigned lost = std::min(h2 + 1 - RingSize - first, h - first);
+                result.erase(result.begin() + start, result.begin() + start + lost);
+            }
+        }
+        std::stable_sort(result.begin(), result.end(), earlier);
+        return result;
+    }
+
+    void Trace::clear() {
+        std::vector<Ring *> rs = allRings();
+        for (size_t i = 0; i < rs.size(); i++) {
+            rs[i]->floor = rs[i]->head;
+        }
+    }
+
+    bool Trace::writeChromeTrace(const std::string &filename) {
+        std::vector<Record> recs = records();
+
+        FILE *fp = fopen(filename.c_str(), "w");
+        if (!fp) {
+            error(Event::FileSaveError,
+                  "Trace::writeChromeTrace: Unable to open %s for writing: %s",
+                  filename.c_str(), strerror(errno));
+            return false;
+        }
+
+        // Chrome wants microsecond timestamps; make them relative to
+        // the first frame so they fit comfortably in a double.
+        Time origin;
+        if (recs.size()) origin = firstMark(recs[0].marks);
+
+        fprintf(fp, "{\"traceEvents\":[\n");
+        fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,"
+                "\"args\":{\"name\":\"FCam pipeline\"}}");
+        for (size_t i = 0; i < recs.size(); i++) {
+            const Marks &m = recs[i].marks;
+
+            // Collect the stages this frame passed, in time order. The
+            // exposure start is inferred from the exposure end, so it
+            // doesn't always follow the issue mark.
+            int stages[NumStages];
+            int n = 0;
+            for (int s = 0; s < NumStages; s++) {
+                if (m.at[s] == Time()) continue;
+                int k = n++;
+                while (k > 0 && m.at[s] < m.at[stages[k-1]]) {
+                    stages[k] = stages[k-1];
+                    k--;
+                }
+                stages[k] = s;
+            }
+            if (n < 2) continue;
+
+            // The whole frame, then one slice per stage ending at
+            // the next stage
+            fprintf(fp, ",\n{\"name\":\"shot %d\",\"cat\":\"frame\",\"ph\":\"b\","
+                    "\"id\":%u,\"pid\":0,\"tid\":0,\"ts\":%d}",
+                    recs[i].shotId, (unsigned)i, m.at[stages[0]] - origin);
+            for (int k = 0; k+1 < n; k++) {
+                fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"b\","
+                        "\"id\":%u,\"pid\":0,\"tid\":0,\"ts\":%d}",
+                        stageName(stages[k]), (unsigned)i, m.at[stages[k]] - origin);
+                fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"e\","
+                        "\"id\":%u,\"pid\":0,\"tid\":0,\"ts\":%d}",
+                        stageName(stages[k]), (unsigned)i, m.at[stages[k+1]] - origin);
+            }
+            fprintf(fp, ",\n{\"name\":\"shot %d\",\"cat\":\"frame\",\"ph\":\"e\","
+                    "\"id\":%u,\"pid\":0,\"tid\":0,\"ts\":%d}",
+                    recs[i].shotId, (unsigned)i, m.at[stages[n-1]] - origin);
+        }
+        fprintf(fp, "\n]}\n");
+
+        if (fclose(fp) != 0) {
+            error(Event::FileSaveError,
+                  "Trace::writeChromeTrace: Error writing %s: %s",
+                  filename.c_str(), strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    Trace::LatencyHistogram Trace::histogram(Stage from, Stage to, int bucketWidth, int buckets) {
+        LatencyHistogram h;
+        if (bucketWidth < 1) bucketWidth = 1;
+        if (buckets < 1) buckets = 1;
+        h.bucketWidth = bucketWidth;
+        h.counts.resize(buckets, 0);
+
+        std::vector<Record> recs = records();
+        double sum = 0;
+        for (size_t i = 0; i < recs.size(); i++) {
+            int l = recs[i].marks.latency(from, to);
+            if (l < 0) continue;
+            if (h.samples == 0 || l < h.min) h.min = l;
+            if (h.samples == 0 || l > h.max) h.max = l;
+            h.samples++;
+            sum += l;
+            int b = l / bucketWidth;
+            if (b < buckets) h.counts[b]++;
+            else h.overflow++;
+        }
+        if (h.samples) h.mean = (float)(sum / h.samples);
+        return h;
+    }
+
+    int Trace::LatencyHistogram::percentile(float p) const {
+        if (samples == 0) return 0;
+        unsigned target = (unsigned)(p / 100.0f * samples);
+        if (target >= samples) target = samples - 1;
+        unsigned seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen > target) return (int)((i+1) * bucketWidth);
+        }
+        return max;
+    }
+
+    std::string Trace::LatencyHistogram::toString() const {
+        std::string s;
+        char line[128];
+        snprintf(line, sizeof(line), "%u frames, min %d us, mean %.0f us, max %d us\n",
+                 samples, min, mean, max);
+        s += line;
+        for (size_t i = 0; i < counts.size(); i++) {
+            if (!counts[i]) continue;
+            snprintf(line, sizeof(line), "%8d - %8d us: %u\n",
+                     (int)(i * bucketWidth), (int)((i+1) * bucketWidth), counts[i]);
+            s += line;
+        }
+        if (overflow) {
+            snprintf(line, sizeof(line), "%8d us and up : %u\n",
+                     (int)(counts.size() * bucketWidth), overflow);
+            s += line;
+        }
+        return s;
+    }
+
+}
@@ -70,8 +70,10 @@ namespace FCam {
     }
     
     const char tiffEPVersion[4] = {1,0,0,0};
-    const char understoodDNGVersion[4] = {1,3,0,0};
+    const char understoodDNGVersion[4] = {1,4,0,0};
     const char oldestSupportedDNGVersion[4] = {1,2,0,0};
+    // Deflate with the X2 predictor needs a DNG 1.4 reader
+    const char deflateDNGVersion[4] = {1,4,0,0};
     const char privateDataPreamble[] = "stanford.fcam.privatedata";
     const int privateDataVersion = 2;
     const int backwardPrivateDataVersion = 2;
@@ -119,13 +121,13 @@ namespace FCam {
         
     }
 
-    void saveDNGPrivateData_v2(const Frame &frame, std::stringstream &privateData, 
+    void saveDNGPrivateData_v2(const Frame &frame, std::string &privateData, 
                                const std::vector<float> &rawToRGB3000, const std::vector<float> &rawToRGB6500);
-    void saveDNGPrivateData_v2(const Frame &frame, std::stringstream &privateData, 
+    void saveDNGPrivateData_v2(const Frame &frame, std::string &privateData, 
                                const std::vector<float> &rawToRGB3000, const std::vector<float> &rawToRGB6500) {
 
         // First write backward-compatibility field
-        privateData << TagValue(backwardPrivateDataVersion).toBlob();
+        TagValue(backwardPrivateDataVersion).appendBlob(&privateData);
         
         // Now write everything using a TagMap
         TagMap frameFields;
@@ -152,18 +154,12 @@ namespace FCam {
         frameFields["frame.illuminant2"] = 6500;        
         frameFields["frame.colorMatrix2"] = rawToRGB6500;
                 
-        // Write frame fields
-        for (TagMap::const_iterator it = frameFields.begin(); it != frameFields.end(); it++) {
-            privateData << TagValue(it->first).toBlob() << it->second.toBlob();
-        }
-
-        // Write tags
-        for (TagMap::const_iterator it = frame.tags().begin(); it != frame.tags().end(); it++) {
-            privateData << TagValue(it->first).toBlob() << it->second.toBlob();
-        }
+        // Write frame fields, then tags. They're read back as one map.
+        appendTagMapBlob(frameFields, &privateData);
+        appendTagMapBlob(frame.tags(), &privateData);
     }
 
-    void saveDNG(Frame frame, const std::string &filename) {
+    void saveDNG(Frame frame, const std::string &filename, DNGCompression compression) {
         dprintf(DBG_MINOR, "saveDNG: Starting to write %s\n", filename.c_str());
 
         // Initial error checking
@@ -258,7 +254,7 @@ namespace FCam {
         std::string dngVersion(understoodDNGVersion,4);
         ifd0->add(DNG_TAG_DNGVersion, dngVersion);
         
-        std::string dngBackVersion(oldestSupportedDNGVersion,4);
+        std::string dngBackVersion(compression == DNGDeflate ? deflateDNGVersion : oldestSupportedDNGVersion, 4);
         ifd0->add(DNG_TAG_DNGBackwardVersion, dngBackVersion);
 
         ifd0->add(TIFF_TAG_Make, frame.platform().manufacturer());
@@ -337,20 +333,22 @@ namespace FCam {
 
         // Create our very own DNG private data!
         {
-            std::stringstream privateData;
             // must start with manufacturer and identification string, terminated by null character. No whitespace!
-            privateData << privateDataPreamble << std::ends;
+            std::string privateData(privateDataPreamble, sizeof(privateDataPreamble));
             // never remove this
-            privateData << TagValue(privateDataVersion).toBlob();
+            TagValue(privateDataVersion).appendBlob(&privateData);
             switch (privateDataVersion) {
-            case 1:
-                saveDNGPrivateData_v1(frame, privateData, rawToRGB3000, rawToRGB6500);
+            case 1: {
+                std::stringstream privateDataV1;
+                saveDNGPrivateData_v1(frame, privateDataV1, rawToRGB3000, rawToRGB6500);
+                privateData += privateDataV1.str();
                 break;
+            }
             case 2:
                 saveDNGPrivateData_v2(frame, privateData, rawToRGB3000, rawToRGB6500);
                 break;
             }
-            ifd0->add(DNG_TAG_DNGPrivateData, privateData.str());
+            ifd0->add(DNG_TAG_DNGPrivateData, privateData);
         }
         // Add thumbnail into thumbnail IFD
 
@@ -426,7 +424,17 @@ namespace FCam {
         rawIfd->add(DNG_TAG_DefaultCropSize, cropSize);
 
         dprintf(4, "saveDNG: Adding RAW image\n");
-        rawIfd->setImage(frame.image());
+        switch (compression) {
+        case DNGLosslessJPEG:
+            rawIfd->setImage(frame.image(), TIFF_Compression_JPEG);
+            break;
+        case DNGDeflate:
+            rawIfd->setImage(frame.image(), TIFF_Compression_Deflate);
+            break;
+        default:
+            rawIfd->setImage(frame.image());
+            break;
+        }
 
         dprintf(4, "saveDNG: Beginning write to disk\n");
         // Constructed all DNG fields, write it to disk
@@ -487,18 +495,16 @@ namespace FCam {
         TagValue key;
         while ((privateData >> key).good()) {
             privateData >> val;
-            _f->tags[key] = val;
+            _f->tags[key.asString()] = val;
         }
     }
 
-    void loadDNGPrivateData_v2(_DNGFrame *_f, std::stringstream &privateData);
-    void loadDNGPrivateData_v2(_DNGFrame *_f, std::stringstream &privateData) {
+    void loadDNGPrivateData_v2(_DNGFrame *_f, const char *privateData, size_t size);
+    void loadDNGPrivateData_v2(_DNGFrame *_f, const char *privateData, size_t size) {
 
         // Read everything into the frame tags
-        TagValue key, val;
-        while ((privateData >> key).good()) {
-            privateData >> val;
-            _f->tags[key] = val;
+        if (!readTagMapBlob(privateData, size, &_f->tags)) {
+            warning(Event::FileLoadError, "loadDNG: Private data is corrupt, some frame fields and tags are missing.");
         }
 
         // And then look for special frame fields and parse them out
@@ -561,7 +567,7 @@ namespace FCam {
     }
 
 
-    DNGFrame loadDNG(const std::string &filename) {
+    DNGFrame loadDNG(const std::string &filename, DNGLoadMode mode) {
         // Construct DNG Frame
         _DNGFrame *_f = new _DNGFrame;
         DNGFrame f(_f);
@@ -650,8 +656,20 @@ namespace FCam {
         }
 
         //
-        // Read in RAW image data 
-        _f->image = rawIfd->getImage();
+        // Read in RAW image data. Mapping it only sets up the
+        // mapping, so nothing is read from disk until the pixels are
+        // accessed.
+        switch (mode) {
+        case DNGMapped:
+            _f->image = rawIfd->getImage(true);
+            break;
+        case DNGRead:
+            _f->image = rawIfd->getImage(false);
+            break;
+        case DNGMetadataOnly:
+            dprintf(4, "loadDNG: %s: Skipping RAW data\n", filename.c_str());
+            break;
+        }
         
         //
         // Ok, now to parse the RAW metadata
@@ -797,7 +815,7 @@ namespace FCam {
         }
 
         if (thumbIfd) {
-            _f->thumbnail = thumbIfd->getImage();
+            _f->thumbnail = thumbIfd->getImage(mode != DNGRead);
         }
 
         //
@@ -918,21 +936,30 @@ namespace FCam {
             int preambleEnd = privateString.find((char)0);
             std::string preamble = privateString.substr(0,preambleEnd);
             if (preamble == privateDataPreamble) {
-                // Extract the private data, starting with version
-                std::stringstream privateData(privateString.substr(preambleEnd+1));
+                // Extract the private data, starting with version.
+                // Version 1 stores tags in the text format, so it's
+                // parsed as a stream. Later versions are all binary
+                // and decoded straight out of the tag's buffer.
+                const char *privateData = privateString.data() + preambleEnd + 1;
+                size_t privateSize = privateString.size() - (preambleEnd + 1);
                 TagValue version;
-                privateData >> version;
+                size_t used = TagValue::fromBlob(privateData, privateSize, &version);
+                privateData += used;
+                privateSize -= used;
                 
                 if (version.asInt() == 1) {
                     dprintf(4,"loadDNG: %s: Reading private data, version 1.\n", filename.c_str());
-                    loadDNGPrivateData_v1(_f, privateData);
+                    std::stringstream privateDataV1(std::string(privateData, privateSize));
+                    loadDNGPrivateData_v1(_f, privateDataV1);
                 } else {
                     TagValue backwardVersion;
-                    privateData >> backwardVersion;
+                    used = TagValue::fromBlob(privateData, privateSize, &backwardVersion);
+                    privateData += used;
+                    privateSize -= used;
                     switch (backwardVersion.asInt()) {
                     case 2:
                         dprintf(4,"loadDNG: %s: Reading private data, version 2.\n", filename.c_str());
-                        loadDNGPrivateData_v2(_f, privateData);
+                        loadDNGPrivateData_v2(_f, privateData, privateSize);
                         break;                        
                     default:
                         warning(Event::FileLoadError,
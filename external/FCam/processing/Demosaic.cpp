@@ -7,11 +7,17 @@
 #ifdef FCAM_ARCH_ARM
 #include "Demosaic_ARM.h"
 #endif
+#ifdef FCAM_ARCH_X86
+#include "Demosaic_x86.h"
+#endif
 
 #include <FCam/processing/Demosaic.h>
 #include <FCam/Sensor.h>
 #include <FCam/Time.h>
 
+#include "DemosaicBands.h"
+#include "../Parallel.h"
+
 
 namespace FCam {
 
@@ -74,7 +80,30 @@ namespace FCam {
         return demosaic_ARM(src, contrast, denoise, blackLevel, gamma);
         #endif
 
-        Image input = src.image();
+        DemosaicBands bands(src, contrast, denoise, blackLevel, gamma);
+        if (!bands.valid()) return Image();
+
+        Image out(bands.size(), RGB24);
+        bands.rows(0, out.height(), out(0, 0), out.bytesPerRow());
+
+        return out;
+    }
+
+    DemosaicBands::DemosaicBands(Frame src, float contrast, bool denoise_, int blackLevel, float gamma) :
+        denoise(denoise_), ok(false) {
+
+        const int BLOCK_WIDTH = 40;
+        const int BLOCK_HEIGHT = 24;
+
+        input = src.image();
+        if (!input.valid()) {
+            error(Event::DemosaicError, "Cannot demosaic an invalid image");
+            return;
+        }
+        if (input.bytesPerRow() % 2 == 1) {
+            error(Event::DemosaicError, "Cannot demosaic an image with bytesPerRow not divisible by 2");
+            return;
+        }
 
         // First check we're the right bayer pattern. If not crop and continue.
         switch((int)src.platform().bayerPattern()) {
@@ -90,23 +119,21 @@ namespace FCam {
             input = input.subImage(1, 1, Size(input.width()-2, input.height()-2));
         default:
             error(Event::DemosaicError, "Can't demosaic from a non-bayer sensor\n");
-            return Image();
+            input = Image();
+            return;
         }
 
-        const int BLOCK_WIDTH = 40;
-        const int BLOCK_HEIGHT = 24;
-        const int G = 0, GR = 0, R = 1, B = 2, GB = 3;        
-
-        int rawWidth = input.width();
-        int rawHeight = input.height();
-        int outWidth = rawWidth-8;
-        int outHeight = rawHeight-8;
+        // The output is a little smaller than the input, and a whole
+        // number of blocks of the scalar code
+        int outWidth = input.width()-8;
+        int outHeight = input.height()-8;
         outWidth /= BLOCK_WIDTH;
         outWidth *= BLOCK_WIDTH;
         outHeight /= BLOCK_HEIGHT;
         outHeight *= BLOCK_HEIGHT;
-
-        Image out(outWidth, outHeight, RGB24);               
+        if (outWidth < 0) outWidth = 0;
+        if (outHeight < 0) outHeight = 0;
+        outSize = Size(outWidth, outHeight);
 
         // Check we're the right size, if not, crop center
         if (((input.width() - 8) != (unsigned)outWidth) ||
@@ -122,11 +149,9 @@ namespace FCam {
         }           
 
         // Prepare the lookup table
-        unsigned char lut[4096];
         makeLUT(src, contrast, blackLevel, gamma, lut);
 
         // Grab the color matrix
-        float colorMatrix[12];
         // Check if there's a custom color matrix
         if (src.shot().colorMatrix().size() == 12) {
             for (int i = 0; i < 12; i++) {
@@ -137,8 +162,21 @@ namespace FCam {
             src.platform().rawToRGBColorMatrix(src.shot().whiteBalance, colorMatrix);
         }
 
-        for (int by = 0; by < rawHeight-8-BLOCK_HEIGHT+1; by += BLOCK_HEIGHT) {
-            for (int bx = 0; bx < rawWidth-8-BLOCK_WIDTH+1; bx += BLOCK_WIDTH) {
+        ok = true;
+    }
+
+    // Demosaic an outWidth x outHeight region, given the input around
+    // it, in blocks of BLOCK_WIDTH x BLOCK_HEIGHT output pixels. Each
+    // block only looks at the input within four pixels of it, so the
+    // block size does not change the result.
+    template<int BLOCK_WIDTH, int BLOCK_HEIGHT>
+    void demosaicBlocks(const Image &input, int outWidth, int outHeight, bool denoise,
+                        const float *colorMatrix, const unsigned char *lut,
+                        unsigned char *dst, int dstBytesPerRow) {
+        const int G = 0, GR = 0, R = 1, B = 2, GB = 3;        
+
+        for (int by = 0; by < outHeight-BLOCK_HEIGHT+1; by += BLOCK_HEIGHT) {
+            for (int bx = 0; bx < outWidth-BLOCK_WIDTH+1; bx += BLOCK_WIDTH) {
                 /*
                   Stage 1: Load a block of input, treat it as 4-channel gr, r, b, gb
                 */
@@ -343,6 +381,9 @@ namespace FCam {
                 for (int y = 2; y < BLOCK_HEIGHT/2+2; y++) {
                     for (int x = 2; x < BLOCK_WIDTH/2+2; x++) {
 
+                        unsigned char *out0 = dst + (by+(y-2)*2)*dstBytesPerRow + (bx+(x-2)*2)*3;
+                        unsigned char *out1 = out0 + dstBytesPerRow;
+
                         // Convert from sensor rgb to srgb
                         r = colorMatrix[0]*linear[R][GR][y][x] +
                             colorMatrix[1]*linear[G][GR][y][x] +
@@ -365,9 +406,9 @@ namespace FCam {
                         bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
                        
                         // Gamma correct and store
-                        out(bx+(x-2)*2, by+(y-2)*2)[0] = lut[ri];
-                        out(bx+(x-2)*2, by+(y-2)*2)[1] = lut[gi];
-                        out(bx+(x-2)*2, by+(y-2)*2)[2] = lut[bi];
+                        out0[0] = lut[ri];
+                        out0[1] = lut[gi];
+                        out0[2] = lut[bi];
 
                         // Convert from sensor rgb to srgb
                         r = colorMatrix[0]*linear[R][R][y][x] +
@@ -391,9 +432,9 @@ namespace FCam {
                         bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
                         
                         // Gamma correct and store
-                        out(bx+(x-2)*2+1, by+(y-2)*2)[0] = lut[ri];
-                        out(bx+(x-2)*2+1, by+(y-2)*2)[1] = lut[gi];
-                        out(bx+(x-2)*2+1, by+(y-2)*2)[2] = lut[bi];
+                        out0[3] = lut[ri];
+                        out0[4] = lut[gi];
+                        out0[5] = lut[bi];
                         
                         // Convert from sensor rgb to srgb
                         r = colorMatrix[0]*linear[R][B][y][x] +
@@ -417,9 +458,9 @@ namespace FCam {
                         bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
                        
                         // Gamma correct and store
-                        out(bx+(x-2)*2, by+(y-2)*2+1)[0] = lut[ri];
-                        out(bx+(x-2)*2, by+(y-2)*2+1)[1] = lut[gi];
-                        out(bx+(x-2)*2, by+(y-2)*2+1)[2] = lut[bi];
+                        out1[0] = lut[ri];
+                        out1[1] = lut[gi];
+                        out1[2] = lut[bi];
                         
                         // Convert from sensor rgb to srgb
                         r = colorMatrix[0]*linear[R][GB][y][x] +
@@ -443,16 +484,81 @@ namespace FCam {
                         bi = b < 0 ? 0 : (b > 1023 ? 1023 : (unsigned short)(b+0.5f));
                        
                         // Gamma correct and store
-                        out(bx+(x-2)*2+1, by+(y-2)*2+1)[0] = lut[ri];
-                        out(bx+(x-2)*2+1, by+(y-2)*2+1)[1] = lut[gi];
-                        out(bx+(x-2)*2+1, by+(y-2)*2+1)[2] = lut[bi];
+                        out1[3] = lut[ri];
+                        out1[4] = lut[gi];
+                        out1[5] = lut[bi];
                         
                     }
                 }                
             }
         }
+    }
 
-        return out;
+    // Runs demosaicBlocks over a range of BLOCK_WIDTH wide column
+    // stripes of a band, so a band of only a few rows still splits
+    // across the thread pool.
+    template<int BLOCK_WIDTH, int BLOCK_HEIGHT>
+    class DemosaicStripes : public ParallelTask {
+    public:
+        DemosaicStripes(const Image &band_, int outHeight_, bool denoise_,
+                        const float *colorMatrix_, const unsigned char *lut_,
+                        unsigned char *dst_, int dstBytesPerRow_) :
+            band(band_), outHeight(outHeight_), denoise(denoise_),
+            colorMatrix(colorMatrix_), lut(lut_),
+            dst(dst_), dstBytesPerRow(dstBytesPerRow_) {}
+
+        void run(int begin, int end) {
+            const int x = begin*BLOCK_WIDTH;
+            const int w = (end - begin)*BLOCK_WIDTH;
+            Image stripe = band.subImage(x, 0, Size(w+8, outHeight+8));
+            demosaicBlocks<BLOCK_WIDTH, BLOCK_HEIGHT>(stripe, w, outHeight, denoise, colorMatrix, lut,
+                                                      dst + 3*x, dstBytesPerRow);
+        }
+
+    private:
+        const Image &band;
+        int outHeight;
+        bool denoise;
+        const float *colorMatrix;
+        const unsigned char *lut;
+        unsigned char *dst;
+        int dstBytesPerRow;
+    };
+
+    template<int BLOCK_WIDTH, int BLOCK_HEIGHT>
+    void demosaicStripes(const Image &band, int outWidth, int outHeight, bool denoise,
+                         const float *colorMatrix, const unsigned char *lut,
+                         unsigned char *dst, int dstBytesPerRow) {
+        DemosaicStripes<BLOCK_WIDTH, BLOCK_HEIGHT> task(band, outHeight, denoise, colorMatrix, lut,
+                                                        dst, dstBytesPerRow);
+        // A few chunks per thread evens out the load
+        const int stripes = outWidth/BLOCK_WIDTH;
+        parallelFor(0, stripes, task, std::max(1, stripes/(4*threadCount())));
+    }
+
+    void DemosaicBands::rows(int y, int count, unsigned char *dst, int dstBytesPerRow) const {
+        if (!ok || count <= 0 || outSize.width <= 0) return;
+
+        Image band = input.subImage(0, y, Size(outSize.width+8, count+8));
+
+        // The x86 version is vectorized and multithreaded
+        #ifdef FCAM_ARCH_X86
+        demosaicRows_x86(band, outSize.width, count, denoise, colorMatrix, lut,
+                         dst, dstBytesPerRow);
+        return;
+        #endif
+
+        // Use the tallest blocks that divide the band
+        if (count % 24 == 0) {
+            demosaicStripes<40, 24>(band, outSize.width, count, denoise, colorMatrix, lut,
+                                     dst, dstBytesPerRow);
+        } else if (count % 16 == 0) {
+            demosaicStripes<40, 16>(band, outSize.width, count, denoise, colorMatrix, lut,
+                                     dst, dstBytesPerRow);
+        } else {
+            demosaicStripes<40, 8>(band, outSize.width, count, denoise, colorMatrix, lut,
+                                   dst, dstBytesPerRow);
+        }
     }
 
     // Generic RAW to thumbnail converter
@@ -0,0 +1,46 @@
+#ifndef FCAM_DEMOSAIC_BANDS_H
+#define FCAM_DEMOSAIC_BANDS_H
+
+#include <FCam/Base.h>
+#include <FCam/Image.h>
+#include <FCam/Frame.h>
+
+namespace FCam {
+
+    // Demosaics, color corrects and gamma corrects a raw frame a band
+    // of rows at a time. The pixels are exactly those demosaic()
+    // would produce, but the caller supplies the memory for each
+    // band, so consumers that work in scanline order (like the JPEG
+    // encoder) never need the whole RGB24 image at once.
+    class DemosaicBands {
+    public:
+        // Sets up the crop, lookup table and color matrix. Reports a
+        // DemosaicError and leaves the object invalid if the frame
+        // can't be demosaicked.
+        DemosaicBands(Frame src, float contrast = 50.0f,
+                      bool denoise = true, int blackLevel = 25,
+                      float gamma = 2.2f);
+
+        bool valid() const {return ok;}
+
+        // The size of the whole output, the same as demosaic() returns
+        Size size() const {return outSize;}
+
+        // Write output rows [y, y+count) as RGB24 to dst, which has
+        // room for count rows of dstBytesPerRow bytes. y and count
+        // must be multiples of 8.
+        void rows(int y, int count, unsigned char *dst, int dstBytesPerRow) const;
+
+    private:
+        // Cropped so that output pixel (x, y) is computed from the
+        // input around (x+4, y+4)
+        Image input;
+        Size outSize;
+        bool denoise;
+        bool ok;
+        unsigned char lut[4096];
+        float colorMatrix[12];
+    };
+}
+
+#endif
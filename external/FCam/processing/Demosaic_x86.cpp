@@ -0,0 +1,269 @@
+#ifdef FCAM_ARCH_X86
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include <immintrin.h>
+
+#include "Demosaic_x86.h"
+#include "../Debug.h"
+#include "../Parallel.h"
+
+// The tiles are independent, so the work is split across threads,
+// and within a tile each demosaic stage is a pass over rows of
+// shorts, which vectorizes directly. Each output pixel only depends
+// on the input within two quads of it, so tiles of any size give the
+// same result as the 40x24 blocks of the scalar code.
+//
+// The SIMD kernels do the integer stages in 16 bits where the scalar
+// code uses ints. That is exact as long as no intermediate sum
+// overflows, which holds when every input sample fits in 14 bits.
+// Tiles with larger values are handed to the scalar kernel. The color
+// matrix is applied with separate multiplies and adds in the same
+// order as the scalar code, which matches it exactly under SSE
+// floating point (the x86-64 default).
+
+namespace FCam {
+
+    namespace {
+
+        // Tile size in quads (2x2 bayer cells) of output
+        const int TILE_WIDTH = 32;
+        const int TILE_HEIGHT = 32;
+        // Widest vector of shorts used by any kernel
+        const int MAX_VEC = 16;
+
+        struct Tile {
+            int tw, th, stride;
+            bool denoise;
+            const float *colorMatrix;
+            const unsigned char *lut;
+            unsigned char *out;
+            int outStride;
+        };
+
+        namespace scalar {
+            typedef short V;
+            enum {VN = 1};
+            inline V vload(const short *p) {return *p;}
+            inline void vstore(short *p, V v) {*p = v;}
+            inline V vadd(V a, V b) {return (short)(a + b);}
+            inline V vsub(V a, V b) {return (short)(a - b);}
+            inline V vmin(V a, V b) {return a < b ? a : b;}
+            inline V vmax(V a, V b) {return a > b ? a : b;}
+            inline V vabsdiff(V a, V b) {return (short)abs(a - b);}
+            inline V vavg(V a, V b) {return (short)((a + b)/2);}
+            inline bool vlt(V a, V b) {return a < b;}
+            inline V vsel(bool m, V a, V b) {return m ? a : b;}
+
+            typedef float F;
+            enum {FN = 1};
+            inline F fload(const short *p) {return *p;}
+            inline F fset1(float f) {return f;}
+            inline F fmul(F a, F b) {return a*b;}
+            inline F fadd(F a, F b) {return a+b;}
+            inline void fstoreIndex(int *p, F v) {
+                *p = v < 0 ? 0 : (v > 1023 ? 1023 : (unsigned short)(v+0.5f));
+            }
+
+#include "Demosaic_x86_kernel.h"
+        }
+
+#pragma GCC push_options
+#pragma GCC target("sse2")
+        namespace sse2 {
+            typedef __m128i V;
+            enum {VN = 8};
+            inline V vload(const short *p) {return _mm_loadu_si128((const __m128i *)p);}
+            inline void vstore(short *p, V v) {_mm_storeu_si128((__m128i *)p, v);}
+            inline V vadd(V a, V b) {return _mm_add_epi16(a, b);}
+            inline V vsub(V a, V b) {return _mm_sub_epi16(a, b);}
+            inline V vmin(V a, V b) {return _mm_min_epi16(a, b);}
+            inline V vmax(V a, V b) {return _mm_max_epi16(a, b);}
+            inline V vabsdiff(V a, V b) {return _mm_max_epi16(_mm_sub_epi16(a, b), _mm_sub_epi16(b, a));}
+            inline V vavg(V a, V b) {
+                // Add the sign bit before shifting to round towards zero
+                V s = _mm_add_epi16(a, b);
+                return _mm_srai_epi16(_mm_add_epi16(s, _mm_srli_epi16(s, 15)), 1);
+            }
+            inline V vlt(V a, V b) {return _mm_cmplt_epi16(a, b);}
+            inline V vsel(V m, V a, V b) {return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));}
+
+            typedef __m128 F;
+            enum {FN = 4};
+            inline F fload(const short *p) {
+                __m128i v = _mm_loadl_epi64((const __m128i *)p);
+                return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+            }
+            inline F fset1(float f) {return _mm_set1_ps(f);}
+            inline F fmul(F a, F b) {return _mm_mul_ps(a, b);}
+            inline F fadd(F a, F b) {return _mm_add_ps(a, b);}
+            inline void fstoreIndex(int *p, F v) {
+                __m128i t = _mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(0.5f)));
+                __m128i neg = _mm_castps_si128(_mm_cmplt_ps(v, _mm_setzero_ps()));
+                __m128i big = _mm_castps_si128(_mm_cmpgt_ps(v, _mm_set1_ps(1023)));
+                t = _mm_andnot_si128(neg, t);
+                t = _mm_or_si128(_mm_andnot_si128(big, t), _mm_and_si128(big, _mm_set1_epi32(1023)));
+                _mm_storeu_si128((__m128i *)p, t);
+            }
+
+#include "Demosaic_x86_kernel.h"
+        }
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+        namespace avx2 {
+            typedef __m256i V;
+            enum {VN = 16};
+            inline V vload(const short *p) {return _mm256_loadu_si256((const __m256i *)p);}
+            inline void vstore(short *p, V v) {_mm256_storeu_si256((__m256i *)p, v);}
+            inline V vadd(V a, V b) {return _mm256_add_epi16(a, b);}
+            inline V vsub(V a, V b) {return _mm256_sub_epi16(a, b);}
+            inline V vmin(V a, V b) {return _mm256_min_epi16(a, b);}
+            inline V vmax(V a, V b) {return _mm256_max_epi16(a, b);}
+            inline V vabsdiff(V a, V b) {return _mm256_abs_epi16(_mm256_sub_epi16(a, b));}
+            inline V vavg(V a, V b) {
+                V s = _mm256_add_epi16(a, b);
+                return _mm256_srai_epi16(_mm256_add_epi16(s, _mm256_srli_epi16(s, 15)), 1);
+            }
+            inline V vlt(V a, V b) {return _mm256_cmpgt_epi16(b, a);}
+            inline V vsel(V m, V a, V b) {return _mm256_blendv_epi8(b, a, m);}
+
+            typedef __m256 F;
+            enum {FN = 8};
+            inline F fload(const short *p) {
+                return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)p)));
+            }
+            inline F fset1(float f) {return _mm256_set1_ps(f);}
+            // No FMA here: it would round differently from the scalar code
+            inline F fmul(F a, F b) {return _mm256_mul_ps(a, b);}
+            inline F fadd(F a, F b) {return _mm256_add_ps(a, b);}
+            inline void fstoreIndex(int *p, F v) {
+                __m256i t = _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_set1_ps(0.5f)));
+                __m256i neg = _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_LT_OQ));
+                __m256i big = _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_set1_ps(1023), _CMP_GT_OQ));
+                t = _mm256_andnot_si256(neg, t);
+                t = _mm256_blendv_epi8(t, _mm256_set1_epi32(1023), big);
+                _mm256_storeu_si256((__m256i *)p, t);
+            }
+
+#include "Demosaic_x86_kernel.h"
+        }
+#pragma GCC pop_options
+
+        typedef void (*TileKernel)(const Tile &, short *, int *);
+
+        TileKernel bestKernel() {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx2")) return avx2::demosaicTile;
+            if (__builtin_cpu_supports("sse2")) return sse2::demosaicTile;
+            return scalar::demosaicTile;
+        }
+
+        struct Job {
+            Image input;
+            unsigned char *out;
+            int outStride;
+            const unsigned char *lut;
+            const float *colorMatrix;
+            bool denoise;
+            int quadsX, quadsY;
+            int tilesX, tilesY;
+            TileKernel kernel;
+        };
+
+        // Split a tile's worth of bayer data into its four channel
+        // planes. Returns whether all samples fit in 14 bits.
+        bool loadTile(const Job &job, int x0, int y0, int w, int h, int stride, short *s) {
+            const int P = stride*h;
+            unsigned short bits = 0;
+            for (int y = 0; y < h; y++) {
+                const unsigned short *row0 = (const unsigned short *)job.input(2*x0, 2*(y0+y));
+                const unsigned short *row1 = (const unsigned short *)job.input(2*x0, 2*(y0+y)+1);
+                short *gr = s + y*stride;
+                short *r = gr + P;
+                short *b = gr + 2*P;
+                short *gb = gr + 3*P;
+                for (int x = 0; x < w; x++) {
+                    unsigned short v0 = row0[2*x], v1 = row0[2*x+1];
+                    unsigned short v2 = row1[2*x], v3 = row1[2*x+1];
+                    gr[x] = v0;
+                    r[x] = v1;
+                    b[x] = v2;
+                    gb[x] = v3;
+                    bits |= v0 | v1 | v2 | v3;
+                }
+            }
+            return (bits & 0xC000) == 0;
+        }
+
+        // Demosaics a range of tiles, reusing one set of planes for
+        // all of them
+        class DemosaicTiles : public ParallelTask {
+        public:
+            DemosaicTiles(const Job &job_) : job(job_) {}
+
+            void run(int begin, int end) {
+                const int stride = ((TILE_WIDTH + 4 + 2*MAX_VEC) + 15) & ~15;
+                const int planeSize = stride*(TILE_HEIGHT + 4);
+                std::vector<short> planes(16*planeSize + MAX_VEC, 0);
+                std::vector<int> indices(12*stride + MAX_VEC, 0);
+
+                for (int i = begin; i < end; i++) {
+                    int qx = (i % job.tilesX)*TILE_WIDTH;
+                    int qy = (i / job.tilesX)*TILE_HEIGHT;
+
+                    Tile t;
+                    t.tw = std::min(TILE_WIDTH, job.quadsX - qx);
+                    t.th = std::min(TILE_HEIGHT, job.quadsY - qy);
+                    t.stride = stride;
+                    t.denoise = job.denoise;
+                    t.colorMatrix = job.colorMatrix;
+                    t.lut = job.lut;
+                    t.out = job.out + 2*qy*job.outStride + 2*qx*3;
+                    t.outStride = job.outStride;
+
+                    bool fits = loadTile(job, qx, qy, t.tw+4, t.th+4, stride, &planes[0]);
+                    if (fits) {
+                        job.kernel(t, &planes[0], &indices[0]);
+                    } else {
+                        scalar::demosaicTile(t, &planes[0], &indices[0]);
+                    }
+                }
+            }
+
+        private:
+            const Job &job;
+        };
+    }
+
+    void demosaicRows_x86(const Image &input, int outWidth, int outHeight, bool denoise,
+                          const float *colorMatrix, const unsigned char *lut,
+                          unsigned char *out, int outBytesPerRow) {
+        if (outWidth <= 0 || outHeight <= 0) return;
+
+        Job job;
+        job.input = input;
+        job.out = out;
+        job.outStride = outBytesPerRow;
+        job.lut = lut;
+        job.colorMatrix = colorMatrix;
+        job.denoise = denoise;
+        job.quadsX = outWidth/2;
+        job.quadsY = outHeight/2;
+        job.tilesX = (job.quadsX + TILE_WIDTH - 1)/TILE_WIDTH;
+        job.tilesY = (job.quadsY + TILE_HEIGHT - 1)/TILE_HEIGHT;
+        job.kernel = bestKernel();
+
+        // A few chunks per thread evens out the load without
+        // reallocating the planes for every tile
+        const int tiles = job.tilesX*job.tilesY;
+        DemosaicTiles task(job);
+        parallelFor(0, tiles, task, std::max(1, tiles/(4*threadCount())));
+
+        dprintf(4, "demosaicRows_x86: %dx%d in %d tiles\n", outWidth, outHeight, tiles);
+    }
+}
+
+#endif
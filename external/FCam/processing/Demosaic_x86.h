@@ -0,0 +1,22 @@
+#ifndef FCAM_DEMOSAIC_X86_H
+#define FCAM_DEMOSAIC_X86_H
+#ifdef FCAM_ARCH_X86
+
+#include <FCam/Base.h>
+#include <FCam/Image.h>
+#include <FCam/Frame.h>
+
+// x86-specific optimized post-processing routines
+
+namespace FCam {
+    // Tiled, multithreaded demosaic using SSE2 or AVX2 when the CPU
+    // has them. Fills outWidth x outHeight RGB24 pixels at out from
+    // the already cropped bayer input around them (see
+    // DemosaicBands), exactly as the scalar demosaic would.
+    void demosaicRows_x86(const Image &input, int outWidth, int outHeight, bool denoise,
+                          const float *colorMatrix, const unsigned char *lut,
+                          unsigned char *out, int outBytesPerRow);
+}
+
+#endif
+#endif
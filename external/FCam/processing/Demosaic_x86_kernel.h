@@ -0,0 +1,181 @@
+// The per-tile demosaic kernel used by Demosaic_x86.cpp. This file is
+// included once per instruction set, inside a namespace that provides:
+//
+//   V, VN           a vector of VN shorts
+//   vload, vstore   unaligned loads and stores of a V
+//   vadd, vsub, vmin, vmax
+//   vabsdiff(a, b)  |a-b|, computed as in C integer arithmetic
+//   vavg(a, b)      (a+b)/2, rounded towards zero like C integer division
+//   vlt(a, b)       lane mask of a < b
+//   vsel(m, a, b)   m ? a : b per lane
+//   F, FN           a vector of FN floats
+//   fload           FN shorts converted to float
+//   fset1, fmul, fadd
+//   fstoreIndex     clamp to [0, 1023], round, store as FN ints
+//
+// The arithmetic mirrors the scalar loop in Demosaic.cpp step for
+// step, in the same order, so that the results are bit-exact.
+
+static void demosaicTile(const Tile &t, short *s, int *idx) {
+    const int G = 0, GR = 0, R = 1, B = 2, GB = 3;
+    const int W = t.tw + 4;
+    const int H = t.th + 4;
+    const int S = t.stride;
+    const int P = S*H;
+
+    // The four input channels are already loaded into the first
+    // four planes
+    short *in[4];
+    short *linear[3][4];
+    for (int c = 0; c < 4; c++) {
+        in[c] = s + c*P;
+    }
+    for (int c = 0; c < 3; c++) {
+        for (int k = 0; k < 4; k++) {
+            linear[c][k] = s + (4 + c*4 + k)*P;
+        }
+    }
+
+    // Stage 1.5: Suppress hot pixels
+    const int channelOf[4] = {G, R, B, G};
+    for (int k = 0; k < 4; k++) {
+        for (int y = 1; y < H-1; y++) {
+            const short *here = in[k] + y*S;
+            short *dst = linear[channelOf[k]][k] + y*S;
+            if (t.denoise) {
+                for (int x = 1; x < W-1; x += VN) {
+                    V m = vmax(vmax(vload(here+x-S), vload(here+x+S)),
+                               vmax(vload(here+x+1), vload(here+x-1)));
+                    vstore(dst+x, vmin(vload(here+x), m));
+                }
+            } else {
+                for (int x = 1; x < W-1; x += VN) {
+                    vstore(dst+x, vload(here+x));
+                }
+            }
+        }
+    }
+
+    // Stages 2 and 3: Interpolate g at r and at b
+    for (int y = 1; y < H-1; y++) {
+        const short *gr = linear[G][GR] + y*S;
+        const short *gb = linear[G][GB] + y*S;
+        short *g_r = linear[G][R] + y*S;
+        short *g_b = linear[G][B] + y*S;
+        for (int x = 1; x < W-1; x += VN) {
+            V gbUp = vload(gb+x-S), gbHere = vload(gb+x), gbLeft = vload(gb+x-1);
+            V grHere = vload(gr+x), grRight = vload(gr+x+1), grDown = vload(gr+x+S);
+
+            V gv_r = vavg(gbUp, gbHere);
+            V gvd_r = vabsdiff(gbUp, gbHere);
+            V gh_r = vavg(grHere, grRight);
+            V ghd_r = vabsdiff(grHere, grRight);
+            vstore(g_r+x, vsel(vlt(ghd_r, gvd_r), gh_r, gv_r));
+
+            V gv_b = vavg(grDown, grHere);
+            V gvd_b = vabsdiff(grDown, grHere);
+            V gh_b = vavg(gbHere, gbLeft);
+            V ghd_b = vabsdiff(gbHere, gbLeft);
+            vstore(g_b+x, vsel(vlt(ghd_b, gvd_b), gh_b, gv_b));
+        }
+    }
+
+    // Stages 4 to 7: Interpolate r and b at gr and gb
+    for (int y = 1; y < H-1; y++) {
+        const short *r = linear[R][R] + y*S;
+        const short *b = linear[B][B] + y*S;
+        const short *g_r = linear[G][R] + y*S;
+        const short *g_b = linear[G][B] + y*S;
+        const short *gr = linear[G][GR] + y*S;
+        const short *gb = linear[G][GB] + y*S;
+        for (int x = 1; x < W-1; x += VN) {
+            V rHere = vload(r+x), g_rHere = vload(g_r+x);
+            V bHere = vload(b+x), g_bHere = vload(g_b+x);
+            V grHere = vload(gr+x), gbHere = vload(gb+x);
+
+            vstore(linear[R][GR] + y*S + x,
+                   vsub(vadd(vavg(vload(r+x-1), rHere), grHere),
+                        vavg(vload(g_r+x-1), g_rHere)));
+            vstore(linear[B][GR] + y*S + x,
+                   vsub(vadd(vavg(vload(b+x-S), bHere), grHere),
+                        vavg(vload(g_b+x-S), g_bHere)));
+            vstore(linear[R][GB] + y*S + x,
+                   vsub(vadd(vavg(rHere, vload(r+x+S)), gbHere),
+                        vavg(g_rHere, vload(g_r+x+S))));
+            vstore(linear[B][GB] + y*S + x,
+                   vsub(vadd(vavg(bHere, vload(b+x+1)), gbHere),
+                        vavg(g_bHere, vload(g_b+x+1))));
+        }
+    }
+
+    // Stages 8 and 9: Interpolate r at b and b at r
+    for (int y = 1; y < H-1; y++) {
+        const short *r = linear[R][R] + y*S;
+        const short *b = linear[B][B] + y*S;
+        const short *g_r = linear[G][R] + y*S;
+        const short *g_b = linear[G][B] + y*S;
+        for (int x = 1; x < W-1; x += VN) {
+            V rHere = vload(r+x), rLeft = vload(r+x-1);
+            V rDown = vload(r+x+S), rDownLeft = vload(r+x+S-1);
+            V g_rHere = vload(g_r+x), g_rLeft = vload(g_r+x-1);
+            V g_rDown = vload(g_r+x+S), g_rDownLeft = vload(g_r+x+S-1);
+            V g_bHere = vload(g_b+x);
+
+            V rp_b = vsub(vadd(vavg(rDownLeft, rHere), g_bHere), vavg(g_rDownLeft, g_rHere));
+            V rpd_b = vabsdiff(rDownLeft, rHere);
+            V rn_b = vsub(vadd(vavg(rLeft, rDown), g_bHere), vavg(g_rLeft, g_rDown));
+            V rnd_b = vabsdiff(rLeft, rDown);
+            vstore(linear[R][B] + y*S + x, vsel(vlt(rpd_b, rnd_b), rp_b, rn_b));
+
+            V bHere = vload(b+x), bRight = vload(b+x+1);
+            V bUp = vload(b+x-S), bUpRight = vload(b+x-S+1);
+            V g_bRight = vload(g_b+x+1);
+            V g_bUp = vload(g_b+x-S), g_bUpRight = vload(g_b+x-S+1);
+
+            V bp_r = vsub(vadd(vavg(bUpRight, bHere), g_rHere), vavg(g_bUpRight, g_bHere));
+            V bpd_r = vabsdiff(bUpRight, bHere);
+            V bn_r = vsub(vadd(vavg(bRight, bUp), g_rHere), vavg(g_bRight, g_bUp));
+            V bnd_r = vabsdiff(bRight, bUp);
+            vstore(linear[B][R] + y*S + x, vsel(vlt(bpd_r, bnd_r), bp_r, bn_r));
+        }
+    }
+
+    // Stages 10 and 11: Color matrix, then gamma correct through the
+    // lookup table
+    F m[12];
+    for (int i = 0; i < 12; i++) {
+        m[i] = fset1(t.colorMatrix[i]);
+    }
+    for (int y = 2; y < H-2; y++) {
+        for (int k = 0; k < 4; k++) {
+            const short *r = linear[R][k] + y*S;
+            const short *g = linear[G][k] + y*S;
+            const short *b = linear[B][k] + y*S;
+            int *ri = idx + (k*3+0)*S;
+            int *gi = idx + (k*3+1)*S;
+            int *bi = idx + (k*3+2)*S;
+            for (int x = 2; x < W-2; x += FN) {
+                F rv = fload(r+x), gv = fload(g+x), bv = fload(b+x);
+                fstoreIndex(ri+x, fadd(fadd(fadd(fmul(m[0], rv), fmul(m[1], gv)), fmul(m[2], bv)), m[3]));
+                fstoreIndex(gi+x, fadd(fadd(fadd(fmul(m[4], rv), fmul(m[5], gv)), fmul(m[6], bv)), m[7]));
+                fstoreIndex(bi+x, fadd(fadd(fadd(fmul(m[8], rv), fmul(m[9], gv)), fmul(m[10], bv)), m[11]));
+            }
+        }
+
+        // Scatter the four output pixels of each quad
+        for (int k = 0; k < 4; k++) {
+            const int dx = (k == R || k == GB) ? 1 : 0;
+            const int dy = (k == B || k == GB) ? 1 : 0;
+            const int *ri = idx + (k*3+0)*S;
+            const int *gi = idx + (k*3+1)*S;
+            const int *bi = idx + (k*3+2)*S;
+            unsigned char *dst = t.out + ((y-2)*2 + dy)*t.outStride + dx*3;
+            for (int x = 2; x < W-2; x++) {
+                dst[0] = t.lut[ri[x]];
+                dst[1] = t.lut[gi[x]];
+                dst[2] = t.lut[bi[x]];
+                dst += 6;
+            }
+        }
+    }
+}
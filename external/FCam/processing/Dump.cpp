@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <sys/stat.h>
 
 #include <FCam/Event.h>
 #include <FCam/processing/Dump.h>
@@ -7,7 +8,7 @@
 
 namespace FCam {
 
-    Image loadDump(std::string filename) {
+    Image loadDump(std::string filename, bool memMap) {
         FILE *fp = fopen(filename.c_str(), "rb");
 
         if (!fp) {
@@ -46,6 +47,33 @@ namespace FCam {
             return Image();
         }
 
+        if (memMap) {
+            // The pixel data directly follows the header with no
+            // padding, so it can be mapped as is. Touching a mapped
+            // page past the end of the file raises SIGBUS, so check
+            // the file is long enough first.
+            off_t dataBytes = (off_t)header[1]*header[2]*bytesPerPixel(type);
+            struct stat st;
+            if (fstat(fileno(fp), &st) != 0 || st.st_size < (off_t)sizeof(header) + dataBytes) {
+                error(Event::FileLoadError, 
+                      "loadDump: %s: Unexpected EOF in image data.", filename.c_str());
+                fclose(fp);
+                return Image();
+            }
+            Image im(fileno(fp), sizeof(header), Size(header[1], header[2]), type);
+            // The mapping outlives the file descriptor
+            fclose(fp);
+            if (im.valid()) return im;
+
+            // Mapping failed, fall back to reading the file
+            fp = fopen(filename.c_str(), "rb");
+            if (!fp || fseek(fp, sizeof(header), SEEK_SET) != 0) {
+                error(Event::FileLoadError, "loadDump: %s: Cannot open file for reading.", filename.c_str());
+                if (fp) fclose(fp);
+                return Image();
+            }
+        }
+
         // Allocate an image
         // todo: Allow loading into a preallocated image
         Image im(header[1], header[2], type);
@@ -61,6 +89,7 @@ namespace FCam {
             }
         }
         
+        fclose(fp);
         return im;
     }
     
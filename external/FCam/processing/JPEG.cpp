@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <algorithm>
+#include <vector>
 
 extern "C" {
 #include <jpeglib.h>
@@ -9,40 +11,103 @@ extern "C" {
 #include <FCam/processing/Demosaic.h>
 
 #include "../Debug.h"
+#include "DemosaicBands.h"
 
 using namespace std;
 
 
 namespace FCam {
+    namespace {
+        // Open the file and start compressing an image of the given
+        // size. Returns NULL if the file can't be opened.
+        FILE *startJPEG(jpeg_compress_struct *cinfo, jpeg_error_mgr *jerr,
+                        const string &filename, int width, int height,
+                        J_COLOR_SPACE colorSpace, int quality) {
+            FILE *f = fopen(filename.c_str(), "wb");
+            if (!f) return NULL;
+
+            cinfo->err = jpeg_std_error(jerr);
+            jpeg_create_compress(cinfo);
+            jpeg_stdio_dest(cinfo, f);
+
+            cinfo->image_width = width;
+            cinfo->image_height = height;
+            cinfo->input_components = 3;
+            cinfo->in_color_space = colorSpace;
+
+            jpeg_set_defaults(cinfo);
+            jpeg_set_quality(cinfo, quality, TRUE);
+
+            jpeg_start_compress(cinfo, TRUE);
+            return f;
+        }
+
+        void finishJPEG(jpeg_compress_struct *cinfo, FILE *f) {
+            jpeg_finish_compress(cinfo);
+            fclose(f);
+            jpeg_destroy_compress(cinfo);
+        }
+
+        // Demosaic a raw frame straight into the encoder, one band of
+        // BAND_HEIGHT rows at a time. That is the height of an MCU row
+        // of the default 2x2 chroma subsampling, so libjpeg can
+        // compress each band as soon as it arrives, and only one
+        // band of RGB data exists at any time instead of the full
+        // size image demosaic() would return.
+        void saveRawJPEG(Frame frame, const string &filename, int quality) {
+            const int BAND_HEIGHT = 16;
+
+            DemosaicBands bands(frame);
+            const int width = bands.size().width;
+            const int height = bands.size().height;
+            if (!bands.valid() || width <= 0 || height <= 0) {
+                error(Event::FileSaveError, frame, "saveJPEG: %s: Cannot demosaic RAW image to save as JPEG.", filename.c_str());
+                return;
+            }
+
+            dprintf(DBG_MINOR, "saveJPEG: Saving JPEG to %s, quality %d\n", filename.c_str(), quality);
+
+            struct jpeg_compress_struct cinfo;
+            struct jpeg_error_mgr jerr;
+            FILE *f = startJPEG(&cinfo, &jerr, filename, width, height, JCS_RGB, quality);
+            if (!f) {
+                error(Event::FileSaveError, frame, "saveJPEG: %s: Cannot open file for writing", filename.c_str());
+                return;
+            }
+
+            std::vector<JSAMPLE> band((size_t)width*3*BAND_HEIGHT);
+            JSAMPROW rows[BAND_HEIGHT];
+            for (int i = 0; i < BAND_HEIGHT; i++) {
+                rows[i] = &band[0] + i*width*3;
+            }
+
+            // The height is a multiple of 8, so the last band may be
+            // half height
+            for (int y = 0; y < height; y += BAND_HEIGHT) {
+                int count = std::min(BAND_HEIGHT, height - y);
+                bands.rows(y, count, &band[0], width*3);
+                jpeg_write_scanlines(&cinfo, rows, count);
+            }
+
+            finishJPEG(&cinfo, f);
+
+            dprintf(DBG_MINOR, "saveJPEG: Done saving JPEG to %s, streamed in %d byte bands\n",
+                    filename.c_str(), (int)band.size());
+        }
+    }
+
     void saveJPEG(Image im, string filename, int quality) {
         struct jpeg_compress_struct cinfo;
         struct jpeg_error_mgr jerr;
 
         dprintf(DBG_MINOR, "saveJPEG: Saving JPEG to %s, quality %d\n", filename.c_str(), quality);
 
-        FILE *f = fopen(filename.c_str(), "wb");
+        FILE *f = startJPEG(&cinfo, &jerr, filename, im.width(), im.height(),
+                            im.type() == RGB24 ? JCS_RGB : JCS_YCbCr, quality);
         if (!f) {
             error(Event::FileSaveError, "saveJPEG: %s: Cannot open file for writing", filename.c_str());
             return;
         }
-        
-        cinfo.err = jpeg_std_error(&jerr);
-        jpeg_create_compress(&cinfo);
-        jpeg_stdio_dest(&cinfo, f);
-
-        cinfo.image_width = im.width();
-        cinfo.image_height = im.height();
-        cinfo.input_components = 3;
-        if (im.type() == RGB24) {
-            cinfo.in_color_space = JCS_RGB;  
-        } else if (im.type() == YUV24) {
-            cinfo.in_color_space = JCS_YCbCr;
-        }
-
-        jpeg_set_defaults(&cinfo);
-        jpeg_set_quality(&cinfo, quality, TRUE);
-
-        jpeg_start_compress(&cinfo, TRUE);
 
         if (im.type() == RGB24 || im.type() == YUV24) {
             while (cinfo.next_scanline < cinfo.image_height) {
@@ -98,9 +163,7 @@ namespace FCam {
             }
         }
 
-        jpeg_finish_compress(&cinfo);
-        fclose(f);
-        jpeg_destroy_compress(&cinfo);
+        finishJPEG(&cinfo, f);
 
         dprintf(DBG_MINOR, "saveJPEG: Done saving JPEG to %s\n", filename.c_str());
     }
@@ -115,12 +178,18 @@ namespace FCam {
         
         switch (im.type()) {
         case RAW:
+            #ifdef FCAM_ARCH_ARM
+            // The ARM demosaic only works on whole images
             im = demosaic(frame);
             if (!im.valid()) {
                 error(Event::FileSaveError, frame, "saveJPEG: %s: Cannot demosaic RAW image to save as JPEG.", filename.c_str());
                 return;
             }
-            // fall through to rgb24
+            saveJPEG(im, filename, quality);
+            #else
+            saveRawJPEG(frame, filename, quality);
+            #endif
+            break;
         case RGB24: case YUV24: case UYVY: case YUV420p:
             saveJPEG(im, filename, quality);
             break;
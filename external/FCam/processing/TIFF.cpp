@@ -1,15 +1,26 @@
 #include <sstream>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include "string.h"
 
 #include "FCam/processing/TIFF.h" 
 #include <FCam/processing/Demosaic.h>
 #include <FCam/Tegra/YUV420.h>
 #include "TIFF.h"
+#include "TIFFTiles.h"
 #include "../Debug.h"
 
 namespace FCam {
 
+    namespace {
+        // Offset and byte count entries with a single value are read
+        // in as a plain int
+        std::vector<int> intVector(const TagValue &val) {
+            if (val.type == TagValue::Int) return std::vector<int>(1, (int)val);
+            return val;
+        }
+    }
+
     void saveTIFF(Frame frame, std::string filename) 
     {
         Image im = frame.image();
@@ -790,7 +801,8 @@ namespace FCam {
 // Methods for TiffIfd
 //
 
-    TiffIfd::TiffIfd(TiffFile *parent): parent(parent), exifIfd(NULL), imgState(UNREAD)  {
+    TiffIfd::TiffIfd(TiffFile *parent): parent(parent), exifIfd(NULL), imgState(UNREAD),
+                                        imgCompression(TIFF_Compression_Uncompressed)  {
     }
 
     TiffIfd::~TiffIfd() {
@@ -926,6 +938,17 @@ namespace FCam {
         case TIFF_Compression_Uncompressed:
             // ok
             break;
+        case TIFF_Compression_JPEG:
+        case TIFF_Compression_Deflate:
+        case TIFF_Compression_Deflate_old:
+            // Only lossless JPEG and Deflate tiles of RAW data are
+            // supported; readTiles checks the rest
+            if (fmt != RAW || !find(TIFF_TAG_TileOffsets)) {
+                fatalError("TiffIfd::getImage(): %s: Compression type %d is only supported for tiled RAW images.",
+                           file,
+                           compression);
+            }
+            break;
         default:
             fatalError("TiffIfd::getImage(): %s: Unsupported compression type %d.",
                        file,
@@ -933,7 +956,7 @@ namespace FCam {
             break;
         }
 
-        // Now assuming uncompressed RAW or RGB24
+        // Now assuming RAW or RGB24
         int samplesPerPixel = TIFF_SamplesPerPixel_DEFAULT;
         entry = find(TIFF_TAG_SamplesPerPixel);
         if (entry) samplesPerPixel = entry->value();
@@ -986,6 +1009,50 @@ namespace FCam {
 
         dprintf(4,"TiffIfd::getImage(): %s: Image size is %d x %d\n", file, imageWidth, imageLength);
 
+        // Read in tiled image data, which is never memory mapped
+        entry = find(TIFF_TAG_TileOffsets);
+        if (entry) {
+            std::vector<int> tileOffsets = intVector(entry->value());
+            entry = find(TIFF_TAG_TileByteCounts);
+            if (!entry) fatalError("TiffIfd::getImage(): %s: No TileByteCounts entry found.", file);
+            std::vector<int> tileByteCounts = intVector(entry->value());
+            entry = find(TIFF_TAG_TileWidth);
+            if (!entry) fatalError("TiffIfd::getImage(): %s: No TileWidth entry found.", file);
+            int tileWidth = entry->value();
+            entry = find(TIFF_TAG_TileLength);
+            if (!entry) fatalError("TiffIfd::getImage(): %s: No TileLength entry found.", file);
+            int tileLength = entry->value();
+            int predictor = TIFF_Predictor_DEFAULT;
+            entry = find(TIFF_TAG_Predictor);
+            if (entry) predictor = entry->value();
+
+            if (tileWidth <= 0 || tileLength <= 0 || tileOffsets.size() != tileByteCounts.size())
+                fatalError("TiffIfd::getImage(): %s: Malformed IFD - inconsistent tile layout.", file);
+
+            dprintf(5, "TiffIfd::getImage(): %s: Image data in %d tiles of %d x %d, compression %d\n",
+                    file, (int)tileOffsets.size(), tileWidth, tileLength, compression);
+
+            // Read all tiles first, then decompress them in parallel
+            std::vector<std::vector<uint8_t> > tiles(tileOffsets.size());
+            for (size_t i = 0; i < tiles.size(); i++) {
+                if (tileByteCounts[i] <= 0)
+                    fatalError("TiffIfd::getImage(): %s: Malformed IFD - empty tile %d.", file, (int)i);
+                tiles[i].resize(tileByteCounts[i]);
+                if (!parent->readByteArray(tileOffsets[i], tileByteCounts[i], &tiles[i][0]))
+                    fatalError("TiffIfd::getImage(): %s: Cannot read in all image data.\n", file);
+            }
+
+            Image img(imageWidth, imageLength, fmt);
+            if (!readTiles(tiles, img, compression, predictor, tileWidth, tileLength, file)) {
+                imgState = NONE;
+                return imgCache;
+            }
+
+            imgCache = img;
+            imgState = CACHED;
+            return imgCache;
+        }
+
 
         // Read in image strip information
         entry = find(TIFF_TAG_RowsPerStrip);
@@ -998,8 +1065,8 @@ namespace FCam {
         }
         
         entry = find(TIFF_TAG_StripOffsets);
-        if (!entry) fatalError("TiffIfd::getImage(): %s: No image strip data found, and tiled data is not supported.", file);
-        std::vector<int> stripOffsets = entry->value();
+        if (!entry) fatalError("TiffIfd::getImage(): %s: No image strip or tile data found.", file);
+        std::vector<int> stripOffsets = intVector(entry->value());
         if (stripOffsets.size() != stripsPerImage)
             fatalError("TiffIfd::getImage(): %s: Malformed IFD - conflicting values on number of image strips.", file);
         
@@ -1018,6 +1085,32 @@ namespace FCam {
                 }
             }
         }
+        if (memMap) {
+            // Touching a mapped page past the end of the file raises
+            // SIGBUS, so a truncated file has to be read instead
+            struct stat st;
+            if (fstat(fileno(parent->fp), &st) != 0 ||
+                (off_t)stripOffsets[0] + (off_t)bytesLeft > st.st_size) {
+                memMap = false;
+                warning(Event::FileLoadError, "TiffIfd::getImage(): %s: Image data runs past the end of the file, not memory mapping it.", file);
+            }
+        }
+        if (memMap) {
+            // Read in image data - Memory mapped IO. Pages are only
+            // read from disk as they're touched.
+            dprintf(5, "TiffIfd::getImage(): %s: Memmapping Image at %x, %x bytes\n",
+                    file, stripOffsets[0], bytesPerPixel(fmt)*imageWidth*imageLength);
+            Image img(fileno(parent->fp), 
+                      stripOffsets[0], 
+                      Size(imageWidth, imageLength), 
+                      fmt);
+            if (img.valid()) {
+                imgCache = img;
+                imgState = CACHED;
+            } else {
+                memMap = false;
+            }
+        }
 
         if (!memMap) {
             //
@@ -1037,28 +1130,35 @@ namespace FCam {
 
             imgCache = img;
             imgState = CACHED;
-        } else {
-            // Read in image data - Memory mapped IO
-            dprintf(5, "TiffIfd::getImage(): %s: Memmapping Image at %x, %x bytes\n",
-                    file, stripOffsets[0], bytesPerPixel(fmt)*imageWidth*imageLength);
-            imgCache = Image(fileno(parent->fp), 
-                             stripOffsets[0], 
-                             Size(imageWidth, imageLength), 
-                             fmt);
         }
 #undef fatalError
 
         return imgCache;
     }
 
-    bool TiffIfd::setImage(Image newImg) {
+    bool TiffIfd::setImage(Image newImg, uint16_t compression) {
         if (newImg.type() != RAW &&
             newImg.type() != RGB24) {
             error(Event::FileSaveError, "TiffIfd::setImage(): Can only save RAW or RGB24 images");
             return false;
         }
+        switch (compression) {
+        case TIFF_Compression_Uncompressed:
+            break;
+        case TIFF_Compression_JPEG:
+        case TIFF_Compression_Deflate:
+            if (newImg.type() != RAW) {
+                error(Event::FileSaveError, "TiffIfd::setImage(): Can only compress RAW images");
+                return false;
+            }
+            break;
+        default:
+            error(Event::FileSaveError, "TiffIfd::setImage(): Unsupported compression type %d", compression);
+            return false;
+        }
         imgCache = newImg;
         imgState = CACHED;
+        imgCompression = compression;
         return true;
     }
 
@@ -1178,6 +1278,53 @@ namespace FCam {
         int width = img.width();
         int height = img.height();
 
+        bool success;
+        if (imgCompression != TIFF_Compression_Uncompressed) {
+            // Compressed images are written as tiles. Drop any strip
+            // layout left over from a file this Ifd was read from.
+            entries.erase(TIFF_TAG_RowsPerStrip);
+            entries.erase(TIFF_TAG_StripOffsets);
+            entries.erase(TIFF_TAG_StripByteCounts);
+            std::vector<int> tileOffsets;
+            std::vector<int> tileByteCounts;
+            if (!writeTiles(fw, img, imgCompression,
+                            TIFF_TileWidth_DEFAULT, TIFF_TileLength_DEFAULT,
+                            &tileOffsets, &tileByteCounts)) {
+                return false;
+            }
+
+            success = add(TIFF_TAG_PhotometricInterpretation, photometricInterpretation);
+            if (success) success = add(TIFF_TAG_SamplesPerPixel, samplesPerPixel);
+            if (success) success = add(TIFF_TAG_BitsPerSample, bitsPerSample);
+
+            if (success) success = add(TIFF_TAG_ImageWidth, width);
+            if (success) success = add(TIFF_TAG_ImageLength, height);
+            if (success) success = add(TIFF_TAG_TileWidth, TIFF_TileWidth_DEFAULT);
+            if (success) success = add(TIFF_TAG_TileLength, TIFF_TileLength_DEFAULT);
+
+            if (success) success = add(TIFF_TAG_TileOffsets, tileOffsets);
+            if (success) success = add(TIFF_TAG_TileByteCounts, tileByteCounts);
+            if (success) success = add(TIFF_TAG_Compression, imgCompression);
+            if (success && imgCompression == TIFF_Compression_Deflate) {
+                success = add(TIFF_TAG_Predictor, DNG_Predictor_HorizontalX2);
+            }
+
+            if (!success) {
+                error(Event::FileSaveError,
+                      "TiffIfd::writeImage: Can't add needed tags to IFD");
+                return false;
+            }
+
+            dprintf(5, "TiffIfd::writeImage: Image written as %d tiles.\n", (int)tileOffsets.size());
+            return true;
+        }
+
+        entries.erase(TIFF_TAG_TileWidth);
+        entries.erase(TIFF_TAG_TileLength);
+        entries.erase(TIFF_TAG_TileOffsets);
+        entries.erase(TIFF_TAG_TileByteCounts);
+        entries.erase(TIFF_TAG_Predictor);
+
         const uint32_t targetBytesPerStrip = 64 * 1024; // 64 K strips if possible
         const uint32_t minRowsPerStrip = 10; // But at least 10 rows per strip
 
@@ -1211,7 +1358,6 @@ namespace FCam {
             }
         }
 
-        bool success;
         success = add(TIFF_TAG_PhotometricInterpretation, photometricInterpretation);
         if (success) success = add(TIFF_TAG_SamplesPerPixel, samplesPerPixel);
         if (success) success = add(TIFF_TAG_BitsPerSample, bitsPerSample);
@@ -115,8 +115,11 @@ namespace FCam {
         // hasn't been read already. Optionally, use memory mapped IO to manage the image memory.
 	// This is only allowable for images that have been stored contiguously in the source file.
         Image getImage(bool memMap = true);
-        // Sets the image to be saved in this Ifd.
-        bool setImage(Image newImg);
+        // Sets the image to be saved in this Ifd. Uncompressed images
+        // are saved in strips. RAW images can also be saved as tiles
+        // with TIFF_Compression_JPEG (lossless JPEG) or
+        // TIFF_Compression_Deflate; see TIFFTiles.h.
+        bool setImage(Image newImg, uint16_t compression = TIFF_Compression_Uncompressed);
 
         // Write all entries, subIFds, and image data to file
         // Retuns success/failure, and the starting location of the Ifd in
@@ -137,6 +140,7 @@ namespace FCam {
             CACHED
         } imgState;
         Image imgCache;
+        uint16_t imgCompression;
 
         // Subfunction to write image data out, and to update the IFD
         // entry offsets for it
@@ -145,8 +149,8 @@ namespace FCam {
 
     // High-level interface to reading and writing TIFF
     // files. Implemented functionality limited to those needed for
-    // DNG file access (uncompressed striped data, only a few color
-    // spaces)
+    // DNG file access (uncompressed striped data, compressed tiled
+    // RAW data, only a few color spaces)
     class TiffFile {
     public:
 
@@ -608,6 +608,20 @@ namespace FCam {
         },
 //// TIFF Extension tags
         {
+            "Predictor",
+            317,
+            TIFF_SHORT
+            // N = 1
+            // A mathematical operator that is applied to the image data before an encoding
+            // scheme is applied.
+            // 1 = No prediction scheme used before coding.
+            // 2 = Horizontal differencing.
+            // DNG 1.4 adds, for Deflate compressed data:
+            // 34892 = Horizontal difference X2. Each sample is differenced against the
+            // sample two to its left, so same-colored CFA samples are paired.
+            // 34893 = Horizontal difference X4.
+            // Default is 1.
+        },{
             "TileWidth",
             322,
             TIFF_SHORT // or LONG
@@ -661,7 +675,7 @@ namespace FCam {
         },{
             "TileByteCounts",
             325,
-            TIFF_SHORT // or LONG
+            TIFF_LONG // or SHORT, but make sure to write LONG
             // N = TilesPerImage for PlanarConfiguration = 1
             // = SamplesPerPixel * TilesPerImage for PlanarConfiguration = 2
             // For each tile, the number of (compressed) bytes in that tile.
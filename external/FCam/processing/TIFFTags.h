@@ -72,6 +72,11 @@ namespace FCam {
     const uint16_t        TIFF_TAG_ResolutionUnit                      = 296;
     const uint16_t        TIFF_TAG_Software                            = 305;
     const uint16_t        TIFF_TAG_DateTime                            = 306;
+    const uint16_t        TIFF_TAG_Predictor                           = 317;
+    const uint16_t        TIFF_TAG_TileWidth                           = 322;
+    const uint16_t        TIFF_TAG_TileLength                          = 323;
+    const uint16_t        TIFF_TAG_TileOffsets                         = 324;
+    const uint16_t        TIFF_TAG_TileByteCounts                      = 325;
 
     const uint16_t        TIFFEP_TAG_CFARepeatPatternDim               = 33421;
     const uint16_t        TIFFEP_TAG_CFAPattern                        = 33422;
@@ -158,8 +163,16 @@ namespace FCam {
     const uint16_t TIFF_Compression_LZW = 5;
     const uint16_t TIFF_Compression_JPEG_old = 6;
     const uint16_t TIFF_Compression_JPEG = 7;
+    const uint16_t TIFF_Compression_Deflate = 8;
+    const uint16_t TIFF_Compression_Deflate_old = 32946;
     const uint16_t TIFF_Compression_DEFAULT = TIFF_Compression_Uncompressed;
 
+    const uint16_t TIFF_Predictor_None = 1;
+    const uint16_t TIFF_Predictor_Horizontal = 2;
+    const uint16_t DNG_Predictor_HorizontalX2 = 34892;
+    const uint16_t DNG_Predictor_HorizontalX4 = 34893;
+    const uint16_t TIFF_Predictor_DEFAULT = TIFF_Predictor_None;
+
     // First term is what 0th row represents, the second is what 0th column represents
     const uint16_t TIFF_Orientation_TopLeft = 1;
     const uint16_t TIFF_Orientation_TopRight = 2;
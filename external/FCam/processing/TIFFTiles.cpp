@@ -0,0 +1,811 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <algorithm>
+
+#include <FCam/Event.h>
+
+#include "TIFFTiles.h"
+#include "TIFFTags.h"
+#include "../Debug.h"
+#include "../Parallel.h"
+
+// Tiles are independent, so each pool thread claims the next few
+// tiles, compresses each into its own buffer and hands it over to
+// whichever thread is currently writing. Tiles are written in order as soon as
+// all the ones before them are done, so the output is the same no
+// matter how many threads ran, and only the few tiles finished out of
+// order are ever held in memory.
+
+namespace FCam {
+
+    namespace {
+
+        // zlib level for Deflate tiles. On raw data, higher levels
+        // only save about a percent, at 1.5 to 5 times the time.
+        const int DEFLATE_LEVEL = 1;
+
+        // Lossless JPEG markers
+        const uint8_t M_SOF3 = 0xC3;
+        const uint8_t M_DHT = 0xC4;
+        const uint8_t M_SOI = 0xD8;
+        const uint8_t M_EOI = 0xD9;
+        const uint8_t M_SOS = 0xDA;
+        const uint8_t M_DRI = 0xDD;
+
+        // Number of Huffman symbols (difference magnitude categories)
+        const int CATEGORIES = 17;
+
+        // Magnitude category of a 16-bit difference. -32768 is coded
+        // as category 16, which means 32768 modulo 2^16.
+        inline int category(int diff) {
+            if (diff == 0) return 0;
+            if (diff == -32768) return 16;
+            return 32 - __builtin_clz(diff < 0 ? -diff : diff);
+        }
+
+        // Build a length-limited optimal Huffman code for the given
+        // symbol frequencies, following ITU T.81 annex K.2. bits[l] is
+        // the number of codes of length l, vals the symbols in code
+        // order.
+        void buildHuffmanTable(const unsigned *symbolFreq, uint8_t *bits, uint8_t *vals, int *count) {
+            // One reserved symbol with the lowest frequency, so that no
+            // real code is all ones
+            const int N = CATEGORIES + 1;
+            long freq[N];
+            int codeSize[N], others[N];
+            for (int i = 0; i < CATEGORIES; i++) freq[i] = symbolFreq[i];
+            freq[CATEGORIES] = 1;
+            for (int i = 0; i < N; i++) {
+                codeSize[i] = 0;
+                others[i] = -1;
+            }
+
+            while (1) {
+                // The two least frequent trees, ties going to the
+                // higher symbol
+                int c1 = -1, c2 = -1;
+                for (int i = 0; i < N; i++) {
+                    if (freq[i] && (c1 < 0 || freq[i] <= freq[c1])) c1 = i;
+                }
+                for (int i = 0; i < N; i++) {
+                    if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2])) c2 = i;
+                }
+                if (c2 < 0) break;
+
+                freq[c1] += freq[c2];
+                freq[c2] = 0;
+                codeSize[c1]++;
+                while (others[c1] >= 0) {
+                    c1 = others[c1];
+                    codeSize[c1]++;
+                }
+                others[c1] = c2;
+                codeSize[c2]++;
+                while (others[c2] >= 0) {
+                    c2 = others[c2];
+                    codeSize[c2]++;
+                }
+            }
+
+            int lengths[33];
+            memset(lengths, 0, sizeof(lengths));
+            for (int i = 0; i < N; i++) {
+                if (codeSize[i]) lengths[codeSize[i]]++;
+            }
+
+            // Limit code lengths to 16 bits
+            for (int i = 32; i > 16; i--) {
+                while (lengths[i] > 0) {
+                    int j = i - 2;
+                    while (lengths[j] == 0) j--;
+                    lengths[i] -= 2;
+                    lengths[i-1]++;
+                    lengths[j+1] += 2;
+                    lengths[j]--;
+                }
+            }
+            // And drop the reserved symbol, which has the longest code
+            int i = 16;
+            while (lengths[i] == 0) i--;
+            lengths[i]--;
+
+            bits[0] = 0;
+            for (i = 1; i <= 16; i++) bits[i] = lengths[i];
+
+            *count = 0;
+            for (int len = 1; len <= 32; len++) {
+                for (int s = 0; s < CATEGORIES; s++) {
+                    if (codeSize[s] == len) vals[(*count)++] = s;
+                }
+            }
+        }
+
+        // Writes entropy coded data, stuffing a zero after each 0xFF.
+        // The caller makes sure the buffer is big enough.
+        class BitWriter {
+        public:
+            BitWriter(uint8_t *out): p(out), acc(0), n(0) {}
+
+            // count <= 32, and value has no bits set above count
+            void put(uint32_t value, int count) {
+                acc = (acc << count) | value;
+                n += count;
+                if (n >= 32) {
+                    n -= 32;
+                    uint32_t w = (uint32_t)(acc >> n);
+                    if (((~w - 0x01010101u) & w & 0x80808080u) == 0) {
+                        // No 0xFF bytes, the common case
+                        p[0] = w >> 24;
+                        p[1] = w >> 16;
+                        p[2] = w >> 8;
+                        p[3] = w;
+                        p += 4;
+                    } else {
+                        putByte(w >> 24);
+                        putByte(w >> 16);
+                        putByte(w >> 8);
+                        putByte(w);
+                    }
+                }
+            }
+
+            // Pad the last byte with ones and return the end of the data
+            uint8_t *finish() {
+                int pad = (8 - (n & 7)) & 7;
+                acc = (acc << pad) | ((1u << pad) - 1);
+                n += pad;
+                while (n > 0) {
+                    n -= 8;
+                    putByte((uint8_t)(acc >> n));
+                }
+                return p;
+            }
+        private:
+            void putByte(uint8_t b) {
+                *p++ = b;
+                if (b == 0xFF) *p++ = 0;
+            }
+
+            uint8_t *p;
+            uint64_t acc;
+            int n;
+        };
+
+        void putMarker(std::vector<uint8_t> *out, uint8_t marker) {
+            out->push_back(0xFF);
+            out->push_back(marker);
+        }
+
+        void putShort(std::vector<uint8_t> *out, int v) {
+            out->push_back((uint8_t)(v >> 8));
+            out->push_back((uint8_t)v);
+        }
+
+        // Predictor 1: the left neighbour of the same component, the
+        // one above for the first column, and half range for the
+        // first sample
+        inline int predict(const uint16_t *row, int x, int y, int width, int components) {
+            if (x >= components) return row[x - components];
+            if (y > 0) return row[x - width];
+            return 1 << 15;
+        }
+
+        // Encode width x height samples of a tile as lossless JPEG,
+        // with the given number of interleaved components per row.
+        // scratch is reused between calls.
+        void encodeLosslessJPEG(const uint16_t *tile, int width, int height, int components,
+                                std::vector<uint8_t> *scratch, std::vector<uint8_t> *out) {
+            const int jpegWidth = width / components;
+            const int n = width * height;
+
+            unsigned freq[CATEGORIES];
+            memset(freq, 0, sizeof(freq));
+            for (int y = 0; y < height; y++) {
+                const uint16_t *row = tile + y*width;
+                for (int x = 0; x < width; x++) {
+                    freq[category((int16_t)(uint16_t)(row[x] - predict(row, x, y, width, components)))]++;
+                }
+            }
+
+            uint8_t bits[17], vals[CATEGORIES];
+            int count;
+            buildHuffmanTable(freq, bits, vals, &count);
+            uint32_t code[CATEGORIES];
+            int size[CATEGORIES];
+            memset(size, 0, sizeof(size));
+            {
+                uint32_t c = 0;
+                int k = 0;
+                for (int len = 1; len <= 16; len++) {
+                    for (int i = 0; i < bits[len]; i++) {
+                        code[vals[k]] = c++;
+                        size[vals[k]] = len;
+                        k++;
+                    }
+                    c <<= 1;
+                }
+            }
+
+            out->clear();
+            putMarker(out, M_SOI);
+
+            putMarker(out, M_DHT);
+            putShort(out, 2 + 1 + 16 + count);
+            out->push_back(0x00); // DC table 0
+            out->insert(out->end(), bits + 1, bits + 17);
+            out->insert(out->end(), vals, vals + count);
+
+            putMarker(out, M_SOF3);
+            putShort(out, 8 + 3*components);
+            out->push_back(16); // precision
+            putShort(out, height);
+            putShort(out, jpegWidth);
+            out->push_back((uint8_t)components);
+            for (int c = 0; c < components; c++) {
+                out->push_back((uint8_t)c);
+                out->push_back(0x11); // no subsampling
+                out->push_back(0);
+            }
+
+            putMarker(out, M_SOS);
+            putShort(out, 6 + 2*components);
+            out->push_back((uint8_t)components);
+            for (int c = 0; c < components; c++) {
+                out->push_back((uint8_t)c);
+                out->push_back(0x00); // Huffman table 0
+            }
+            out->push_back(1); // predictor
+            out->push_back(0);
+            out->push_back(0); // no point transform
+
+            // At most 31 bits per sample, doubled by byte stuffing
+            scratch->resize(8*(size_t)n + 16);
+            BitWriter bw(&(*scratch)[0]);
+            for (int y = 0; y < height; y++) {
+                const uint16_t *row = tile + y*width;
+                for (int x = 0; x < width; x++) {
+                    int d = (int16_t)(uint16_t)(row[x] - predict(row, x, y, width, components));
+                    int s = category(d);
+                    if (s == 0 || s == 16) {
+                        bw.put(code[s], size[s]);
+                    } else {
+                        uint32_t extra = (uint32_t)(d < 0 ? d - 1 : d) & ((1u << s) - 1);
+                        bw.put((code[s] << s) | extra, size[s] + s);
+                    }
+                }
+            }
+            uint8_t *end = bw.finish();
+            out->insert(out->end(), &(*scratch)[0], end);
+
+            putMarker(out, M_EOI);
+        }
+
+        // Reads entropy coded data up to the next marker
+        class BitReader {
+        public:
+            BitReader(const uint8_t *p, const uint8_t *end): p(p), end(end), acc(0), n(0) {}
+
+            // Buffer at least 32 bits, enough for one sample
+            void fill() {
+                while (n <= 56) {
+                    uint64_t b = 0;
+                    // Past the end of the data or at a marker, read zeros
+                    if (p < end) {
+                        if (*p != 0xFF) {
+                            b = *p++;
+                        } else if (p + 1 < end && p[1] == 0) {
+                            b = 0xFF;
+                            p += 2;
+                        }
+                    }
+                    acc |= b << (56 - n);
+                    n += 8;
+                }
+            }
+            // count <= 32
+            uint32_t peek(int count) const {
+                return (uint32_t)(acc >> (64 - count));
+            }
+            void skip(int count) {
+                acc <<= count;
+                n -= count;
+            }
+        private:
+            const uint8_t *p, *end;
+            uint64_t acc;
+            int n;
+        };
+
+        struct HuffmanDecoder {
+            // Codes up to this long are decoded with a single lookup
+            enum {FAST_BITS = 9};
+
+            bool defined;
+            // (length << 8) | symbol, or 0 for longer codes
+            uint16_t fast[1 << FAST_BITS];
+            int maxCode[17];
+            int valOffset[17];
+            uint8_t vals[256];
+
+            HuffmanDecoder(): defined(false) {}
+
+            // Returns false if the code lengths don't describe a
+            // valid prefix code
+            bool init(const uint8_t *bits, const uint8_t *v, int count) {
+                memcpy(vals, v, count);
+                memset(fast, 0, sizeof(fast));
+                int code = 0, k = 0;
+                for (int len = 1; len <= 16; len++) {
+                    // There are only 1 << len codes of this length
+                    if (code + bits[len] > (1 << len)) return false;
+                    valOffset[len] = k - code;
+                    for (int i = 0; i < bits[len]; i++, code++, k++) {
+                        if (len <= FAST_BITS) {
+                            int first = code << (FAST_BITS - len);
+                            for (int j = 0; j < 1 << (FAST_BITS - len); j++) {
+                                fast[first + j] = (uint16_t)((len << 8) | vals[k]);
+                            }
+                        }
+                    }
+                    maxCode[len] = bits[len] ? code - 1 : -1;
+                    code <<= 1;
+                }
+                defined = true;
+                return true;
+            }
+
+            // Returns -1 for an invalid code. Needs 16 buffered bits.
+            int decode(BitReader &br) const {
+                uint32_t bits = br.peek(16);
+                int f = fast[bits >> (16 - FAST_BITS)];
+                if (f) {
+                    br.skip(f >> 8);
+                    return f & 0xFF;
+                }
+                for (int len = FAST_BITS + 1; len <= 16; len++) {
+                    int code = bits >> (16 - len);
+                    if (code <= maxCode[len]) {
+                        br.skip(len);
+                        return vals[valOffset[len] + code];
+                    }
+                }
+                return -1;
+            }
+        };
+
+        // Decode a lossless JPEG stream into exactly count samples, in
+        // stream order. Supports a single scan of all components, with
+        // any predictor.
+        bool decodeLosslessJPEG(const uint8_t *data, size_t size, uint16_t *out, int count) {
+            const uint8_t *p = data, *end = data + size;
+            HuffmanDecoder tables[4];
+            int precision = 0, width = 0, height = 0, components = 0;
+            int componentIds[4];
+
+#define need(n) do { if ((n) < 0 || end - p < (int)(n)) return false; } while(0)
+
+            need(2);
+            if (p[0] != 0xFF || p[1] != M_SOI) return false;
+            p += 2;
+
+            while (1) {
+                // Find the next marker
+                need(2);
+                if (*p != 0xFF) return false;
+                while (p < end && *p == 0xFF) p++;
+                need(3);
+                uint8_t marker = *p++;
+                // The length counts its own two bytes
+                int length = (p[0] << 8) | p[1];
+                if (length < 2) return false;
+                need(length);
+                const uint8_t *seg = p + 2, *segEnd = p + length;
+                p += length;
+
+                switch (marker) {
+                case M_SOF3:
+                    if (length < 8) return false;
+                    precision = seg[0];
+                    height = (seg[1] << 8) | seg[2];
+                    width = (seg[3] << 8) | seg[4];
+                    components = seg[5];
+                    if (precision < 2 || precision > 16 ||
+                        components < 1 || components > 4 ||
+                        length < 8 + 3*components) return false;
+                    for (int c = 0; c < components; c++) {
+                        componentIds[c] = seg[6 + 3*c];
+                    }
+                    break;
+                case M_DHT:
+                    while (seg < segEnd) {
+                        if (segEnd - seg < 17) return false;
+                        int id = seg[0] & 0x0F;
+                        if (id > 3) return false;
+                        uint8_t bits[17];
+                        bits[0] = 0;
+                        int n = 0;
+                        for (int i = 1; i <= 16; i++) {
+                            bits[i] = seg[i];
+                            n += bits[i];
+                        }
+                        if (n > 256 || segEnd - seg < 17 + n) return false;
+                        if (!tables[id].init(bits, seg + 17, n)) return false;
+                        seg += 17 + n;
+                    }
+                    break;
+                case M_DRI:
+                    // Restart intervals aren't used by DNG writers
+                    if (length >= 4 && ((seg[0] << 8) | seg[1]) != 0) return false;
+                    break;
+                case M_SOS: {
+                    if (!components || length < 6) return false;
+                    int scanComponents = seg[0];
+                    if (scanComponents != components || length < 6 + 2*components) return false;
+                    const HuffmanDecoder *table[4];
+                    for (int c = 0; c < components; c++) {
+                        if (seg[1 + 2*c] != componentIds[c]) return false;
+                        const HuffmanDecoder &t = tables[seg[2 + 2*c] >> 4 & 3];
+                        if (!t.defined) return false;
+                        table[c] = &t;
+                    }
+                    const uint8_t *params = seg + 1 + 2*components;
+                    int predictor = params[0];
+                    int pointTransform = params[2] & 0x0F;
+                    if (predictor < 1 || predictor > 7 || pointTransform != 0) return false;
+
+                    const int rowLength = width*components;
+                    if ((long)rowLength*height != count) return false;
+                    const int mask = (1 << precision) - 1;
+
+                    BitReader br(p, end);
+                    for (int y = 0; y < height; y++) {
+                        uint16_t *row = out + y*rowLength;
+                        const uint16_t *above = row - rowLength;
+                        for (int x = 0, c = 0; x < rowLength; x++, c = c + 1 < components ? c + 1 : 0) {
+                            int pred;
+                            if (y == 0) {
+                                pred = x < components ? 1 << (precision - 1) : row[x - components];
+                            } else if (x < components) {
+                                pred = above[x];
+                            } else {
+                                int ra = row[x - components], rb = above[x], rc = above[x - components];
+                                switch (predictor) {
+                                case 1: pred = ra; break;
+                                case 2: pred = rb; break;
+                                case 3: pred = rc; break;
+                                case 4: pred = ra + rb - rc; break;
+                                case 5: pred = ra + ((rb - rc) >> 1); break;
+                                case 6: pred = rb + ((ra - rc) >> 1); break;
+                                default: pred = (ra + rb) >> 1; break;
+                                }
+                            }
+                            br.fill();
+                            int s = table[c]->decode(br);
+                            int diff;
+                            if (s < 0 || s > 16) {
+                                return false;
+                            } else if (s == 16) {
+                                diff = 32768;
+                            } else if (s == 0) {
+                                diff = 0;
+                            } else {
+                                diff = br.peek(s);
+                                br.skip(s);
+                                if (diff < (1 << (s - 1))) diff -= (1 << s) - 1;
+                            }
+                            row[x] = (uint16_t)((pred + diff) & mask);
+                        }
+                    }
+                    return true;
+                }
+                case M_EOI:
+                    return false;
+                default:
+                    // Skip application and comment segments
+                    break;
+                }
+            }
+#undef need
+        }
+
+        // Horizontal differencing with a stride of the given number of
+        // samples, applied to each row of a tile
+        void differenceRows(uint16_t *tile, int width, int height, int stride) {
+            for (int y = 0; y < height; y++) {
+                uint16_t *row = tile + y*width;
+                for (int x = width - 1; x >= stride; x--) {
+                    row[x] -= row[x - stride];
+                }
+            }
+        }
+
+        void accumulateRows(uint16_t *tile, int width, int height, int stride) {
+            for (int y = 0; y < height; y++) {
+                uint16_t *row = tile + y*width;
+                for (int x = stride; x < width; x++) {
+                    row[x] += row[x - stride];
+                }
+            }
+        }
+
+        struct TileGrid {
+            int width, length;
+            int across, down;
+
+            TileGrid(const Image &img, int width, int length):
+                width(width), length(length),
+                across((img.width() + width - 1) / width),
+                down((img.height() + length - 1) / length) {}
+
+            int count() const {return across*down;}
+        };
+
+        // Copy a tile out of the image. Pixels past the edges of the
+        // image repeat the nearest pixel of the same bayer color, so
+        // they cost next to nothing to code.
+        void loadTile(const Image &img, const TileGrid &grid, int i, uint16_t *tile) {
+            const int x0 = (i % grid.across)*grid.width;
+            const int y0 = (i / grid.across)*grid.length;
+            const int w = std::min(grid.width, (int)img.width() - x0);
+            const int h = std::min(grid.length, (int)img.height() - y0);
+            for (int y = 0; y < grid.length; y++) {
+                int sy = y < h ? y : std::max(h - 2 + ((y - h) & 1), 0);
+                const uint16_t *src = (const uint16_t *)img(x0, y0 + sy);
+                uint16_t *dst = tile + y*grid.width;
+                memcpy(dst, src, w*sizeof(uint16_t));
+                for (int x = w; x < grid.width; x++) {
+                    dst[x] = dst[std::max(w - 2 + ((x - w) & 1), 0)];
+                }
+            }
+        }
+
+        void storeTile(Image &img, const TileGrid &grid, int i, const uint16_t *tile) {
+            const int x0 = (i % grid.across)*grid.width;
+            const int y0 = (i / grid.across)*grid.length;
+            const int w = std::min(grid.width, (int)img.width() - x0);
+            const int h = std::min(grid.length, (int)img.height() - y0);
+            for (int y = 0; y < h; y++) {
+                memcpy(img(x0, y0 + y), tile + y*grid.width, w*sizeof(uint16_t));
+            }
+        }
+
+        struct WriteJob {
+            WriteJob(const Image &img, int tileWidth, int tileLength): grid(img, tileWidth, tileLength) {}
+
+            Image img;
+            uint16_t compression;
+            TileGrid grid;
+            FILE *fw;
+
+            // Everything below is protected by the lock
+            pthread_mutex_t lock;
+            std::vector<std::vector<uint8_t> > finished;
+            std::vector<char> ready;
+            int nextToWrite;
+            bool writing;
+            bool failed;
+            std::vector<int> *offsets, *byteCounts;
+        };
+
+        // Compresses a range of tiles. Whichever thread finishes the
+        // next tile in file order writes it, along with any after it
+        // that are already done.
+        class WriteTiles : public ParallelTask {
+        public:
+            WriteTiles(WriteJob &job_) : job(job_) {}
+            void run(int begin, int end);
+        private:
+            WriteJob &job;
+        };
+
+        void WriteTiles::run(int begin, int end) {
+            const int n = job.grid.count();
+            std::vector<uint16_t> tile(job.grid.width*job.grid.length);
+            std::vector<uint8_t> data, scratch;
+
+            for (int i = begin; i < end; i++) {
+                loadTile(job.img, job.grid, i, &tile[0]);
+                if (job.compression == TIFF_Compression_JPEG) {
+                    encodeLosslessJPEG(&tile[0], job.grid.width, job.grid.length, 2, &scratch, &data);
+                } else {
+                    differenceRows(&tile[0], job.grid.width, job.grid.length, 2);
+                    uLongf bytes = compressBound(tile.size()*sizeof(uint16_t));
+                    data.resize(bytes);
+                    if (compress2(&data[0], &bytes, (const Bytef *)&tile[0],
+                                  tile.size()*sizeof(uint16_t), DEFLATE_LEVEL) != Z_OK) {
+                        bytes = 0;
+                    }
+                    data.resize(bytes);
+                }
+
+                pthread_mutex_lock(&job.lock);
+                job.finished[i].swap(data);
+                job.ready[i] = 1;
+                if (job.writing) {
+                    // The current writer will get to it
+                    pthread_mutex_unlock(&job.lock);
+                    continue;
+                }
+                job.writing = true;
+                while (job.nextToWrite < n && job.ready[job.nextToWrite]) {
+                    int w = job.nextToWrite;
+                    std::vector<uint8_t> out;
+                    out.swap(job.finished[w]);
+                    pthread_mutex_unlock(&job.lock);
+
+                    long offset = ftell(job.fw);
+                    bool ok = !out.empty() &&
+                        fwrite(&out[0], 1, out.size(), job.fw) == out.size();
+
+                    pthread_mutex_lock(&job.lock);
+                    (*job.offsets)[w] = (int)offset;
+                    (*job.byteCounts)[w] = (int)out.size();
+                    if (!ok) job.failed = true;
+                    job.nextToWrite++;
+                }
+                job.writing = false;
+                pthread_mutex_unlock(&job.lock);
+            }
+        }
+
+        struct ReadJob {
+            ReadJob(const Image &img, int tileWidth, int tileLength): grid(img, tileWidth, tileLength) {}
+
+            Image img;
+            const std::vector<std::vector<uint8_t> > *tiles;
+            uint16_t compression;
+            int predictorStride;
+            TileGrid grid;
+            volatile int failedTile;
+        };
+
+        class ReadTiles : public ParallelTask {
+        public:
+            ReadTiles(ReadJob &job_) : job(job_) {}
+            void run(int begin, int end);
+        private:
+            ReadJob &job;
+        };
+
+        void ReadTiles::run(int begin, int end) {
+            const int samples = job.grid.width*job.grid.length;
+            std::vector<uint16_t> tile(samples);
+
+            for (int i = begin; i < end; i++) {
+                const std::vector<uint8_t> &data = (*job.tiles)[i];
+                bool ok = !data.empty();
+                if (ok) {
+                    switch (job.compression) {
+                    case TIFF_Compression_Uncompressed:
+                        ok = data.size() >= samples*sizeof(uint16_t);
+                        if (ok) memcpy(&tile[0], &data[0], samples*sizeof(uint16_t));
+                        break;
+                    case TIFF_Compression_JPEG:
+                        ok = decodeLosslessJPEG(&data[0], data.size(), &tile[0], samples);
+                        break;
+                    default: {
+                        uLongf bytes = samples*sizeof(uint16_t);
+                        ok = uncompress((Bytef *)&tile[0], &bytes, &data[0], data.size()) == Z_OK &&
+                            bytes == samples*sizeof(uint16_t);
+                        break;
+                    }
+                    }
+                }
+                if (!ok) {
+                    job.failedTile = i;
+                    continue;
+                }
+                if (job.predictorStride) {
+                    accumulateRows(&tile[0], job.grid.width, job.grid.length, job.predictorStride);
+                }
+                storeTile(job.img, job.grid, i, &tile[0]);
+            }
+        }
+
+        // A few chunks per thread evens out the load without
+        // reallocating the tile buffers for every tile
+        int tileGrain(int tiles) {
+            return std::max(1, tiles/(4*threadCount()));
+        }
+    }
+
+    bool writeTiles(FILE *fw, const Image &img, uint16_t compression,
+                    int tileWidth, int tileLength,
+                    std::vector<int> *tileOffsets, std::vector<int> *tileByteCounts) {
+        if (img.type() != RAW) {
+            error(Event::FileSaveError, "writeTiles: Only RAW images can be saved as compressed tiles");
+            return false;
+        }
+        if (compression != TIFF_Compression_JPEG &&
+            compression != TIFF_Compression_Deflate) {
+            error(Event::FileSaveError, "writeTiles: Unsupported compression type %d", compression);
+            return false;
+        }
+        if (tileWidth <= 0 || tileLength <= 0 || tileWidth % 16 || tileLength % 16) {
+            error(Event::FileSaveError, "writeTiles: Tile size %dx%d is not a multiple of 16",
+                  tileWidth, tileLength);
+            return false;
+        }
+
+        WriteJob job(img, tileWidth, tileLength);
+        const int n = job.grid.count();
+        job.img = img;
+        job.compression = compression;
+        job.fw = fw;
+        pthread_mutex_init(&job.lock, NULL);
+        job.finished.resize(n);
+        job.ready.assign(n, 0);
+        job.nextToWrite = 0;
+        job.writing = false;
+        job.failed = false;
+        tileOffsets->assign(n, 0);
+        tileByteCounts->assign(n, 0);
+        job.offsets = tileOffsets;
+        job.byteCounts = tileByteCounts;
+
+        WriteTiles task(job);
+        parallelFor(0, n, task, tileGrain(n));
+        pthread_mutex_destroy(&job.lock);
+
+        if (job.failed) {
+            error(Event::FileSaveError, "writeTiles: Unable to compress and write all %d tiles", n);
+            return false;
+        }
+        dprintf(4, "writeTiles: Wrote %d tiles of %dx%d, compression %d\n", n, tileWidth, tileLength, compression);
+        return true;
+    }
+
+    bool readTiles(const std::vector<std::vector<uint8_t> > &tiles, Image img,
+                   uint16_t compression, uint16_t predictor,
+                   int tileWidth, int tileLength, const char *file) {
+        if (img.type() != RAW) {
+            warning(Event::FileLoadError, "readTiles: %s: Only 16-bit tiled images are supported", file);
+            return false;
+        }
+
+        ReadJob job(img, tileWidth, tileLength);
+        const int n = job.grid.count();
+        if ((int)tiles.size() != n) {
+            warning(Event::FileLoadError, "readTiles: %s: Expected %d tiles, found %d",
+                    file, n, (int)tiles.size());
+            return false;
+        }
+
+        job.img = img;
+        job.tiles = &tiles;
+        job.compression = compression;
+        switch (compression) {
+        case TIFF_Compression_Uncompressed:
+        case TIFF_Compression_JPEG:
+        case TIFF_Compression_Deflate:
+        case TIFF_Compression_Deflate_old:
+            break;
+        default:
+            warning(Event::FileLoadError, "readTiles: %s: Unsupported compression type %d", file, compression);
+            return false;
+        }
+        switch (predictor) {
+        case TIFF_Predictor_None: job.predictorStride = 0; break;
+        case TIFF_Predictor_Horizontal: job.predictorStride = 1; break;
+        case DNG_Predictor_HorizontalX2: job.predictorStride = 2; break;
+        case DNG_Predictor_HorizontalX4: job.predictorStride = 4; break;
+        default:
+            warning(Event::FileLoadError, "readTiles: %s: Unsupported predictor %d", file, predictor);
+            return false;
+        }
+        if (compression == TIFF_Compression_JPEG) job.predictorStride = 0;
+        job.failedTile = -1;
+
+        ReadTiles task(job);
+        parallelFor(0, n, task, tileGrain(n));
+
+        if (job.failedTile >= 0) {
+            warning(Event::FileLoadError, "readTiles: %s: Tile %d is corrupt or uses unsupported coding",
+                    file, job.failedTile);
+            return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef FCAM_TIFF_TILES_H
+#define FCAM_TIFF_TILES_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+
+#include <FCam/Image.h>
+
+namespace FCam {
+
+    // Compressed, tiled image data for TIFF and DNG files. Only RAW
+    // (16-bit, one sample per pixel) images are supported, which is
+    // what DNG needs for the CFA data. Two compressions are
+    // available:
+    //
+    // TIFF_Compression_JPEG: Lossless JPEG (ITU T.81 process 14,
+    // predictor 1) with an optimal Huffman table per tile. Each tile
+    // row is coded as two interleaved components, so that a sample is
+    // predicted from its same-colored neighbour. This is what DNG
+    // readers expect for compressed raw data.
+    //
+    // TIFF_Compression_Deflate: zlib, after differencing each sample
+    // against the one two to the left (DNG 1.4's horizontal
+    // difference X2 predictor).
+    //
+    // Tiles are compressed and decompressed on all available cores.
+
+    // Default tile size for writing. DNG wants multiples of 16.
+    const int TIFF_TileWidth_DEFAULT = 256;
+    const int TIFF_TileLength_DEFAULT = 256;
+
+    // Compress img into tiles of tileWidth x tileLength and write them
+    // to fw in order, starting at the current file position. Returns
+    // the file offset and size of each tile, left to right, top to
+    // bottom.
+    bool writeTiles(FILE *fw, const Image &img, uint16_t compression,
+                    int tileWidth, int tileLength,
+                    std::vector<int> *tileOffsets, std::vector<int> *tileByteCounts);
+
+    // Decompress tiles as stored in a file into img, which must
+    // already have its final size. tiles[i] is the data of tile i,
+    // in the order of TileOffsets. Reports a FileLoadError and
+    // returns false on malformed data.
+    bool readTiles(const std::vector<std::vector<uint8_t> > &tiles, Image img,
+                   uint16_t compression, uint16_t predictor,
+                   int tileWidth, int tileLength, const char *file);
+}
+
+#endif
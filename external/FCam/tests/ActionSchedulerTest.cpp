@@ -0,0 +1,151 @@
+// Test of the Tegra action scheduler. Host only, see the Makefile.
+//
+// Streams shots with several deferred actions each through the simulated
+// camera, and fails unless every scheduled action fired and the 99th
+// percentile of the fire time error, from Sensor::actionStatistics(), is
+// within a bound. Then checks cancel() and cancelAll() on a scheduler of
+// its own, including actions far enough out to wait on the outer wheels.
+//
+// Usage: ActionSchedulerTest [frames [p99 bound in us]]
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <FCam/Tegra.h>
+#include <FCam/Tegra/ActionScheduler.h>
+#include <FCam/Tegra/hal/SimulatedCamera.h>
+
+using namespace FCam;
+
+namespace {
+
+    volatile int fired = 0;
+
+    class Tick : public CopyableAction<Tick> {
+    public:
+        int type() const {return CustomAction;}
+        void doAction() {__sync_fetch_and_add(&fired, 1);}
+    };
+
+    int failures = 0;
+
+    void check(bool ok, const char *what, int a, int b) {
+        if (ok) return;
+        printf("ActionSchedulerTest: %s (%d, %d)\n", what, a, b);
+        failures++;
+    }
+
+    void printHistogram(const Tegra::ActionScheduler::Stats &stats) {
+        const int width = 50;
+        std::vector<unsigned> h = stats.errorHistogram(width, 10);
+        printf("fire time error histogram (%d us buckets):", width);
+        for (size_t i = 0; i < h.size(); i++) printf(" %u", h[i]);
+        printf("\n");
+    }
+
+    // Deferred actions on streamed shots
+    void streamTest(int frames, int bound) {
+        const int frameTime = 10000, actionsPerShot = 4;
+
+        Tegra::Hal::SimulatedCamera::Config config;
+        config.frameTime = frameTime;
+        config.processingLatency = 3000;
+        Tegra::Hal::SimulatedProduct::setCameraConfig(config);
+
+        Tegra::Sensor sensor;
+        Tegra::Shot shot;
+        shot.exposure = 8000;
+        shot.frameTime = frameTime;
+        shot.gain = 1;
+        shot.image = Image(640, 480, YUV420p, Image::AutoAllocate);
+        for (int i = 0; i < actionsPerShot; i++) {
+            Tick t;
+            t.time = 1000 + i*1500;
+            t.latency = 0;
+            shot.addAction(t);
+        }
+
+        fired = 0;
+        sensor.stream(shot);
+        for (int i = 0; i < frames; i++) sensor.getFrame();
+        sensor.stopStreaming();
+        while (sensor.shotsPending()) sensor.getFrame();
+        // The actions all fall within their frame's exposure, so they've
+        // fired by the time it's delivered
+        Tegra::ActionScheduler::Stats stats = sensor.actionStatistics();
+        sensor.stop();
+
+        printf("streamed: %u actions scheduled, %u fired, %u cancelled, "
+               "error p50 %d us, p99 %d us, max %d us\n",
+               stats.scheduled, stats.fired, stats.cancelled, stats.errorPercentile(50),
+               stats.errorPercentile(99), stats.errorPercentile(100));
+        printHistogram(stats);
+
+        check(stats.scheduled >= (unsigned)(frames*actionsPerShot),
+              "fewer actions scheduled than requested", stats.scheduled, frames*actionsPerShot);
+        check(stats.fired == stats.scheduled, "not every action fired", stats.fired, stats.scheduled);
+        check(stats.fired == (unsigned)fired, "fired count doesn't match doAction() calls",
+              stats.fired, fired);
+        check(stats.cancelled == 0, "actions cancelled", stats.cancelled, 0);
+        check(stats.errorPercentile(99) <= bound, "p99 fire time error over the bound (us)",
+              stats.errorPercentile(99), bound);
+    }
+
+    void *runScheduler(void *arg) {
+        ((Tegra::ActionScheduler *)arg)->run();
+        return NULL;
+    }
+
+    // cancel() and cancelAll() on a standalone scheduler
+    void cancelTest() {
+        Tegra::ActionScheduler scheduler;
+        pthread_t thread;
+        pthread_create(&thread, NULL, runScheduler, &scheduler);
+
+        int keep, drop, late;
+        fired = 0;
+        Time now = Time::now();
+        Tick t;
+        // Spread over 300 ms, so they land on the first two wheel levels
+        for (int i = 0; i < 50; i++) {
+            scheduler.schedule(t.copy(), now + 2000 + (i*7919) % 300000, i % 2 ? &keep : &drop);
+        }
+        // Far enough out for the outer wheel
+        scheduler.schedule(t.copy(), now + 5000000, &late);
+        scheduler.cancel(&drop);
+        usleep(400000);
+
+        Tegra::ActionScheduler::Stats stats = scheduler.statistics();
+        check(stats.scheduled == 51, "scheduled", stats.scheduled, 51);
+        check(stats.fired == 25 && fired == 25, "fired after cancel()", stats.fired, fired);
+        check(stats.cancelled == 25, "cancelled by cancel()", stats.cancelled, 25);
+
+        scheduler.cancelAll();
+        usleep(10000);
+        stats = scheduler.statistics();
+        check(stats.cancelled == 26, "cancelled after cancelAll()", stats.cancelled, 26);
+        check(fired == 25, "an action fired after cancelAll()", fired, 25);
+
+        scheduler.shutdown();
+        pthread_join(thread, NULL);
+        printf("cancel: %u scheduled, %u fired, %u cancelled\n",
+               stats.scheduled, stats.fired, stats.cancelled);
+    }
+
+}
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 200;
+    int bound = argc > 2 ? atoi(argv[2]) : 1000;
+
+    streamTest(frames, bound);
+    cancelTest();
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+// Benchmark of demosaic() and the streamed saveJPEG() over several frame
+// sizes. Host only, see the Makefile.
+//
+// On x86 the Makefile builds this twice: DemosaicBench uses the tiled
+// SSE2/AVX2 path and DemosaicBench-generic the scalar one. "make bench"
+// runs both and fails unless they print the same checksums, since the
+// tiled path must be bit-exact with the scalar one.
+//
+// Usage: DemosaicBench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+#include <FCam/Tegra.h>
+#include <FCam/processing/Demosaic.h>
+#include <FCam/processing/JPEG.h>
+
+using namespace FCam;
+
+namespace {
+
+    unsigned hash(unsigned h, const unsigned char *data, size_t bytes) {
+        // FNV-1a
+        for (size_t i = 0; i < bytes; i++) h = (h ^ data[i]) * 16777619u;
+        return h;
+    }
+
+    unsigned hashImage(unsigned h, Image im) {
+        for (unsigned y = 0; y < im.height(); y++) {
+            h = hash(h, im(0, y), im.width()*im.bytesPerPixel());
+        }
+        return h;
+    }
+
+    unsigned hashFile(unsigned h, const char *filename) {
+        FILE *f = fopen(filename, "rb");
+        if (!f) return 0;
+        std::vector<unsigned char> buf(1 << 16);
+        size_t n;
+        while ((n = fread(&buf[0], 1, buf.size(), f)) > 0) h = hash(h, &buf[0], n);
+        fclose(f);
+        return h;
+    }
+
+    // A gradient with some noise, so denoising has work to do
+    Frame makeFrame(int width, int height) {
+        Tegra::_Frame *f = new Tegra::_Frame;
+        f->image = Image(width, height, RAW);
+        unsigned s = 1;
+        for (int y = 0; y < height; y++) {
+            unsigned short *row = (unsigned short *)f->image(0, y);
+            for (int x = 0; x < width; x++) {
+                s = s*1103515245 + 12345;
+                row[x] = (unsigned short)(((x*7 + y*3) & 1023) + ((s >> 16) & 63));
+            }
+        }
+        f->exposure = 10000;
+        f->gain = 1;
+        f->whiteBalance = 5000;
+        return Frame(f);
+    }
+
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 3;
+    const int sizes[][2] = {{640, 480}, {1000, 777}, {1280, 720}, {1920, 1080}, {2592, 1944}};
+    const char *jpeg = "DemosaicBench.jpg";
+
+    for (int k = 0; k < 5; k++) {
+        int width = sizes[k][0], height = sizes[k][1];
+        Frame frame = makeFrame(width, height);
+
+        Image out;
+        Time start = Time::now();
+        for (int i = 0; i < iterations; i++) out = demosaic(frame);
+        float demosaicMs = (Time::now() - start)/(1000.0f*iterations);
+        unsigned h = hashImage(2166136261u, out);
+
+        // Without denoising, and with other curve settings
+        h = hashImage(h, demosaic(frame, 30.0f, false, 10, 1.8f));
+
+        start = Time::now();
+        for (int i = 0; i < iterations; i++) saveJPEG(frame, jpeg, 90);
+        float jpegMs = (Time::now() - start)/(1000.0f*iterations);
+        h = hashFile(h, jpeg);
+        unlink(jpeg);
+
+        printf("%4dx%-4d demosaic %7.1f ms, saveJPEG %7.1f ms, checksum %08x\n",
+               width, height, demosaicMs, jpegMs, h);
+    }
+    return 0;
+}
@@ -0,0 +1,128 @@
+// Benchmark of RingQueue against TSQueue. Host only, see the Makefile.
+//
+// The throughput test has one or more producers push a sequence of
+// numbers that a single consumer pulls, as the Daemon's queues do, and
+// checks that every number arrives. The handoff test has a producer push
+// a timestamp every so often to a consumer blocked in pull(), and reports
+// percentiles of the time until the consumer has it, which is what each
+// frame pays at each queue between the setter, handler and user threads.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include <FCam/RingQueue.h>
+#include <FCam/TSQueue.h>
+#include <FCam/Time.h>
+
+using namespace FCam;
+
+namespace {
+
+    // TSQueue grows without bound, RingQueue refuses when it's full
+    template<typename T> void pushItem(TSQueue<T> &q, const T &v) {
+        q.push(v);
+    }
+
+    template<typename T> void pushItem(RingQueue<T> &q, const T &v) {
+        while (!q.push(v)) sched_yield();
+    }
+
+    int failures = 0;
+
+    // ======================================================================
+    // THROUGHPUT
+    // ======================================================================
+
+    template<class Q> struct ThroughputArg {
+        Q *queue;
+        long items;
+    };
+
+    template<class Q> void *throughputProducer(void *ptr) {
+        ThroughputArg<Q> *arg = (ThroughputArg<Q> *)ptr;
+        for (long i = 1; i <= arg->items; i++) pushItem(*arg->queue, i);
+        return NULL;
+    }
+
+    template<class Q> void throughput(const char *name, int producers, long items) {
+        Q queue;
+        ThroughputArg<Q> arg = {&queue, items};
+        std::vector<pthread_t> threads(producers);
+        Time start = Time::now();
+        for (int i = 0; i < producers; i++) {
+            pthread_create(&threads[i], NULL, throughputProducer<Q>, &arg);
+        }
+        long long sum = 0;
+        for (long i = 0; i < producers*items; i++) sum += queue.pull();
+        for (int i = 0; i < producers; i++) pthread_join(threads[i], NULL);
+        int us = Time::now() - start;
+
+        if (sum != producers*((long long)items*(items+1)/2)) {
+            printf("%s: items lost or duplicated\n", name);
+            failures++;
+        }
+        printf("%-10s %d producer%s: %6.1f ns per item\n", name, producers,
+               producers > 1 ? "s" : " ", us*1000.0/(producers*items));
+    }
+
+    // ======================================================================
+    // HANDOFF LATENCY
+    // ======================================================================
+
+    template<class Q> struct HandoffArg {
+        Q *queue;
+        int items;
+        int interval;
+    };
+
+    template<class Q> void *handoffProducer(void *ptr) {
+        HandoffArg<Q> *arg = (HandoffArg<Q> *)ptr;
+        for (int i = 0; i < arg->items; i++) {
+            usleep(arg->interval);
+            pushItem(*arg->queue, Time::now());
+        }
+        return NULL;
+    }
+
+    template<class Q> void handoff(const char *name, int items, int interval) {
+        Q queue;
+        HandoffArg<Q> arg = {&queue, items, interval};
+        pthread_t thread;
+        pthread_create(&thread, NULL, handoffProducer<Q>, &arg);
+        std::vector<int> latency(items);
+        for (int i = 0; i < items; i++) {
+            Time sent = queue.pull();
+            latency[i] = Time::now() - sent;
+        }
+        pthread_join(thread, NULL);
+
+        std::sort(latency.begin(), latency.end());
+        printf("%-10s handoff to a blocked consumer: p50 %d us, p90 %d us, p99 %d us, max %d us\n",
+               name, latency[items/2], latency[items*9/10], latency[items*99/100],
+               latency[items-1]);
+    }
+
+}
+
+int main(int argc, char **argv) {
+    long items = argc > 1 ? atol(argv[1]) : 1000000;
+    int handoffs = argc > 2 ? atoi(argv[2]) : 2000;
+
+    for (int p = 1; p <= 2; p++) {
+        throughput<TSQueue<long> >("TSQueue", p, items/p);
+        throughput<RingQueue<long> >("RingQueue", p, items/p);
+    }
+    handoff<TSQueue<Time> >("TSQueue", handoffs, 500);
+    handoff<RingQueue<Time> >("RingQueue", handoffs, 500);
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
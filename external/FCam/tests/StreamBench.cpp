@@ -0,0 +1,70 @@
+// Streaming benchmark of the Tegra runtime on the simulated camera hal.
+// Host only, see the Makefile.
+//
+// Streams a YUV420p shot through Sensor::stream and getFrame and reports
+// the sustained frame rate, percentiles of the capture to delivery
+// latency, and the frames the pipeline failed to feed or that the sensor
+// refused, as counted by the simulated camera after a warm-up.
+//
+// Usage: StreamBench [frames [frameTime [width height [source...]]]]
+//
+// The frame time is in microseconds. Sources are DNG or dump files to
+// replay; without any, the simulated camera renders a test pattern.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <FCam/Tegra.h>
+#include <FCam/Tegra/hal/SimulatedCamera.h>
+
+using namespace FCam;
+
+int main(int argc, char **argv) {
+    int frames = argc > 1 ? atoi(argv[1]) : 300;
+    int frameTime = argc > 2 ? atoi(argv[2]) : 10000;
+    int width = argc > 4 ? atoi(argv[3]) : 640;
+    int height = argc > 4 ? atoi(argv[4]) : 480;
+    const int warmup = 30;
+
+    Tegra::Hal::SimulatedCamera::Config config;
+    config.frameTime = frameTime;
+    config.processingLatency = frameTime/3;
+    for (int i = 5; i < argc; i++) config.sources.push_back(argv[i]);
+    Tegra::Hal::SimulatedProduct::setCameraConfig(config);
+
+    Tegra::Sensor sensor;
+    Tegra::Shot shot;
+    shot.exposure = frameTime*4/5;
+    shot.frameTime = frameTime;
+    shot.gain = 1;
+    shot.image = Image(width, height, YUV420p, Image::AutoAllocate);
+
+    Tegra::Hal::SimulatedCamera *camera =
+        (Tegra::Hal::SimulatedCamera *)sensor.getHardwareInterface();
+
+    sensor.stream(shot);
+    int valid = 0;
+    for (int i = 0; i < warmup + frames; i++) {
+        if (i == warmup) camera->resetStatistics();
+        Tegra::Frame f = sensor.getFrame();
+        if (i >= warmup && f.image().valid()) valid++;
+    }
+    sensor.stopStreaming();
+    Tegra::Hal::SimulatedCamera::Stats stats = camera->statistics();
+    sensor.stop();
+
+    printf("%d frames of %dx%d at %d us, %d with images\n",
+           frames, width, height, frameTime, valid);
+    printf("fps %.2f (sensor rate %.2f)\n", stats.fps(), 1e6f/frameTime);
+    printf("latency mean %.0f us, p50 %d, p90 %d, p99 %d, max %d\n",
+           stats.meanLatency(), stats.latencyPercentile(50), stats.latencyPercentile(90),
+           stats.latencyPercentile(99), stats.latencyMax);
+    printf("frames missed %u, captures rejected %u\n",
+           stats.framesMissed, stats.capturesRejected);
+
+    if (valid != frames) {
+        printf("FAILED: %d frames had no image\n", frames - valid);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+// Benchmark of tagging frames. Host only, see the Makefile.
+//
+// Counts the heap allocations and times the tagging each frame gets at
+// streaming rates: the twenty tags Tegra::Lens and Tegra::Flash put on
+// every frame, and a short string and a small vector like the ones
+// applications add. It tags with names looked up from string literals,
+// as most code does, and with TagNames interned once, as the devices
+// do, on new frames and on a frame that already has the tags.
+//
+// Usage: TagBench [frames]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <FCam/Tegra.h>
+#include <FCam/Frame.h>
+
+using namespace FCam;
+
+namespace {
+    long allocations = 0;
+}
+
+// These are out of line, or gcc sees through them to the malloc() and
+// free() and warns that they don't match new and delete
+__attribute__((noinline)) void *operator new(size_t bytes) {
+    allocations++;
+    void *p = malloc(bytes ? bytes : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t bytes) {
+    return operator new(bytes);
+}
+
+__attribute__((noinline)) void operator delete(void *p) throw() {
+    free(p);
+}
+
+void operator delete[](void *p) throw() {
+    free(p);
+}
+
+namespace {
+
+    const char *names[] = {
+        "lens.initialFocus", "lens.finalFocus", "lens.focus", "lens.focusSpeed",
+        "lens.zoom", "lens.initialZoom", "lens.finalZoom", "lens.zoomSpeed",
+        "lens.aperture", "lens.initialAperture", "lens.finalAperture", "lens.apertureSpeed",
+        "lens.minZoom", "lens.maxZoom", "lens.wideApertureMin", "lens.wideApertureMax",
+        "flash.brightness", "flash.duration", "flash.start", "flash.peak",
+        "app.mode", "app.gains"
+    };
+    const int tagCount = sizeof(names)/sizeof(names[0]);
+
+    // Key is either const char * or TagName
+    std::string mode;
+    std::vector<int> gains;
+
+    template<typename Key> void tagFrame(Frame f, const Key *keys, float focus) {
+        for (int i = 0; i < 16; i++) f[keys[i]] = focus + i;
+        for (int i = 16; i < 20; i++) f[keys[i]] = i;
+        f[keys[20]] = mode;
+        f[keys[21]] = gains;
+    }
+
+    template<typename Key> void bench(const char *name, const Key *keys, int frames) {
+        // Once first, so anything allocated once per process is done
+        tagFrame(Frame(new Tegra::_Frame), keys, 0);
+
+        long before = allocations;
+        Time start = Time::now();
+        for (int i = 0; i < frames; i++) {
+            Frame f(new Tegra::_Frame);
+            tagFrame(f, keys, i*0.1f);
+        }
+        float newUs = (float)(Time::now() - start)/frames;
+        float newAllocations = (float)(allocations - before)/frames;
+
+        // The frame's own allocations, to tell them apart
+        before = allocations;
+        for (int i = 0; i < frames; i++) Frame f(new Tegra::_Frame);
+        float frameAllocations = (float)(allocations - before)/frames;
+
+        Frame f(new Tegra::_Frame);
+        tagFrame(f, keys, 0);
+        before = allocations;
+        start = Time::now();
+        for (int i = 0; i < frames; i++) tagFrame(f, keys, i*0.1f);
+        float retagUs = (float)(Time::now() - start)/frames;
+        float retagAllocations = (float)(allocations - before)/frames;
+
+        printf("%-15s new frame: %5.1f allocations (%4.1f for the frame), %6.2f us; "
+               "retagging: %5.1f allocations, %6.2f us\n",
+               name, newAllocations, frameAllocations, newUs, retagAllocations, retagUs);
+    }
+
+}
+
+int main(int argc, char **argv) {
+    // A minute at 30 fps
+    int frames = argc > 1 ? atoi(argv[1]) : 1800;
+
+    mode = "burst";
+    gains.resize(3, 256);
+    gains[1] = 300;
+    std::vector<TagName> atoms(names, names + tagCount);
+    printf("%d tags per frame, sizeof(TagValue) %d\n", tagCount, (int)sizeof(TagValue));
+    bench("string literals", names, frames);
+    bench("TagNames", &atoms[0], frames);
+    return 0;
+}
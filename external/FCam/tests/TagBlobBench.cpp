@@ -0,0 +1,136 @@
+// Benchmark of encoding and decoding frame tags. Host only, see the
+// Makefile.
+//
+// Times appendTagMapBlob() and readTagMapBlob() on two tag sets like the
+// ones frames carry: the scalars the devices tag every frame with, and
+// those plus the vectors an application adds (histograms, sharpness maps,
+// curves), against the text format of the stream operators.
+//
+// Usage: TagBlobBench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <FCam/Frame.h>
+
+using namespace FCam;
+
+namespace {
+
+    int failures = 0;
+
+    TagMap makeTags(bool vectors) {
+        TagMap m;
+        const char *lens[] = {
+            "lens.initialFocus", "lens.finalFocus", "lens.focus", "lens.focusSpeed",
+            "lens.initialZoom", "lens.finalZoom", "lens.zoom", "lens.zoomSpeed",
+            "lens.initialAperture", "lens.finalAperture", "lens.aperture", "lens.apertureSpeed",
+            "lens.minZoom", "lens.maxZoom", "lens.wideAperture", "lens.narrowAperture",
+            "lens.farFocus", "lens.nearFocus"
+        };
+        for (int i = 0; i < 18; i++) m[lens[i]] = 1.5f*i;
+        m["flash.start"] = 100;
+        m["flash.duration"] = 2000;
+        m["flash.peak"] = 300;
+        m["flash.brightness"] = 4.5f;
+        m["sensor.model"] = std::string("ov5650");
+        m["frame.exposureStartTime"] = Time(12345, 678);
+        if (!vectors) return m;
+
+        std::vector<int> histogram(3*256);
+        for (size_t i = 0; i < histogram.size(); i++) histogram[i] = i*37 % 1000;
+        m["app.histogram"] = histogram;
+        std::vector<int> sharpness(3*40*30);
+        for (size_t i = 0; i < sharpness.size(); i++) sharpness[i] = i*91 % 65536;
+        m["app.sharpness"] = sharpness;
+        std::vector<float> curve(1024);
+        for (size_t i = 0; i < curve.size(); i++) curve[i] = i*0.37f;
+        m["app.curve"] = curve;
+        m["app.names"] = std::vector<std::string>(16, "string value");
+        return m;
+    }
+
+    std::string toText(const TagMap &tags) {
+        std::ostringstream out;
+        for (TagMap::const_iterator it = tags.begin(); it != tags.end(); it++) {
+            out << TagValue(it->first) << ' ' << it->second << ' ';
+        }
+        return out.str();
+    }
+
+    void fromText(const std::string &text, TagMap *tags) {
+        std::istringstream in(text);
+        TagValue key, value;
+        while ((in >> std::ws) && !in.eof()) {
+            in >> key >> std::ws >> value;
+            if (!in) break;
+            (*tags)[key.asString()] = value;
+        }
+    }
+
+    float usSince(Time start, int iterations) {
+        return (float)(Time::now() - start)/iterations;
+    }
+
+    void bench(const char *name, const TagMap &tags, int iterations) {
+        std::string blob;
+        Time start = Time::now();
+        for (int i = 0; i < iterations; i++) {
+            blob.clear();
+            appendTagMapBlob(tags, &blob);
+        }
+        float encode = usSince(start, iterations);
+
+        TagMap back;
+        start = Time::now();
+        for (int i = 0; i < iterations; i++) {
+            TagMap t;
+            if (!readTagMapBlob(blob.data(), blob.size(), &t)) failures++;
+            if (i == 0) back = t;
+        }
+        float decode = usSince(start, iterations);
+
+        // Text is much slower, so time fewer of those
+        int textIterations = iterations/10 + 1;
+        std::string text;
+        start = Time::now();
+        for (int i = 0; i < textIterations; i++) text = toText(tags);
+        float textEncode = usSince(start, textIterations);
+
+        TagMap textBack;
+        start = Time::now();
+        for (int i = 0; i < textIterations; i++) {
+            TagMap t;
+            fromText(text, &t);
+            if (i == 0) textBack = t;
+        }
+        float textDecode = usSince(start, textIterations);
+
+        if (back.size() != tags.size() || textBack.size() != tags.size()) {
+            printf("%s: tags lost in a round trip\n", name);
+            failures++;
+        }
+
+        printf("%-12s %2d tags: blob %6d bytes, encode %7.2f us, decode %7.2f us; "
+               "text %6d bytes, encode %8.2f us, decode %8.2f us\n",
+               name, (int)tags.size(), (int)blob.size(), encode, decode,
+               (int)text.size(), textEncode, textDecode);
+    }
+
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 5000;
+
+    bench("scalars", makeTags(false), iterations);
+    bench("with vectors", makeTags(true), iterations/10 + 1);
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
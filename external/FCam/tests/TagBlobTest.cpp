@@ -0,0 +1,197 @@
+// Test of the binary tag format. Host only, see the Makefile.
+//
+// Round trips a value of every TagValue type, including empty and edge
+// case values, through TagValue::toBlob() and fromBlob(), and a TagMap of
+// all of them through appendTagMapBlob() and readTagMapBlob(). Then reads
+// the map back from every truncation of its blob, which must fail except
+// at a tag boundary and never leave a Null tag behind, and from many
+// randomly corrupted copies, which only must not crash or leave Null tags
+// (build with "make check SAN=address" to catch overreads).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <float.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <FCam/Frame.h>
+#include <FCam/Event.h>
+
+using namespace FCam;
+
+namespace {
+
+    int failures = 0;
+
+    void check(bool ok, const char *what, int n) {
+        if (ok) return;
+        if (failures++ < 20) printf("TagBlobTest: %s (%d)\n", what, n);
+    }
+
+    bool same(TagValue a, TagValue b) {
+        if (a.type != b.type) return false;
+        switch (a.type) {
+        case TagValue::Null:         return true;
+        case TagValue::Int:          return a.asInt() == b.asInt();
+        case TagValue::Float:        return a.asFloat() == b.asFloat();
+        case TagValue::Double:       return a.asDouble() == b.asDouble();
+        case TagValue::String:       return a.asString() == b.asString();
+        case TagValue::Time:         return a.asTime() == b.asTime();
+        case TagValue::IntVector:    return a.asIntVector() == b.asIntVector();
+        case TagValue::FloatVector:  return a.asFloatVector() == b.asFloatVector();
+        case TagValue::DoubleVector: return a.asDoubleVector() == b.asDoubleVector();
+        case TagValue::StringVector: return a.asStringVector() == b.asStringVector();
+        case TagValue::TimeVector:   return a.asTimeVector() == b.asTimeVector();
+        }
+        return false;
+    }
+
+    // One or more values of each type, keyed by name
+    TagMap makeTags() {
+        TagMap m;
+        m["null"] = TagValue();
+        m["int"] = 42;
+        m["int.min"] = INT_MIN;
+        m["int.max"] = INT_MAX;
+        m["float"] = -1.5f;
+        m["float.min"] = FLT_MIN;
+        m["double"] = 3.141592653589793;
+        m["double.max"] = DBL_MAX;
+        m["string"] = std::string("ov5650");
+        m["string.empty"] = std::string();
+        m["string.binary"] = std::string("a\0b\n\"c\xff", 7);
+        m["time"] = Time(1234567, 890);
+
+        std::vector<int> iv;
+        for (int i = 0; i < 1000; i++) iv.push_back(i*i - 500*i);
+        m["intVector"] = iv;
+        m["intVector.empty"] = std::vector<int>();
+
+        std::vector<float> fv;
+        for (int i = 0; i < 333; i++) fv.push_back(i*0.37f - 20);
+        m["floatVector"] = fv;
+
+        std::vector<double> dv;
+        for (int i = 0; i < 77; i++) dv.push_back(i/7.0);
+        m["doubleVector"] = dv;
+        m["doubleVector.one"] = std::vector<double>(1, 2.5);
+
+        std::vector<std::string> sv;
+        sv.push_back("lens");
+        sv.push_back("");
+        sv.push_back(std::string(300, 'x'));
+        m["stringVector"] = sv;
+
+        std::vector<Time> tv;
+        for (int i = 0; i < 5; i++) tv.push_back(Time(i*1000, i*999));
+        m["timeVector"] = tv;
+        return m;
+    }
+
+    void roundTripValues(const TagMap &tags) {
+        for (TagMap::const_iterator it = tags.begin(); it != tags.end(); it++) {
+            std::string blob = it->second.toBlob();
+            std::string appended;
+            it->second.appendBlob(&appended);
+            check(blob == appended, "toBlob() and appendBlob() differ for type", it->second.type);
+
+            TagValue back;
+            size_t used = TagValue::fromBlob(blob.data(), blob.size(), &back);
+            check(used == blob.size(), "fromBlob() didn't use the whole blob for type", it->second.type);
+            check(same(back, it->second), "fromBlob() changed a value of type", it->second.type);
+            check(same(TagValue::fromString(blob), it->second),
+                  "fromString() of a blob changed a value of type", it->second.type);
+        }
+    }
+
+    void roundTripMap(const TagMap &tags) {
+        std::string blob;
+        appendTagMapBlob(tags, &blob);
+        TagMap back;
+        check(readTagMapBlob(blob.data(), blob.size(), &back), "readTagMapBlob() failed", 0);
+        check(back.size() == tags.size(), "readTagMapBlob() lost tags", (int)back.size());
+        for (TagMap::const_iterator it = tags.begin(); it != tags.end(); it++) {
+            TagMap::const_iterator b = back.find(it->first);
+            check(b != back.end() && same(b->second, it->second), "a tag changed in the map", 0);
+        }
+    }
+
+    bool hasNull(const TagMap &tags) {
+        for (TagMap::const_iterator it = tags.begin(); it != tags.end(); it++) {
+            if (it->second.type == TagValue::Null) return true;
+        }
+        return false;
+    }
+
+    // Every prefix of the blob
+    void truncations(TagMap tags) {
+        // A Null tag would make the Null check below meaningless
+        tags.erase("null");
+        std::string blob;
+        std::set<size_t> boundaries;
+        boundaries.insert(0);
+        for (TagMap::const_iterator it = tags.begin(); it != tags.end(); it++) {
+            TagValue(it->first).appendBlob(&blob);
+            it->second.appendBlob(&blob);
+            boundaries.insert(blob.size());
+        }
+
+        int failed = 0;
+        for (size_t n = 0; n <= blob.size(); n++) {
+            TagMap back;
+            bool ok = readTagMapBlob(blob.data(), n, &back);
+            if (!ok) failed++;
+            check(ok == (boundaries.count(n) > 0),
+                  "readTagMapBlob() of a truncated blob returned the wrong result at", (int)n);
+            check(!hasNull(back), "a truncated blob left a Null tag at", (int)n);
+            for (TagMap::const_iterator it = back.begin(); it != back.end(); it++) {
+                TagMap::const_iterator t = tags.find(it->first);
+                check(t != tags.end() && same(t->second, it->second),
+                      "a truncated blob decoded a wrong tag at", (int)n);
+            }
+        }
+        printf("truncation: %d bytes, %d of %d prefixes rejected\n",
+               (int)blob.size(), failed, (int)blob.size() + 1);
+    }
+
+    // Random bytes overwritten in copies of the blob
+    void corruptions(TagMap tags, int trials) {
+        tags.erase("null");
+        std::string blob;
+        appendTagMapBlob(tags, &blob);
+
+        srand(1);
+        int failed = 0;
+        Event e;
+        for (int i = 0; i < trials; i++) {
+            std::string c = blob;
+            int bytes = 1 + rand() % 4;
+            for (int k = 0; k < bytes; k++) c[rand() % c.size()] = (char)rand();
+            TagMap back;
+            if (!readTagMapBlob(c.data(), c.size(), &back)) failed++;
+            check(!hasNull(back), "a corrupted blob left a Null tag in trial", i);
+            // Don't let the parse errors pile up
+            while (getNextEvent(&e)) {}
+        }
+        printf("corruption: %d trials, %d rejected\n", trials, failed);
+    }
+
+}
+
+int main(int argc, char **argv) {
+    int trials = argc > 1 ? atoi(argv[1]) : 20000;
+
+    TagMap tags = makeTags();
+    roundTripValues(tags);
+    roundTripMap(tags);
+    truncations(tags);
+    corruptions(tags, trials);
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
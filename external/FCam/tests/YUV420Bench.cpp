@@ -0,0 +1,217 @@
+// Test and benchmark of the YUV420p conversions. Host only, see the
+// Makefile.
+//
+// Checks every conversion, over the whole image and over a region,
+// against the conversion formula applied a pixel at a time, then times
+// them against the original RGB24 conversion they replaced. On x86 the
+// Makefile also builds YUV420Bench-generic with only the scalar kernels,
+// and "make bench" fails unless both print the same checksums.
+//
+// Usage: YUV420Bench [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include <FCam/Tegra.h>
+#include <FCam/Tegra/YUV420.h>
+
+using namespace FCam;
+using namespace FCam::Tegra;
+
+namespace {
+
+    int failures = 0;
+
+    void fail(const char *what, int width, int height, int x, int y) {
+        if (failures++ < 10) {
+            printf("YUV420Bench: %s differs at %d, %d in %dx%d\n", what, x, y, width, height);
+        }
+    }
+
+    unsigned char clamp(int n) {
+        return (unsigned char)(n < 1 ? 1 : n > 255 ? 255 : n);
+    }
+
+    // The conversion formula, one pixel at a time
+    void reference(Image src, int x, int y, unsigned char *rgb) {
+        const unsigned char *uPlane = src(0, src.height());
+        const unsigned char *vPlane = uPlane + (src.width()/2)*(src.height()/2);
+        int c = (y/2)*(src.width()/2) + x/2;
+        int l = (-1 + 149*src(x, y)[0])/2, u = uPlane[c], v = vPlane[c];
+        rgb[0] = clamp((l - (14216 - 102*v))/64);
+        rgb[1] = clamp((l + ((8696 - 25*u) - 52*v))/64);
+        rgb[2] = clamp((l - (17672 - 129*u))/64);
+    }
+
+    // The RGB24 conversion before it was vectorized and threaded, for
+    // timing. It has the chroma addressing bugs since fixed, so it's
+    // only compared for speed.
+    void originalRGB24(Image dst, Image im) {
+        for (unsigned j = 0; j < im.height(); j += 2) {
+            unsigned int uvrow = j/4;
+            unsigned int uvcol = 0;
+            unsigned char *rgb = dst(0, j);
+            unsigned char *dataYPtr = im(0, j);
+            unsigned char *dataUPtr = im(uvcol, im.height() + uvrow);
+            unsigned char *dataVPtr = im(uvcol, im.height() + im.height()/4 + uvrow);
+            for (unsigned i = 0; i < im.width(); i += 2) {
+                int y1 = (-1+149*dataYPtr[0])/2;
+                int y2 = (-1+149*dataYPtr[1])/2;
+                int y3 = (-1+149*dataYPtr[im.width()])/2;
+                int y4 = (-1+149*dataYPtr[im.width() + 1])/2;
+                int u = dataUPtr[0], v = dataVPtr[0];
+                int ruv = (14216-102*v);
+                int guv = ((8696-25*u)-52*v);
+                int buv = (17672-129*u);
+                rgb[0] = clamp((y1 - ruv)/64);
+                rgb[1] = clamp((y1 + guv)/64);
+                rgb[2] = clamp((y1 - buv)/64);
+                rgb[3] = clamp((y2 - ruv)/64);
+                rgb[4] = clamp((y2 + guv)/64);
+                rgb[5] = clamp((y2 - buv)/64);
+                rgb[0+im.width()*3] = clamp((y3 - ruv)/64);
+                rgb[1+im.width()*3] = clamp((y3 + guv)/64);
+                rgb[2+im.width()*3] = clamp((y3 - buv)/64);
+                rgb[3+im.width()*3] = clamp((y4 - ruv)/64);
+                rgb[4+im.width()*3] = clamp((y4 + guv)/64);
+                rgb[5+im.width()*3] = clamp((y4 - buv)/64);
+                rgb += 6;
+                dataYPtr += 2;
+                dataUPtr += 1;
+                dataVPtr += 1;
+            }
+        }
+    }
+
+    unsigned hash(unsigned h, const void *data, size_t bytes) {
+        // FNV-1a
+        const unsigned char *p = (const unsigned char *)data;
+        for (size_t i = 0; i < bytes; i++) h = (h ^ p[i]) * 16777619u;
+        return h;
+    }
+
+    // Run each conversion over the region, check it, and return a
+    // checksum of the outputs
+    unsigned check(Image src, Rect roi) {
+        const int w = roi.width, h = roi.height;
+        Image rgb(w, h, RGB24);
+        std::vector<unsigned char> rgba(w*h*4), nv12(w*h*3/2);
+        std::vector<float> planes(w*h*3);
+        bool ok = convertYUV420ToRGB24(rgb, src, roi) &&
+            convertYUV420ToRGBA32(&rgba[0], w*4, src, roi, 200) &&
+            convertYUV420ToFloat(&planes[0], &planes[w*h], &planes[2*w*h], w, src, roi) &&
+            convertYUV420ToNV12(&nv12[0], w, &nv12[w*h], w, src, roi);
+        if (!ok) {
+            fail("a conversion refused the region", w, h, roi.x, roi.y);
+            return 0;
+        }
+
+        const unsigned char *uPlane = src(0, src.height());
+        const unsigned char *vPlane = uPlane + (src.width()/2)*(src.height()/2);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                int sx = roi.x + x, sy = roi.y + y, i = y*w + x;
+                unsigned char expected[3];
+                reference(src, sx, sy, expected);
+                const unsigned char *p = rgb(x, y);
+                for (int c = 0; c < 3; c++) {
+                    if (p[c] != expected[c]) fail("RGB24", w, h, x, y);
+                    if (rgba[i*4 + c] != expected[c]) fail("RGBA32", w, h, x, y);
+                    if (planes[c*w*h + i] != expected[c]/255.0f) fail("float", w, h, x, y);
+                }
+                if (rgba[i*4 + 3] != 200) fail("RGBA32 alpha", w, h, x, y);
+                if (nv12[i] != src(sx, sy)[0]) fail("NV12 luma", w, h, x, y);
+                if (!(x & 1) && !(y & 1)) {
+                    int c = (sy/2)*(src.width()/2) + sx/2;
+                    const unsigned char *uv = &nv12[w*h + (y/2)*w + x];
+                    if (uv[0] != uPlane[c] || uv[1] != vPlane[c]) fail("NV12 chroma", w, h, x, y);
+                }
+            }
+        }
+
+        unsigned sum = 2166136261u;
+        for (int y = 0; y < h; y++) sum = hash(sum, rgb(0, y), w*3);
+        sum = hash(sum, &rgba[0], rgba.size());
+        sum = hash(sum, &planes[0], planes.size()*sizeof(float));
+        return hash(sum, &nv12[0], nv12.size());
+    }
+
+    template<class F> float time(int iterations, F f) {
+        Time start = Time::now();
+        for (int i = 0; i < iterations; i++) f();
+        return (Time::now() - start)/(1000.0f*iterations);
+    }
+
+    struct RunOriginal {
+        Image dst, src;
+        void operator()() {originalRGB24(dst, src);}
+    };
+
+    struct RunRGB24 {
+        Image dst, src;
+        void operator()() {convertYUV420ToRGB24(dst, src);}
+    };
+
+    struct RunRGBA32 {
+        unsigned char *dst;
+        Image src;
+        void operator()() {convertYUV420ToRGBA32(dst, src.width()*4, src);}
+    };
+
+    struct RunFloat {
+        float *dst;
+        Image src;
+        void operator()() {
+            int n = src.width()*src.height();
+            convertYUV420ToFloat(dst, dst + n, dst + 2*n, src.width(), src);
+        }
+    };
+
+    struct RunNV12 {
+        unsigned char *dst;
+        Image src;
+        void operator()() {
+            convertYUV420ToNV12(dst, src.width(), dst + src.width()*src.height(), src.width(), src);
+        }
+    };
+
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 20;
+    const int sizes[][2] = {{64, 48}, {640, 480}, {1000, 750}, {1280, 720}, {2592, 1944}};
+
+    for (int k = 0; k < 5; k++) {
+        const int width = sizes[k][0], height = sizes[k][1];
+        Image src(width, height, YUV420p);
+        unsigned s = 1;
+        unsigned char *p = src(0, 0);
+        for (int i = 0; i < width*height*3/2; i++) {
+            s = s*1103515245 + 12345;
+            p[i] = (unsigned char)(s >> 16);
+        }
+
+        unsigned sum = check(src, Rect(0, 0, width, height));
+        sum ^= check(src, Rect((width/4) & ~1, (height/4) & ~1, (width/2) & ~1, (height/2) & ~1));
+
+        Image rgb(width, height, RGB24);
+        std::vector<unsigned char> bytes(width*height*4);
+        std::vector<float> planes(width*height*3);
+        RunOriginal original = {rgb, src};
+        RunRGB24 rgb24 = {rgb, src};
+        RunRGBA32 rgba32 = {&bytes[0], src};
+        RunFloat flt = {&planes[0], src};
+        RunNV12 nv12 = {&bytes[0], src};
+        printf("%4dx%-4d original %6.2f ms, RGB24 %6.2f ms, RGBA32 %6.2f ms, "
+               "float %6.2f ms, NV12 %6.2f ms, checksum %08x\n",
+               width, height, time(iterations, original), time(iterations, rgb24),
+               time(iterations, rgba32), time(iterations, flt), time(iterations, nv12), sum);
+    }
+
+    if (failures) {
+        printf("FAILED\n");
+        return 1;
+    }
+    return 0;
+}
@@ -21,7 +21,7 @@ LOCAL_SRC_FILES     := \
 	Filter.cpp GaussTransform.cpp Geometry.cpp HDR.cpp Image.cpp \
 	KernelEstimation.cpp LAHBPCG.cpp LaplacianFilter.cpp LightField.cpp \
 	LocalLaplacian.cpp main.cpp Network.cpp NetworkOps.cpp Operation.cpp \
-	OpticalFlow.cpp Paint.cpp Panorama.cpp Parser.cpp \
+	OpticalFlow.cpp Paint.cpp Panorama.cpp Parallel.cpp Parser.cpp \
 	PatchMatch.cpp Plugin.cpp Prediction.cpp Projection.cpp Stack.cpp \
 	Statistics.cpp Wavelet.cpp WLS.cpp
 
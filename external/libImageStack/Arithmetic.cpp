@@ -1,7 +1,318 @@
 #include "main.h"
 #include "Arithmetic.h"
+#include "Parallel.h"
 #include "header.h"
 
+// The per-pixel loops below are split by rows across the thread pool
+// (see Parallel.h). Each is written as a small functor over one
+// sample, wrapped in one of these row functors.
+
+namespace {
+
+// a = f(a, c) for every sample of a. If f.uniform() it ignores c,
+// and the row is treated as one flat run of samples.
+template<typename F>
+struct UnaryRows {
+    UnaryRows(Window a_, F f_) : a(a_), f(f_) {}
+    void operator()(int t, int y) {
+        // Stores to a could alias the members as far as the compiler
+        // knows, so work from local copies
+        Window a = this->a;
+        F f = this->f;
+        float *aPtr = a(0, y, t);
+        if (f.uniform()) {
+            for (int x = 0; x < a.width*a.channels; x++) {
+                aPtr[x] = f(aPtr[x], 0);
+            }
+            return;
+        }
+        for (int x = 0; x < a.width; x++) {
+            for (int c = 0; c < a.channels; c++) {
+                aPtr[c] = f(aPtr[c], c);
+            }
+            aPtr += a.channels;
+        }
+    }
+    Window a;
+    F f;
+};
+
+template<typename F>
+void unary(Window a, F f) {
+    UnaryRows<F> rows(a, f);
+    parallelForRows(a.frames, a.height, rows);
+}
+
+// a = f(a, b) for every sample of a. If b has fewer channels than a,
+// its channels are repeated across each pixel of a.
+template<typename F>
+struct BinaryRows {
+    BinaryRows(Window a_, Window b_, F f_) : a(a_), b(b_), f(f_) {}
+    void operator()(int t, int y) {
+        Window a = this->a, b = this->b;
+        F f = this->f;
+        float *aPtr = a(0, y, t);
+        float *bPtr = b(0, y, t);
+        if (a.channels == b.channels) {
+            for (int x = 0; x < a.width*a.channels; x++) {
+                aPtr[x] = f(aPtr[x], bPtr[x]);
+            }
+        } else {
+            for (int x = 0; x < a.width; x++) {
+                for (int c = 0; c < a.channels; c++) {
+                    aPtr[c] = f(aPtr[c], bPtr[c % b.channels]);
+                }
+                aPtr += a.channels;
+                bPtr += b.channels;
+            }
+        }
+    }
+    Window a, b;
+    F f;
+};
+
+template<typename F>
+void binary(Window a, Window b, F f) {
+    BinaryRows<F> rows(a, b, f);
+    parallelForRows(a.frames, a.height, rows);
+}
+
+struct AddOp {
+    float operator()(float a, float b) const {return a + b;}
+};
+
+struct AddScaledOp {
+    AddScaledOp(float k_) : k(k_) {}
+    float operator()(float a, float b) const {return a + b * k;}
+    float k;
+};
+
+struct SubtractOp {
+    float operator()(float a, float b) const {return a - b;}
+};
+
+struct MultiplyOp {
+    float operator()(float a, float b) const {return a * b;}
+};
+
+struct DivideOp {
+    float operator()(float a, float b) const {return a / b;}
+};
+
+struct MaxOp {
+    float operator()(float a, float b) const {return max(a, b);}
+};
+
+struct MinOp {
+    float operator()(float a, float b) const {return min(a, b);}
+};
+
+// Per-channel arguments for the ops below. A single argument applies
+// to every channel.
+struct ChannelArgs {
+    ChannelArgs(float k_) : k(k_) {}
+    ChannelArgs(const vector<float> &args) : k(args[0]) {
+        if (args.size() > 1) { v = args; }
+    }
+    bool uniform() const {return v.empty();}
+    float operator[](int c) const {return v.empty() ? k : v[c];}
+    vector<float> v;
+    float k;
+};
+
+void checkChannelArgs(const char *op, const vector<float> &args, int channels) {
+    assert(args.size() == 1 || args.size() == (size_t)channels,
+           "%s takes either 1 argument, or 1 argument per channel\n", op);
+}
+
+struct LogOp {
+    float operator()(float a, int) const {return logf(a);}
+    bool uniform() const {return true;}
+};
+
+struct ExpOp {
+    ExpOp(float base_) : base(base_) {}
+    float operator()(float a, int) const {return powf(base, a);}
+    bool uniform() const {return true;}
+    float base;
+};
+
+struct AbsOp {
+    float operator()(float a, int) const {return fabs(a);}
+    bool uniform() const {return true;}
+};
+
+struct OffsetOp {
+    OffsetOp(ChannelArgs args_) : args(args_) {}
+    float operator()(float a, int c) const {return a + args[c];}
+    bool uniform() const {return args.uniform();}
+    ChannelArgs args;
+};
+
+struct ScaleOp {
+    ScaleOp(ChannelArgs args_) : args(args_) {}
+    float operator()(float a, int c) const {return a * args[c];}
+    bool uniform() const {return args.uniform();}
+    ChannelArgs args;
+};
+
+struct GammaOp {
+    GammaOp(ChannelArgs args_) : args(args_) {}
+    float operator()(float a, int c) const {
+        if (a > 0) { return powf(a, args[c]); }
+        else { return -powf(-a, args[c]); }
+    }
+    bool uniform() const {return args.uniform();}
+    ChannelArgs args;
+};
+
+struct ModOp {
+    ModOp(ChannelArgs args_) : args(args_) {}
+    float operator()(float a, int c) const {return fmod(a, args[c]);}
+    bool uniform() const {return args.uniform();}
+    ChannelArgs args;
+};
+
+struct ClampOp {
+    ClampOp(float lower_, float upper_) : lower(lower_), upper(upper_) {}
+    float operator()(float a, int) const {return min(upper, max(lower, a));}
+    bool uniform() const {return true;}
+    float lower, upper;
+};
+
+struct DeNaNOp {
+    DeNaNOp(float replacement_) : replacement(replacement_) {}
+    float operator()(float a, int) const {return isnan(a) ? replacement : a;}
+    bool uniform() const {return true;}
+    float replacement;
+};
+
+struct ThresholdOp {
+    ThresholdOp(float threshold_) : threshold(threshold_) {}
+    float operator()(float a, int) const {return a > threshold ? 1.0f : 0.0f;}
+    bool uniform() const {return true;}
+    float threshold;
+};
+
+struct NormalizeOp {
+    NormalizeOp(float minValue_, float invDelta_) : minValue(minValue_), invDelta(invDelta_) {}
+    float operator()(float a, int) const {return (a - minValue) * invDelta;}
+    bool uniform() const {return true;}
+    float minValue, invDelta;
+};
+
+struct QuantizeOp {
+    QuantizeOp(float increment_) : increment(increment_) {}
+    float operator()(float a, int) const {return a - fmodf(a, increment);}
+    bool uniform() const {return true;}
+    float increment;
+};
+
+// A deferred f, for lazy evaluation
+template<typename F>
+class PointwiseStep : public PointwiseOp {
+public:
+    PointwiseStep(F f_) : f(f_) {}
+    void apply(Window im) {
+        UnaryRows<F> rows(im, f);
+        for (int t = 0; t < im.frames; t++) {
+            for (int y = 0; y < im.height; y++) {
+                rows(t, y);
+            }
+        }
+    }
+private:
+    F f;
+};
+
+// Apply f to the top of the stack, or defer it if evaluation is lazy
+template<typename F>
+void applyToTop(F f) {
+    if (lazy()) { defer(new PointwiseStep<F>(f)); }
+    else { unary(stack(0), f); }
+}
+
+// Runs a chain over one tile at a time. Tiles are at most TILE_SAMPLES
+// floats, so each stays in cache from the first op to the last.
+#define TILE_SAMPLES 8192
+struct ChainTiles {
+    ChainTiles(Window im_, const vector<PointwiseOp *> &ops_) : im(im_), ops(ops_) {
+        tileWidth = max(1, min(im.width, TILE_SAMPLES / im.channels));
+        tileHeight = max(1, TILE_SAMPLES / (tileWidth * im.channels));
+        tilesX = (im.width + tileWidth - 1) / tileWidth;
+        tilesY = (im.height + tileHeight - 1) / tileHeight;
+    }
+
+    void operator()(int t, int i) {
+        Window tile(im, (i % tilesX) * tileWidth, (i / tilesX) * tileHeight, t,
+                    tileWidth, tileHeight, 1);
+        for (size_t j = 0; j < ops.size(); j++) {
+            ops[j]->apply(tile);
+        }
+    }
+
+    Window im;
+    const vector<PointwiseOp *> &ops;
+    int tileWidth, tileHeight, tilesX, tilesY;
+};
+
+// The out-of-place products. a has at least as many channels as b.
+struct MultiplyRows {
+    MultiplyRows(Window out_, Window a_, Window b_, Multiply::Mode m_) :
+        out(out_), a(a_), b(b_), m(m_) {}
+
+    void operator()(int t, int y) {
+        Window out = this->out, a = this->a, b = this->b;
+        float *outPtr = out(0, y, t);
+        float *aPtr = a(0, y, t);
+        float *bPtr = b(0, y, t);
+        for (int x = 0; x < a.width; x++) {
+            if (b.channels == 1 || m == Multiply::Elementwise) {
+                for (int c = 0; c < a.channels; c++) {
+                    outPtr[c] = aPtr[c] * bPtr[c % b.channels];
+                }
+            } else if (m == Multiply::Inner) {
+                int ac = 0;
+                for (int oc = 0; oc < out.channels; oc++) {
+                    for (int bc = 0; bc < b.channels; bc++) {
+                        outPtr[oc] += aPtr[ac] * bPtr[bc];
+                        ac++;
+                    }
+                }
+            } else {
+                int oc = 0;
+                for (int ac = 0; ac < a.channels; ac++) {
+                    for (int bc = 0; bc < b.channels; bc++) {
+                        outPtr[oc] = aPtr[ac] * bPtr[bc];
+                        oc++;
+                    }
+                }
+            }
+            outPtr += out.channels;
+            aPtr += a.channels;
+            bPtr += b.channels;
+        }
+    }
+
+    Window out, a, b;
+    Multiply::Mode m;
+};
+
+}
+
+void PointwiseChain::clear() {
+    for (size_t i = 0; i < ops.size(); i++) {
+        delete ops[i];
+    }
+    ops.clear();
+}
+
+void PointwiseChain::apply(Window im) {
+    if (ops.empty() || !im.width || !im.channels) { return; }
+    ChainTiles tiles(im, ops);
+    parallelForRows(im.frames, tiles.tilesX * tiles.tilesY, tiles);
+}
+
 void Add::help() {
     printf("\n-add adds the second image in the stack to the top image in the stack.\n\n"
            "Usage: ImageStack -load a.tga -load b.tga -add -save out.tga.\n");
@@ -21,29 +332,7 @@ void Add::apply(Window a, Window b, float coefficient) {
            (a.channels == b.channels || b.channels == 1),
            "Cannot add images of different sizes or channel numbers\n");
 
-    if (a.channels != 1 && b.channels == 1) {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                for (int c = 0; c < a.channels; c++) {
-                    float *aPtr = a(0, y, t)+c;
-                    float *bPtr = b(0, y, t);
-                    for (int x = 0; x < a.width; x++) {
-                        aPtr[x *a.channels] += bPtr[x] * coefficient;
-                    }
-                }
-            }
-        }
-    } else {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                float *aPtr = a(0, y, t);
-                float *bPtr = b(0, y, t);
-                for (int x = 0; x < a.width*a.channels; x++) {
-                    aPtr[x] += bPtr[x] * coefficient;
-                }
-            }
-        }
-    }
+    binary(a, b, AddScaledOp(coefficient));
 }
 
 void Add::apply(Window a, Window b) {
@@ -53,29 +342,7 @@ void Add::apply(Window a, Window b) {
            (a.channels == b.channels || b.channels == 1),
            "Cannot add images of different sizes or channel numbers\n");
 
-    if (a.channels != 1 && b.channels == 1) {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                for (int c = 0; c < a.channels; c++) {
-                    float *aPtr = a(0, y, t)+c;
-                    float *bPtr = b(0, y, t);
-                    for (int x = 0; x < a.width; x++) {
-                        aPtr[x *a.channels] += bPtr[x];
-                    }
-                }
-            }
-        }
-    } else {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                float *aPtr = a(0, y, t);
-                float *bPtr = b(0, y, t);
-                for (int x = 0; x < a.width*a.channels; x++) {
-                    aPtr[x] += bPtr[x];
-                }
-            }
-        }
-    }
+    binary(a, b, AddOp());
 }
 
 
@@ -145,95 +412,19 @@ Image Multiply::apply(Window a, Window b, Mode m) {
     // This code is written on the assumption that this op will be
     // memory-bandwidth limited so too much optimization is foolish
 
-    if (b.channels == 1) { // scalar-vector case
-        out = Image(a.width, a.height, a.frames, a.channels);
-
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                for (int x = 0; x < a.width; x++) {
-                    for (int c = 0; c < a.channels; c++) {
-                        out(x, y, t)[c] = a(x, y, t)[c] * b(x, y, t)[0];
-                    }
-                }
-            }
-        }
-
-    } else if (m == Elementwise) {
+    if (b.channels == 1 || m == Elementwise) {
         out = Image(a.width, a.height, a.frames, a.channels);
-        if (a.channels == b.channels) {
-            for (int t = 0; t < a.frames; t++) {
-                for (int y = 0; y < a.height; y++) {
-                    for (int x = 0; x < a.width; x++) {
-                        for (int c = 0; c < a.channels; c++) {
-                            out(x, y, t)[c] = a(x, y, t)[c] * b(x, y, t)[c];
-                        }
-                    }
-                }
-            }
-        } else {
-            int factor = a.channels / b.channels;
-            for (int t = 0; t < a.frames; t++) {
-                for (int y = 0; y < a.height; y++) {
-                    for (int x = 0; x < a.width; x++) {
-                        int oc = 0;
-                        for (int c = 0; c < factor; c++) {
-                            for (int bc = 0; bc < b.channels; bc++) {
-                                out(x, y, t)[oc] = a(x, y, t)[oc] * b(x, y, t)[bc];
-                                oc++;
-                            }
-                        }
-                    }
-                }
-            }
-
-        }
     } else if (m == Inner) {
         out = Image(a.width, a.height, a.frames, a.channels/b.channels);
-        if (a.channels == b.channels) {
-            for (int t = 0; t < a.frames; t++) {
-                for (int y = 0; y < a.height; y++) {
-                    for (int x = 0; x < a.width; x++) {
-                        for (int c = 0; c < a.channels; c++) {
-                            out(x, y, t)[0] += a(x, y, t)[c] * b(x, y, t)[c];
-                        }
-                    }
-                }
-            }
-        } else {
-            int factor = a.channels / b.channels;
-            for (int t = 0; t < a.frames; t++) {
-                for (int y = 0; y < a.height; y++) {
-                    for (int x = 0; x < a.width; x++) {
-                        int ac = 0;
-                        for (int oc = 0; oc < factor; oc++) {
-                            for (int bc = 0; bc < b.channels; bc++) {
-                                out(x, y, t)[oc] += a(x, y, t)[ac] * b(x, y, t)[bc];
-                                ac++;
-                            }
-                        }
-                    }
-                }
-            }
-        }
     } else if (m == Outer) {
         out = Image(a.width, a.height, a.frames, a.channels*b.channels);
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                for (int x = 0; x < a.width; x++) {
-                    int oc = 0;
-                    for (int ac = 0; ac < a.channels; ac++) {
-                        for (int bc = 0; bc < b.channels; bc++) {
-                            out(x, y, t)[oc] = a(x, y, t)[ac] * b(x, y, t)[bc];
-                            oc++;
-                        }
-                    }
-                }
-            }
-        }
     } else {
         panic("Unknown multiplication type: %d\n", m);
     }
 
+    MultiplyRows rows(out, a, b, m);
+    parallelForRows(a.frames, a.height, rows);
+
     return out;
 }
 
@@ -246,32 +437,7 @@ void Multiply::applyElementwise(Window a, Window b) {
     assert(a.channels % b.channels == 0,
            "One input have a number of channels which is a multiple of the other's\n");
 
-    if (a.channels == b.channels) {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                for (int x = 0; x < a.width; x++) {
-                    for (int c = 0; c < a.channels; c++) {
-                        a(x, y, t)[c] *= b(x, y, t)[c];
-                    }
-                }
-            }
-        }
-    } else {
-        int factor = a.channels / b.channels;
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                for (int x = 0; x < a.width; x++) {
-                    int oc = 0;
-                    for (int c = 0; c < factor; c++) {
-                        for (int bc = 0; bc < b.channels; bc++) {
-                            a(x, y, t)[oc] *= b(x, y, t)[bc];
-                            oc++;
-                        }
-                    }
-                }
-            }
-        }
-    }
+    binary(a, b, MultiplyOp());
 }
 
 void Subtract::help() {
@@ -293,30 +459,7 @@ void Subtract::apply(Window a, Window b) {
            (a.channels == b.channels || b.channels == 1),
            "Cannot subtract images of different sizes or channel numbers\n");
 
-
-    if (a.channels != 1 && b.channels == 1) {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                for (int c = 0; c < a.channels; c++) {
-                    float *aPtr = a(0, y, t)+c;
-                    float *bPtr = b(0, y, t);
-                    for (int x = 0; x < a.width; x++) {
-                        aPtr[x *a.channels] -= bPtr[x];
-                    }
-                }
-            }
-        }
-    } else {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                float *aPtr = a(0, y, t);
-                float *bPtr = b(0, y, t);
-                for (int x = 0; x < a.width*a.channels; x++) {
-                    aPtr[x] -= bPtr[x];
-                }
-            }
-        }
-    }
+    binary(a, b, SubtractOp());
 }
 
 void Divide::help() {
@@ -338,31 +481,7 @@ void Divide::apply(Window a, Window b) {
            (a.channels == b.channels || b.channels == 1),
            "Cannot divide images of different sizes or channel numbers\n");
 
-
-    if (a.channels != 1 && b.channels == 1) {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                for (int c = 0; c < a.channels; c++) {
-                    float *aPtr = a(0, y, t)+c;
-                    float *bPtr = b(0, y, t);
-                    for (int x = 0; x < a.width; x++) {
-                        aPtr[x *a.channels] /= bPtr[x];
-                    }
-                }
-            }
-        }
-    } else {
-        for (int t = 0; t < a.frames; t++) {
-            for (int y = 0; y < a.height; y++) {
-                float *aPtr = a(0, y, t);
-                float *bPtr = b(0, y, t);
-                for (int x = 0; x < a.width*a.channels; x++) {
-                    aPtr[x] /= bPtr[x];
-                }
-            }
-        }
-    }
-
+    binary(a, b, DivideOp());
 }
 
 
@@ -385,17 +504,7 @@ void Maximum::apply(Window a, Window b) {
            a.channels == b.channels,
            "Cannot compare images of different sizes or channel numbers\n");
 
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    float aVal = a(x, y, t)[c];
-                    float bVal = b(x, y, t)[c];
-                    a(x, y, t)[c] = max(aVal, bVal);
-                }
-            }
-        }
-    }
+    binary(a, b, MaxOp());
 }
 
 
@@ -418,17 +527,7 @@ void Minimum::apply(Window a, Window b) {
            a.channels == b.channels,
            "Cannot compare images of different sizes or channel numbers\n");
 
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    float aVal = a(x, y, t)[c];
-                    float bVal = b(x, y, t)[c];
-                    a(x, y, t)[c] = min(aVal, bVal);
-                }
-            }
-        }
-    }
+    binary(a, b, MinOp());
 }
 
 
@@ -439,19 +538,11 @@ void Log::help() {
 
 void Log::parse(vector<string> args) {
     assert(args.size() == 0, "-log takes no arguments\n");
-    apply(stack(0));
+    applyToTop(LogOp());
 }
 
 void Log::apply(Window a) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] = logf(a(x, y, t)[c]);
-                }
-            }
-        }
-    }
+    unary(a, LogOp());
 }
 
 void Exp::help() {
@@ -461,21 +552,13 @@ void Exp::help() {
 }
 
 void Exp::parse(vector<string> args) {
-    if (args.size() == 0) { apply(stack(0)); }
-    else if (args.size() == 1) { apply(stack(0), readFloat(args[1])); }
+    if (args.size() == 0) { applyToTop(ExpOp(E)); }
+    else if (args.size() == 1) { applyToTop(ExpOp(readFloat(args[0]))); }
     else { panic("-exp takes zero or one arguments\n"); }
 }
 
 void Exp::apply(Window a, float base) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] = powf(base, a(x, y, t)[c]);
-                }
-            }
-        }
-    }
+    unary(a, ExpOp(base));
 }
 
 void Abs::help() {
@@ -485,19 +568,11 @@ void Abs::help() {
 
 void Abs::parse(vector<string> args) {
     assert(args.size() == 0, "-abs takes no arguments\n");
-    apply(stack(0));
+    applyToTop(AbsOp());
 }
 
 void Abs::apply(Window a) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] = fabs(a(x, y, t)[c]);
-                }
-            }
-        }
-    }
+    unary(a, AbsOp());
 }
 
 void Offset::help() {
@@ -512,36 +587,17 @@ void Offset::parse(vector<string> args) {
         fargs.push_back(readFloat(args[i]));
     }
 
-    apply(stack(0), fargs);
+    checkChannelArgs("-offset", fargs, peek(0).channels);
+    applyToTop(OffsetOp(fargs));
 }
 
 void Offset::apply(Window a, float offset) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] += offset;
-                }
-            }
-        }
-    }
+    unary(a, OffsetOp(offset));
 }
 
 void Offset::apply(Window a, vector<float> args) {
-    if (args.size() == 1) {
-        apply(a, args[0]);
-        return;
-    }
-    assert(args.size() == (size_t)a.channels, "-offset takes either 1 argument, or 1 argument per channel\n");
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] += args[c];
-                }
-            }
-        }
-    }
+    checkChannelArgs("-offset", args, a.channels);
+    unary(a, OffsetOp(args));
 }
 
 void Scale::help() {
@@ -556,37 +612,17 @@ void Scale::parse(vector<string> args) {
         fargs.push_back(readFloat(args[i]));
     }
 
-    apply(stack(0), fargs);
-
+    checkChannelArgs("-scale", fargs, peek(0).channels);
+    applyToTop(ScaleOp(fargs));
 }
 
 void Scale::apply(Window a, float scale) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] *= scale;
-                }
-            }
-        }
-    }
+    unary(a, ScaleOp(scale));
 }
 
 void Scale::apply(Window a, vector<float> args) {
-    if (args.size() == 1) {
-        apply(a, args[0]);
-        return;
-    }
-    assert(args.size() == (size_t)a.channels, "-scale takes either 1 argument, or 1 argument per channel\n");
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] *= args[c];
-                }
-            }
-        }
-    }
+    checkChannelArgs("-scale", args, a.channels);
+    unary(a, ScaleOp(args));
 }
 
 void Gamma::help() {
@@ -601,46 +637,17 @@ void Gamma::parse(vector<string> args) {
         fargs.push_back(readFloat(args[i]));
     }
 
-    apply(stack(0), fargs);
+    checkChannelArgs("-gamma", fargs, peek(0).channels);
+    applyToTop(GammaOp(fargs));
 }
 
 void Gamma::apply(Window a, float gamma) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                float *sample = a(x, y, t);
-                for (int c = 0; c < a.channels; c++) {
-                    if (sample[c] > 0) {
-                        sample[c] = powf(sample[c], gamma);
-                    } else {
-                        sample[c] = -powf(-sample[c], gamma);
-                    }
-                }
-            }
-        }
-    }
+    unary(a, GammaOp(gamma));
 }
 
 void Gamma::apply(Window a, vector<float> args) {
-    if (args.size() == 1) {
-        apply(a, args[0]);
-        return;
-    }
-    assert(args.size() == (size_t)a.channels, "-gamma takes either 1 argument, or 1 argument per channel\n");
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                float *sample = a(x, y, t);
-                for (int c = 0; c < a.channels; c++) {
-                    if (sample[c] > 0) {
-                        sample[c] = powf(sample[c], args[c]);
-                    } else {
-                        sample[c] = -powf(-sample[c], args[c]);
-                    }
-                }
-            }
-        }
-    }
+    checkChannelArgs("-gamma", args, a.channels);
+    unary(a, GammaOp(args));
 }
 
 void Mod::help() {
@@ -655,36 +662,17 @@ void Mod::parse(vector<string> args) {
         fargs.push_back(readFloat(args[i]));
     }
 
-    apply(stack(0), fargs);
+    checkChannelArgs("-mod", fargs, peek(0).channels);
+    applyToTop(ModOp(fargs));
 }
 
 void Mod::apply(Window a, float mod) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] = fmod(a(x, y, t)[c], mod);
-                }
-            }
-        }
-    }
+    unary(a, ModOp(mod));
 }
 
 void Mod::apply(Window a, vector<float> args) {
-    if (args.size() == 1) {
-        apply(a, args[0]);
-        return;
-    }
-    assert(args.size() == (size_t)a.channels, "-mod takes either 1 argument, or 1 argument per channel\n");
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] = fmod(a(x, y, t)[c], args[c]);
-                }
-            }
-        }
-    }
+    checkChannelArgs("-mod", args, a.channels);
+    unary(a, ModOp(args));
 }
 
 void Clamp::help() {
@@ -696,26 +684,16 @@ void Clamp::help() {
 
 void Clamp::parse(vector<string> args) {
     if (args.size() == 0) {
-        apply(stack(0), 0, 1);
+        applyToTop(ClampOp(0, 1));
     } else if (args.size() == 2) {
-        apply(stack(0), readFloat(args[0]), readFloat(args[1]));
+        applyToTop(ClampOp(readFloat(args[0]), readFloat(args[1])));
     } else {
         panic("-clamp takes zero or two arguments\n");
     }
 }
 
 void Clamp::apply(Window a, float lower, float upper) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                float *sample = a(x, y, t);
-                for (int c = 0; c < a.channels; c++) {
-                    sample[c] = max(lower, sample[c]);
-                    sample[c] = min(upper, sample[c]);
-                }
-            }
-        }
-    }
+    unary(a, ClampOp(lower, upper));
 }
 
 void DeNaN::help() {
@@ -726,24 +704,16 @@ void DeNaN::help() {
 
 void DeNaN::parse(vector<string> args) {
     if (args.size() == 0) {
-        apply(stack(0), 0);
+        applyToTop(DeNaNOp(0));
     } else if (args.size() == 1) {
-        apply(stack(0), readFloat(args[0]));
+        applyToTop(DeNaNOp(readFloat(args[0])));
     } else {
         panic("-denan takes zero or one arguments\n");
     }
 }
 
 void DeNaN::apply(Window a, float replacement) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    if (isnan(a(x, y, t)[c])) { a(x, y, t)[c] = replacement; }
-                }
-            }
-        }
-    }
+    unary(a, DeNaNOp(replacement));
 }
 
 void Threshold::help() {
@@ -754,20 +724,12 @@ void Threshold::help() {
 
 void Threshold::parse(vector<string> args) {
     assert(args.size() == 1, "-threshold takes exactly one argument\n");
-    apply(stack(0), readFloat(args[0]));
+    applyToTop(ThresholdOp(readFloat(args[0])));
 }
 
 
 void Threshold::apply(Window a, float threshold) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] = a(x, y, t)[c] > threshold ? 1.0f : 0.0f;
-                }
-            }
-        }
-    }
+    unary(a, ThresholdOp(threshold));
 }
 
 void Normalize::help() {
@@ -798,16 +760,7 @@ void Normalize::apply(Window a) {
     }
 
     float invDelta = 1.0f/(maxValue - minValue);
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] -= minValue;
-                    a(x, y, t)[c] *= invDelta;
-                }
-            }
-        }
-    }
+    unary(a, NormalizeOp(minValue, invDelta));
 }
 
 
@@ -821,21 +774,13 @@ void Quantize::help() {
 void Quantize::parse(vector<string> args) {
     assert(args.size() <= 1, "-quantize takes zero or one arguments\n");
 
-    if (args.size()) { apply(stack(0), readFloat(args[0])); }
-    else { apply(stack(0), 1); }
+    if (args.size()) { applyToTop(QuantizeOp(readFloat(args[0]))); }
+    else { applyToTop(QuantizeOp(1)); }
 
 }
 
 void Quantize::apply(Window a, float increment) {
-    for (int t = 0; t < a.frames; t++) {
-        for (int y = 0; y < a.height; y++) {
-            for (int x = 0; x < a.width; x++) {
-                for (int c = 0; c < a.channels; c++) {
-                    a(x, y, t)[c] -= fmodf(a(x, y, t)[c], increment);
-                }
-            }
-        }
-    }
+    unary(a, QuantizeOp(increment));
 }
 
 #include "footer.h"
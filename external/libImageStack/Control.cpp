@@ -1,5 +1,6 @@
 #include "main.h"
 #include "Control.h"
+#include "Parallel.h"
 #include "header.h"
 
 void Loop::help() {
@@ -85,10 +86,90 @@ void Time::parse(vector<string> args) {
 
     float t1 = currentTime();
     parseCommands(newArgs);
+    // Include the cost of anything deferred by the commands
+    evaluate();
     float t2 = currentTime();
     printf("%3.3f s\n", t2 - t1);
 }
 
+void Lazy::help() {
+    pprintf("-lazy turns on lazy evaluation of pointwise operations (-scale, -offset,"
+            " -gamma, -mod, -clamp, -denan, -threshold, -quantize, -log, -exp and"
+            " -abs). Instead of making a pass over the top image on the stack per"
+            " operation, each one is recorded, and the whole chain is applied in a"
+            " single pass, one small tile at a time, when the next operation that"
+            " needs the pixels comes along. The results are the same. Given the"
+            " argument \"off\", it applies anything pending and goes back to"
+            " evaluating each operation immediately.\n\n"
+            "Usage: ImageStack -lazy -load a.exr -scale 2 -offset 0.1 -gamma 0.45 -clamp -save b.jpg\n\n");
+}
+
+void Lazy::parse(vector<string> args) {
+    assert(args.size() < 2, "-lazy takes zero or one arguments\n");
+    if (args.size() == 0 || args[0] == "on") {
+        setLazy(true);
+    } else if (args[0] == "off") {
+        setLazy(false);
+    } else {
+        panic("Unknown argument to -lazy: %s\n", args[0].c_str());
+    }
+}
+
+void Threads::help() {
+    printf("\n-threads sets the number of threads used by operations that split their work\n"
+           "across several cores. The default is the value of the IMAGESTACK_THREADS\n"
+           "environment variable, or failing that the number of CPUs. Given no arguments,\n"
+           "it prints the current number of threads.\n\n"
+           "Usage: ImageStack -threads 4 -load a.jpg -time --resample 1000 1000\n\n");
+}
+
+void Threads::parse(vector<string> args) {
+    assert(args.size() < 2, "-threads takes zero or one arguments\n");
+    if (args.size() == 0) {
+        printf("%d\n", threadCount());
+        return;
+    }
+    setThreadCount(readInt(args[0]));
+}
+
+void Scratch::help() {
+    pprintf("-scratch controls which images are kept in scratch files on disk that are"
+            " mapped into memory, rather than in RAM. This lets ImageStack work on"
+            " images larger than memory, as long as each operation only touches a"
+            " part of them at a time. The first argument is the size in megabytes"
+            " above which new images go in scratch files, or \"off\" to keep"
+            " everything in RAM. The default is the value of the"
+            " IMAGESTACK_SCRATCH_THRESHOLD environment variable, or failing that half"
+            " the physical memory. The optional second argument is the directory to"
+            " put scratch files in, which defaults to IMAGESTACK_SCRATCH_DIR, then"
+            " TMPDIR, then /var/tmp, then /tmp. Scratch files are deleted as soon as"
+            " they're created, so they never outlive ImageStack. Given no arguments,"
+            " -scratch prints the current settings.\n"
+            "\n"
+            "Usage: ImageStack -scratch 1024 /mnt/big -loadframes frames/*.tmp\n"
+            "                  -resample 1000 1000 -save small.tmp\n\n");
+}
+
+void Scratch::parse(vector<string> args) {
+    assert(args.size() < 3, "-scratch takes zero, one, or two arguments\n");
+    if (args.size() == 0) {
+        long long threshold = scratchThreshold();
+        if (threshold == std::numeric_limits<long long>::max()) {
+            printf("off %s\n", scratchDirectory().c_str());
+        } else {
+            printf("%g %s\n", threshold / (double)(1 << 20), scratchDirectory().c_str());
+        }
+        return;
+    }
+
+    if (args[0] == "off") {
+        setScratchThreshold(std::numeric_limits<long long>::max());
+    } else {
+        setScratchThreshold((long long)(readFloat(args[0]) * (1 << 20)));
+    }
+    if (args.size() > 1) { setScratchDirectory(args[1]); }
+}
+
 #include "footer.h"
 
 
@@ -4,6 +4,7 @@
 #include "Geometry.h"
 #include "DFT.h"
 #include "File.h"
+#include "Parallel.h"
 #include "header.h"
 
 void Convolve::help() {
@@ -169,16 +170,156 @@ inline void Convolve__Scalar(float *a, int na, float *b, int nb, float *out, int
 // Make a more convenient name to refer to the various types of vector-vector multiplication
 typedef void (*Convolve__VectorVectorMult)(float *, int, float *, int, float *, int);
 
+// One row of output of the convolution below
+template<Convolve::BoundaryCondition b, Convolve__VectorVectorMult m>
+struct Convolve__Rows {
+    Convolve__Rows(Window im_, Window filter_, Window out_, float *ones_, float *filterSum_) :
+        im(im_), filter(filter_), out(out_), ones(ones_), filterSum(filterSum_) {
+        xoff = (filter.width - 1)/2;
+        yoff = (filter.height - 1)/2;
+        toff = (filter.frames - 1)/2;
+    }
+
+    void operator()(int t, int y) {
+        // Stores to out could alias the members as far as the compiler
+        // knows, so work from local copies
+        Window im = this->im, filter = this->filter, out = this->out;
+        int xoff = this->xoff, yoff = this->yoff, toff = this->toff;
+        vector<float> weight(out.channels, 0.0f);
+
+        for (int x = 0; x < im.width; x++) {
+            float *outPtr = out(x, y, t);
+
+            bool boundary = (x - xoff < 0 ||
+                             x + xoff > im.width-1 ||
+                             y - yoff < 0 ||
+                             y + yoff > im.height-1 ||
+                             t - toff < 0 ||
+                             t + toff > im.frames-1);
+
+            if (!boundary) {
+                for (int dt = -toff; dt <= toff; dt++) {
+                    for (int dy = -yoff; dy <= yoff; dy++) {
+                        float *filterPtr = filter(filter.width-1, -dy+yoff, -dt+toff);
+                        float *imPtr = im(x-xoff, y+dy, t+dt);
+                        for (int dx = -xoff; dx <= xoff; dx++) {
+                            m(filterPtr, filter.channels,
+                              imPtr, im.channels,
+                              outPtr, out.channels);
+                            filterPtr -= filter.channels;
+                            imPtr += im.channels;
+                        }
+                    }
+                }
+
+                if (b == Convolve::Homogeneous) {
+                    // Renormalize the output to have the right sum of weights
+                    for (int c = 0; c < out.channels; c++) {
+                        outPtr[c] *= filterSum[c];
+                    }
+                }
+            } else if (b == Convolve::Zero || b == Convolve::Homogeneous) {
+                if (b == Convolve::Homogeneous) {
+                    for (int c = 0; c < out.channels; c++) {
+                        weight[c] = 0.0f;
+                    }
+                }
+
+
+                for (int dt = -toff; dt <= toff; dt++) {
+                    if (t + dt < 0) { continue; }
+                    if (t + dt > im.frames-1) { break; }
+                    for (int dy = -yoff; dy <= yoff; dy++) {
+                        if (y + dy < 0) { continue; }
+                        if (y + dy > im.height-1) { break; }
+                        float *filterPtr = filter(filter.width-1, -dy+yoff, -dt+toff);
+                        float *imPtr = im(x-xoff, y+dy, t+dt);
+                        for (int dx = -xoff; dx <= xoff; dx++) {
+                            if (x + dx < 0) {
+                                imPtr += im.channels;
+                                filterPtr -= filter.channels;
+                                continue;
+                            }
+                            if (x + dx > im.width-1) { break; }
+
+                            m(filterPtr, filter.channels,
+                              imPtr, im.channels,
+                              outPtr, out.channels);
+                            if (b == Convolve::Homogeneous) {
+                                // What would have been the effect if
+                                // I did the same thing for all-ones
+                                m(filterPtr, filter.channels,
+                                  ones, im.channels,
+                                  &weight[0], out.channels);
+                            }
+
+                            filterPtr -= filter.channels;
+                            imPtr += im.channels;
+                        }
+                    }
+                }
+
+                if (b == Convolve::Homogeneous) {
+                    // Renormalize the output to have the right sum of weights
+                    for (int c = 0; c < out.channels; c++) {
+                        outPtr[c] /= weight[c];
+                    }
+                }
+            } else if (b == Convolve::Clamp) {
+                for (int dt = -toff; dt <= toff; dt++) {
+                    int imt = clamp(t + dt, 0, im.frames-1);
+                    for (int dy = -yoff; dy <= yoff; dy++) {
+                        int imy = clamp(y + dy, 0, im.height-1);
+                        float *filterPtr = filter(filter.width-1, -dy+yoff, -dt+toff);
+                        float *imPtr = im(0, imy, imt);
+                        for (int dx = -xoff; dx <= xoff; dx++) {
+                            int imx = clamp(x + dx, 0, im.width-1);
+                            m(filterPtr, filter.channels,
+                              imPtr + imx * im.xstride, im.channels,
+                              outPtr, out.channels);
+                            filterPtr -= filter.channels;
+                        }
+                    }
+                }
+            } else if (b == Convolve::Wrap) {
+                for (int dt = -toff; dt <= toff; dt++) {
+                    int imt = t + dt;
+                    while (imt < 0) { imt += im.frames; }
+                    while (imt >= im.frames) { imt -= im.frames; }
+                    for (int dy = -yoff; dy <= yoff; dy++) {
+                        int imy = y + dy;
+                        while (imy < 0) { imy += im.height; }
+                        while (imy >= im.height) { imy -= im.height; }
+                        float *filterPtr = filter(filter.width-1, -dy+yoff, -dt+toff);
+                        float *imPtr = im(0, imy, imt);
+                        for (int dx = -xoff; dx <= xoff; dx++) {
+                            int imx = x + dx;
+                            while (imx < 0) { imx += im.width; }
+                            while (imx >= im.width) { imx -= im.width; }
+                            m(filterPtr, filter.channels,
+                              imPtr + imx * im.xstride, im.channels,
+                              outPtr, out.channels);
+                            filterPtr -= filter.channels;
+                        }
+                    }
+                }
+            } else {
+                panic("Unknown boundary condition: %d\n", b);
+            }
+        }
+    }
+
+    Window im, filter, out;
+    float *ones, *filterSum;
+    int xoff, yoff, toff;
+};
+
 template<Convolve::BoundaryCondition b, Convolve__VectorVectorMult m>
 static Image Convolve__apply(Window im, Window filter, Image out) {
 
     int filterSize = filter.frames * filter.width * filter.height;
     assert(filterSize % 2 == 1, "filter must have odd size\n");
 
-    int xoff = (filter.width - 1)/2;
-    int yoff = (filter.height - 1)/2;
-    int toff = (filter.frames - 1)/2;
-
     // Used by the homogeneous boundary condition
     vector<float> ones(im.channels, 1.0f);
     vector<float> filterSum(out.channels, 0.0f);
@@ -198,132 +339,8 @@ static Image Convolve__apply(Window im, Window filter, Image out) {
             filterSum[c] = 1.0f/filterSum[c];
         }
     }
-    vector<float> weight(out.channels, 0.0f);
-
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                float *outPtr = out(x, y, t);
-
-                bool boundary = (x - xoff < 0 ||
-                                 x + xoff > im.width-1 ||
-                                 y - yoff < 0 ||
-                                 y + yoff > im.height-1 ||
-                                 t - toff < 0 ||
-                                 t + toff > im.frames-1);
-
-                if (!boundary) {
-                    for (int dt = -toff; dt <= toff; dt++) {
-                        for (int dy = -yoff; dy <= yoff; dy++) {
-                            float *filterPtr = filter(filter.width-1, -dy+yoff, -dt+toff);
-                            float *imPtr = im(x-xoff, y+dy, t+dt);
-                            for (int dx = -xoff; dx <= xoff; dx++) {
-                                m(filterPtr, filter.channels,
-                                  imPtr, im.channels,
-                                  outPtr, out.channels);
-                                filterPtr -= filter.channels;
-                                imPtr += im.channels;
-                            }
-                        }
-                    }
-
-                    if (b == Convolve::Homogeneous) {
-                        // Renormalize the output to have the right sum of weights
-                        for (int c = 0; c < out.channels; c++) {
-                            outPtr[c] *= filterSum[c];
-                        }
-                    }
-                } else if (b == Convolve::Zero || b == Convolve::Homogeneous) {
-                    if (b == Convolve::Homogeneous) {
-                        for (int c = 0; c < out.channels; c++) {
-                            weight[c] = 0.0f;
-                        }
-                    }
-
-
-                    for (int dt = -toff; dt <= toff; dt++) {
-                        if (t + dt < 0) { continue; }
-                        if (t + dt > im.frames-1) { break; }
-                        for (int dy = -yoff; dy <= yoff; dy++) {
-                            if (y + dy < 0) { continue; }
-                            if (y + dy > im.height-1) { break; }
-                            float *filterPtr = filter(filter.width-1, -dy+yoff, -dt+toff);
-                            float *imPtr = im(x-xoff, y+dy, t+dt);
-                            for (int dx = -xoff; dx <= xoff; dx++) {
-                                if (x + dx < 0) {
-                                    imPtr += im.channels;
-                                    filterPtr -= filter.channels;
-                                    continue;
-                                }
-                                if (x + dx > im.width-1) { break; }
-
-                                m(filterPtr, filter.channels,
-                                  imPtr, im.channels,
-                                  outPtr, out.channels);
-                                if (b == Convolve::Homogeneous) {
-                                    // What would have been the effect if
-                                    // I did the same thing for all-ones
-                                    m(filterPtr, filter.channels,
-                                      &ones[0], im.channels,
-                                      &weight[0], out.channels);
-                                }
-
-                                filterPtr -= filter.channels;
-                                imPtr += im.channels;
-                            }
-                        }
-                    }
-
-                    if (b == Convolve::Homogeneous) {
-                        // Renormalize the output to have the right sum of weights
-                        for (int c = 0; c < out.channels; c++) {
-                            outPtr[c] /= weight[c];
-                        }
-                    }
-                } else if (b == Convolve::Clamp) {
-                    for (int dt = -toff; dt <= toff; dt++) {
-                        int imt = clamp(t + dt, 0, im.frames-1);
-                        for (int dy = -yoff; dy <= yoff; dy++) {
-                            int imy = clamp(y + dy, 0, im.height-1);
-                            float *filterPtr = filter(filter.width-1, -dy+yoff, -dt+toff);
-                            float *imPtr = im(0, imy, imt);
-                            for (int dx = -xoff; dx <= xoff; dx++) {
-                                int imx = clamp(x + dx, 0, im.width-1);
-                                m(filterPtr, filter.channels,
-                                  imPtr + imx * im.xstride, im.channels,
-                                  outPtr, out.channels);
-                                filterPtr -= filter.channels;
-                            }
-                        }
-                    }
-                } else if (b == Convolve::Wrap) {
-                    for (int dt = -toff; dt <= toff; dt++) {
-                        int imt = t + dt;
-                        while (imt < 0) { imt += im.frames; }
-                        while (imt >= im.frames) { imt -= im.frames; }
-                        for (int dy = -yoff; dy <= yoff; dy++) {
-                            int imy = y + dy;
-                            while (imy < 0) { imy += im.height; }
-                            while (imy >= im.height) { imy -= im.height; }
-                            float *filterPtr = filter(filter.width-1, -dy+yoff, -dt+toff);
-                            float *imPtr = im(0, imy, imt);
-                            for (int dx = -xoff; dx <= xoff; dx++) {
-                                int imx = x + dx;
-                                while (imx < 0) { imx += im.width; }
-                                while (imx >= im.width) { imx -= im.width; }
-                                m(filterPtr, filter.channels,
-                                  imPtr + imx * im.xstride, im.channels,
-                                  outPtr, out.channels);
-                                filterPtr -= filter.channels;
-                            }
-                        }
-                    }
-                } else {
-                    panic("Unknown boundary condition: %d\n", b);
-                }
-            }
-        }
-    }
+    Convolve__Rows<b, m> rows(im, filter, out, &ones[0], &filterSum[0]);
+    parallelForRows(im.frames, im.height, rows);
 
     return out;
 }
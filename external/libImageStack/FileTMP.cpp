@@ -1,5 +1,10 @@
 #include "main.h"
 #include "File.h"
+#ifndef WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
 #include "header.h"
 
 namespace FileTMP {
@@ -28,11 +33,62 @@ void help() {
             " may be any of int8, uint8, int16, uint16, int32, uint32, int64,"
             " uint64, float32, float64, or correspondingly char, unsigned"
             " char, short, unsigned short, int, unsigned int, float, or"
-            " double. The default is float32.\n");
+            " double. The default is float32.\n"
+            "\n"
+            "Files of 32 bit floats are loaded by mapping them into memory rather"
+            " than reading them, so loading is immediate and only the parts of the"
+            " file that get used are read. The image shares the file's pages until"
+            " it modifies them, and never changes the file. Don't modify a file in"
+            " place while ImageStack has it loaded; saving over it with ImageStack"
+            " is fine.\n");
 }
 
+// Writes a file in large chunks that start at multiples of CHUNK
+// bytes into the file. Whole chunks of the image go straight from
+// its memory to the file, and everything else is staged in a buffer.
+class Writer {
+public:
+    Writer(FILE *f_) : f(f_), buf(CHUNK), used(0) {
+        // every write is already large, so skip stdio's buffer
+        setvbuf(f, NULL, _IONBF, 0);
+    }
+
+    void write(const void *src, size_t bytes) {
+        const char *ptr = (const char *)src;
+        while (bytes) {
+            if (used == 0 && bytes >= CHUNK) {
+                size_t n = bytes - bytes % CHUNK;
+                assert(fwrite(ptr, 1, n, f) == n, "Error writing .tmp file\n");
+                ptr += n;
+                bytes -= n;
+                continue;
+            }
+            size_t n = min(bytes, CHUNK - used);
+            memcpy(&buf[used], ptr, n);
+            used += n;
+            ptr += n;
+            bytes -= n;
+            if (used == CHUNK) { flush(); }
+        }
+    }
+
+    void flush() {
+        if (used) {
+            assert(fwrite(&buf[0], 1, used, f) == used, "Error writing .tmp file\n");
+            used = 0;
+        }
+    }
+
+private:
+    static const size_t CHUNK = 1 << 22;
+
+    FILE *f;
+    vector<char> buf;
+    size_t used;
+};
+
 template<typename T>
-void saveData(FILE *f, Window im) {
+void saveData(Writer &out, Window im) {
 
     vector<T> buf(im.width*im.channels);
 
@@ -43,77 +99,145 @@ void saveData(FILE *f, Window im) {
             for (int j = 0; j < im.width*im.channels; j++) {
                 *dstPtr++ = (T)(*srcPtr++);
             }
-            fwrite(&buf[0], sizeof(T), im.width*im.channels, f);
+            out.write(&buf[0], buf.size() * sizeof(T));
         }
     }
 }
 
 template<>
-void saveData<float>(FILE *f, Window im) {
+void saveData<float>(Writer &out, Window im) {
+    size_t row = (size_t)im.width * im.channels;
 
-    vector<float> buf(im.width*im.channels);
+    // A whole image with no gaps between rows or frames goes out in
+    // one piece
+    if (im.xstride == im.channels && im.ystride == (int)row && im.tstride == im.ystride * im.height) {
+        out.write(im(0, 0, 0), row * im.height * im.frames * sizeof(float));
+        return;
+    }
 
     for (int t = 0; t < im.frames; t++) {
         for (int y = 0; y < im.height; y++) {
-            fwrite(im(0, y, t), sizeof(float), im.width*im.channels, f);
+            out.write(im(0, y, t), row * sizeof(float));
         }
     }
 }
 
 
-void save(Window im, string filename, string type) {
-    FILE *f = fopen(filename.c_str(), "wb");
-    assert(f, "Could not write output file %s\n", filename.c_str());
+// Write the whole file, header and all
+void saveFile(FILE *f, Window im, string type) {
+    Writer out(f);
+
     // write the dimensions
-    fwrite(&im.frames, sizeof(int), 1, f);
-    fwrite(&im.width, sizeof(int), 1, f);
-    fwrite(&im.height, sizeof(int), 1, f);
-    fwrite(&im.channels, sizeof(int), 1, f);
+    out.write(&im.frames, sizeof(int));
+    out.write(&im.width, sizeof(int));
+    out.write(&im.height, sizeof(int));
+    out.write(&im.channels, sizeof(int));
 
     int typeCode;
 
     if (type == "float" || type == "float32") {
         typeCode = FLOAT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<float>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<float>(out, im);
     } else if (type == "double" || type == "float64") {
         typeCode = FLOAT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<double>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<double>(out, im);
     } else if (type == "uint8" || type == "unsigned char") {
         typeCode = UINT8;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<unsigned char>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<unsigned char>(out, im);
     } else if (type == "int8" || type == "char") {
         typeCode = INT8;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<signed char>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<signed char>(out, im);
     } else if (type == "uint16" || type == "unsigned short") {
         typeCode = UINT16;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<unsigned short>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<unsigned short>(out, im);
     } else if (type == "int16" || type == "short") {
         typeCode = INT16;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<signed short>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<signed short>(out, im);
     } else if (type == "uint32" || type == "unsigned int") {
         typeCode = UINT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<unsigned long>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<unsigned long>(out, im);
     } else if (type == "int32" || type == "int") {
         typeCode = INT32;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<signed long>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<signed long>(out, im);
     } else if (type == "uint64") {
         typeCode = UINT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<unsigned long long>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<unsigned long long>(out, im);
     } else if (type == "int64") {
         typeCode = INT64;
-        fwrite(&typeCode, sizeof(int), 1, f);
-        saveData<signed long long>(f, im);
+        out.write(&typeCode, sizeof(int));
+        saveData<signed long long>(out, im);
     }
-    fclose(f);
+    out.flush();
+}
+
+void save(Window im, string filename, string type) {
+#ifndef WIN32
+    // An image loaded from this file still maps it, so it can't be
+    // rewritten in place. Write a new file next to it and rename that
+    // over it, which leaves the image the old one. Anything else is
+    // written in place, which keeps symlinks, hard links, and the
+    // file's mode and owner.
+    if (Image::fileIsMapped(filename)) {
+        char *resolved = realpath(filename.c_str(), NULL);
+        if (!resolved) {
+            panic("Could not resolve output file %s: %s\n", filename.c_str(), strerror(errno));
+        }
+        string target = resolved;
+        free(resolved);
+
+        string name = target + ".XXXXXX";
+        vector<char> temp(name.begin(), name.end());
+        temp.push_back(0);
+        int fd = mkstemp(&temp[0]);
+        if (fd < 0) {
+            panic("Could not make a temporary file next to %s: %s\n", target.c_str(), strerror(errno));
+        }
+
+        // Keep the old file's mode, and its owner if we're allowed to
+        struct stat st;
+        if (stat(target.c_str(), &st) == 0) {
+            fchmod(fd, st.st_mode & 07777);
+            if (fchown(fd, st.st_uid, st.st_gid)) { }
+        }
+
+        FILE *f = fdopen(fd, "wb");
+        if (!f) {
+            close(fd);
+            unlink(&temp[0]);
+            panic("Could not write output file %s\n", &temp[0]);
+        }
+        try {
+            saveFile(f, im, type);
+        } catch (Exception &) {
+            fclose(f);
+            unlink(&temp[0]);
+            throw;
+        }
+        if (fclose(f)) {
+            unlink(&temp[0]);
+            panic("Error writing .tmp file\n");
+        }
+        if (rename(&temp[0], target.c_str())) {
+            int err = errno;
+            unlink(&temp[0]);
+            panic("Could not replace %s: %s\n", target.c_str(), strerror(err));
+        }
+        return;
+    }
+#endif
+    FILE *f = fopen(filename.c_str(), "wb");
+    assert(f, "Could not write output file %s\n", filename.c_str());
+    saveFile(f, im, type);
+    if (fclose(f)) { panic("Error writing .tmp file\n"); }
 }
 
 template<typename T>
@@ -170,7 +294,12 @@ Image load(string filename) {
     Image im;
 
     if (h.typeCode == FLOAT32) {
-        im = loadData<float>(file, h.frames, h.width, h.height, h.channels);
+        // The pixels are already laid out the way an Image wants
+        // them, so share the file's pages rather than reading them.
+        im = Image::mapFile(file, sizeof(h), h.width, h.height, h.frames, h.channels);
+        if (!im.data) {
+            im = loadData<float>(file, h.frames, h.width, h.height, h.channels);
+        }
     } else if (h.typeCode == FLOAT64) {
         im = loadData<double>(file, h.frames, h.width, h.height, h.channels);
     } else if (h.typeCode == UINT8) {
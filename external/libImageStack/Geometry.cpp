@@ -2,6 +2,7 @@
 #include "Geometry.h"
 #include "Stack.h"
 #include "Arithmetic.h"
+#include "Parallel.h"
 #include "header.h"
 
 void Upsample::help() {
@@ -170,105 +171,150 @@ Image Resample::apply(Window im, int width, int height, int frames) {
     }
 }
 
-Image Resample::resampleX(Window im, int width) {
-    float filterWidth = max(1.0f, (float)im.width / width);
-    int filterBoxWidth = ((int)(filterWidth * 6 + 2) >> 1) << 1;
-
-    Image out(width, im.height, im.frames, im.channels);
+namespace {
+struct ResampleXRows {
+    ResampleXRows(Window out_, Window im_) : out(out_), im(im_) {
+        filterWidth = max(1.0f, (float)im.width / out.width);
+        filterBoxWidth = ((int)(filterWidth * 6 + 2) >> 1) << 1;
+    }
 
-    for (int t = 0; t < out.frames; t++) {
-        for (int y = 0; y < out.height; y++) {
-            for (int x = 0; x < out.width; x++) {
-                float oldX = ((float)x + 0.5) / width * im.width - 0.5;
-                int oldXi = (int)floorf(oldX);
-                int minX = max(0, oldXi - filterBoxWidth/2 + 1);
-                int maxX = min(oldXi + filterBoxWidth/2, im.width-1);
-
-                float totalWeight = 0;
-                // iterate over the filter box
-                for (int dx = minX; dx <= maxX; dx++) {
-                    float weight = lanczos_3((dx - oldX)/filterWidth);
-                    totalWeight += weight;
-                    for (int c = 0; c < im.channels; c++) {
-                        out(x, y, t)[c] += weight * im(dx, y, t)[c];
-                    }
+    void operator()(int t, int y) {
+        // Stores to out could alias the members as far as the
+        // compiler knows, so work from local copies
+        Window out = this->out, im = this->im;
+        float filterWidth = this->filterWidth;
+        int filterBoxWidth = this->filterBoxWidth;
+
+        for (int x = 0; x < out.width; x++) {
+            float oldX = ((float)x + 0.5) / out.width * im.width - 0.5;
+            int oldXi = (int)floorf(oldX);
+            int minX = max(0, oldXi - filterBoxWidth/2 + 1);
+            int maxX = min(oldXi + filterBoxWidth/2, im.width-1);
+
+            float totalWeight = 0;
+            // iterate over the filter box
+            for (int dx = minX; dx <= maxX; dx++) {
+                float weight = lanczos_3((dx - oldX)/filterWidth);
+                totalWeight += weight;
+                for (int c = 0; c < im.channels; c++) {
+                    out(x, y, t)[c] += weight * im(dx, y, t)[c];
                 }
+            }
 
-                if (totalWeight > 0) {
-                    for (int c = 0; c < im.channels; c++) { out(x, y, t)[c] /= totalWeight; }
-                }
+            if (totalWeight > 0) {
+                for (int c = 0; c < im.channels; c++) { out(x, y, t)[c] /= totalWeight; }
             }
         }
     }
 
-    return out;
+    Window out, im;
+    float filterWidth;
+    int filterBoxWidth;
+};
 }
 
-Image Resample::resampleY(Window im, int height) {
-    float filterHeight = max(1.0f, (float)im.height / height);
-    int filterBoxHeight = ((int)(filterHeight * 6 + 2) >> 1) << 1;
+Image Resample::resampleX(Window im, int width) {
+    Image out(width, im.height, im.frames, im.channels);
+    ResampleXRows rows(out, im);
+    parallelForRows(out.frames, out.height, rows);
+    return out;
+}
 
-    Image out(im.width, height, im.frames, im.channels);
+namespace {
+struct ResampleYRows {
+    ResampleYRows(Window out_, Window im_) : out(out_), im(im_) {
+        filterHeight = max(1.0f, (float)im.height / out.height);
+        filterBoxHeight = ((int)(filterHeight * 6 + 2) >> 1) << 1;
+    }
 
-    for (int t = 0; t < out.frames; t++) {
-        for (int y = 0; y < out.height; y++) {
-            float oldY = ((float)y + 0.5) / height * im.height - 0.5;
-            int oldYi = (int)floorf(oldY);
-            int minY = max(0, oldYi - filterBoxHeight/2 + 1);
-            int maxY = min(oldYi + filterBoxHeight/2, im.height-1);
-
-            for (int x = 0; x < out.width; x++) {
-                float totalWeight = 0;
-                // iterate over the filter box
-                for (int dy = minY; dy <= maxY; dy++) {
-                    float weight = lanczos_3((dy - oldY)/filterHeight);
-                    totalWeight += weight;
-                    for (int c = 0; c < im.channels; c++) {
-                        out(x, y, t)[c] += weight * im(x, dy, t)[c];
-                    }
+    void operator()(int t, int y) {
+        // Stores to out could alias the members as far as the
+        // compiler knows, so work from local copies
+        Window out = this->out, im = this->im;
+        float filterHeight = this->filterHeight;
+        int filterBoxHeight = this->filterBoxHeight;
+
+        float oldY = ((float)y + 0.5) / out.height * im.height - 0.5;
+        int oldYi = (int)floorf(oldY);
+        int minY = max(0, oldYi - filterBoxHeight/2 + 1);
+        int maxY = min(oldYi + filterBoxHeight/2, im.height-1);
+
+        for (int x = 0; x < out.width; x++) {
+            float totalWeight = 0;
+            // iterate over the filter box
+            for (int dy = minY; dy <= maxY; dy++) {
+                float weight = lanczos_3((dy - oldY)/filterHeight);
+                totalWeight += weight;
+                for (int c = 0; c < im.channels; c++) {
+                    out(x, y, t)[c] += weight * im(x, dy, t)[c];
                 }
+            }
 
-                if (totalWeight > 0) {
-                    for (int c = 0; c < im.channels; c++) { out(x, y, t)[c] /= totalWeight; }
-                }
+            if (totalWeight > 0) {
+                for (int c = 0; c < im.channels; c++) { out(x, y, t)[c] /= totalWeight; }
             }
         }
     }
 
+    Window out, im;
+    float filterHeight;
+    int filterBoxHeight;
+};
+}
+
+Image Resample::resampleY(Window im, int height) {
+    Image out(im.width, height, im.frames, im.channels);
+    ResampleYRows rows(out, im);
+    parallelForRows(out.frames, out.height, rows);
     return out;
 }
 
-Image Resample::resampleT(Window im, int frames) {
-    float filterFrames = max(1.0f, (float)im.frames / frames);
-    int filterBoxFrames = ((int)(filterFrames * 6 + 2) >> 1) << 1;
+namespace {
+struct ResampleTRows {
+    ResampleTRows(Window out_, Window im_) : out(out_), im(im_) {
+        filterFrames = max(1.0f, (float)im.frames / out.frames);
+        filterBoxFrames = ((int)(filterFrames * 6 + 2) >> 1) << 1;
+    }
 
-    Image out(im.width, im.height, frames, im.channels);
+    void operator()(int t, int y) {
+        // Stores to out could alias the members as far as the
+        // compiler knows, so work from local copies
+        Window out = this->out, im = this->im;
+        float filterFrames = this->filterFrames;
+        int filterBoxFrames = this->filterBoxFrames;
 
-    for (int t = 0; t < out.frames; t++) {
-        float oldT = ((float)t + 0.5) / frames * im.frames - 0.5;
+        float oldT = ((float)t + 0.5) / out.frames * im.frames - 0.5;
         int oldTi = (int)floorf(oldT);
         int minT = max(0, oldTi - filterBoxFrames/2 + 1);
         int maxT = min(oldTi + filterBoxFrames/2, im.frames-1);
 
-        for (int y = 0; y < out.height; y++) {
-            for (int x = 0; x < out.width; x++) {
-                float totalWeight = 0;
-                // iterate over the filter box
-                for (int dt = minT; dt <= maxT; dt++) {
-                    float weight = lanczos_3((dt - oldT)/filterFrames);
-                    totalWeight += weight;
-                    for (int c = 0; c < im.channels; c++) {
-                        out(x, y, t)[c] += weight * im(x, y, dt)[c];
-                    }
+        for (int x = 0; x < out.width; x++) {
+            float totalWeight = 0;
+            // iterate over the filter box
+            for (int dt = minT; dt <= maxT; dt++) {
+                float weight = lanczos_3((dt - oldT)/filterFrames);
+                totalWeight += weight;
+                for (int c = 0; c < im.channels; c++) {
+                    out(x, y, t)[c] += weight * im(x, y, dt)[c];
                 }
+            }
 
-                if (totalWeight > 0) {
-                    for (int c = 0; c < im.channels; c++) { out(x, y, t)[c] /= totalWeight; }
-                }
+            if (totalWeight > 0) {
+                for (int c = 0; c < im.channels; c++) { out(x, y, t)[c] /= totalWeight; }
             }
         }
     }
 
+    Window out, im;
+    float filterFrames;
+    int filterBoxFrames;
+};
+}
+
+Image Resample::resampleT(Window im, int frames) {
+    Image out(im.width, im.height, frames, im.channels);
+    ResampleTRows rows(out, im);
+    parallelForRows(out.frames, out.height, rows);
     return out;
 }
 
@@ -482,41 +528,50 @@ void Rotate::parse(vector<string> args) {
 }
 
 
-Image Rotate::apply(Window im, float degrees) {
+namespace {
+struct RotateRows {
+    RotateRows(Window out_, Window im_, float degrees) : out(out_), im(im_) {
+        // figure out the rotation matrix
+        float radians = degrees * M_PI / 180;
+        float cosine = cosf(radians);
+        float sine = sinf(radians);
+        m00 = cosine;
+        m01 = sine;
+        m10 = -sine;
+        m11 = cosine;
 
-    // figure out the rotation matrix
-    float radians = degrees * M_PI / 180;
-    float cosine = cosf(radians);
-    float sine = sinf(radians);
-    float m00 = cosine;
-    float m01 = sine;
-    float m10 = -sine;
-    float m11 = cosine;
-
-    // locate the origin
-    float xorigin = (im.width-1) * 0.5;
-    float yorigin = (im.height-1) * 0.5;
-
-    Image out(im.width, im.height, im.frames, im.channels);
+        // locate the origin
+        xorigin = (im.width-1) * 0.5;
+        yorigin = (im.height-1) * 0.5;
+    }
 
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                // figure out the sample location
-                float fx = m00 * (x - xorigin) + m01 * (y - yorigin) + xorigin;
-                float fy = m10 * (x - xorigin) + m11 * (y - yorigin) + yorigin;
-                // don't sample outside the image
-                if (fx < 0 || fx > im.width || fy < 0 || fy > im.height) {
-                    for (int i = 0; i < im.channels; i++) { out(x, y, t)[i] = 0; }
-                } else {
-                    im.sample2D(fx, fy, t, out(x, y, t));
-                }
+    void operator()(int t, int y) {
+        Window out = this->out, im = this->im;
+
+        for (int x = 0; x < im.width; x++) {
+            // figure out the sample location
+            float fx = m00 * (x - xorigin) + m01 * (y - yorigin) + xorigin;
+            float fy = m10 * (x - xorigin) + m11 * (y - yorigin) + yorigin;
+            // don't sample outside the image
+            if (fx < 0 || fx > im.width || fy < 0 || fy > im.height) {
+                for (int i = 0; i < im.channels; i++) { out(x, y, t)[i] = 0; }
+            } else {
+                im.sample2D(fx, fy, t, out(x, y, t));
             }
         }
     }
 
-    return out;
+    Window out, im;
+    float m00, m01, m10, m11;
+    float xorigin, yorigin;
+};
+}
 
+Image Rotate::apply(Window im, float degrees) {
+    Image out(im.width, im.height, im.frames, im.channels);
+    RotateRows rows(out, im, degrees);
+    parallelForRows(im.frames, im.height, rows);
+    return out;
 }
 
 
@@ -535,26 +590,36 @@ void AffineWarp::parse(vector<string> args) {
     push(im);
 }
 
-Image AffineWarp::apply(Window im, vector<double> matrix) {
+namespace {
+struct AffineWarpRows {
+    AffineWarpRows(Window out_, Window im_, const vector<double> &matrix_) :
+        out(out_), im(im_), matrix(&matrix_[0]) {}
 
-    Image out(im.width, im.height, im.frames, im.channels);
+    void operator()(int t, int y) {
+        Window out = this->out, im = this->im;
 
-    for (int t = 0; t < im.frames; t++) {
-        for (int y = 0; y < im.height; y++) {
-            for (int x = 0; x < im.width; x++) {
-                // figure out the sample location
-                float fx = matrix[0] * x + matrix[1] * y + matrix[2] * im.width;
-                float fy = matrix[3] * x + matrix[4] * y + matrix[5] * im.height;
-                // don't sample outside the image
-                if (fx < 0 || fx > im.width || fy < 0 || fy > im.height) {
-                    for (int i = 0; i < im.channels; i++) { out(x, y, t)[i] = 0; }
-                } else {
-                    im.sample2D(fx, fy, t, out(x, y, t));
-                }
+        for (int x = 0; x < im.width; x++) {
+            // figure out the sample location
+            float fx = matrix[0] * x + matrix[1] * y + matrix[2] * im.width;
+            float fy = matrix[3] * x + matrix[4] * y + matrix[5] * im.height;
+            // don't sample outside the image
+            if (fx < 0 || fx > im.width || fy < 0 || fy > im.height) {
+                for (int i = 0; i < im.channels; i++) { out(x, y, t)[i] = 0; }
+            } else {
+                im.sample2D(fx, fy, t, out(x, y, t));
             }
         }
     }
 
+    Window out, im;
+    const double *matrix;
+};
+}
+
+Image AffineWarp::apply(Window im, vector<double> matrix) {
+    Image out(im.width, im.height, im.frames, im.channels);
+    AffineWarpRows rows(out, im, matrix);
+    parallelForRows(im.frames, im.height, rows);
     return out;
 }
 
@@ -1435,36 +1500,40 @@ void Warp::parse(vector<string> args) {
     push(im);
 }
 
-Image Warp::apply(Window coords, Window source) {
-
-    Image out(coords.width, coords.height, coords.frames, source.channels);
-
-    if (coords.channels == 3) {
-        for (int t = 0; t < coords.frames; t++) {
-            for (int y = 0; y < coords.height; y++) {
-                for (int x = 0; x < coords.width; x++) {
-                    float *srcCoords = coords(x, y, t);
-                    source.sample3D(srcCoords[0]*source.width,
-                                    srcCoords[1]*source.height,
-                                    srcCoords[2]*source.frames,
-                                    out(x, y, t));
-                }
+namespace {
+struct WarpRows {
+    WarpRows(Window out_, Window coords_, Window source_) :
+        out(out_), coords(coords_), source(source_) {}
+
+    void operator()(int t, int y) {
+        Window out = this->out, coords = this->coords, source = this->source;
+
+        for (int x = 0; x < coords.width; x++) {
+            float *srcCoords = coords(x, y, t);
+            if (coords.channels == 3) {
+                source.sample3D(srcCoords[0]*source.width,
+                                srcCoords[1]*source.height,
+                                srcCoords[2]*source.frames,
+                                out(x, y, t));
+            } else {
+                source.sample2D(srcCoords[0]*source.width,
+                                srcCoords[1]*source.height,
+                                t, out(x, y, t));
             }
         }
-    } else if (coords.channels == 2) {
-        for (int t = 0; t < coords.frames; t++) {
-            for (int y = 0; y < coords.height; y++) {
-                for (int x = 0; x < coords.width; x++) {
-                    float *srcCoords = coords(x, y, t);
-                    source.sample2D(srcCoords[0]*source.width,
-                                    srcCoords[1]*source.height,
-                                    t, out(x, y, t));
-                }
-            }
-        }
-    } else {
-        panic("index image must have two or three channels\n");
     }
+
+    Window out, coords, source;
+};
+}
+
+Image Warp::apply(Window coords, Window source) {
+    assert(coords.channels == 2 || coords.channels == 3,
+           "index image must have two or three channels\n");
+
+    Image out(coords.width, coords.height, coords.frames, source.channels);
+    WarpRows rows(out, coords, source);
+    parallelForRows(coords.frames, coords.height, rows);
     return out;
 }
 
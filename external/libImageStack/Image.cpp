@@ -1,5 +1,15 @@
 #include "main.h"
 #include "Image.h"
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
 #include "header.h"
 
 // The rest of the Image class is inlined.
@@ -25,7 +35,7 @@ Image::~Image() {
         delete refCount;
         //printf("refCount deleted\n"); fflush(stdout);
         //debug();
-        delete[] memory;
+        release();
         //printf("data deleted\n"); fflush(stdout);
         //debug();
     }
@@ -33,4 +43,197 @@ Image::~Image() {
     //printf("Leaving image desctructor\n"); fflush(stdout);
 }
 
+namespace {
+
+// -1 until first use
+long long threshold = -1;
+string directory;
+
+#ifndef WIN32
+// The files mapped by mapFile, by the memory they're mapped at
+map<float *, pair<dev_t, ino_t> > mappedFiles;
+#endif
+
+long long defaultThreshold() {
+    const char *env = getenv("IMAGESTACK_SCRATCH_THRESHOLD");
+    if (env) { return (long long)(atof(env) * (1 << 20)); }
+#ifndef WIN32
+    long long pages = sysconf(_SC_PHYS_PAGES);
+    long long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pageSize > 0) { return pages / 2 * pageSize; }
+#endif
+    return std::numeric_limits<long long>::max();
+}
+
+string defaultDirectory() {
+    const char *env = getenv("IMAGESTACK_SCRATCH_DIR");
+    if (!env) { env = getenv("TMPDIR"); }
+    if (env) { return env; }
+#ifndef WIN32
+    // /tmp is often a tmpfs, which is RAM, so /var/tmp is better
+    if (access("/var/tmp", W_OK | X_OK) == 0) { return "/var/tmp"; }
+#endif
+    return "/tmp";
+}
+
+// Reserve the blocks for a scratch file. A sparse file would get
+// SIGBUS instead of an error if the disk filled up while writing.
+bool reserve(int fd, size_t bytes) {
+#ifdef _POSIX_ADVISORY_INFO
+    int err = posix_fallocate(fd, 0, (off_t)bytes);
+    if (err != EINVAL && err != EOPNOTSUPP) { return err == 0; }
+#endif
+    // The filesystem can't preallocate, so settle for a sparse file
+    return ftruncate(fd, (off_t)bytes) == 0;
+}
+
+// Warn once per directory if scratch files are going in RAM anyway
+void checkFilesystem(int fd) {
+#ifdef __linux__
+    static string warned;
+    struct statfs fs;
+    const long TMPFS_MAGIC = 0x01021994;
+    if (fstatfs(fd, &fs) == 0 && fs.f_type == TMPFS_MAGIC && warned != scratchDirectory()) {
+        warned = scratchDirectory();
+        printf("Warning: The scratch directory %s is a tmpfs, which is kept in memory."
+               " Use -scratch or IMAGESTACK_SCRATCH_DIR to pick one on disk.\n",
+               warned.c_str());
+    }
+#endif
+}
+
+// Make a scratch file of the given size and map it, or return NULL.
+void *mapScratch(size_t bytes) {
+#ifdef WIN32
+    return NULL;
+#else
+    string name = scratchDirectory() + "/ImageStackXXXXXX";
+    vector<char> path(name.begin(), name.end());
+    path.push_back(0);
+    int fd = mkstemp(&path[0]);
+    if (fd < 0) { return NULL; }
+    // The mapping keeps the file alive until it's unmapped
+    unlink(&path[0]);
+    checkFilesystem(fd);
+
+    void *m = MAP_FAILED;
+    if (reserve(fd, bytes)) {
+        m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    return m == MAP_FAILED ? NULL : m;
+#endif
+}
+
+}
+
+long long scratchThreshold() {
+    if (threshold < 0) { threshold = defaultThreshold(); }
+    return threshold;
+}
+
+void setScratchThreshold(long long bytes) {
+    assert(bytes >= 0, "The scratch threshold can't be negative\n");
+    threshold = bytes;
+}
+
+string scratchDirectory() {
+    if (directory.empty()) { directory = defaultDirectory(); }
+    return directory;
+}
+
+void setScratchDirectory(string dir) {
+    assert(!dir.empty(), "The scratch directory can't be empty\n");
+    directory = dir;
+}
+
+bool Image::allocate(long long size, Storage storage) {
+    mapping = 0;
+
+    // Empty images can't be mapped, and don't need to be
+    bool map = size > 0 && (storage == Mapped ||
+               (storage == Automatic && size * (long long)sizeof(float) > scratchThreshold()));
+    if (map) {
+        size_t bytes = size * sizeof(float);
+        void *m = mapScratch(bytes);
+        if (m) {
+            // Page aligned, so it's 16-byte aligned like the heap
+            memory = data = (float *)m;
+            mapping = bytes;
+            return true;
+        }
+        // Automatic quietly falls back to the heap
+        if (storage == Mapped) {
+            panic("Could not make a scratch file of %lld bytes in %s\n",
+                  (long long)bytes, scratchDirectory().c_str());
+        }
+    }
+
+    // guarantee 16-byte alignment in case people want to use SSE
+    memory = new float[size+3];
+    if ((long long)memory & 0xf) {
+        data = memory + 4 - (((long long)memory & 0xf) >> 2);
+    } else {
+        data = memory;
+    }
+    return false;
+}
+
+Image Image::mapFile(FILE *f, long long offset, int width, int height, int frames, int channels) {
+    Image im;
+#ifndef WIN32
+    long long size = ((long long)frames *
+                      (long long)height *
+                      (long long)width *
+                      (long long)channels);
+    long long bytes = offset + size * (long long)sizeof(float);
+
+    struct stat st;
+    int fd = fileno(f);
+    if (offset % sizeof(float) || fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < bytes) {
+        return im;
+    }
+    void *m = mmap(NULL, (size_t)bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) { return im; }
+
+    im.width = width;
+    im.height = height;
+    im.frames = frames;
+    im.channels = channels;
+    im.xstride = channels;
+    im.ystride = im.xstride * width;
+    im.tstride = im.ystride * height;
+    im.memory = (float *)m;
+    im.data = (float *)((char *)m + offset);
+    mappedFiles[im.memory] = make_pair(st.st_dev, st.st_ino);
+    im.mapping = (size_t)bytes;
+    im.refCount = new int;
+    *im.refCount = 1;
+#endif
+    return im;
+}
+
+bool Image::fileIsMapped(string filename) {
+#ifndef WIN32
+    struct stat st;
+    if (stat(filename.c_str(), &st)) { return false; }
+    for (map<float *, pair<dev_t, ino_t> >::iterator i = mappedFiles.begin();
+         i != mappedFiles.end(); i++) {
+        if (i->second.first == st.st_dev && i->second.second == st.st_ino) { return true; }
+    }
+#endif
+    return false;
+}
+
+void Image::release() {
+#ifndef WIN32
+    if (mapping) {
+        mappedFiles.erase(memory);
+        munmap(memory, mapping);
+        return;
+    }
+#endif
+    delete[] memory;
+}
+
 #include "footer.h"
@@ -50,6 +50,9 @@ void loadOperations() {
     operationMap["-loop"] = new Loop();
     operationMap["-pause"] = new Pause();
     operationMap["-time"] = new Time();
+    operationMap["-threads"] = new Threads();
+    operationMap["-lazy"] = new Lazy();
+    operationMap["-scratch"] = new Scratch();
 
     // statistics
 
@@ -1,8 +1,58 @@
 #include "main.h"
 #include "Paint.h"
 #include "Parser.h"
+#include "Parallel.h"
 #include "header.h"
 
+namespace {
+
+// Runs programs[c] for channel c of every row of out.
+class EvalRows : public ParallelTask {
+public:
+    EvalRows(vector<Expression::Program *> &programs_, Expression::State &state_, Window out_) :
+        programs(programs_), state(state_), out(out_) {}
+
+    void run(int begin, int end) {
+        // Each thread walks the tree with its own state. The programs
+        // have already computed any stats they need, so the copies
+        // don't compute them again.
+        Expression::State s(state);
+
+        int size = 0;
+        for (size_t i = 0; i < programs.size(); i++) {
+            size = max(size, programs[i]->scratchSize());
+        }
+        vector<float> scratch(size);
+
+        for (int i = begin; i < end; i++) {
+            s.t = i / out.height;
+            s.y = i % out.height;
+            for (int x = 0; x < out.width; x += Expression::Program::RUN) {
+                int n = min((int)Expression::Program::RUN, out.width - x);
+                float *dst = out(x, s.y, s.t);
+                for (s.c = 0; s.c < out.channels; s.c++) {
+                    const float *v = programs[s.c]->run(&s, x, n, &scratch[0]);
+                    for (int j = 0; j < n; j++) {
+                        dst[j * out.channels + s.c] = v[j];
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    vector<Expression::Program *> &programs;
+    Expression::State &state;
+    Window out;
+};
+
+void evaluate(vector<Expression::Program *> &programs, Expression::State &state, Window out) {
+    EvalRows task(programs, state, out);
+    parallelFor(0, out.frames * out.height, task);
+}
+
+}
+
 void Eval::help() {
     printf("\n-eval takes a simple expression and evaluates it, writing the result to the\n"
            "current image.\n\n");
@@ -23,17 +73,15 @@ Image Eval::apply(Window im, string expression_) {
 
     Image out(im.width, im.height, im.frames, im.channels);
 
-    for (state.t = 0; state.t < im.frames; state.t++) {
-        for (state.y = 0; state.y < im.height; state.y++) {
-            for (state.x = 0; state.x < im.width; state.x++) {
-                state.val = im(state.x, state.y, state.t);
-                for (state.c = 0; state.c < im.channels; state.c++) {
-                    out(state.x, state.y, state.t)[state.c] = expression.eval(&state);
-                }
-            }
-        }
+    vector<Expression::Program *> programs(im.channels);
+    for (state.c = 0; state.c < im.channels; state.c++) {
+        programs[state.c] = new Expression::Program(expression, &state);
     }
 
+    evaluate(programs, state, out);
+
+    for (size_t i = 0; i < programs.size(); i++) { delete programs[i]; }
+
     return out;
 }
 
@@ -68,17 +116,14 @@ Image EvalChannels::apply(Window im, vector<string> expressions_) {
 
     Expression::State state(im);
 
-    for (state.t = 0; state.t < im.frames; state.t++) {
-        for (state.y = 0; state.y < im.height; state.y++) {
-            for (state.x = 0; state.x < im.width; state.x++) {
-                state.val = im(state.x, state.y, state.t);
-                for (state.c = 0; state.c < channels; state.c++) {
-                    out(state.x, state.y, state.t)[state.c] = expressions[state.c]->eval(&state);
-                }
-            }
-        }
+    vector<Expression::Program *> programs(channels);
+    for (state.c = 0; state.c < channels; state.c++) {
+        programs[state.c] = new Expression::Program(*expressions[state.c], &state);
     }
 
+    evaluate(programs, state, out);
+
+    for (size_t i = 0; i < programs.size(); i++) { delete programs[i]; }
     for (size_t i = 0; i < expressions.size(); i++) { delete expressions[i]; }
 
     return out;
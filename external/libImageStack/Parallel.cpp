@@ -0,0 +1,281 @@
+#include "main.h"
+#include "Parallel.h"
+#ifndef WIN32
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#include "header.h"
+
+#ifdef WIN32
+
+// No pool on windows yet. Everything runs on the calling thread.
+
+void parallelFor(int begin, int end, ParallelTask &task, int grain) {
+    if (begin < end) { task.run(begin, end); }
+}
+
+int threadCount() {
+    return 1;
+}
+
+void setThreadCount(int threads) {
+}
+
+#else
+
+namespace {
+
+// The part of the range one thread is working through. Its owner
+// takes chunks off the front, and thieves take the back half.
+struct Share {
+    pthread_mutex_t lock;
+    int next, end;
+};
+
+struct Pool {
+    // Held for the duration of a parallelFor
+    pthread_mutex_t busy;
+
+    // Guards everything below
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+
+    vector<pthread_t> workers;
+    int threads; // 0 until first use
+    bool quit;
+
+    // The current loop. Workers run it when generation changes.
+    ParallelTask *task;
+    int grain;
+    Share *shares;
+    int generation;
+    int spawned; // the generation when the workers were started
+    int running; // workers yet to finish the current loop
+
+    bool failed;
+    Exception error;
+
+    Pool() : error("") {
+        pthread_mutex_init(&busy, NULL);
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&wake, NULL);
+        pthread_cond_init(&done, NULL);
+        threads = 0;
+        quit = false;
+        task = NULL;
+        grain = 1;
+        shares = NULL;
+        generation = 0;
+        spawned = 0;
+        running = 0;
+        failed = false;
+    }
+};
+
+Pool pool;
+
+int defaultThreadCount() {
+    const char *env = getenv("IMAGESTACK_THREADS");
+    if (env && atoi(env) > 0) { return atoi(env); }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+// Take the next chunk of share i, if there's anything left in it.
+bool takeChunk(Share &s, int grain, int *begin, int *end) {
+    pthread_mutex_lock(&s.lock);
+    bool found = s.next < s.end;
+    if (found) {
+        *begin = s.next;
+        *end = min(s.next + grain, s.end);
+        s.next = *end;
+    }
+    pthread_mutex_unlock(&s.lock);
+    return found;
+}
+
+// Move the back half of someone else's share into share i.
+bool steal(int i, int participants) {
+    Share *shares = pool.shares;
+    for (int j = 1; j < participants; j++) {
+        Share &victim = shares[(i + j) % participants];
+        pthread_mutex_lock(&victim.lock);
+        int remaining = victim.end - victim.next;
+        if (remaining > 0) {
+            int mid = victim.next + remaining / 2;
+            int end = victim.end;
+            victim.end = mid;
+            pthread_mutex_unlock(&victim.lock);
+
+            pthread_mutex_lock(&shares[i].lock);
+            shares[i].next = mid;
+            shares[i].end = end;
+            pthread_mutex_unlock(&shares[i].lock);
+            return true;
+        }
+        pthread_mutex_unlock(&victim.lock);
+    }
+    return false;
+}
+
+// Give up on the rest of the loop, e.g. because some chunk threw.
+void abandon(int participants) {
+    for (int i = 0; i < participants; i++) {
+        pthread_mutex_lock(&pool.shares[i].lock);
+        pool.shares[i].next = pool.shares[i].end;
+        pthread_mutex_unlock(&pool.shares[i].lock);
+    }
+}
+
+void fail(const Exception &e, int participants) {
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.failed) { pool.error = e; }
+    pool.failed = true;
+    pthread_mutex_unlock(&pool.lock);
+    abandon(participants);
+}
+
+// Work through share i, then help out with the others.
+void participate(int i, int participants) {
+    int begin, end;
+    try {
+        do {
+            while (takeChunk(pool.shares[i], pool.grain, &begin, &end)) {
+                pool.task->run(begin, end);
+            }
+        } while (steal(i, participants));
+    } catch (Exception &e) {
+        fail(e, participants);
+    } catch (...) {
+        fail(Exception("Unknown error in a parallel loop\n"), participants);
+    }
+}
+
+void *workerMain(void *arg) {
+    int id = (int)(long)arg;
+    pthread_mutex_lock(&pool.lock);
+    // Not pool.generation, which may already have moved on to a loop
+    // this worker is expected to take part in.
+    int seen = pool.spawned;
+    for (;;) {
+        while (pool.generation == seen && !pool.quit) {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        if (pool.quit) { break; }
+        seen = pool.generation;
+        int participants = (int)pool.workers.size() + 1;
+        pthread_mutex_unlock(&pool.lock);
+
+        participate(id, participants);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.running == 0) { pthread_cond_signal(&pool.done); }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+// Bring the number of workers in line with pool.threads. Called with
+// pool.busy held, so no loop is running.
+void resizePool() {
+    int wanted = pool.threads - 1;
+    if ((int)pool.workers.size() == wanted) { return; }
+
+    if (pool.workers.size()) {
+        pthread_mutex_lock(&pool.lock);
+        pool.quit = true;
+        pthread_cond_broadcast(&pool.wake);
+        pthread_mutex_unlock(&pool.lock);
+        for (size_t i = 0; i < pool.workers.size(); i++) {
+            pthread_join(pool.workers[i], NULL);
+        }
+        pool.workers.clear();
+        pool.quit = false;
+    }
+
+    pool.spawned = pool.generation;
+    for (int i = 0; i < wanted; i++) {
+        pthread_t thread;
+        // worker i owns share i+1, the caller owns share 0
+        if (pthread_create(&thread, NULL, workerMain, (void *)(long)(i + 1))) { break; }
+        pool.workers.push_back(thread);
+    }
+}
+
+}
+
+void parallelFor(int begin, int end, ParallelTask &task, int grain) {
+    if (begin >= end) { return; }
+    if (grain < 1) { grain = 1; }
+
+    // Nested or concurrent loops run serially
+    if (pthread_mutex_trylock(&pool.busy)) {
+        task.run(begin, end);
+        return;
+    }
+
+    if (!pool.threads) { pool.threads = defaultThreadCount(); }
+    resizePool();
+
+    int participants = (int)pool.workers.size() + 1;
+    if (participants == 1 || end - begin <= grain) {
+        pthread_mutex_unlock(&pool.busy);
+        task.run(begin, end);
+        return;
+    }
+
+    // Split the range evenly to start with
+    vector<Share> shares(participants);
+    long long size = end - begin;
+    for (int i = 0; i < participants; i++) {
+        pthread_mutex_init(&shares[i].lock, NULL);
+        shares[i].next = begin + (int)(size * i / participants);
+        shares[i].end = begin + (int)(size * (i + 1) / participants);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.task = &task;
+    pool.grain = grain;
+    pool.shares = &shares[0];
+    pool.failed = false;
+    pool.running = participants - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    participate(0, participants);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.running > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    bool failed = pool.failed;
+    Exception error = pool.error;
+    pool.task = NULL;
+    pool.shares = NULL;
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < participants; i++) {
+        pthread_mutex_destroy(&shares[i].lock);
+    }
+    pthread_mutex_unlock(&pool.busy);
+
+    if (failed) { throw error; }
+}
+
+int threadCount() {
+    if (!pool.threads) { return defaultThreadCount(); }
+    return pool.threads;
+}
+
+void setThreadCount(int threads) {
+    assert(threads > 0, "The number of threads must be positive\n");
+    pthread_mutex_lock(&pool.busy);
+    pool.threads = threads;
+    resizePool();
+    pthread_mutex_unlock(&pool.busy);
+}
+
+#endif
+
+#include "footer.h"
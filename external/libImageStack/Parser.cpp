@@ -328,6 +328,413 @@ float Expression::eval(State *state) {
     return root->eval(state);
 }
 
+namespace {
+
+// The least an instruction with this opcode varies, whatever its
+// arguments do. Samples are never walked from a Program, because the
+// tree's Sample nodes keep a buffer that isn't safe to share between
+// threads.
+Expression::Value::Kind opcodeKind(Expression::Opcode op) {
+    switch (op) {
+    case Expression::Op_Uniform:
+        return Expression::Value::Uniform;
+    case Expression::Op_X:
+    case Expression::Op_Val:
+    case Expression::Op_SampleHere:
+    case Expression::Op_Sample2D:
+    case Expression::Op_Sample3D:
+        return Expression::Value::Varying;
+    default:
+        return Expression::Value::Constant;
+    }
+}
+
+// Whether an instruction only computes the lanes that take the
+// branch it's in. That's everything that calls out to something
+// expensive, or that might read memory it shouldn't for the lanes
+// that don't.
+bool masked(Expression::Opcode op) {
+    switch (op) {
+    case Expression::Op_Uniform:
+    case Expression::Op_Mod:
+    case Expression::Op_Power:
+    case Expression::Op_Sin:
+    case Expression::Op_Cos:
+    case Expression::Op_Tan:
+    case Expression::Op_Atan:
+    case Expression::Op_Asin:
+    case Expression::Op_Acos:
+    case Expression::Op_Atan2:
+    case Expression::Op_Log:
+    case Expression::Op_Exp:
+        return true;
+    default:
+        return op >= Expression::Op_Mean;
+    }
+}
+
+Expression::Value makeValue(Expression::Value::Kind kind, float constant, Expression::Node *node, int reg) {
+    Expression::Value v;
+    v.kind = kind;
+    v.constant = constant;
+    v.node = node;
+    v.reg = reg;
+    return v;
+}
+
+inline bool active(const float *mask, int i) {
+    return !mask || mask[i] != 0;
+}
+
+}
+
+Expression::Compiler::Compiler(Program *program_, State *state_) :
+    program(program_), state(state_), branch(NULL) {
+}
+
+Expression::Value Expression::Compiler::emit(Node *n, Opcode op, Node *a, Node *b, Node *c) {
+    Node *children[] = {a, b, c};
+    Value args[3];
+    int kind = opcodeKind(op);
+    for (int i = 0; i < 3 && children[i]; i++) {
+        args[i] = children[i]->compile(this);
+        kind = max(kind, (int)args[i].kind);
+    }
+
+    // Evaluating the node itself is the surest way to fold it to
+    // exactly what the tree walker would have computed.
+    if (kind == Value::Constant) {
+        return makeValue(Value::Constant, n->eval(state), NULL, -1);
+    }
+
+    // The stats are computed on first use, which mustn't happen from
+    // several threads at once, so get it out of the way now.
+    if (op >= Op_Mean && op <= Op_Covariance) {
+        state->stats.mean();
+        if (op >= Op_Variance) { state->stats.variance(); }
+    }
+
+    if (kind == Value::Uniform) {
+        return makeValue(Value::Uniform, 0, n, -1);
+    }
+
+    int regs[] = {-1, -1, -1};
+    for (int i = 0; i < 3 && children[i]; i++) {
+        regs[i] = materialize(args[i]);
+    }
+    int reg = instruction(op, regs[0], regs[1], regs[2], masked(op) ? mask() : -1);
+    return makeValue(Value::Varying, 0, n, reg);
+}
+
+Expression::Value Expression::Compiler::ifThenElse(Node *n, Node *cond, Node *a, Node *b) {
+    Value c = cond->compile(this);
+    if (c.kind == Value::Constant) {
+        return (c.constant ? a : b)->compile(this);
+    }
+
+    Branch *outer = branch;
+    Branch taken = {c, true, outer, -1};
+    Branch other = {c, false, outer, -1};
+
+    branch = &taken;
+    Value va = a->compile(this);
+    branch = &other;
+    Value vb = b->compile(this);
+    branch = outer;
+
+    if (c.kind == Value::Uniform && va.kind != Value::Varying && vb.kind != Value::Varying) {
+        return makeValue(Value::Uniform, 0, n, -1);
+    }
+
+    int rc = materialize(c);
+    branch = &taken;
+    int ra = materialize(va);
+    branch = &other;
+    int rb = materialize(vb);
+    branch = outer;
+
+    return makeValue(Value::Varying, 0, n, instruction(Op_Select, rc, ra, rb, -1));
+}
+
+int Expression::Compiler::materialize(Value v) {
+    switch (v.kind) {
+    case Value::Constant:
+        return instruction(Op_Constant, -1, -1, -1, -1, v.constant);
+    case Value::Uniform:
+        return instruction(Op_Uniform, -1, -1, -1, mask(), 0, v.node);
+    default:
+        return v.reg;
+    }
+}
+
+int Expression::Compiler::mask() {
+    if (!branch) { return -1; }
+    if (branch->mask < 0) {
+        // The condition and the enclosing mask belong to the
+        // enclosing branch.
+        Branch *inner = branch;
+        branch = inner->outer;
+        int outer = mask();
+        int cond = materialize(inner->cond);
+        branch = inner;
+        inner->mask = instruction(inner->taken ? Op_When : Op_Unless, outer, cond, -1, -1);
+    }
+    return branch->mask;
+}
+
+// Append an instruction, or find an identical one, and return its
+// index.
+int Expression::Compiler::instruction(Opcode op, int a, int b, int c, int mask, float constant, Node *node) {
+    vector<Program::Instruction> &code = program->code;
+    for (size_t i = 0; i < code.size(); i++) {
+        Program::Instruction &ins = code[i];
+        if (ins.op == op && ins.a == a && ins.b == b && ins.c == c &&
+            ins.mask == mask && ins.node == node &&
+            !memcmp(&ins.constant, &constant, sizeof(float))) {
+            return (int)i;
+        }
+    }
+    Program::Instruction ins;
+    ins.op = op;
+    ins.dst = (int)code.size();
+    ins.a = a;
+    ins.b = b;
+    ins.c = c;
+    ins.mask = mask;
+    ins.constant = constant;
+    ins.node = node;
+    code.push_back(ins);
+    return ins.dst;
+}
+
+Expression::Program::Program(Expression &e, State *state) {
+    Compiler compiler(this, state);
+    int value = compiler.materialize(e.root->compile(&compiler));
+
+    // So far each instruction has its own register. Share them out
+    // again, reusing a register once the last instruction to read it
+    // is done. An instruction never writes to a register it reads
+    // from, so the loops below don't have to worry about aliasing.
+    int n = (int)code.size();
+    vector<int> lastUse(n, -1);
+    for (int i = 0; i < n; i++) {
+        int args[] = {code[i].a, code[i].b, code[i].c, code[i].mask};
+        for (int j = 0; j < 4; j++) {
+            if (args[j] >= 0) { lastUse[args[j]] = i; }
+        }
+    }
+    lastUse[value] = n;
+
+    vector<int> physical(n), unused;
+    registers = 0;
+    for (int i = 0; i < n; i++) {
+        Instruction &ins = code[i];
+        if (unused.empty()) {
+            physical[i] = registers++;
+        } else {
+            physical[i] = unused.back();
+            unused.pop_back();
+        }
+
+        int *args[] = {&ins.a, &ins.b, &ins.c, &ins.mask};
+        for (int j = 0; j < 4; j++) {
+            int arg = *args[j];
+            if (arg < 0) { continue; }
+            *args[j] = physical[arg];
+            // Free each register once, even if it's read twice
+            bool repeated = false;
+            for (int k = 0; k < j; k++) {
+                repeated = repeated || *args[k] == physical[arg];
+            }
+            if (lastUse[arg] == i && !repeated) { unused.push_back(physical[arg]); }
+        }
+        ins.dst = physical[i];
+        if (lastUse[i] < 0) { unused.push_back(ins.dst); }
+    }
+    result = physical[value];
+}
+
+const float *Expression::Program::run(State *state, int x, int n, float *scratch) const {
+    Window &im = state->im;
+    const float *pixel = im(x, state->y, state->t);
+    int stride = im.xstride;
+    int channel = state->c;
+    vector<float> sample;
+
+    for (size_t k = 0; k < code.size(); k++) {
+        const Instruction &ins = code[k];
+        float *r = scratch + ins.dst * RUN;
+        const float *a = ins.a < 0 ? NULL : scratch + ins.a * RUN;
+        const float *b = ins.b < 0 ? NULL : scratch + ins.b * RUN;
+        const float *c = ins.c < 0 ? NULL : scratch + ins.c * RUN;
+        const float *m = ins.mask < 0 ? NULL : scratch + ins.mask * RUN;
+
+        switch (ins.op) {
+        case Op_Constant:
+            for (int i = 0; i < n; i++) { r[i] = ins.constant; }
+            break;
+        case Op_Uniform: {
+            bool any = !m;
+            for (int i = 0; i < n && !any; i++) { any = m[i] != 0; }
+            float v = any ? ins.node->eval(state) : 0;
+            for (int i = 0; i < n; i++) { r[i] = v; }
+            break;
+        }
+        case Op_X:
+            for (int i = 0; i < n; i++) { r[i] = x + i; }
+            break;
+        case Op_Val:
+            for (int i = 0; i < n; i++) { r[i] = pixel[i * stride + channel]; }
+            break;
+        case Op_When:
+            if (a) {
+                for (int i = 0; i < n; i++) { r[i] = a[i] != 0 && b[i] != 0; }
+            } else {
+                for (int i = 0; i < n; i++) { r[i] = b[i] != 0; }
+            }
+            break;
+        case Op_Unless:
+            if (a) {
+                for (int i = 0; i < n; i++) { r[i] = a[i] != 0 && b[i] == 0; }
+            } else {
+                for (int i = 0; i < n; i++) { r[i] = b[i] == 0; }
+            }
+            break;
+        case Op_Select:
+            for (int i = 0; i < n; i++) { r[i] = a[i] != 0 ? b[i] : c[i]; }
+            break;
+        case Op_Negate:
+            for (int i = 0; i < n; i++) { r[i] = -a[i]; }
+            break;
+        case Op_LTE:
+            for (int i = 0; i < n; i++) { r[i] = a[i] <= b[i] ? 1 : 0; }
+            break;
+        case Op_GTE:
+            for (int i = 0; i < n; i++) { r[i] = a[i] >= b[i] ? 1 : 0; }
+            break;
+        case Op_LT:
+            for (int i = 0; i < n; i++) { r[i] = a[i] < b[i] ? 1 : 0; }
+            break;
+        case Op_GT:
+            for (int i = 0; i < n; i++) { r[i] = a[i] > b[i] ? 1 : 0; }
+            break;
+        case Op_EQ:
+            for (int i = 0; i < n; i++) { r[i] = a[i] == b[i] ? 1 : 0; }
+            break;
+        case Op_NEQ:
+            for (int i = 0; i < n; i++) { r[i] = a[i] != b[i] ? 1 : 0; }
+            break;
+        case Op_Plus:
+            for (int i = 0; i < n; i++) { r[i] = a[i] + b[i]; }
+            break;
+        case Op_Minus:
+            for (int i = 0; i < n; i++) { r[i] = a[i] - b[i]; }
+            break;
+        case Op_Times:
+            for (int i = 0; i < n; i++) { r[i] = a[i] * b[i]; }
+            break;
+        case Op_Divide:
+            for (int i = 0; i < n; i++) { r[i] = a[i] / b[i]; }
+            break;
+        case Op_Mod:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? fmod(a[i], b[i]) : 0; }
+            break;
+        case Op_Power:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? powf(a[i], b[i]) : 0; }
+            break;
+        case Op_Sin:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? sinf(a[i]) : 0; }
+            break;
+        case Op_Cos:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? cosf(a[i]) : 0; }
+            break;
+        case Op_Tan:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? tanf(a[i]) : 0; }
+            break;
+        case Op_Atan:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? atanf(a[i]) : 0; }
+            break;
+        case Op_Asin:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? asinf(a[i]) : 0; }
+            break;
+        case Op_Acos:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? acosf(a[i]) : 0; }
+            break;
+        case Op_Atan2:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? atan2f(a[i], b[i]) : 0; }
+            break;
+        case Op_Abs:
+            for (int i = 0; i < n; i++) { r[i] = fabsf(a[i]); }
+            break;
+        case Op_Floor:
+            for (int i = 0; i < n; i++) { r[i] = floorf(a[i]); }
+            break;
+        case Op_Ceil:
+            for (int i = 0; i < n; i++) { r[i] = ceilf(a[i]); }
+            break;
+        case Op_Round:
+            for (int i = 0; i < n; i++) { r[i] = roundf(a[i]); }
+            break;
+        case Op_Log:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? logf(a[i]) : 0; }
+            break;
+        case Op_Exp:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? expf(a[i]) : 0; }
+            break;
+        case Op_Mean:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? state->stats.mean((int)(a[i] + 0.5)) : 0; }
+            break;
+        case Op_Sum:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? state->stats.sum((int)(a[i] + 0.5)) : 0; }
+            break;
+        case Op_Max:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? state->stats.maximum((int)(a[i] + 0.5)) : 0; }
+            break;
+        case Op_Min:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? state->stats.minimum((int)(a[i] + 0.5)) : 0; }
+            break;
+        case Op_Variance:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? state->stats.variance((int)(a[i] + 0.5)) : 0; }
+            break;
+        case Op_Stddev:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? sqrtf(state->stats.variance((int)(a[i] + 0.5))) : 0; }
+            break;
+        case Op_Skew:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? state->stats.skew((int)(a[i] + 0.5)) : 0; }
+            break;
+        case Op_Kurtosis:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? state->stats.kurtosis((int)(a[i] + 0.5)) : 0; }
+            break;
+        case Op_Covariance:
+            for (int i = 0; i < n; i++) {
+                r[i] = active(m, i) ? state->stats.covariance((int)(a[i] + 0.5), (int)(b[i] + 0.5)) : 0;
+            }
+            break;
+        case Op_SampleHere:
+            for (int i = 0; i < n; i++) { r[i] = active(m, i) ? pixel[i * stride + (int)(a[i] + 0.5)] : 0; }
+            break;
+        case Op_Sample2D:
+            sample.resize(im.channels);
+            for (int i = 0; i < n; i++) {
+                if (!active(m, i)) { r[i] = 0; continue; }
+                im.sample2D(a[i], b[i], &sample[0]);
+                r[i] = sample[channel];
+            }
+            break;
+        case Op_Sample3D:
+            sample.resize(im.channels);
+            for (int i = 0; i < n; i++) {
+                if (!active(m, i)) { r[i] = 0; continue; }
+                im.sample3D(a[i], b[i], c[i], &sample[0]);
+                r[i] = sample[channel];
+            }
+            break;
+        }
+    }
+
+    return scratch + result * RUN;
+}
+
 void Expression::help() {
     printf("Variables:\n"
            "  x   \t the x coordinate, measured from 0 to width - 1\n"
@@ -2,23 +2,33 @@
 #include "main.h"
 #include "time.h"
 #include "Parser.h"
+#include "Arithmetic.h"
 #ifndef WIN32
 #include <sys/time.h>
 #endif
 #include "header.h"
 
 vector<Image> stack_;
+
+// Pointwise operations waiting to be applied to the top of the stack
+bool lazy_ = false;
+PointwiseChain deferred_;
+
 Image &stack(size_t idx) {
+    evaluate();
     assert(idx < stack_.size(), "Stack underflow\n");
     return stack_[stack_.size() - 1 - idx];
 }
 
 void push(Image im) {
+    evaluate();
     stack_.push_back(im);
 }
 
 void pop() {
     assert(stack_.size(), "Stack underflow\n");
+    // No point applying them now
+    deferred_.clear();
     stack_.pop_back();
 }
 
@@ -30,6 +40,7 @@ void dup() {
 }
 
 void pull(size_t n) {
+    evaluate();
     assert(n < stack_.size(), "Stack underflow\n");
     for (size_t i = stack_.size() - n - 1; i < stack_.size()-1; i++) {
         Image tmp = stack_[i+1];
@@ -38,6 +49,39 @@ void pull(size_t n) {
     }
 }
 
+void setLazy(bool on) {
+    if (!on) { evaluate(); }
+    lazy_ = on;
+}
+
+bool lazy() {
+    return lazy_;
+}
+
+void defer(PointwiseOp *op) {
+    if (!stack_.size()) {
+        delete op;
+        panic("Stack underflow\n");
+    }
+    deferred_.add(op);
+}
+
+void evaluate() {
+    if (deferred_.empty()) { return; }
+    try {
+        deferred_.apply(stack_.back());
+    } catch (Exception &e) {
+        deferred_.clear();
+        throw;
+    }
+    deferred_.clear();
+}
+
+Image &peek(size_t idx) {
+    assert(idx < stack_.size(), "Stack underflow\n");
+    return stack_[stack_.size() - 1 - idx];
+}
+
 int randomInt(int min, int max) {
     return (int)(((double)rand()/(RAND_MAX+1.0)) * (max - min + 1) + min);
 }
@@ -137,7 +181,28 @@ int readInt(string arg) {
 }
 
 
+// Whether arg is just a decimal number like -0.25, which can be read
+// without an expression, and so without looking at the stack (and
+// applying anything deferred on it)
+static bool isPlainNumber(const string &arg) {
+    size_t i = 0;
+    if (i < arg.size() && arg[i] == '-') { i++; }
+    bool digits = false, point = false;
+    for (; i < arg.size(); i++) {
+        if (isdigit(arg[i])) { digits = true; }
+        else if (arg[i] == '.' && !point) { point = true; }
+        else { return false; }
+    }
+    return digits;
+}
+
 float readFloat(string arg) {
+    if (isPlainNumber(arg)) {
+        float val;
+        sscanf(arg.c_str(), "%f", &val);
+        return val;
+    }
+
     bool needToPop = false;
     Expression e(arg, false);
     if (stack_.size() == 0) {
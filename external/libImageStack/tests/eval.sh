@@ -0,0 +1,89 @@
+#!/bin/bash
+# Runs a set of -eval expressions through the bytecode compiler and
+# through the tree walker it replaced, checks that both give the same
+# result, and reports how long each took.
+#
+# Usage: tests/eval.sh IMAGESTACK TREE_IMAGESTACK [SIZE [FRAMES]]
+#
+# IMAGESTACK is a current build. -eval only walks the tree in builds
+# from before it compiled expressions, so TREE_IMAGESTACK must be one of
+# those, for example built from the parent of the commit that added
+# Expression::Program. The input is SIZE x SIZE (default 1024) with
+# three channels and FRAMES frames (default 2). Both builds run with one
+# thread, so the times compare the evaluators and not the scheduling.
+
+set -e
+
+BIN=${1:?usage: $0 IMAGESTACK TREE_IMAGESTACK [SIZE [FRAMES]]}
+TREE=${2:?usage: $0 IMAGESTACK TREE_IMAGESTACK [SIZE [FRAMES]]}
+SIZE=${3:-1024}
+FRAMES=${4:-2}
+
+OUT=$(mktemp -d "${TMPDIR:-/tmp}/evaltest.XXXXXX")
+trap 'rm -rf "$OUT"' EXIT
+
+"$BIN" -push $SIZE $SIZE $FRAMES 3 -eval "((x*7 + y*13 + t*17 + c*29) % 101) / 101 + 0.005" \
+    -save "$OUT/in.tmp" > /dev/null
+
+# eval BIN EXPRESSION OUTPUT prints the time -eval took, in seconds
+eval_time() {
+    "$1" -threads 1 -load "$OUT/in.tmp" -time --eval "$2" -save "$3" |
+        awk '/operation -eval/ {getline; if ($2 == "s") print $1; exit}'
+}
+
+FAILED=0
+TOTAL_BYTECODE=0
+TOTAL_TREE=0
+printf "%9s %9s\n" tree bytecode
+while read -r e; do
+    [ -n "$e" ] || continue
+    rm -f "$OUT/bytecode.tmp" "$OUT/tree.tmp"
+    B=$(eval_time "$BIN" "$e" "$OUT/bytecode.tmp")
+    T=$(eval_time "$TREE" "$e" "$OUT/tree.tmp")
+    if [ -z "$B" ] || [ -z "$T" ]; then
+        echo "FAILED to evaluate: $e"
+        FAILED=$((FAILED + 1))
+        continue
+    fi
+    if cmp -s "$OUT/bytecode.tmp" "$OUT/tree.tmp"; then
+        RESULT=same
+    else
+        RESULT=DIFFERENT
+        FAILED=$((FAILED + 1))
+    fi
+    printf "%7.3f s %7.3f s %5.1fx  %-9s %s\n" $T $B $(echo "$T $B" | awk '{print ($2 > 0 ? $1 / $2 : 0)}') \
+        $RESULT "$e"
+    TOTAL_BYTECODE=$(echo "$TOTAL_BYTECODE $B" | awk '{print $1 + $2}')
+    TOTAL_TREE=$(echo "$TOTAL_TREE $T" | awk '{print $1 + $2}')
+done <<'EXPRESSIONS'
+val
+val*2+1
+(x*y*t)^0.5
+[0]*0.299+[1]*0.587+[2]*0.114
+val > 0.5 ? val*val : val^0.5
+val > 0.5 ? val^2.2 : 1-val
+x < width/2 ? [x*2, y] : val
+x < 20 ? [x*2, y*1.5, 0] : -val
+c == 0 ? [1] : (c == 1 ? [2] : [0])
+[(x+c)%3]
+x%7 < 3 ? log(val) : exp(val)
+sin(x/10)*cos(y/10) + tan(val) - atan(val) + asin(val-0.5) + acos(val-0.5)
+atan(y - height/2) + atan(x - width/2)
+abs(val-0.5) + floor(val*10) + ceil(val*10) + round(val*10.3)
+mean() + sum()/1000000 + max() - min() + stddev() + variance() + skew() + kurtosis()
+mean(c) + stddev(c) + covariance(c, 0) + max(c) - min(c) + skew(c) + kurtosis(c) + variance(c)
+(val - mean(c))/stddev(c)
+val*val + val*val + (val*val)*(val*val)
+y/height + t + c + width/1000
+pi*e
+val != val ? 0 : val
+val >= 0.3 ? (val <= 0.6 ? 1 : 2) : (val == 0 ? 3 : 4)
+x % 3 == 0 ? (y % 2 == 1 ? sin(val) : [x, y]) : (c == 2 ? val : log(val))
+(-val) + -x + -(y*2)
+val / (x - 100)
+EXPRESSIONS
+
+printf "%7.3f s %7.3f s %5.1fx  total\n" $TOTAL_TREE $TOTAL_BYTECODE \
+    $(echo "$TOTAL_TREE $TOTAL_BYTECODE" | awk '{print ($2 > 0 ? $1 / $2 : 0)}')
+[ $FAILED -eq 0 ] || { echo "FAILED: $FAILED expressions differ or didn't run"; exit 1; }
+echo "PASSED"
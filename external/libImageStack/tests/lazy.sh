@@ -0,0 +1,59 @@
+#!/bin/bash
+# Runs the same chain of pointwise operations with and without -lazy,
+# reports the wall time and peak resident set size of each, and checks
+# that both give the same result.
+#
+# Usage: tests/lazy.sh IMAGESTACK [SIZE [FRAMES [RUNS]]]
+#
+# The input is SIZE x SIZE (default 2048) with three channels and FRAMES
+# frames (default 4). The fastest of RUNS runs (default 3) is reported,
+# along with its peak RSS. Needs python3 to measure the RSS.
+
+set -e
+
+BIN=${1:?usage: $0 IMAGESTACK [SIZE [FRAMES [RUNS]]]}
+SIZE=${2:-2048}
+FRAMES=${3:-4}
+RUNS=${4:-3}
+
+OUT=$(mktemp -d "${TMPDIR:-/tmp}/lazytest.XXXXXX")
+trap 'rm -rf "$OUT"' EXIT
+
+"$BIN" -push $SIZE $SIZE $FRAMES 3 -eval "((x*7 + y*13 + t*17 + c*29) % 101) / 100" \
+    -save "$OUT/in.tmp" > /dev/null
+
+CHAIN="-scale 2 -offset 0.1 -gamma 0.45 -clamp -log -abs -exp
+    -mod 0.7 -offset -0.1 -denan 0 -threshold 0.2 -quantize 0.05"
+
+fail() {
+    echo "FAILED: $*"
+    exit 1
+}
+
+# measure COMMAND... prints the wall time in ms and the peak RSS in KB
+measure() {
+    python3 -c '
+import resource, subprocess, sys, time
+start = time.time()
+status = subprocess.call(sys.argv[1:], stdout=subprocess.DEVNULL)
+ms = (time.time() - start) * 1000
+print("%d %d" % (ms, resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss))
+sys.exit(status)' "$@"
+}
+
+echo "$SIZE x $SIZE x $FRAMES x 3 input, $(($SIZE * $SIZE * $FRAMES * 12 / 1048576)) MB"
+for mode in off on; do
+    LAZY=
+    [ $mode = on ] && LAZY=-lazy
+    BEST=
+    for ((r = 0; r < RUNS; r++)); do
+        RESULT=$(measure "$BIN" $LAZY -load "$OUT/in.tmp" $CHAIN -save "$OUT/$mode.tmp") ||
+            fail "-lazy $mode didn't run"
+        set -- $RESULT
+        if [ -z "$BEST" ] || [ $1 -lt $BEST ]; then BEST=$1; RSS=$2; fi
+    done
+    printf -- "-lazy %-3s %6d ms, peak RSS %6d MB\n" $mode $BEST $((RSS / 1024))
+done
+
+cmp "$OUT/off.tmp" "$OUT/on.tmp" > /dev/null || fail "-lazy changes the result"
+echo "PASSED"
@@ -0,0 +1,79 @@
+#!/bin/bash
+# Pushes a volume bigger than physical memory through -crop, -resample
+# and -save using scratch files, and checks the result against the heap.
+#
+# Usage: tests/scratch.sh IMAGESTACK [SCRATCH_DIR [MEGABYTES]]
+#
+# The volume defaults to 5/4 of physical memory, and the scratch
+# directory needs about three times that free. The run is limited with
+# ulimit -d to a quarter of physical memory. Shared file mappings don't
+# count against that limit, but the heap does, so the run can only pass
+# if every image is mapped. Output frames depend only on the same input
+# frame, so the first and last are checked against the same pipeline run
+# on just that frame, on the heap. A small volume is also run both ways
+# and compared whole.
+
+set -e
+
+BIN=${1:?usage: $0 IMAGESTACK [SCRATCH_DIR [MEGABYTES]]}
+DIR=${2:-/var/tmp}
+RAM=$(awk '/^MemTotal:/ {print int($2 / 1024)}' /proc/meminfo)
+MB=${3:-$((RAM * 5 / 4))}
+
+OUT=$(mktemp -d "$DIR/scratchtest.XXXXXX")
+trap 'rm -rf "$OUT"' EXIT
+
+# A pattern that's exact in floats, so the runs can be compared bytewise
+pattern() {
+    echo "((x*7 + y*13 + $1*29) % 101) / 100"
+}
+
+# run WIDTH HEIGHT FRAMES OUTPUT [ImageStack options]
+run() {
+    local w=$1 h=$2 f=$3 out=$4
+    shift 4
+    "$BIN" "$@" -push $w $h $f 1 -eval "$(pattern t)" \
+        -crop 8 8 0 $((w - 16)) $((h - 16)) $f \
+        -resample $(((w - 16) / 2)) $(((h - 16) / 2)) \
+        -save "$out" > /dev/null
+}
+
+# The same pipeline on frame T of the volume alone
+runFrame() {
+    local w=$1 h=$2 t=$3 out=$4
+    "$BIN" -scratch off -push $w $h 1 1 -eval "$(pattern $t)" \
+        -crop 8 8 $((w - 16)) $((h - 16)) \
+        -resample $(((w - 16) / 2)) $(((h - 16) / 2)) \
+        -save "$out" > /dev/null
+}
+
+fail() {
+    echo "FAILED: $*"
+    exit 1
+}
+
+echo "small volume, scratch files against the heap"
+run 256 192 5 "$OUT/mapped.tmp" -scratch 0 "$OUT"
+run 256 192 5 "$OUT/heap.tmp" -scratch off
+cmp "$OUT/mapped.tmp" "$OUT/heap.tmp" || fail "small volume differs"
+
+W=2048
+H=2048
+F=$((MB * 1024 * 1024 / (W * H * 4)))
+[ $F -ge 2 ] || F=2
+echo "$W x $H x $F volume, $((W * H * F / 262144)) MB, physical memory $RAM MB"
+
+START=$(date +%s)
+(
+    ulimit -d $((RAM * 1024 / 4))
+    run $W $H $F "$OUT/big.tmp" -scratch 0 "$OUT"
+) || fail "big volume didn't run in $((RAM / 4)) MB of heap"
+echo "big volume took $(($(date +%s) - START)) s"
+
+for t in 0 $((F - 1)); do
+    "$BIN" -load "$OUT/big.tmp" -crop $t 1 -save "$OUT/frame.tmp" > /dev/null
+    runFrame $W $H $t "$OUT/heap.tmp"
+    cmp "$OUT/frame.tmp" "$OUT/heap.tmp" || fail "frame $t differs"
+done
+
+echo "PASSED"
@@ -0,0 +1,54 @@
+#!/bin/bash
+# Runs a fixed pipeline of the operations that split their work across
+# threads with -threads 1 up to N, reports the wall time of each, and
+# checks that every thread count gives the same result.
+#
+# Usage: tests/threads.sh IMAGESTACK [MAX_THREADS [SIZE [RUNS]]]
+#
+# MAX_THREADS defaults to the number of CPUs, SIZE (the width and height
+# of the three channel input) to 2048, and RUNS to 3, of which the
+# fastest is reported.
+
+set -e
+
+BIN=${1:?usage: $0 IMAGESTACK [MAX_THREADS [SIZE [RUNS]]]}
+N=${2:-$(getconf _NPROCESSORS_ONLN)}
+SIZE=${3:-2048}
+RUNS=${4:-3}
+
+OUT=$(mktemp -d "${TMPDIR:-/tmp}/threadstest.XXXXXX")
+trap 'rm -rf "$OUT"' EXIT
+
+"$BIN" -push $SIZE $SIZE 1 3 -eval "((x*7 + y*13 + c*29) % 101) / 100" \
+    -save "$OUT/in.tmp" > /dev/null
+
+# Pointwise arithmetic, two images, a warp, a resample and a convolution
+PIPELINE="-load $OUT/in.tmp -dup -scale 1.5 -offset 0.1 -gamma 0.8 -clamp
+    -multiply -rotate 17 -resample $((SIZE * 3 / 4)) $((SIZE * 3 / 4))
+    -convolve 3 3 1 0.05 0.1 0.05 0.1 0.4 0.1 0.05 0.1 0.05 homogeneous
+    -eval val*val+x/width"
+
+fail() {
+    echo "FAILED: $*"
+    exit 1
+}
+
+now() {
+    date +%s%N
+}
+
+BASE=
+for ((t = 1; t <= N; t++)); do
+    BEST=
+    for ((r = 0; r < RUNS; r++)); do
+        START=$(now)
+        "$BIN" -threads $t $PIPELINE -save "$OUT/out$t.tmp" > /dev/null
+        MS=$((($(now) - START) / 1000000))
+        if [ -z "$BEST" ] || [ $MS -lt $BEST ]; then BEST=$MS; fi
+    done
+    [ -n "$BASE" ] || BASE=$BEST
+    printf "%2d threads: %6d ms, %5.2fx\n" $t $BEST $(echo "$BASE $BEST" | awk '{print $1 / $2}')
+    cmp "$OUT/out1.tmp" "$OUT/out$t.tmp" > /dev/null || fail "$t threads differ from one"
+done
+
+echo "PASSED"
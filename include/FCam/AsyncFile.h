@@ -2,11 +2,12 @@
 #define FCAM_ASYNCFILE_H
 
 #include <queue>
-#include <semaphore.h>
+#include <vector>
 #include <string>
 #include <pthread.h>
 
 #include "Frame.h"
+#include "processing/DNG.h"
 
 //! \file 
 //! AsyncFile contains classes to load and save images in the background
@@ -16,32 +17,87 @@ namespace FCam {
     class Lens;
     class Flash;
 
-    /** The AsyncFileWriter saves frames in a low priority background
-     * thread */
+    /** The AsyncFileWriter saves frames in low priority background
+     * threads.
+     *
+     * Requests are handed to a pool of worker threads, highest
+     * priority first and in order within a priority. By default raw
+     * dumps go before DNGs, which go before JPEGs, so a burst of fast
+     * raw saves doesn't wait behind slow JPEG encodes. See
+     * setPriority().
+     *
+     * Every pending request keeps its frame or image alive until it
+     * has been saved. To bound that memory, give the writer a budget
+     * in bytes with setMemoryBudget(); a save request that would take
+     * the pending bytes over the budget then either blocks the caller
+     * until enough saves have completed, or is dropped.
+     */
     class AsyncFileWriter {
       public:
-        AsyncFileWriter();
-        ~AsyncFileWriter();
+        /** What to do with a save request that doesn't fit in the
+         * memory budget */
+        enum BudgetPolicy {
+            Block = 0, //!< Wait for enough pending saves to complete
+            Drop       //!< Drop the new request and return false
+        };
 
-        /** Save a DNG in a background thread. */
-        void saveDNG(Frame, std::string filename);
-        void saveDNG(Image, std::string filename);
+        /** The kinds of files the writer saves, for setPriority() */
+        enum FileType {
+            DNG = 0,
+            JPEG,
+            Dump
+        };
 
-        /** Save a JPEG in a background thread. You can optionally
-         * pass a jpeg quality (0-100). */
-        void saveJPEG(Frame, std::string filename, int quality = 75);
-        void saveJPEG(Image, std::string filename, int quality = 75);
+        /** Make a writer with the given number of worker threads. */
+        AsyncFileWriter(int workers = 1);
+        ~AsyncFileWriter();
 
-        /** Save a raw dump in a background thread. */
-        void saveDump(Frame, std::string filename);
-        void saveDump(Image, std::string filename);
+        /** Save a DNG in a background thread. You can optionally
+         * compress the raw data; see \ref DNGCompression. Returns
+         * false if the request was dropped by the memory budget. */
+        bool saveDNG(Frame, std::string filename, DNGCompression compression = DNGUncompressed);
+        bool saveDNG(Image, std::string filename);
 
-        /** How many save requests are pending (including the one
-         * currently saving) */
-        int savesPending() {return pending;}        
+        /** Save a JPEG in a background thread. You can optionally
+         * pass a jpeg quality (0-100). Returns false if the request
+         * was dropped by the memory budget. */
+        bool saveJPEG(Frame, std::string filename, int quality = 75);
+        bool saveJPEG(Image, std::string filename, int quality = 75);
+
+        /** Save a raw dump in a background thread. Returns false if
+         * the request was dropped by the memory budget. */
+        bool saveDump(Frame, std::string filename);
+        bool saveDump(Image, std::string filename);
+
+        /** How many save requests are pending (including the ones
+         * currently saving). If bytes is not NULL, it is set to the
+         * image memory those requests are holding on to. */
+        int savesPending(size_t *bytes = NULL);
+
+        /** How many save requests have been dropped because they
+         * didn't fit in the memory budget. */
+        int savesDropped();
+
+        /** Limit the image memory held by pending saves to the given
+         * number of bytes. Zero, the default, means no limit. A
+         * single request larger than the whole budget is still
+         * accepted when nothing else is pending. */
+        void setMemoryBudget(size_t bytes, BudgetPolicy policy = Block);
+        size_t memoryBudget() {return budget;}
+        BudgetPolicy budgetPolicy() {return policy;}
+
+        /** Set the priority of requests of a file type. Higher
+         * priorities are saved first. Defaults are 2 for dumps, 1
+         * for DNGs and 0 for JPEGs. Affects requests made after the
+         * call. */
+        void setPriority(FileType type, int priority);
+        int priority(FileType type);
+
+        /** How many worker threads are saving files */
+        int workers() {return (int)threads.size();}
 
         /** Cancel all outstanding requests. The writer will finish
-         * saving the current request, but not save any more */
+         * saving the requests in progress, but not save any more */
         void cancel();
 
       private:
@@ -56,18 +112,43 @@ namespace FCam {
             std::string filename;
             enum {DNGFrame = 0, JPEGFrame, JPEGImage, DumpFrame, DumpImage} fileType;
             int quality;
+            DNGCompression compression;
+
+            // Scheduling: higher priority first, then first come
+            // first served
+            int priority;
+            unsigned int sequence;
+            size_t bytes;
+
+            bool operator<(const SaveRequest &other) const {
+                if (priority != other.priority) return priority < other.priority;
+                return sequence > other.sequence;
+            }
         };
 
-        std::queue<SaveRequest> saveQueue;
+        // Queue a request, applying the memory budget
+        bool enqueue(SaveRequest &r, FileType type, const Image &im);
+
+        std::priority_queue<SaveRequest> saveQueue;
         pthread_mutex_t saveQueueMutex;
-        sem_t *saveQueueSemaphore;
+        // Signalled when a request is queued
+        pthread_cond_t requestQueued;
+        // Signalled when a request completes or is cancelled
+        pthread_cond_t requestDone;
 
-        bool running, stop;
-        pthread_t thread;
+        bool stop;
+        std::vector<pthread_t> threads;
 
         void run();
 
         int pending;
+        size_t pendingBytes;
+        int dropped;
+        unsigned int sequence;
+
+        size_t budget;
+        BudgetPolicy policy;
+        int priorities[3];
     };
 
 }
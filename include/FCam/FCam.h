@@ -14,11 +14,15 @@
 #include "Flash.h"
 #include "Frame.h"
 #include "Image.h"
+#include "ImagePool.h"
 #include "Lens.h"
 #include "Platform.h"
 #include "Sensor.h"
 #include "Shot.h"
+#include "TagName.h"
+#include "TagValue.h"
 #include "Time.h"
+#include "Trace.h"
 
 #include "processing/DNG.h"
 #include "processing/Demosaic.h"
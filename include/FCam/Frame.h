@@ -12,6 +12,7 @@ using std::tr1::shared_ptr;
 #include "Device.h"
 #include "Time.h"
 #include "Image.h"
+#include "TagName.h"
 #include "TagValue.h"
 #include "Shot.h"
 #include "Event.h"
@@ -22,9 +23,25 @@ namespace FCam {
     class Action;
     class Lens;
 
-    /** A TagMap is a dictionary mapping strings to \ref TagValue
-     * "TagValues" */
-    typedef std::tr1::unordered_map<std::string, TagValue> TagMap;
+    /** A TagMap is a dictionary mapping \ref TagName "TagNames"
+     * to \ref TagValue "TagValues". TagNames convert to and from
+     * strings, so it can mostly be used as if it were keyed by
+     * strings. */
+    typedef std::tr1::unordered_map<TagName, TagValue, TagName::Hash> TagMap;
+
+    /** Serialize a TagMap into the binary TagValue format: each tag
+     * is its name as a String value followed by its value, both as
+     * written by \ref TagValue::toBlob. The encoding uses the
+     * machine's byte order. The result is appended to out, so
+     * several maps can be concatenated into one buffer and read
+     * back as one. \relates TagMap */
+    void appendTagMapBlob(const TagMap &tags, std::string *out);
+
+    /** Deserialize tags written by \ref appendTagMapBlob from a
+     * buffer, adding them to tags. Values are decoded directly into
+     * the map. Returns false on malformed data, in which case tags
+     * holds everything decoded before the error. \relates TagMap */
+    bool readTagMapBlob(const char *buf, size_t size, TagMap *tags);
 
     /** A struct containing the data that makes up a \ref Frame.  You
      * should not instantiate a _Frame, unless you're making dummy
@@ -164,8 +181,11 @@ namespace FCam {
          * Or to attach new tags that will survive being saved to a
          * file and loaded again like so:
          * frame["mySpecialTag"] = 42;
+         * Names given as strings are interned on every call. Code
+         * that tags every frame should use a \ref TagName it made
+         * once instead.
          */
-        TagValue &operator[](const std::string &name) const {
+        TagValue &operator[](const TagName &name) const {
             return ptr->tags[name];
         }
 
@@ -11,6 +11,8 @@
 
 namespace FCam {
 
+    class ImagePool;
+
     /** A reference-counted Image object.
      *
      * Images are stored in row-major order, with the origin is the
@@ -390,6 +392,13 @@ namespace FCam {
         // A pointer to the private data;
         void *privateData;
 
+        // The pool this image's buffer returns to, if any
+        ImagePool *pool;
+
+        // Used by ImagePool to wrap one of its buffers
+        Image(Size, ImageFormat, unsigned char *buffer, unsigned int bytes, ImagePool *);
+        friend class ImagePool;
+
         /** Make the image refer to data stored elsewhere. Internally
          *  used by the constructors to centralize some common operations
          */         
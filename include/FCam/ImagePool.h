@@ -0,0 +1,123 @@
+#ifndef FCAM_IMAGE_POOL_H
+#define FCAM_IMAGE_POOL_H
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+
+#include "Base.h"
+#include "Image.h"
+
+/** \file
+ * A pool of recycled image buffers. */
+
+namespace FCam {
+
+    /** A process-wide pool of image buffers, keyed by image size and
+     * format. Images handed out by \ref acquire behave like any other
+     * allocated Image, except that when the last reference to one is
+     * destroyed its buffer goes back to the pool instead of the heap,
+     * ready for the next acquire() of the same size and format. The
+     * FCam runtime uses it for the images it allocates on AutoAllocate
+     * shots, so a stream of same-sized frames settles into reusing a
+     * few buffers instead of allocating one per frame.
+     *
+     * Buffers are aligned to \ref Alignment bytes.
+     */
+    class ImagePool {
+    public:
+        enum {
+            /** Alignment of the start of pooled buffers in bytes */
+            Alignment = 64
+        };
+
+        /** Counters describing the pool's behavior so far. */
+        struct Stats {
+            Stats() : hits(0), misses(0), buffersAllocated(0), bytesAllocated(0),
+                      highWaterBuffers(0), highWaterBytes(0), buffersFree(0) {}
+
+            /** Number of acquire() calls served from the free list */
+            unsigned int hits;
+            /** Number of acquire() calls that had to allocate */
+            unsigned int misses;
+            /** Buffers currently owned by the pool, in use or free */
+            unsigned int buffersAllocated;
+            /** Bytes currently owned by the pool, in use or free */
+            size_t bytesAllocated;
+            /** Largest value buffersAllocated has reached */
+            unsigned int highWaterBuffers;
+            /** Largest value bytesAllocated has reached */
+            size_t highWaterBytes;
+            /** Buffers currently sitting in the free lists */
+            unsigned int buffersFree;
+        };
+
+        /** The process-wide pool. */
+        static ImagePool &instance();
+
+        /** Return a new Image of the given size and format, reusing
+         * a buffer released by an earlier image if one is
+         * available. The contents of the image are undefined. */
+        Image acquire(Size, ImageFormat);
+        Image acquire(int width, int height, ImageFormat f) {
+            return acquire(Size(width, height), f);
+        }
+
+        /** The maximum number of free buffers kept for each size and
+         * format. Buffers released beyond this are freed. Zero turns
+         * off recycling. The default is 4. */
+        void setMaxFreeBuffers(unsigned int n);
+        unsigned int maxFreeBuffers() const;
+
+        /** Free all buffers that are not currently in use. */
+        void trim();
+
+        /** A snapshot of the pool counters. */
+        Stats stats() const;
+
+        /** Reset the hit and miss counters and the high-water marks
+         * to the current state. */
+        void resetStats();
+
+    private:
+        ImagePool();
+        ~ImagePool();
+
+        struct Key {
+            Size size;
+            ImageFormat type;
+            bool operator<(const Key &other) const {
+                if (size.width != other.size.width) return size.width < other.size.width;
+                if (size.height != other.size.height) return size.height < other.size.height;
+                return type < other.type;
+            }
+        };
+
+        struct Buffer {
+            Key key;
+            size_t bytes;
+        };
+
+        // Called by Image when the last reference to a pooled buffer
+        // goes away.
+        void release(unsigned char *buffer);
+        friend class Image;
+
+        // Free buffers until no free list holds more than n. The
+        // caller must hold the mutex.
+        void trimLocked(size_t n);
+
+        mutable pthread_mutex_t mutex;
+        std::map<Key, std::vector<unsigned char *> > freeLists;
+        std::map<unsigned char *, Buffer> buffers;
+        unsigned int maxFree;
+        Stats counters;
+
+        // Not copyable
+        ImagePool(const ImagePool &);
+        ImagePool &operator=(const ImagePool &);
+    };
+
+}
+
+#endif
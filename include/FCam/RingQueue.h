@@ -0,0 +1,276 @@
+#ifndef FCAM_RINGQUEUE_H
+#define FCAM_RINGQUEUE_H
+
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "Base.h"
+
+/** \file
+ * A bounded lock-free queue built on a ring buffer. It offers the
+ * producer-consumer subset of the TSQueue interface (push, pop, wait,
+ * pull, tryPull) without taking a mutex on any of them, so it is
+ * suited to the per-frame handoffs between the runtime threads. Use
+ * TSQueue when you need to insert at the front, remove from the back,
+ * or iterate over the queue contents.
+ */
+
+namespace FCam {
+
+    /** Bounded lock-free consumer/producer queue. Safe for multiple
+     * producers and multiple consumers. Each slot of the ring carries
+     * a sequence number that tells producers and consumers whether it
+     * is free or filled for their lap around the ring, so the only
+     * shared writes are a compare-and-swap on the head or tail
+     * index. A semaphore counts the filled slots so consumers can
+     * block in wait() and pull().
+     *
+     * The capacity is fixed at construction, rounded up to a power
+     * of two. push() fails rather than blocks when the queue is
+     * full. T should be cheap to copy; use it for pointers.
+     */
+    template<typename T>
+    class RingQueue {
+    public:
+        RingQueue(size_t capacity = 256);
+        ~RingQueue();
+
+        /** Add a copy of item to the back of the queue. Returns
+         * false, leaving the queue unchanged, if the queue is full. */
+        bool push(const T& val);
+
+        /** Wait for the queue not to be empty and remove the
+         * frontmost element. */
+        void pop();
+
+        /** Returns true if empty, false otherwise. */
+        bool empty() const;
+        /** Returns the number of items in the queue. With concurrent
+         * producers or consumers this is only a snapshot. */
+        size_t size() const;
+        /** The maximum number of items the queue can hold. */
+        size_t capacity() const {return mask+1;}
+
+        /** Waits until there are entries in the queue.
+         * The optional timeout is in microseconds, zero means no timeout. */
+        bool wait(unsigned int timeout=0);
+
+        /** Waits for the queue not to be empty, and then removes and
+         * returns the frontmost item. */
+        T pull();
+
+        /** Atomically either dequeue an item, or fail to do so. Does
+         * not block. Returns whether it succeeded. */
+        bool tryPull(T *);
+
+    private:
+        struct Cell {
+            volatile size_t seq;
+            T data;
+        };
+
+        // Claim and read the slot at the head of the ring. Can fail
+        // transiently even when the semaphore says an item exists,
+        // if the producer of the oldest slot hasn't finished writing it.
+        bool dequeue(T *);
+
+        static size_t loadAcquire(const volatile size_t *p) {
+            size_t v = *p;
+            __sync_synchronize();
+            return v;
+        }
+
+        static void storeRelease(volatile size_t *p, size_t v) {
+            __sync_synchronize();
+            *p = v;
+        }
+
+        Cell *cells;
+        size_t mask;
+
+        // Keep the producer and consumer indices on separate cache
+        // lines so they don't bounce between cores.
+        char pad0[64];
+        volatile size_t enqueuePos;
+        char pad1[64];
+        volatile size_t dequeuePos;
+        char pad2[64];
+
+        sem_t *sem;
+
+        // Not copyable
+        RingQueue(const RingQueue<T> &);
+        RingQueue<T> &operator=(const RingQueue<T> &);
+    };
+
+    template<typename T>
+    RingQueue<T>::RingQueue(size_t requested) : enqueuePos(0), dequeuePos(0) {
+        size_t cap = 2;
+        while (cap < requested) cap <<= 1;
+        mask = cap - 1;
+        cells = new Cell[cap];
+        for (size_t i = 0; i < cap; i++) {
+            cells[i].seq = i;
+        }
+        __sync_synchronize();
+
+#ifdef FCAM_PLATFORM_OSX
+        // unnamed semaphores not supported on OSX
+        char semName[256];
+        // Create a unique semaphore name for this RingQueue using its pointer value
+        snprintf(semName, 256, "FCam::RingQueue::sema::%llx", (long long unsigned)this);
+        sem = sem_open(semName, O_CREAT, 0600, 0);
+        if (sem == SEM_FAILED) {
+            fcamPanic("RingQueue::RingQueue: Unable to initialize semaphore %s: %s",
+                      semName,
+                      strerror(errno));
+        }
+#else
+        sem = new sem_t;
+        int success = sem_init(sem, 0, 0);
+        if (success == -1) {
+            fcamPanic("RingQueue::RingQueue: Unable to initialize semaphore: %s",
+                      strerror(errno));
+        }
+#endif
+    }
+
+    template<typename T>
+    RingQueue<T>::~RingQueue() {
+        delete[] cells;
+#ifdef FCAM_PLATFORM_OSX
+        int success = sem_close(sem);
+        char semName[256];
+        // Recreate the unique semaphore name for this RingQueue using its pointer value
+        snprintf(semName, 256, "FCam::RingQueue::sema::%llx", (long long unsigned)this);
+        if (success == 0) success = sem_unlink(semName);
+        if (success == -1) {
+            fcamPanic("RingQueue::~RingQueue: Unable to destroy semaphore %s: %s\n",
+                      semName,
+                      strerror(errno));
+        }
+#else
+        int success = sem_destroy(sem);
+        if (success == -1) {
+            fcamPanic("RingQueue::~RingQueue: Unable to destroy semaphore: %s\n",
+                      strerror(errno));
+        }
+        delete sem;
+#endif
+    }
+
+    template<typename T>
+    bool RingQueue<T>::push(const T& val) {
+        Cell *cell;
+        size_t pos = enqueuePos;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = loadAcquire(&cell->seq);
+            long dif = (long)seq - (long)pos;
+            if (dif == 0) {
+                // The slot is free for this lap, try to claim it
+                if (__sync_bool_compare_and_swap(&enqueuePos, pos, pos+1)) break;
+                pos = enqueuePos;
+            } else if (dif < 0) {
+                // The slot still holds an item from the previous lap
+                return false;
+            } else {
+                // Another producer got here first
+                pos = enqueuePos;
+            }
+        }
+        cell->data = val;
+        storeRelease(&cell->seq, pos+1);
+        sem_post(sem);
+        return true;
+    }
+
+    template<typename T>
+    bool RingQueue<T>::dequeue(T *ptr) {
+        Cell *cell;
+        size_t pos = dequeuePos;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t seq = loadAcquire(&cell->seq);
+            long dif = (long)seq - (long)(pos+1);
+            if (dif == 0) {
+                if (__sync_bool_compare_and_swap(&dequeuePos, pos, pos+1)) break;
+                pos = dequeuePos;
+            } else if (dif < 0) {
+                // Not written yet
+                return false;
+            } else {
+                pos = dequeuePos;
+            }
+        }
+        *ptr = cell->data;
+        // Hand the slot to the producer on the next lap
+        storeRelease(&cell->seq, pos+mask+1);
+        return true;
+    }
+
+    template<typename T>
+    void RingQueue<T>::pop() {
+        T dummy = pull();
+        (void)dummy;
+    }
+
+    template<typename T>
+    bool RingQueue<T>::empty() const {
+        return size() == 0;
+    }
+
+    template<typename T>
+    size_t RingQueue<T>::size() const {
+        size_t d = dequeuePos;
+        size_t e = enqueuePos;
+        return e > d ? e - d : 0;
+    }
+
+    template<typename T>
+    bool RingQueue<T>::wait(unsigned int timeout) {
+        int err;
+        if (timeout == 0) {
+            err = sem_wait(sem);
+        } else {
+#ifndef FCAM_PLATFORM_OSX // No clock_gettime or sem_timedwait on OSX
+            timespec tv;
+            // This will overflow around 1 hour or so of timeout
+            clock_gettime(CLOCK_REALTIME, &tv);
+            tv.tv_nsec += timeout*1000;
+            tv.tv_sec += tv.tv_nsec / 1000000000;
+            tv.tv_nsec = tv.tv_nsec % 1000000000;
+            err = sem_timedwait(sem, &tv);
+#else
+            err = sem_trywait(sem);
+#endif
+        }
+        if (err == -1) return false;
+        sem_post(sem); // Put back the semaphore since we're not actually popping
+        return true;
+    }
+
+    template<typename T>
+    T RingQueue<T>::pull() {
+        while (sem_wait(sem) == -1 && errno == EINTR);
+        T val;
+        // The semaphore guarantees an item has been committed, but
+        // possibly to a later slot than the one at the head.
+        while (!dequeue(&val)) sched_yield();
+        return val;
+    }
+
+    template<typename T>
+    bool RingQueue<T>::tryPull(T *ptr) {
+        if (sem_trywait(sem)) return false;
+        while (!dequeue(ptr)) sched_yield();
+        return true;
+    }
+
+}
+
+#endif
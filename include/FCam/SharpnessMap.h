@@ -13,23 +13,39 @@ namespace FCam {
      * computed over the entire image. */
     class SharpnessMapConfig {
       public:
+        /** The ways of measuring sharpness within a region. Platforms
+         * that compute sharpness in hardware may ignore this. */
+        enum Metric {
+            /** The variance of the luminance */
+            Variance = 0,
+            /** The mean of the squared horizontal and vertical
+             * luminance differences. Less affected by smooth shading
+             * and large flat areas than the variance. */
+            GradientEnergy
+        };
+
         /** The default constructor disables the sharpness map
          * generator */
-        SharpnessMapConfig() : size(0, 0), enabled(false) {}
+        SharpnessMapConfig() : size(0, 0), enabled(false), metric(Variance) {}
 
         /** The requested sharpness map resolution. Currently on the
          * N900 this request is ignored and you always get a 16x12
-         * sharpness map. */
+         * sharpness map. On Tegra the map has this size, clamped to
+         * between 1x1 and the image size. */
         Size size;
 
         /** Whether or not a sharpness map should be generated. */
         bool enabled;
 
+        /** How sharpness is measured. The default is \ref Variance. */
+        Metric metric;
+
         /** Compare two requested configurations to see if they would
          * return the same data. */
         bool operator==(const SharpnessMapConfig &other) const {
             if (enabled != other.enabled) return false;
             if (enabled && size != other.size) return false;
+            if (enabled && metric != other.metric) return false;
             return true;
         }
 
@@ -0,0 +1,66 @@
+#ifndef FCAM_TAGNAME_H
+#define FCAM_TAGNAME_H
+
+#include <string>
+#include <stddef.h>
+
+/** \file
+ * Interned names for the tags attached to a frame. */
+
+namespace FCam {
+
+    /** The name of a tag in a \ref TagMap. Every distinct name is
+     * stored exactly once for the lifetime of the program, and a
+     * TagName is just a pointer to that copy. This makes TagNames
+     * cheap to copy, compare, and hash, and means inserting a tag
+     * into a frame never allocates a string.
+     *
+     * A TagName can be made from any string, so frame["myTag"]
+     * keeps working, but that looks the name up in a global table
+     * each time. Code that tags every frame should make its names
+     * once, and reuse them: \code
+static const TagName focusTag("lens.focus");
+frame[focusTag] = focus;
+\endcode
+     *
+     * Interned names are never freed, so don't make names out of
+     * unbounded data like timestamps.
+     */
+    class TagName {
+    public:
+        /** The empty name. */
+        TagName();
+
+        /** Intern a name. Thread-safe. */
+        TagName(const char *name);
+        TagName(const std::string &name);
+
+        /** The name as a string. The reference stays valid forever. */
+        const std::string &str() const {return *name;}
+        operator const std::string &() const {return *name;}
+        const char *c_str() const {return name->c_str();}
+        size_t size() const {return name->size();}
+
+        /** Names are equal if and only if they are the same
+         * interned copy, so these are pointer comparisons. */
+        bool operator==(const TagName &other) const {return name == other.name;}
+        bool operator!=(const TagName &other) const {return name != other.name;}
+
+        /** Alphabetical ordering, for sorted output. */
+        bool operator<(const TagName &other) const {return *name < *other.name;}
+
+        /** Hash function for unordered containers keyed by TagName. */
+        struct Hash {
+            size_t operator()(const TagName &n) const {
+                // The low bits of a heap pointer carry no information
+                return (size_t)n.name >> 4;
+            }
+        };
+
+    private:
+        const std::string *name;
+    };
+
+}
+
+#endif
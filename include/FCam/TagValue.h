@@ -38,20 +38,23 @@ namespace FCam {
          * 
          * TagValues can be constructed from many different types. The
          * default constructor makes a \ref Null TagValue. Each other
-         * constructor makes a copy of its argument. */
+         * constructor makes a copy of its argument. The value is
+         * stored inside the TagValue itself, so numbers, times and
+         * (depending on the standard library) short strings don't
+         * allocate any memory. */
         //@{
 
         TagValue(); 
         TagValue(int);
         TagValue(float);
         TagValue(double);
-        TagValue(std::string);
+        TagValue(const std::string &);
         TagValue(FCam::Time);
-        TagValue(std::vector<int>);
-        TagValue(std::vector<float>);
-        TagValue(std::vector<double>);
-        TagValue(std::vector<std::string>);
-        TagValue(std::vector<FCam::Time>);
+        TagValue(const std::vector<int> &);
+        TagValue(const std::vector<float> &);
+        TagValue(const std::vector<double> &);
+        TagValue(const std::vector<std::string> &);
+        TagValue(const std::vector<FCam::Time> &);
         TagValue(const TagValue &);
         //@}
 
@@ -148,18 +151,50 @@ tag.asIntVector().push_back(3);
          * and about 2.5x more space efficient. */
         std::string toBlob() const;
 
+        /** Append the binary format to the end of a string. Vector
+         * payloads are copied in with a single memcpy, so this is the
+         * fastest way to serialize many tags into one buffer. */
+        void appendBlob(std::string *out) const;
+
         /** Deserialize from either format */
         static TagValue fromString(const std::string &);
 
+        /** Deserialize one value in the binary format from the start
+         * of a buffer of the given size, directly into t. Returns the
+         * number of bytes used, or zero if the buffer does not start
+         * with a complete, well-formed value, in which case t is set
+         * to Null and a ParseError is posted. Unlike the stream
+         * operator, this never reads past the end of the buffer. */
+        static size_t fromBlob(const char *buf, size_t size, TagValue *t);
+
         /** The type of this tag. */
         Type type;
 
-        /** A pointer to the actual value of this tag. */
+        /** A pointer to the actual value of this tag. It points into
+         * the TagValue, so it changes when the TagValue is copied. */
         void *data;
 
     private:
         void nullify();
 
+        // Room for any of the types a TagValue can hold. Strings and
+        // vectors still keep their contents on the heap, since casts
+        // hand out references to real std::strings and std::vectors.
+        union Storage {
+            char intData[sizeof(int)];
+            char floatData[sizeof(float)];
+            char doubleData[sizeof(double)];
+            char timeData[sizeof(FCam::Time)];
+            char stringData[sizeof(std::string)];
+            char vectorData[sizeof(std::vector<int>)];
+            char stringVectorData[sizeof(std::vector<std::string>)];
+            char timeVectorData[sizeof(std::vector<FCam::Time>)];
+            // Alignment
+            double alignDouble;
+            long long alignLong;
+            void *alignPointer;
+        } storage;
+
 
         // Dummy objects to return references to. Set them to zero or
         // clear them before returning a reference to them.
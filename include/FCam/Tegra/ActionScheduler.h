@@ -0,0 +1,171 @@
+#ifndef FCAM_TEGRA_ACTION_SCHEDULER_H
+#define FCAM_TEGRA_ACTION_SCHEDULER_H
+
+/** \file
+ * The scheduler that fires actions slaved to Tegra frames.
+ */
+
+#include <vector>
+#include <pthread.h>
+
+#include "../Action.h"
+#include "../Time.h"
+#include "../RingQueue.h"
+
+namespace FCam { namespace Tegra {
+
+    /** Fires FCam::Action objects at precise times. The Tegra runtime
+     * schedules each deferred action of a shot here once it knows when
+     * the shot's exposure starts, and one real-time thread fires them.
+     *
+     * Pending actions are kept in a hierarchical timer wheel, so
+     * scheduling and firing are constant time however many actions
+     * are queued. The firing thread sleeps until shortly before each
+     * deadline and spins for the remainder, which keeps the scheduler
+     * wakeup latency out of the fire time. Other threads talk to the
+     * firing thread through a lock-free command queue.
+     *
+     * The difference between the scheduled and actual fire time of
+     * every action is recorded in \ref Stats, so the timing accuracy
+     * can be checked in the field, e.g. against flash sync.
+     */
+    class ActionScheduler {
+    public:
+        /** Timing counters for the fired actions. */
+        struct Stats {
+            Stats();
+
+            /** Number of actions scheduled */
+            unsigned int scheduled;
+            /** Number of actions fired */
+            unsigned int fired;
+            /** Number of actions cancelled before they fired */
+            unsigned int cancelled;
+
+            /** Microseconds between the scheduled time and the
+             * moment doAction() was called, for the most recent
+             * fired actions (up to \ref MaxSamples). Actions whose
+             * time had already passed when they were scheduled are
+             * included, so large values can point at the setter
+             * running late as well as at the scheduler. */
+            std::vector<int> error;
+
+            enum {MaxSamples = 4096};
+
+            /** The given percentile (0-100) of the fire time error in
+             * microseconds */
+            int errorPercentile(float p) const;
+
+            /** Counts of the fire time error in buckets of
+             * bucketWidth microseconds. Errors beyond the last
+             * bucket are counted in it. */
+            std::vector<unsigned> errorHistogram(int bucketWidth = 10, int buckets = 100) const;
+        };
+
+        ActionScheduler();
+        /** Deletes any actions still pending. Call shutdown() and
+         * wait for run() to return first. */
+        ~ActionScheduler();
+
+        /** Fire the action at the given time. The scheduler takes
+         * ownership of the action and deletes it after it fires or
+         * is cancelled. The tag identifies the action for cancel();
+         * the runtime uses the frame request the action belongs
+         * to. Safe to call from any thread. */
+        void schedule(FCam::Action *action, Time time, const void *tag = NULL);
+
+        /** Drop all pending actions scheduled with the given tag, for
+         * example because their shot was dropped. Actions already
+         * fired are not affected. Safe to call from any thread. */
+        void cancel(const void *tag);
+
+        /** Drop all pending actions. Sensor::stop() calls this once
+         * every shot is done. Safe to call from any thread. */
+        void cancelAll();
+
+        /** Fire actions until shutdown() is called. Run this from a
+         * dedicated, preferably real-time, thread. */
+        void run();
+
+        /** Make run() return. Pending actions are not fired. */
+        void shutdown();
+
+        /** How long before a deadline the firing thread stops
+         * sleeping and starts spinning, in microseconds. Higher
+         * values trade CPU time for accuracy. The default is 500. */
+        void setSpinThreshold(int us) {spinThreshold = us;}
+        int getSpinThreshold() const {return spinThreshold;}
+
+        /** A snapshot of the timing counters. */
+        Stats statistics() const;
+
+        /** Clear the timing counters. */
+        void resetStatistics();
+
+    private:
+        enum {
+            // Each tick of the finest wheel is 2^TickShift us
+            TickShift = 10,
+            // Slots per wheel level, and the number of levels. Three
+            // levels of 64 cover about 4.5 minutes; later actions wait
+            // on an overflow list.
+            SlotBits = 6,
+            Slots = 1 << SlotBits,
+            Levels = 3,
+            CommandQueueCapacity = 1024
+        };
+
+        struct Entry {
+            FCam::Action *action;
+            long long deadline; // us
+            const void *tag;
+            Entry *prev, *next;
+            Entry **list;       // The list this entry is linked into
+        };
+
+        struct Command {
+            enum {Schedule, Cancel, CancelAll, Shutdown} op;
+            Entry *entry;
+            const void *tag;
+        };
+
+        void post(const Command &c);
+        bool processCommands();
+        void insert(Entry *e);
+        void advance(long long tick);
+        void cascade(Entry **list);
+        void dropAll(const void *tag, bool any);
+        long long nextWakeup() const;
+        void fire(Entry *e, long long now);
+
+        static void link(Entry **list, Entry *e);
+        static void unlink(Entry *e);
+        static long long toMicroseconds(Time t) {
+            return (long long)t.s()*1000000 + t.us();
+        }
+
+        RingQueue<Command> commands;
+        volatile bool stopping;
+        volatile int spinThreshold;
+
+        // Everything below here is only touched by the firing thread,
+        // except the stats which are guarded by statsMutex.
+        Entry *wheel[Levels][Slots];
+        Entry *overflow;
+        // Entries due within the current tick, in deadline order
+        Entry *due;
+        long long currentTick;
+        unsigned int pending;
+
+        mutable pthread_mutex_t statsMutex;
+        Stats stats;
+        unsigned int nextSample;
+
+        // Not copyable
+        ActionScheduler(const ActionScheduler &);
+        ActionScheduler &operator=(const ActionScheduler &);
+    };
+
+}}
+
+#endif
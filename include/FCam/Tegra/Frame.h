@@ -57,6 +57,7 @@
  */
 
 #include "../Frame.h"
+#include "../Trace.h"
 #include "Shot.h"
 #include "Platform.h"
 
@@ -75,6 +76,10 @@ namespace FCam { namespace Tegra {
         /** A bitwise value of Frame::FrameConfidence enums */
         unsigned int confidence;
 
+        /** When this frame passed each stage of the pipeline. Only
+         * filled in while tracing is enabled. See FCam::Trace. */
+        Trace::Marks trace;
+
         const Shot &shot() const { return _shot; }
         const FCam::Shot &baseShot() const { return shot(); }
         
@@ -113,6 +118,11 @@ namespace FCam { namespace Tegra {
          * parameters of this frame as defined by the Frame::Confidence enum.
          */
         unsigned int confidence() const { return static_cast<FCam::Tegra::_Frame*>(ptr.get())->confidence; };
+
+        /** When this frame passed each stage of the capture
+         * pipeline. Stages are only stamped while FCam::Trace is
+         * enabled. */
+        const Trace::Marks &trace() const { return static_cast<FCam::Tegra::_Frame*>(ptr.get())->trace; };
     };
 }}
 
@@ -64,6 +64,7 @@
 #include "Platform.h"
 #include "Lens.h"
 #include "Flash.h"
+#include "ActionScheduler.h"
 #include "FCam/Tegra/hal/CameraHal.h"
 
 namespace FCam { namespace Tegra {
@@ -140,6 +141,15 @@ namespace FCam { namespace Tegra {
         int framesPending() const;
         int shotsPending() const;
 
+        /** Timing of the actions fired so far: how many were
+         * scheduled, fired and cancelled, and how far from their
+         * scheduled time each one fired. Empty before the first
+         * capture or stream. */
+        ActionScheduler::Stats actionStatistics() const;
+
+        /** Clear the counters returned by actionStatistics(). */
+        void resetActionStatistics();
+
         /* How many frames to discard after an exposure change */
         int exposureLatency() const;
 
@@ -61,8 +61,47 @@ namespace FCam { namespace Tegra {
 
     class Action;
 
+    /*! An externally owned source of images for the sensor to write
+     * frames into, such as a set of buffers that are handed to the
+     * display. When a shot has a target, the daemon asks it for an
+     * image at the moment the frame arrives, rather than when the
+     * shot is queued, so the frames still in the pipeline can't land
+     * in a buffer that has since been passed on.
+     *
+     * acquire() and release() are called from the daemon's handler
+     * thread, so implementations must synchronize with whoever
+     * consumes the images.
+     *
+     * A frame written to a target carries the target's image as its
+     * \ref FCam::Frame::image "image", not a copy. It's only valid
+     * until the target hands that buffer out again, and its chroma
+     * planes are in the target's order, so with swapUV it holds YV12
+     * even though it's typed YUV420p.
+     */
+    class ImageTarget {
+      public:
+        /** If swapUV is set, the target's YUV420p images store the V
+         * plane before the U plane (YV12), as Android's graphics
+         * buffers do, and frames are written in that order. */
+        ImageTarget(bool swapUV = false) : swapUV(swapUV) {}
+        virtual ~ImageTarget() {}
+
+        /** Return the image to write the next frame into. It must
+         * be densely packed YUV420p of the shot's image size. Return
+         * an invalid image to drop the frame's image data (the frame
+         * itself is still delivered). */
+        virtual Image acquire() = 0;
+
+        /** Called once for every valid image returned by acquire(),
+         * with written set if the frame was stored in it. */
+        virtual void release(Image image, bool written) = 0;
+
+        const bool swapUV;
+    };
+
     /*! The Tegra shot adds:
      * - fastMode property
+     * - an optional ImageTarget
      *
      */
     class Shot : public FCam::Shot {
@@ -94,6 +133,17 @@ namespace FCam { namespace Tegra {
          */
         bool fastMode;
 
+        /** If set, image data goes to images taken from this target
+         * instead of to \ref image, which then only gives the size and
+         * format to capture at (use an Image::Discard image). The
+         * target must outlive any frames captured with this shot.
+         * The frames' images alias the target's buffers, so they are
+         * only valid until the target reuses them, and are in its
+         * plane order (see \ref ImageTarget). A frame whose image
+         * couldn't be written gets an Image::Discard image instead.
+         * Defaults to NULL. */
+        ImageTarget *target;
+
       private:
         // Avoid these assignment.
         const Shot &operator=(const FCam::Shot &other);
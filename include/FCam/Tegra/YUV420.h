@@ -55,9 +55,49 @@
 #include "FCam/Base.h"
 #include "FCam/Image.h"
 
+/** \file
+ * Conversions out of the YUV420p preview format.
+ *
+ * All of these use NEON, SSSE3 or AVX2 where the CPU has them, and
+ * split large images across one thread per core. A region of
+ * interest can be given to convert only part of the source; it must
+ * start at even coordinates and have an even width and height, since
+ * each 2x2 block of pixels shares one chroma sample. A region of
+ * size zero (the default) means the whole image. Each function
+ * returns false without writing anything if the formats, sizes or
+ * region don't fit.
+ */
+
 namespace FCam { namespace Tegra { 
 
+    /** Convert a YUV420p image to an RGB24 image of the same size. */
     bool convertYUV420ToRGB24(Image dstImg, Image srcImg);
+
+    /** Convert the given region of a YUV420p image to an RGB24
+     * image the size of the region. */
+    bool convertYUV420ToRGB24(Image dstImg, Image srcImg, Rect roi);
+
+    /** Convert a YUV420p image to 32 bit RGBA, with the alpha bytes
+     * set to the given value. Rows are written dstBytesPerRow apart
+     * starting at dst. */
+    bool convertYUV420ToRGBA32(unsigned char *dst, int dstBytesPerRow,
+                               Image srcImg, Rect roi = Rect(),
+                               unsigned char alpha = 255);
+
+    /** Convert a YUV420p image to three float planes with values
+     * between 0 and 1. Rows of each plane are dstStride floats
+     * apart. The values are exactly those of the RGB24 conversion
+     * divided by 255. */
+    bool convertYUV420ToFloat(float *r, float *g, float *b, int dstStride,
+                              Image srcImg, Rect roi = Rect());
+
+    /** Convert a YUV420p image to NV12: a full resolution Y plane
+     * followed by a half resolution plane of interleaved U and V
+     * samples. Rows of the two planes are yBytesPerRow and
+     * uvBytesPerRow apart respectively. */
+    bool convertYUV420ToNV12(unsigned char *dstY, int yBytesPerRow,
+                             unsigned char *dstUV, int uvBytesPerRow,
+                             Image srcImg, Rect roi = Rect());
 }}
 
 #endif
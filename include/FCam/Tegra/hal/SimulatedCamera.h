@@ -0,0 +1,221 @@
+#ifndef FCAM_TEGRA_HAL_SIMULATED_CAMERA_H
+#define FCAM_TEGRA_HAL_SIMULATED_CAMERA_H
+
+/** \file
+ * A software implementation of the Tegra camera hal. It replays
+ * frames from DNG or dump files (or generates a synthetic pattern)
+ * at a configurable frame time, so that the FCam::Tegra::Daemon
+ * pipeline can be exercised and measured without camera hardware.
+ *
+ * Build FCam with FCAM_TEGRA_SIMULATED_HAL defined (FCAM_SIMULATED_HAL=1
+ * in the ndk-build invocation) to make Hal::System::openProduct()
+ * return a SimulatedProduct instead of linking against the prebuilt
+ * hal library.
+ */
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+
+#include "FCam/Time.h"
+#include "FCam/Image.h"
+#include "CameraHal.h"
+
+namespace FCam { namespace Tegra { namespace Hal {
+
+    class SimulatedCamera : public ICamera {
+    public:
+
+        /** Configuration of a simulated camera. */
+        struct Config {
+            Config();
+
+            /** Minimum time between frame starts in microseconds. The
+             * effective frame time is the larger of this, the
+             * requested sensor frame time and the exposure. */
+            int frameTime;
+
+            /** How many captures can be queued on the simulated
+             * sensor before it stops asking for more with
+             * readyToCapture(). */
+            int pipelineDepth;
+
+            /** Time between the end of a frame and the onFrame
+             * callback, in microseconds. Models the ISP. */
+            int processingLatency;
+
+            /** DNG (.dng) or raw dump files to replay, in order. If
+             * empty, a synthetic test pattern is generated. */
+            std::vector<std::string> sources;
+
+            /** If false, frames are delivered as fast as the
+             * pipeline consumes them instead of at sensor rate. */
+            bool realTime;
+        };
+
+        /** Counters collected by the simulated camera. */
+        struct Stats {
+            Stats();
+
+            /** Number of capture() requests accepted */
+            unsigned int capturesRequested;
+            /** Number of onFrame() callbacks made */
+            unsigned int framesDelivered;
+            /** Number of capture() calls made with the sensor queue full */
+            unsigned int capturesRejected;
+            /** Number of sensor frame slots that passed with no capture
+             * queued, i.e. frames the pipeline failed to feed */
+            unsigned int framesMissed;
+
+            /** Time of the first and the last onFrame() callback */
+            Time firstFrame, lastFrame;
+
+            /** How many of the most recent latencies are kept for
+             * latencyPercentile() */
+            enum {LatencySamples = 1024};
+
+            /** Microseconds from capture() to onFrame() for the most
+             * recent LatencySamples frames. Once full, it's a ring
+             * with the next sample going at latencyNext. */
+            std::vector<int> latency;
+            size_t latencyNext;
+
+            /** Sum and maximum of the latency over every frame */
+            long long latencyTotal;
+            int latencyMax;
+
+            /** Record the latency of a delivered frame */
+            void addLatency(int us);
+
+            /** Delivered frames per second between the first and the
+             * last frame */
+            float fps() const;
+
+            /** Mean capture to delivery latency over every frame, in
+             * microseconds */
+            float meanLatency() const;
+
+            /** The given percentile (0-100) of the capture to
+             * delivery latency in microseconds, over the most recent
+             * LatencySamples frames */
+            int latencyPercentile(float p) const;
+        };
+
+        SimulatedCamera(ICameraObserver *pObserver, unsigned int id, const Config &cfg = Config());
+        ~SimulatedCamera();
+
+        bool open();
+        bool close();
+
+        const SensorConfig& getSensorConfig();
+        const LensConfig&   getLensConfig();
+
+        bool setFocuserPosition(int pos);
+        bool getFocuserPosition(int *pos);
+
+        bool setSensorFrameTime(int frameTime);
+        bool getSensorFrameTime(int *frameTime);
+        bool setSensorExposure(int exposure);
+        bool getSensorExposure(int *exposure);
+        bool setSensorEffectiveISO(int iso);
+        bool getSensorEffectiveISO(int *iso);
+        bool setISPWhiteBalance(int whiteBalance);
+        bool getISPStatistics(Statistics *stats);
+
+        bool setCaptureMode(CameraMode m);
+
+        float setFlashForStillCapture(float brightness, int duration);
+        float setFlashTorchMode(float brightness);
+
+        bool capture();
+        bool burstCapture(int numFrames);
+        bool startStreaming();
+        bool stopStreaming();
+
+        float fps();
+
+        /** A snapshot of the counters collected so far. */
+        Stats statistics();
+
+        /** Clear the counters, e.g. after a warm-up period. */
+        void resetStatistics();
+
+    private:
+        // The sensor state latched for a single capture
+        struct Request {
+            Time issued;
+            int exposure;
+            int frameTime;
+            int iso;
+            int wb;
+        };
+
+        // A sensor setting that takes effect at a given capture index
+        struct PendingSetting {
+            unsigned int index;
+            int value;
+        };
+
+        void run();
+        void render(const Request &r, unsigned int frameIndex);
+        int focuserPosition(Time t);
+        void applyPending(std::deque<PendingSetting> &q, int *value);
+
+        friend void *simulated_camera_thread_(void *arg);
+
+        ICameraObserver *observer;
+        Config config;
+        SensorConfig sensorConfig;
+        LensConfig lensConfig;
+
+        pthread_t thread;
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        bool running, stop, busy;
+
+        CameraMode mode;
+        std::deque<Request> requests;
+        int freeSlots;
+        unsigned int captureIndex;
+
+        // Current sensor settings, and the ones still in the latency pipe
+        int exposure, frameTime, iso, wb;
+        std::deque<PendingSetting> pendingExposure, pendingISO;
+
+        // Focuser motion
+        int focusFrom, focusTo;
+        Time focusStart;
+
+        std::vector<Image> sources;
+        Image output;
+        CameraFrame frame;
+
+        Stats stats;
+    };
+
+    /** An IProduct handing out SimulatedCamera instances. */
+    class SimulatedProduct : public IProduct {
+    public:
+        SimulatedProduct() {}
+        ~SimulatedProduct() {}
+
+        unsigned int numberOfCameras() { return 1; }
+
+        ICamera* getCameraHal(ICameraObserver *pObserver, unsigned int cameraNum);
+        void releaseCameraHal(ICamera* cameraHal);
+
+        IRenderer* getRendererHal() { return NULL; }
+        void freeRendererHal(IRenderer* renderer) {}
+
+        /** The configuration used for cameras created after this
+         * call. Set this before constructing a Tegra::Sensor. */
+        static void setCameraConfig(const SimulatedCamera::Config &cfg);
+
+    private:
+        static SimulatedCamera::Config cameraConfig;
+    };
+
+}}}
+
+#endif
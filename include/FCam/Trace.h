@@ -0,0 +1,133 @@
+#ifndef FCAM_TRACE_H
+#define FCAM_TRACE_H
+
+#include <string>
+#include <vector>
+
+#include "Time.h"
+
+/** \file
+ * Per-frame latency tracing through the capture pipeline. */
+
+namespace FCam {
+
+    /** Per-frame pipeline tracing. When tracing is enabled, every
+     * frame carries a set of \ref Marks recording when it passed each
+     * \ref Stage of the pipeline, from the request being queued by
+     * Sensor::capture() or Sensor::stream() to Sensor::getFrame()
+     * handing it to the application. The marks of each delivered
+     * frame are then stored in a ring buffer owned by the thread that
+     * called getFrame(). Recording a frame takes no locks, and a
+     * disabled trace costs one load per stage, so tracing can be left
+     * compiled into production builds and switched on when needed.
+     *
+     * The recorded frames can be written out in the Chrome trace
+     * event format (load it in chrome://tracing or Perfetto), or
+     * summarized as a latency histogram between any two stages.
+     */
+    class Trace {
+    public:
+        /** The points in the pipeline at which a frame is stamped. */
+        enum Stage {
+            Enqueued = 0,   //!< The request entered the request queue
+            Issued,         //!< The setter handed the request to the sensor
+            ExposureStart,  //!< Start of the exposure, from the frame
+            ExposureEnd,    //!< End of the exposure, from the frame
+            ProcessingDone, //!< The frame left the ISP, from the frame
+            Dequeued,       //!< The handler matched the frame to its request
+            Delivered,      //!< getFrame() returned the frame
+            NumStages
+        };
+
+        /** A short printable name for a stage */
+        static const char *stageName(int stage);
+
+        /** The times at which a frame passed each stage. Stages it
+         * has not passed (or passed while tracing was off) hold
+         * Time(0, 0). */
+        struct Marks {
+            Time at[NumStages];
+
+            /** Stamp the given stage with the current time, if
+             * tracing is enabled. */
+            void mark(Stage s) {
+                if (Trace::enabled()) at[s] = Time::now();
+            }
+
+            /** Microseconds between two stages, or -1 if either of
+             * them is missing. */
+            int latency(Stage from, Stage to) const;
+        };
+
+        /** The marks of one delivered frame. */
+        struct Record {
+            /** The id of the shot that produced the frame */
+            int shotId;
+            Marks marks;
+        };
+
+        /** Latencies between two stages, bucketed. */
+        struct LatencyHistogram {
+            LatencyHistogram() : bucketWidth(0), samples(0), overflow(0),
+                                 min(0), max(0), mean(0) {}
+
+            /** Frame counts per bucket. Bucket i holds latencies in
+             * [i*bucketWidth, (i+1)*bucketWidth) microseconds. */
+            std::vector<unsigned> counts;
+            /** Width of each bucket in microseconds */
+            int bucketWidth;
+            /** Total number of frames counted, overflow included */
+            unsigned samples;
+            /** Frames with a latency beyond the last bucket */
+            unsigned overflow;
+            /** Smallest, largest and mean latency in microseconds */
+            int min, max;
+            float mean;
+
+            /** The given percentile (0-100) in microseconds, to the
+             * resolution of the buckets. */
+            int percentile(float p) const;
+
+            /** A printable table of the non-empty buckets */
+            std::string toString() const;
+        };
+
+        /** Turn tracing on or off. It is off by default. */
+        static void setEnabled(bool);
+        static bool enabled() {return on;}
+
+        /** Store the marks of a delivered frame in the calling
+         * thread's ring buffer. Never blocks; once a thread's ring
+         * holds \ref RingSize records the oldest are overwritten. */
+        static void record(int shotId, const Marks &);
+
+        enum {
+            /** Number of frames retained per recording thread */
+            RingSize = 1024
+        };
+
+        /** A snapshot of the frames recorded so far by all threads,
+         * ordered by the time they were queued. */
+        static std::vector<Record> records();
+
+        /** Forget all frames recorded so far. */
+        static void clear();
+
+        /** Write the recorded frames to a file in the Chrome trace
+         * event JSON format. Each frame becomes an async track with
+         * one slice per pipeline stage. Returns false if the file
+         * couldn't be written. */
+        static bool writeChromeTrace(const std::string &filename);
+
+        /** Bucket the latency between two stages over the recorded
+         * frames. Frames missing either stage are skipped. */
+        static LatencyHistogram histogram(Stage from = Enqueued, Stage to = Delivered,
+                                          int bucketWidth = 1000, int buckets = 100);
+
+    private:
+        static volatile bool on;
+    };
+
+}
+
+#endif
@@ -86,14 +86,49 @@ namespace FCam {
         Image thumbnail();
     };
 
+    /** How saveDNG stores the RAW image data. */
+    enum DNGCompression {
+        /** Uncompressed strips, as large as the image itself. Can
+         * be memory mapped by loadDNG. */
+        DNGUncompressed = 0,
+        /** Lossless JPEG compressed tiles, the usual compression for
+         * raw data in DNG files. Readable by all DNG readers. */
+        DNGLosslessJPEG,
+        /** Deflate compressed tiles with DNG 1.4's horizontal
+         * difference X2 predictor. Marks the file as requiring a DNG
+         * 1.4 reader, and many third-party readers only accept
+         * lossless JPEG for integer raw data. */
+        DNGDeflate
+    };
+
     /** Save a DNG file. The frame must have an image in RAW format.
      * All FCam::Frame fields and the tag map are saved in the DNG, along with
-     * a thumbnail of the image.
+     * a thumbnail of the image. The RAW data can optionally be
+     * losslessly compressed, which is done in parallel on all
+     * cores. Lossless JPEG typically halves the file size.
      */
-    void saveDNG(Frame frame, const std::string &filename);
-    /** Load a DNG file. Only DNG files saved by FCam are properly supported.
+    void saveDNG(Frame frame, const std::string &filename,
+                 DNGCompression compression = DNGUncompressed);
+    /** How loadDNG gets at the RAW image data. */
+    enum DNGLoadMode {
+        /** Memory map uncompressed RAW data, so that the frame's
+         * image aliases the file and pixels are only read from disk
+         * as they are touched. Compressed RAW data is decoded during
+         * the load. */
+        DNGMapped = 0,
+        /** Read all RAW data into memory during the load. */
+        DNGRead,
+        /** Don't load the RAW data at all. The frame's image is
+         * invalid, but its tags, metadata, and thumbnail are all
+         * available. Much faster for tools that scan many files. */
+        DNGMetadataOnly
+    };
+
+    /** Load a DNG file. Only DNG files saved by FCam are properly
+     * supported. The tags and metadata are always parsed, and the
+     * thumbnail is read in or mapped along with the RAW data. 
      */
-    DNGFrame loadDNG(const std::string &filename);
+    DNGFrame loadDNG(const std::string &filename, DNGLoadMode mode = DNGMapped);
 }
 
 #endif
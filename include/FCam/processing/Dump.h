@@ -24,8 +24,12 @@ namespace FCam {
     void saveDump(Frame frame, std::string filename);
     void saveDump(Image frame, std::string filename);
 
-    /** Load a UYVY, RGB24, or RAW dump file. */
-    Image loadDump(std::string filename);
+    /** Load a UYVY, RGB24, or RAW dump file. If memMap is true,
+     * the returned image aliases a memory mapping of the file
+     * instead of a copy of it, so pixels are only read from disk as
+     * they are touched. Changes to a mapped image are not written
+     * back to the file. */
+    Image loadDump(std::string filename, bool memMap = false);
 
 }
 
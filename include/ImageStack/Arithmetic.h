@@ -140,5 +140,35 @@ public:
     static void apply(Window a, float increment);
 };
 
+// A pointwise operation that can be deferred, and later fused with
+// others into a single pass over an image
+class PointwiseOp {
+public:
+    virtual ~PointwiseOp() {}
+    virtual void apply(Window im) = 0;
+};
+
+// A sequence of pointwise operations. Rather than making one pass
+// over the image per operation, apply runs the whole sequence over
+// one small tile of the image at a time, while it's still in cache.
+class PointwiseChain {
+public:
+    PointwiseChain() {}
+    ~PointwiseChain() { clear(); }
+
+    // Takes ownership of op
+    void add(PointwiseOp *op) { ops.push_back(op); }
+    bool empty() const { return ops.empty(); }
+    void clear();
+
+    void apply(Window im);
+
+private:
+    PointwiseChain(const PointwiseChain &);
+    PointwiseChain &operator=(const PointwiseChain &);
+
+    vector<PointwiseOp *> ops;
+};
+
 #include "footer.h"
 #endif
@@ -20,5 +20,23 @@ public:
     void parse(vector<string> args);
 };
 
+class Lazy : public Operation {
+public:
+    void help();
+    void parse(vector<string> args);
+};
+
+class Threads : public Operation {
+public:
+    void help();
+    void parse(vector<string> args);
+};
+
+class Scratch : public Operation {
+public:
+    void help();
+    void parse(vector<string> args);
+};
+
 #include "footer.h"
 #endif
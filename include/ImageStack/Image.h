@@ -322,11 +322,22 @@ public:
 class Image : public Window {
 protected:
     float *memory;
+    size_t mapping; // bytes mapped at memory, or zero if it's on the heap
 public:
+    // Where the pixels live. Mapped images are kept in a scratch file
+    // that's mapped into memory, so they can be bigger than RAM. Its
+    // blocks are reserved up front, so a full disk is an error here
+    // rather than a crash later. Automatic maps images bigger than
+    // scratchThreshold(), and falls back to the heap if the scratch
+    // file can't be made. Either way data is 16-byte aligned, but
+    // images made by mapFile are only aligned as well as the offset.
+    typedef enum {Automatic = 0, Heap, Mapped} Storage;
+
     Image() : refCount(NULL) {
         width = frames = height = channels = 0;
         xstride = ystride = tstride = 0;
         memory = data = NULL;
+        mapping = 0;
     }
 
 
@@ -335,7 +346,7 @@ public:
     }
 
 
-    Image(int width_, int height_, int frames_, int channels_, const float *data_ = NULL) {
+    Image(int width_, int height_, int frames_, int channels_, const float *data_ = NULL, Storage storage = Automatic) {
         width = width_;
         height = height_;
         frames = frames_;
@@ -346,16 +357,10 @@ public:
                           (long long)width_ *
                           (long long)channels_);
 
-
-        // guarantee 16-byte alignment in case people want to use SSE
-        memory = new float[size+3];
-        if ((long long)memory & 0xf) {
-            data = memory + 4 - (((long long)memory & 0xf) >> 2);
-        } else {
-            data = memory;
-        }
-        if (!data_) { memset(data, 0, size * sizeof(float)); }
-        else { memcpy(data, data_, size * sizeof(float)); }
+        // a fresh scratch file is already zero
+        bool zeroed = allocate(size, storage);
+        if (data_) { memcpy(data, data_, size * sizeof(float)); }
+        else if (!zeroed) { memset(data, 0, size * sizeof(float)); }
 
         xstride = channels;
         ystride = xstride * width;
@@ -374,7 +379,7 @@ public:
             refCount[0]--;
             if (*refCount <= 0) {
                 delete refCount;
-                delete[] memory;
+                release();
             }
         }
 
@@ -385,6 +390,7 @@ public:
 
         data = im.data;
         memory = im.memory;
+        mapping = im.mapping;
 
         xstride = channels;
         ystride = xstride * width;
@@ -403,6 +409,7 @@ public:
         frames = im.frames;
 
         memory = im.memory;
+        mapping = im.mapping;
         data = im.data;
 
         xstride = channels;
@@ -431,13 +438,7 @@ public:
                           (long long)channels *
                           (long long)frames);
 
-        // guarantee 16-byte alignment in case people want to use SSE
-        memory = new float[size+3];
-        if ((long long)memory & 0xf) {
-            data = memory + 4 - (((long long)memory & 0xf) >> 2);
-        } else {
-            data = memory;
-        }
+        allocate(size, Automatic);
 
         for (int t = 0; t < frames; t++) {
             for (int y = 0; y < height; y++) {
@@ -453,6 +454,18 @@ public:
         return Image(width, height, frames, channels, data);
     }
 
+    // Maps floats laid out like an image's pixels, starting offset
+    // bytes into a file, copy-on-write: the image shares the file's
+    // pages until it writes to them, and never changes the file.
+    // Returns an empty image if the file can't be mapped, e.g. because
+    // it's a pipe or is too short.
+    static Image mapFile(FILE *f, long long offset, int width, int height, int frames, int channels);
+
+    // Whether an image made by mapFile still maps the file at this
+    // path. Truncating or rewriting such a file would change the image,
+    // or crash it if the file gets shorter.
+    static bool fileIsMapped(string filename);
+
     ~Image();
 
     int *refCount;
@@ -461,7 +474,28 @@ protected:
     Image &operator=(Window im) {
         return *this;
     }
+
+    // Point memory and data at room for size floats. Returns true if
+    // it's already zero.
+    bool allocate(long long size, Storage storage);
+
+    // Free memory, once nothing refers to it any more
+    void release();
 };
 
+// Images of more than this many bytes are mapped rather than put on
+// the heap. It defaults to the IMAGESTACK_SCRATCH_THRESHOLD
+// environment variable in megabytes, or failing that half the
+// physical memory.
+long long scratchThreshold();
+void setScratchThreshold(long long bytes);
+
+// Where scratch files go. It defaults to IMAGESTACK_SCRATCH_DIR, then
+// TMPDIR, then /var/tmp, then /tmp, and warns if it's a tmpfs. Scratch
+// files are deleted as soon as they're made, so they never outlive the
+// process.
+string scratchDirectory();
+void setScratchDirectory(string directory);
+
 #include "footer.h"
 #endif
@@ -53,6 +53,7 @@
 #include "OpticalFlow.h"
 #include "Paint.h"
 #include "Panorama.h"
+#include "Parallel.h"
 #include "Parser.h"
 #include "Prediction.h"
 #include "Projection.h"
@@ -0,0 +1,62 @@
+#ifndef IMAGESTACK_PARALLEL_H
+#define IMAGESTACK_PARALLEL_H
+#include "header.h"
+
+// A process-wide pool of worker threads for splitting loops over the
+// rows or frames of an image. The range of a parallelFor is split
+// evenly between the calling thread and the workers, and a thread
+// that finishes its share early steals half of what's left of
+// somebody else's.
+//
+// The number of threads defaults to the IMAGESTACK_THREADS
+// environment variable, or failing that the number of CPUs, and can
+// be changed with setThreadCount (or -threads). A parallelFor called
+// from inside another, or while another thread is running one, just
+// runs serially on the calling thread.
+
+// The body of a parallel loop. run is called on disjoint subranges of
+// the full range, from several threads at once, so it should only
+// write to memory that belongs to its subrange. Tasks hold Windows
+// rather than Images, because Image reference counts aren't thread
+// safe.
+class ParallelTask {
+public:
+    virtual ~ParallelTask() {}
+    virtual void run(int begin, int end) = 0;
+};
+
+// Run task over [begin, end) in chunks of at least grain, and wait
+// for it to finish. If run throws, the first exception is rethrown
+// here once every thread has stopped.
+void parallelFor(int begin, int end, ParallelTask &task, int grain = 1);
+
+// The number of threads a parallelFor uses, including the caller.
+int threadCount();
+void setThreadCount(int threads);
+
+// Adapts a functor with an operator()(int t, int y) to a ParallelTask
+// over every row of every frame.
+template<typename F>
+class ParallelRows : public ParallelTask {
+public:
+    ParallelRows(F &f_, int height_) : f(f_), height(height_) {}
+    void run(int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            f(i / height, i % height);
+        }
+    }
+private:
+    F &f;
+    int height;
+};
+
+// Call f(t, y) for every row of an image with the given frames and
+// height, in parallel.
+template<typename F>
+void parallelForRows(int frames, int height, F &f) {
+    ParallelRows<F> task(f, height);
+    parallelFor(0, frames * height, task);
+}
+
+#include "footer.h"
+#endif
@@ -41,10 +41,41 @@ public:
         Stats stats;
     };
 
+    // Besides being evaluated one pixel at a time by walking the tree
+    // below, an expression can be compiled into a Program, which
+    // evaluates a run of pixels at a time. See Program further down.
+
+    struct Node;
+    class Compiler;
+
+    enum Opcode {
+        Op_Constant, Op_Uniform, Op_X, Op_Val,
+        Op_When, Op_Unless, Op_Select,
+        Op_Negate, Op_LTE, Op_GTE, Op_LT, Op_GT, Op_EQ, Op_NEQ,
+        Op_Plus, Op_Minus, Op_Mod, Op_Times, Op_Divide, Op_Power,
+        Op_Sin, Op_Cos, Op_Tan, Op_Atan, Op_Asin, Op_Acos, Op_Atan2,
+        Op_Abs, Op_Floor, Op_Ceil, Op_Round, Op_Log, Op_Exp,
+        Op_Mean, Op_Sum, Op_Max, Op_Min, Op_Variance, Op_Stddev,
+        Op_Skew, Op_Kurtosis, Op_Covariance,
+        Op_SampleHere, Op_Sample2D, Op_Sample3D
+    };
+
+    // What compiling a node produced: a constant, a node that only
+    // depends on the row (and so is evaluated once per run by walking
+    // it), or a register holding one value per pixel.
+    struct Value {
+        enum Kind {Constant = 0, Uniform, Varying};
+        Kind kind;
+        float constant;
+        Node *node;
+        int reg;
+    };
+
     struct Node {
         Node() {};
         virtual ~Node() {};
         virtual float eval(State *state) = 0;
+        virtual Value compile(Compiler *c) = 0;
     };
 
     struct Unary : public Node {
@@ -68,213 +99,257 @@ public:
     struct Negation : public Unary {
         Negation(Node *arg) : Unary(arg) {}
         float eval(State *state) {return -arg->eval(state);}
+        Value compile(Compiler *c) {return c->emit(this, Op_Negate, arg);}
     };
 
     struct IfThenElse : public Ternary {
         IfThenElse(Node *left, Node *middle, Node *right) : Ternary(left, middle, right) {}
         float eval(State *state) {return left->eval(state) ? middle->eval(state) : right->eval(state);}
+        Value compile(Compiler *c) {return c->ifThenElse(this, left, middle, right);}
     };
 
     struct LTE : public Binary {
         LTE(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) <= right->eval(state) ? 1 : 0;}
+        Value compile(Compiler *c) {return c->emit(this, Op_LTE, left, right);}
     };
 
     struct GTE : public Binary {
         GTE(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) >= right->eval(state) ? 1 : 0;}
+        Value compile(Compiler *c) {return c->emit(this, Op_GTE, left, right);}
     };
 
     struct LT : public Binary {
         LT(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) < right->eval(state) ? 1 : 0;}
+        Value compile(Compiler *c) {return c->emit(this, Op_LT, left, right);}
     };
 
     struct GT : public Binary {
         GT(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) > right->eval(state) ? 1 : 0;}
+        Value compile(Compiler *c) {return c->emit(this, Op_GT, left, right);}
     };
 
     struct EQ : public Binary {
         EQ(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) == right->eval(state) ? 1 : 0;}
+        Value compile(Compiler *c) {return c->emit(this, Op_EQ, left, right);}
     };
 
     struct NEQ : public Binary {
         NEQ(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) != right->eval(state) ? 1 : 0;}
+        Value compile(Compiler *c) {return c->emit(this, Op_NEQ, left, right);}
     };
 
     struct Plus : public Binary {
         Plus(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) + right->eval(state);}
+        Value compile(Compiler *c) {return c->emit(this, Op_Plus, left, right);}
     };
 
     struct Minus : public Binary {
         Minus(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) - right->eval(state);}
+        Value compile(Compiler *c) {return c->emit(this, Op_Minus, left, right);}
     };
 
     struct Mod : public Binary {
         Mod(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return fmod(left->eval(state), right->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Mod, left, right);}
     };
 
     struct Times : public Binary {
         Times(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) * right->eval(state);}
+        Value compile(Compiler *c) {return c->emit(this, Op_Times, left, right);}
     };
 
     struct Divide : public Binary {
         Divide(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return left->eval(state) / right->eval(state);}
+        Value compile(Compiler *c) {return c->emit(this, Op_Divide, left, right);}
     };
 
     struct Power : public Binary {
         Power(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return powf(left->eval(state), right->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Power, left, right);}
     };
 
     struct Funct_sin : public Unary {
         Funct_sin(Node *arg) : Unary(arg) {}
         float eval(State *state) {return sinf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Sin, arg);}
     };
 
     struct Funct_cos : public Unary {
         Funct_cos(Node *arg) : Unary(arg) {}
         float eval(State *state) {return cosf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Cos, arg);}
     };
 
     struct Funct_tan : public Unary {
         Funct_tan(Node *arg) : Unary(arg) {}
         float eval(State *state) {return tanf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Tan, arg);}
     };
 
     struct Funct_atan : public Unary {
         Funct_atan(Node *arg) : Unary(arg) {}
         float eval(State *state) {return atanf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Atan, arg);}
     };
 
     struct Funct_asin : public Unary {
         Funct_asin(Node *arg) : Unary(arg) {}
         float eval(State *state) {return asinf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Asin, arg);}
     };
 
     struct Funct_acos : public Unary {
         Funct_acos(Node *arg) : Unary(arg) {}
         float eval(State *state) {return acosf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Acos, arg);}
     };
 
     struct Funct_atan2 : public Binary {
         Funct_atan2(Node *left, Node *right) : Binary(left, right) {}
         float eval(State *state) {return atan2f(left->eval(state), right->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Atan2, left, right);}
     };
 
     struct Funct_abs : public Unary {
         Funct_abs(Node *arg) : Unary(arg) {}
         float eval(State *state) {return fabsf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Abs, arg);}
     };
 
     struct Funct_floor : public Unary {
         Funct_floor(Node *arg) : Unary(arg) {}
         float eval(State *state) {return floorf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Floor, arg);}
     };
 
     struct Funct_ceil : public Unary {
         Funct_ceil(Node *arg) : Unary(arg) {}
         float eval(State *state) {return ceilf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Ceil, arg);}
     };
 
     struct Funct_round : public Unary {
         Funct_round(Node *arg) : Unary(arg) {}
         float eval(State *state) {return roundf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Round, arg);}
     };
 
     struct Funct_log : public Unary {
         Funct_log(Node *arg) : Unary(arg) {}
         float eval(State *state) {return logf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Log, arg);}
     };
 
     struct Funct_exp : public Unary {
         Funct_exp(Node *arg) : Unary(arg) {}
         float eval(State *state) {return expf(arg->eval(state));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Exp, arg);}
     };
 
     struct Funct_mean0 : public Node {
         float eval(State *state) {return state->stats.mean();}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Funct_mean1 : public Unary {
         Funct_mean1(Node *arg) : Unary(arg) {}
         float eval(State *state) {return state->stats.mean((int)(arg->eval(state) + 0.5));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Mean, arg);}
     };
 
     struct Funct_sum0 : public Node {
         float eval(State *state) {return state->stats.sum();}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Funct_sum1 : public Unary {
         Funct_sum1(Node *arg) : Unary(arg) {}
         float eval(State *state) {return state->stats.sum((int)(arg->eval(state) + 0.5));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Sum, arg);}
     };
 
     struct Funct_max0 : public Node {
         float eval(State *state) {return state->stats.maximum();}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Funct_max1 : public Unary {
         Funct_max1(Node *arg) : Unary(arg) {}
         float eval(State *state) {return state->stats.maximum((int)(arg->eval(state) + 0.5));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Max, arg);}
     };
 
     struct Funct_min0 : public Node {
         float eval(State *state) {return state->stats.minimum();}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Funct_min1 : public Unary {
         Funct_min1(Node *arg) : Unary(arg) {}
         float eval(State *state) {return state->stats.minimum((int)(arg->eval(state) + 0.5));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Min, arg);}
     };
 
     struct Funct_variance0 : public Node {
         float eval(State *state) {return state->stats.variance();}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Funct_variance1 : public Unary {
         Funct_variance1(Node *arg) : Unary(arg) {}
         float eval(State *state) {return state->stats.variance((int)(arg->eval(state) + 0.5));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Variance, arg);}
     };
 
     struct Funct_stddev0 : public Node {
         float eval(State *state) {return sqrtf(state->stats.variance());}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Funct_stddev1 : public Unary {
         Funct_stddev1(Node *arg) : Unary(arg) {}
         float eval(State *state) {return sqrtf(state->stats.variance((int)(arg->eval(state) + 0.5)));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Stddev, arg);}
     };
 
     struct Funct_skew0 : public Node {
         float eval(State *state) {return state->stats.skew();}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Funct_skew1 : public Unary {
         Funct_skew1(Node *arg) : Unary(arg) {}
         float eval(State *state) {return state->stats.skew((int)(arg->eval(state) + 0.5));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Skew, arg);}
     };
 
     struct Funct_kurtosis0 : public Node {
         float eval(State *state) {return state->stats.kurtosis();}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Funct_kurtosis1 : public Unary {
         Funct_kurtosis1(Node *arg) : Unary(arg) {}
         float eval(State *state) {return state->stats.kurtosis((int)(arg->eval(state) + 0.5));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Kurtosis, arg);}
     };
 
     struct Funct_covariance : public Binary {
         Funct_covariance(Node *left_, Node *right_) : Binary(left_, right_) {}
         float eval(State *state) {return state->stats.covariance((int)(left->eval(state) + 0.5), (int)(right->eval(state) + 0.5));}
+        Value compile(Compiler *c) {return c->emit(this, Op_Covariance, left, right);}
     };
 
 
@@ -282,6 +357,7 @@ public:
     struct SampleHere : public Unary {
         SampleHere(Node *arg) : Unary(arg) {}
         float eval(State *state) {return state->val[(int)(arg->eval(state) + 0.5)];}
+        Value compile(Compiler *c) {return c->emit(this, Op_SampleHere, arg);}
     };
 
     struct Sample2D : public Binary {
@@ -297,6 +373,8 @@ public:
             return sample[state->c];
         }
 
+        Value compile(Compiler *c) {return c->emit(this, Op_Sample2D, left, right);}
+
         float *sample;
     };
 
@@ -314,51 +392,137 @@ public:
             return sample[state->c];
         }
 
+        Value compile(Compiler *c) {return c->emit(this, Op_Sample3D, left, middle, right);}
+
         float *sample;
     };
 
     struct Var_x : public Node {
         float eval(State *state) {return state->x;}
+        Value compile(Compiler *c) {return c->emit(this, Op_X);}
     };
 
     struct Var_y : public Node {
         float eval(State *state) {return state->y;}
+        Value compile(Compiler *c) {return c->emit(this, Op_Uniform);}
     };
 
     struct Var_t : public Node {
         float eval(State *state) {return state->t;}
+        Value compile(Compiler *c) {return c->emit(this, Op_Uniform);}
     };
 
     struct Var_c : public Node {
         float eval(State *state) {return state->c;}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Var_val : public Node {
         float eval(State *state) {return state->val[state->c];}
+        Value compile(Compiler *c) {return c->emit(this, Op_Val);}
     };
 
     struct Uniform_width : public Node {
         float eval(State *state) {return state->im.width;}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Uniform_height : public Node {
         float eval(State *state) {return state->im.height;}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Uniform_frames : public Node {
         float eval(State *state) {return state->im.frames;}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Uniform_channels : public Node {
         float eval(State *state) {return state->im.channels;}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
     };
 
     struct Float : public Node {
         Float(float value_) : value(value_) {}
         float eval(State *state) {return value;}
+        Value compile(Compiler *c) {return c->emit(this, Op_Constant);}
         float value;
     };
 
+    // An expression compiled to bytecode for one channel of one
+    // image. Each instruction computes a register holding a run of up
+    // to RUN pixels, so the inner loops are plain loops over arrays of
+    // floats. Anything that only depends on the image and the channel
+    // is folded into a constant, anything that only depends on y and t
+    // is evaluated by walking the tree once per run, and identical
+    // instructions are only computed once.
+    //
+    // A Program doesn't change once it's built, so several threads can
+    // run it at once, each with its own State and scratch space. It
+    // refers to the nodes of the Expression, which must outlive it.
+    class Program {
+    public:
+        enum {RUN = 256};
+
+        // Compile for state->im and state->c.
+        Program(Expression &e, State *state);
+
+        // The number of floats of scratch space run needs.
+        int scratchSize() const {return registers * RUN;}
+
+        // Evaluate the expression at pixels x to x+n-1 (n <= RUN) of
+        // row state->y of frame state->t of state->im, for channel
+        // state->c. Returns a pointer into scratch.
+        const float *run(State *state, int x, int n, float *scratch) const;
+
+    private:
+        friend class Compiler;
+
+        struct Instruction {
+            Opcode op;
+            int dst, a, b, c;
+            int mask; // lanes to compute, or -1 for all of them
+            float constant;
+            Node *node;
+        };
+
+        vector<Instruction> code;
+        int registers, result;
+    };
+
+    // Builds a Program. Nodes call back into this from compile.
+    class Compiler {
+    public:
+        Compiler(Program *program, State *state);
+
+        // Compile a node that applies op to the given children.
+        Value emit(Node *n, Opcode op, Node *a = NULL, Node *b = NULL, Node *c = NULL);
+
+        // Compile a conditional. Only the lanes that take a branch
+        // compute its more expensive instructions.
+        Value ifThenElse(Node *n, Node *cond, Node *a, Node *b);
+
+        // The register holding a value.
+        int materialize(Value v);
+
+    private:
+        // The lanes that take the branch of the conditional currently
+        // being compiled.
+        struct Branch {
+            Value cond;
+            bool taken;
+            Branch *outer;
+            int mask; // -1 until some instruction needs it
+        };
+
+        int mask();
+        int instruction(Opcode op, int a, int b, int c, int mask, float constant = 0, Node *node = NULL);
+
+        Program *program;
+        State *state;
+        Branch *branch;
+    };
+
     // all the parsing stuff is below here
 private:
     void skipWhitespace();
@@ -383,6 +547,8 @@ private:
     // Term    -> Funct ( ) | Funct ( IfThenElse , IfThenElse ) | Funct ( IfThenElse ) | - Term | Var | ( IfThenElse ) | Float | Sample
     Node *parseTerm();
 
+    friend class Program;
+
     Node *root;
     string source;
     size_t sourceIndex;
@@ -53,6 +53,24 @@ void pop();
 void dup();
 void pull(size_t);
 
+// Lazy evaluation of pointwise operations on the top of the stack
+// (see -lazy). While it's on, pointwise operations are deferred, and
+// the whole chain is applied in one pass over the image when the
+// stack is next used, or dropped if the top is popped first.
+class PointwiseOp;
+void setLazy(bool);
+bool lazy();
+
+// Queue an operation on the top of the stack. Takes ownership of op.
+void defer(PointwiseOp *op);
+
+// Apply any deferred operations now
+void evaluate();
+
+// An image on the stack without applying deferred operations to
+// it. Only its size is meaningful.
+Image &peek(size_t index);
+
 // Parse ints, floats, chars, and ImageStack commands
 int readInt(string);
 float readFloat(string);